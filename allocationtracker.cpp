@@ -0,0 +1,279 @@
+#include "allocationtracker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <spdlog/spdlog.h>
+
+namespace
+{
+    class TagCounters
+    {
+    public:
+        const char *name;
+        std::atomic<size_t> allocations;
+        std::atomic<size_t> frees;
+        std::atomic<size_t> bytes;
+        std::atomic<size_t> liveBytes;
+        std::atomic<size_t> peakBytes;
+
+        void Allocated(
+            size_t size)
+        {
+            allocations.fetch_add(1, std::memory_order_relaxed);
+            bytes.fetch_add(size, std::memory_order_relaxed);
+
+            auto live = liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+            auto peak = peakBytes.load(std::memory_order_relaxed);
+            while (live > peak && !peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        void Freed(
+            size_t size)
+        {
+            frees.fetch_add(1, std::memory_order_relaxed);
+            liveBytes.fetch_sub(size, std::memory_order_relaxed);
+        }
+
+        AllocationStats Stats() const
+        {
+            AllocationStats stats;
+
+            stats.tag = name;
+            stats.allocations = allocations.load(std::memory_order_relaxed);
+            stats.frees = frees.load(std::memory_order_relaxed);
+            stats.bytes = bytes.load(std::memory_order_relaxed);
+            stats.liveBytes = liveBytes.load(std::memory_order_relaxed);
+            stats.peakBytes = peakBytes.load(std::memory_order_relaxed);
+
+            return stats;
+        }
+    };
+
+    // Every allocation is prefixed with its size and tag, so it can be freed from the right tag.
+    // The header keeps the default new alignment.
+    class alignas(16) AllocationHeader
+    {
+    public:
+        size_t size;
+        int tag;
+    };
+
+    // These are constant initialized, so they work for allocations made before main
+    TagCounters tags[AllocationTracker::MaxTags];
+    TagCounters total;
+    std::atomic<int> tagCount{1};
+    std::mutex tagsLock;
+    thread_local int threadTag = 0;
+
+    void *Allocate(
+        size_t size) noexcept
+    {
+        auto header = (AllocationHeader *)std::malloc(sizeof(AllocationHeader) + size);
+
+        if (header == nullptr)
+        {
+            return nullptr;
+        }
+
+        header->size = size;
+        header->tag = threadTag;
+
+        tags[header->tag].Allocated(size);
+        total.Allocated(size);
+
+        return header + 1;
+    }
+
+    void Free(
+        void *ptr) noexcept
+    {
+        if (ptr == nullptr)
+        {
+            return;
+        }
+
+        auto header = (AllocationHeader *)ptr - 1;
+
+        tags[header->tag].Freed(header->size);
+        total.Freed(header->size);
+
+        std::free(header);
+    }
+
+    void *AllocateOrThrow(
+        size_t size)
+    {
+        if (size == 0)
+            ++size; // keep every allocation unique, like the default operator new
+
+        if (void *ptr = Allocate(size))
+            return ptr;
+
+        throw std::bad_alloc{}; // required by [new.delete.single]/3
+    }
+
+    const char *TagName(
+        int index)
+    {
+        return index == 0 ? "untagged" : tags[index].name;
+    }
+} // namespace
+
+void *operator new(std::size_t sz)
+{
+    return AllocateOrThrow(sz);
+}
+
+void *operator new[](std::size_t sz)
+{
+    return AllocateOrThrow(sz);
+}
+
+void *operator new(std::size_t sz, const std::nothrow_t &) noexcept
+{
+    return Allocate(sz == 0 ? 1 : sz);
+}
+
+void *operator new[](std::size_t sz, const std::nothrow_t &) noexcept
+{
+    return Allocate(sz == 0 ? 1 : sz);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    Free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    Free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    Free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    Free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    Free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    Free(ptr);
+}
+
+int AllocationTracker::RegisterTag(
+    const char *name)
+{
+    std::lock_guard<std::mutex> lock(tagsLock);
+
+    auto count = tagCount.load();
+    for (int i = 1; i < count; i++)
+    {
+        if (strcmp(tags[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    if (count == MaxTags)
+    {
+        spdlog::warn("too many allocation tags, {} is counted as untagged", name);
+
+        return 0;
+    }
+
+    tags[count].name = name;
+    tagCount.store(count + 1);
+
+    return count;
+}
+
+int AllocationTracker::SetThreadTag(
+    int tag)
+{
+    auto previous = threadTag;
+
+    threadTag = tag;
+
+    return previous;
+}
+
+AllocationStats AllocationTracker::Total()
+{
+    auto stats = total.Stats();
+    stats.tag = "total";
+
+    return stats;
+}
+
+std::vector<AllocationStats> AllocationTracker::Tags()
+{
+    std::vector<AllocationStats> result;
+
+    auto count = tagCount.load();
+    result.reserve(count);
+
+    for (int i = 0; i < count; i++)
+    {
+        result.push_back(tags[i].Stats());
+        result.back().tag = TagName(i);
+    }
+
+    return result;
+}
+
+void AllocationTracker::LogSummary()
+{
+    auto stats = Tags();
+
+    std::sort(stats.begin(), stats.end(), [](const AllocationStats &a, const AllocationStats &b) {
+        return a.peakBytes > b.peakBytes;
+    });
+
+    stats.insert(stats.begin(), Total());
+
+    spdlog::info("{:<24} {:>12} {:>12} {:>14} {:>14} {:>14}", "allocations", "count", "frees", "bytes", "live", "peak");
+    for (auto &tag : stats)
+    {
+        spdlog::info("{:<24} {:>12} {:>12} {:>14} {:>14} {:>14}", tag.tag, tag.allocations, tag.frees, tag.bytes, tag.liveBytes, tag.peakBytes);
+    }
+}
+
+void AllocationTracker::WriteJson(
+    std::ostream &out,
+    const std::string &indent)
+{
+    auto stats = Tags();
+    stats.insert(stats.begin(), Total());
+
+    out << "[";
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        auto &tag = stats[i];
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << indent << "  {\"tag\": \"" << tag.tag << "\""
+            << ", \"allocations\": " << tag.allocations
+            << ", \"frees\": " << tag.frees
+            << ", \"bytes\": " << tag.bytes
+            << ", \"live_bytes\": " << tag.liveBytes
+            << ", \"peak_bytes\": " << tag.peakBytes << "}";
+    }
+    out << "\n"
+        << indent << "]";
+}
@@ -0,0 +1,75 @@
+#ifndef ALLOCATIONTRACKER_H
+#define ALLOCATIONTRACKER_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Counts the allocations made through the global operator new, per tag. The tag is set for the
+// current thread by ALLOCATION_SCOPE, scopes nest and restore the outer tag when they end.
+// Memory is freed from the tag it was allocated with, even when that is on another thread.
+//
+//     ALLOCATION_SCOPE("bsp.faces");
+
+class AllocationStats
+{
+public:
+    const char *tag = nullptr;
+    size_t allocations = 0;
+    size_t frees = 0;
+    size_t bytes = 0;     // total allocated
+    size_t liveBytes = 0; // allocated and not yet freed
+    size_t peakBytes = 0; // highest liveBytes
+};
+
+class AllocationTracker
+{
+public:
+    static const int MaxTags = 64;
+
+    // Returns the index of the tag, tags are kept for the lifetime of the process. The name is
+    // not copied. Returns 0, the untagged index, when there are too many tags.
+    static int RegisterTag(
+        const char *name);
+
+    // Sets the tag of the current thread and returns the previous one
+    static int SetThreadTag(
+        int tag);
+
+    // Totals of all tags. The peak is of the whole process, not the sum of the tag peaks.
+    static AllocationStats Total();
+
+    static std::vector<AllocationStats> Tags();
+
+    static void LogSummary();
+
+    static void WriteJson(
+        std::ostream &out,
+        const std::string &indent);
+};
+
+class AllocationScope
+{
+public:
+    explicit AllocationScope(
+        int tag)
+        : _previous(AllocationTracker::SetThreadTag(tag))
+    {}
+
+    ~AllocationScope()
+    {
+        AllocationTracker::SetThreadTag(_previous);
+    }
+
+private:
+    int _previous;
+};
+
+#define ALLOCATION_CONCAT_(a, b) a##b
+#define ALLOCATION_CONCAT(a, b) ALLOCATION_CONCAT_(a, b)
+#define ALLOCATION_SCOPE(name)                                                                          \
+    static const int ALLOCATION_CONCAT(_allocationTag, __LINE__) = AllocationTracker::RegisterTag(name); \
+    AllocationScope ALLOCATION_CONCAT(_allocationScope, __LINE__)(ALLOCATION_CONCAT(_allocationTag, __LINE__))
+
+#endif // ALLOCATIONTRACKER_H
@@ -1,6 +1,7 @@
 #include "camera.h"
 
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <spdlog/spdlog.h>
 
@@ -82,3 +83,14 @@ void Camera::RotateZ(float angle)
 {
     this->_rotation = glm::rotate(this->_rotation, angle, glm::vec3(0, 0, 1));
 }
+
+Camera Camera::Interpolate(const Camera &from, const Camera &to, float amount)
+{
+    Camera result;
+
+    result._position = glm::mix(from._position, to._position, amount);
+    result._up = glm::mix(from._up, to._up, amount);
+    result._rotation = glm::mat4_cast(glm::slerp(glm::quat_cast(from._rotation), glm::quat_cast(to._rotation), amount));
+
+    return result;
+}
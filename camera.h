@@ -28,6 +28,9 @@ public:
     void RotateY(float angle);
     void RotateZ(float angle);
 
+    // Blends position and up linearly and the rotation along the shortest arc, amount 0 is from
+    static Camera Interpolate(const Camera& from, const Camera& to, float amount);
+
 private:
     glm::vec3 _position;
     glm::vec3 _up;
@@ -14,6 +14,14 @@ struct ModelComponent
     int Model;
 };
 
+class StudioEntity;
+
+struct StudioComponent
+{
+    StudioEntity *Instance;
+    glm::vec3 Angles;
+};
+
 enum RenderModes
 {
     NormalBlending = 0,
@@ -22,6 +30,7 @@ enum RenderModes
     GlowBlending = 3,
     SolidBlending = 4,
     AdditiveBlending = 5,
+    RenderModesCount,
 };
 
 struct RenderComponent
@@ -1,16 +1,25 @@
 #include "genmapapp.h"
 #include <glad/glad.h>
 
+#include "allocationtracker.h"
 #include "include/application.h"
+#include "profiler.h"
 
 #include <../mdl/renderapi.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
+#include <limits>
 #include <spdlog/spdlog.h>
 #include <sstream>
 #include <stb_image.h>
+#include <thread>
 
 template <class T>
 inline std::istream &operator>>(
@@ -27,7 +36,8 @@ inline std::istream &operator>>(
 }
 
 unsigned int UploadToGl(
-    valve::Texture *texture)
+    valve::Texture *texture,
+    bool mipmaps = true)
 {
     GLuint format = GL_RGB;
     GLuint glIndex = 0;
@@ -56,11 +66,15 @@ unsigned int UploadToGl(
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     }
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_NEAREST : GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     glTexImage2D(GL_TEXTURE_2D, 0, format, texture->Width(), texture->Height(), 0, format, GL_UNSIGNED_BYTE, texture->Data());
-    glGenerateMipmap(GL_TEXTURE_2D);
+
+    if (mipmaps)
+    {
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
 
     return glIndex;
 }
@@ -100,34 +114,89 @@ void OpenGLMessageCallback(
     spdlog::debug(message);
 }
 
+// The world vertices are quantized, u_matrix includes the dequantization of the positions and
+// the texture coordinates are scaled back up by tVertex::TexcoordRange.
+//
+// The textures are layers of a texture array, padded to the size of the array. f_layer holds the
+// scale of the texture within its layer and the layer, the fragment shader wraps the texture
+// coordinates to the texture and takes the gradients from the unwrapped ones, so the mip level
+// doesn't jump at the wrap.
+const char *normalBlendingVertexShader = GLSL(
+    in vec3 a_vertex;
+    in vec2 a_texcoords;
+    in vec2 a_lightmap_texcoords;
+    in float a_layer;
+
+    uniform mat4 u_matrix;
+    uniform vec4 u_color;
+    uniform vec2 u_layer_scales[64];
+
+    out vec2 f_uv_tex;
+    out vec2 f_uv_light;
+    out vec4 f_color;
+    flat out vec3 f_layer;
+
+    void main() {
+        gl_Position = u_matrix * vec4(a_vertex.xyz, 1.0);
+        f_uv_light = a_lightmap_texcoords;
+        f_uv_tex = a_texcoords * 32.0;
+        f_color = u_color;
+        f_layer = vec3(u_layer_scales[int(a_layer)], a_layer);
+    });
+
+const char *normalBlendingFragmentShader = GLSL(
+    uniform sampler2DArray u_tex0;
+    uniform sampler2D u_tex1;
+
+    in vec2 f_uv_tex;
+    in vec2 f_uv_light;
+    in vec4 f_color;
+    flat in vec3 f_layer;
+
+    out vec4 color;
+
+    void main() {
+        vec3 uv = vec3(fract(f_uv_tex) * f_layer.xy, f_layer.z);
+        vec4 texel0 = textureGrad(u_tex0, uv, dFdx(f_uv_tex) * f_layer.xy, dFdy(f_uv_tex) * f_layer.xy);
+        vec4 texel1 = texture2D(u_tex1, f_uv_light);
+        color = texel0 * texel1 * f_color;
+    });
+
 const char *solidBlendingVertexShader = GLSL(
     in vec3 a_vertex;
-    in vec4 a_texcoords;
+    in vec2 a_texcoords;
+    in vec2 a_lightmap_texcoords;
+    in float a_layer;
 
     uniform mat4 u_matrix;
+    uniform vec2 u_layer_scales[64];
 
     out vec2 f_uv_tex;
     out vec2 f_uv_light;
+    flat out vec3 f_layer;
 
     void main() {
         gl_Position = u_matrix * vec4(a_vertex.xyz, 1.0);
-        f_uv_light = a_texcoords.xy;
-        f_uv_tex = a_texcoords.zw;
+        f_uv_light = a_lightmap_texcoords;
+        f_uv_tex = a_texcoords * 32.0;
+        f_layer = vec3(u_layer_scales[int(a_layer)], a_layer);
     });
 
 const char *solidBlendingFragmentShader = GLSL(
-    uniform sampler2D u_tex0;
+    uniform sampler2DArray u_tex0;
     uniform sampler2D u_tex1;
 
     in vec2 f_uv_tex;
     in vec2 f_uv_light;
+    flat in vec3 f_layer;
 
     out vec4 color;
 
     void main() {
         vec4 texel0;
         vec4 texel1;
-        texel0 = texture2D(u_tex0, f_uv_tex);
+        vec3 uv = vec3(fract(f_uv_tex) * f_layer.xy, f_layer.z);
+        texel0 = textureGrad(u_tex0, uv, dFdx(f_uv_tex) * f_layer.xy, dFdy(f_uv_tex) * f_layer.xy);
         texel1 = texture2D(u_tex1, f_uv_light);
         vec4 tempcolor = texel0 * texel1;
         if (texel0.a < 0.2)
@@ -185,9 +254,189 @@ const char *trailFragmentShader = GLSL(
 
 static bool _skipClipping = false;
 
+static_assert(sizeof(valve::tVertex) == 16, "the world vertex layout is uploaded as is");
+static_assert(valve::tVertex::TexcoordRange == 32.0f, "the texture coordinate scale of the world vertex shaders");
+static_assert(TextureArrayLayout::MaxLayers == 64, "the length of u_layer_scales");
+
+// Relative to the working directory, like the trace
+static const char *TextureCacheDirectory = "genmap.cache/textures";
+
+// Bytes of texture data handed to GL per frame while a map is streaming in
+static const size_t TextureUploadBudget = 4 * 1024 * 1024;
+
+// Of the world texture arrays on the GPU and of the decoded textures, GENMAP_TEXTURE_BUDGET_MB
+// and GENMAP_DECODED_TEXTURE_BUDGET_MB override them
+static const int TextureBudgetMegabytes = 256;
+static const int DecodedTextureBudgetMegabytes = 64;
+
+// Texture arrays built again at the same time, the rest wait so the work of the frame keeps most
+// of the worker pool
+static const size_t MaxTextureArrayLoads = 2;
+
+// The textures seen from the leafs within this distance of the camera are resident, so they are
+// loaded before the camera gets there
+static const float TextureResidencyRadius = 256.0f;
+
+static size_t EnvironmentMegabytes(
+    const char *name,
+    int defaultValue)
+{
+    auto value = std::getenv(name);
+
+    if (value == nullptr || std::atoi(value) <= 0)
+    {
+        return size_t(defaultValue) * 1024 * 1024;
+    }
+
+    return size_t(std::atoi(value)) * 1024 * 1024;
+}
+
+// Squared distance to the closest of the points, the upload priority of a texture is that of
+// the closest face using it
+static float ClosestDistance(
+    const std::vector<glm::vec3> &points,
+    const glm::vec3 &position)
+{
+    auto closest = std::numeric_limits<float>::max();
+
+    for (auto &point : points)
+    {
+        auto offset = point - position;
+
+        closest = std::min(closest, glm::dot(offset, offset));
+    }
+
+    return closest;
+}
+
+// The attribute locations are those of the normal blending shader, the solid blending shader
+// declares the same attributes in the same order
+static void SetupWorldVertexAttributes(
+    ShaderType &normalBlendingShader,
+    ShaderType &solidBlendingShader)
+{
+    auto shaderId = normalBlendingShader.id();
+
+    auto vertexAttrib = glGetAttribLocation(shaderId, "a_vertex");
+    auto texcoordsAttrib = glGetAttribLocation(shaderId, "a_texcoords");
+    auto lightmapTexcoordsAttrib = glGetAttribLocation(shaderId, "a_lightmap_texcoords");
+    auto layerAttrib = glGetAttribLocation(shaderId, "a_layer");
+
+    if (vertexAttrib < 0 || texcoordsAttrib < 0 || lightmapTexcoordsAttrib < 0 || layerAttrib < 0)
+    {
+        spdlog::error("failed to get the world vertex attribute locations");
+
+        return;
+    }
+
+    // The positions are not normalized, the int16 steps are scaled by the matrix
+    glVertexAttribPointer(GLuint(vertexAttrib), 3, GL_SHORT, GL_FALSE, sizeof(valve::tVertex), (void *)offsetof(valve::tVertex, position));
+    glEnableVertexAttribArray(GLuint(vertexAttrib));
+
+    glVertexAttribPointer(GLuint(texcoordsAttrib), 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(valve::tVertex), (void *)offsetof(valve::tVertex, texcoords));
+    glEnableVertexAttribArray(GLuint(texcoordsAttrib));
+
+    glVertexAttribPointer(GLuint(lightmapTexcoordsAttrib), 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(valve::tVertex), (void *)offsetof(valve::tVertex, lightmapTexcoords));
+    glEnableVertexAttribArray(GLuint(lightmapTexcoordsAttrib));
+
+    glVertexAttribPointer(GLuint(layerAttrib), 1, GL_SHORT, GL_FALSE, sizeof(valve::tVertex), (void *)offsetof(valve::tVertex, layer));
+    glEnableVertexAttribArray(GLuint(layerAttrib));
+
+    for (auto shader : {&normalBlendingShader, &solidBlendingShader})
+    {
+        shader->use();
+
+        glUniform1i(glGetUniformLocation(shader->id(), "u_tex0"), 0);
+        glUniform1i(glGetUniformLocation(shader->id(), "u_tex1"), 1);
+    }
+}
+
+// Replays the recorded world draws with the blending and shader of their render mode
+class BspCommandBackend : public RenderCommandBackend
+{
+public:
+    BspCommandBackend(
+        ShaderType &normalBlendingShader,
+        ShaderType &solidBlendingShader,
+        const std::vector<GLuint> &textureIndices,
+        const TextureArrayLayout &textureArrays,
+        const std::vector<GLuint> &lightmapIndices)
+        : _normalBlendingShader(normalBlendingShader),
+          _solidBlendingShader(solidBlendingShader),
+          _textureIndices(textureIndices),
+          _textureArrays(textureArrays),
+          _lightmapIndices(lightmapIndices)
+    {}
+
+    void SetPipeline(
+        uint8_t pipeline) override
+    {
+        switch (pipeline)
+        {
+            case RenderModes::TextureBlending:
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_ONE, GL_DST_ALPHA);
+                _shader = &_normalBlendingShader;
+                break;
+            case RenderModes::SolidBlending:
+                glEnable(GL_BLEND);
+                glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+                _shader = &_solidBlendingShader;
+                break;
+            default:
+                glDisable(GL_BLEND);
+                _shader = &_normalBlendingShader;
+                break;
+        }
+
+        _shader->use();
+        _layerScalesLocation = glGetUniformLocation(_shader->id(), "u_layer_scales");
+    }
+
+    void SetTransform(
+        const DrawTransform &transform) override
+    {
+        _shader->setupMatrices(transform.matrix);
+        _shader->setupColor(transform.color);
+    }
+
+    // texture is a texture array, the scales of its layers go with it
+    void SetTextures(
+        uint32_t texture,
+        uint32_t lightmap) override
+    {
+        auto &scales = _textureArrays.Arrays()[texture].scales;
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, _textureIndices[texture]);
+        glUniform2fv(_layerScalesLocation, GLsizei(scales.size()), &scales[0].x);
+
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, _lightmapIndices[lightmap]);
+    }
+
+    // first and count are a range of the world mesh indices
+    void Draw(
+        uint32_t first,
+        uint32_t count) override
+    {
+        glDrawElements(GL_TRIANGLES, GLsizei(count), GL_UNSIGNED_INT, (void *)(size_t(first) * sizeof(uint32_t)));
+    }
+
+private:
+    ShaderType &_normalBlendingShader;
+    ShaderType &_solidBlendingShader;
+    const std::vector<GLuint> &_textureIndices;
+    const TextureArrayLayout &_textureArrays;
+    const std::vector<GLuint> &_lightmapIndices;
+    ShaderType *_shader = nullptr;
+    GLint _layerScalesLocation = -1;
+};
+
 bool GenMapApp::Startup()
 {
-    _trail.reserve(1000000);
+    PROFILE_ZONE("GenMapApp::Startup");
+    ALLOCATION_SCOPE("app.startup");
 
     spdlog::debug("Startup()");
 
@@ -232,12 +481,36 @@ bool GenMapApp::Startup()
 
     SetupSky();
 
-    _registry.sort<RenderComponent>([](const RenderComponent &lhs, const RenderComponent &rhs) {
-        return lhs.Mode < rhs.Mode;
-    });
+    SortEntitiesByRenderMode();
 
     _trailShader.compile(trailVertexShader, trailFragmentShader);
-    glGenBuffers(1, &VBO);
+
+    // The oldest points are overwritten once the trail no longer fits
+    _trailBuffer.setup(1 << 16, sizeof(TrailVertexType));
+
+    _trailBuffer.bind();
+
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(TrailVertexType), (void *)0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(TrailVertexType), (void *)(sizeof(glm::vec3)));
+    glEnableVertexAttribArray(1);
+
+    _trailBuffer.unbind();
+
+    _snapshots[0].camera = _snapshots[1].camera = _cam;
+    _renderCam = _cam;
+
+    // A replay steps the simulation with the ticks, so it only depends on the recording. It
+    // also waits for all textures, so the frames of a run don't depend on the upload progress.
+    if (!_replaying)
+    {
+        StartSimulationThread();
+    }
+    else
+    {
+        UpdateTextureUploads(true);
+    }
 
     return true;
 }
@@ -252,6 +525,9 @@ void GenMapApp::SetFilename(
 
 void GenMapApp::SetupSky()
 {
+    PROFILE_ZONE("GenMapApp::SetupSky");
+    ALLOCATION_SCOPE("render.sky");
+
     // here we make up for the half of pixel to get the sky textures really stitched together because clamping is not enough
     const float uv_1 = 255.0f / 256.0f;
     const float uv_0 = 1.0f - uv_1;
@@ -347,132 +623,130 @@ void GenMapApp::SetupSky()
 
 void GenMapApp::SetupBsp()
 {
-    _normalBlendingShader.compileDefaultShader();
+    PROFILE_ZONE("GenMapApp::SetupBsp");
+    ALLOCATION_SCOPE("render.upload");
+
+    _studioRenderer.Setup();
+
+    _normalBlendingShader.compile(normalBlendingVertexShader, normalBlendingFragmentShader);
     _solidBlendingShader.compile(solidBlendingVertexShader, solidBlendingFragmentShader);
 
-    _lightmapIndices.resize(_bspAsset->_lightMaps.size());
-    glActiveTexture(GL_TEXTURE1);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    for (size_t i = 0; i < _bspAsset->_lightMaps.size(); i++)
-    {
-        _lightmapIndices[i] = UploadToGl(_bspAsset->_lightMaps[i]);
-    }
+    _textureUploads.Setup(TextureUploadBudget);
+    SetupPlaceholderTextures();
 
-    _textureIndices.resize(_bspAsset->_textures.size());
-    glActiveTexture(GL_TEXTURE0);
-    for (size_t i = 0; i < _bspAsset->_textures.size(); i++)
     {
-        _textureIndices[i] = UploadToGl(_bspAsset->_textures[i]);
-    }
+        PROFILE_ZONE("queue lightmaps");
 
-    _faces.reserve(_bspAsset->_faces.size());
-    for (size_t f = 0; f < _bspAsset->_faces.size(); f++)
-    {
-        auto &face = _bspAsset->_faces[f];
+        _lightmapIndices.assign(_bspAsset->_lightMaps.size(), _placeholderLightmap);
+        glActiveTexture(GL_TEXTURE1);
+        for (size_t i = 0; i < _bspAsset->_lightMaps.size(); i++)
+        {
+            auto page = _bspAsset->_lightMaps[i];
 
-        FaceType ft;
-        ft.flags = face.flags;
-        ft.firstVertex = 0;
-        ft.vertexCount = 0;
-        ft.lightmapIndex = 0;
-        ft.textureIndex = 0;
+            GLuint texture = 0;
+            glGenTextures(1, &texture);
+            glBindTexture(GL_TEXTURE_2D, texture);
 
-        if (face.flags == 0)
-        {
-            ft.firstVertex = _vertexBuffer.vertexCount();
-            ft.vertexCount = face.vertexCount;
-            ft.lightmapIndex = f;
-            ft.textureIndex = face.texture;
+            // The smaller mips of a page would blend neighbouring lightmaps
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-            for (int v = face.firstVertex; v < face.firstVertex + face.vertexCount; v++)
+            TextureUploadFormat format;
+            if (page->Bpp() == 3)
             {
-                auto &vertex = _bspAsset->_vertices[v];
-
-                _vertexBuffer
-                    .uvs(glm::vec4(vertex.texcoords[1].x, vertex.texcoords[1].y, vertex.texcoords[0].x, vertex.texcoords[0].y))
-                    .vertex(glm::vec3(vertex.position));
+                format.internalFormat = GL_RGB8;
+                format.format = GL_RGB;
+                format.bytesPerPixel = 3;
             }
+
+            std::vector<valve::MipLevel> levels(1);
+            levels[0].width = page->Width();
+            levels[0].height = page->Height();
+            levels[0].data.assign(page->Data(), page->Data() + size_t(page->Width()) * size_t(page->Height()) * size_t(format.bytesPerPixel));
+
+            auto upload = _textureUploads.Enqueue(GL_TEXTURE_2D, texture, format, 1, std::move(levels));
+            _pendingTextures.push_back(PendingTexture{upload, texture, true, i});
         }
+    }
 
-        _faces.push_back(ft);
+    {
+        PROFILE_ZONE("queue textures");
+
+        _textureArrays.Build(_bspAsset->_textures);
+        _textureIndices.assign(_textureArrays.Arrays().size(), _placeholderTextureArray);
+
+        // The mips and blocks are built on the worker pool while the first frames are drawn, the
+        // arrays used around the camera are queued for upload once they are done
+        auto compress = GLAD_GL_EXT_texture_compression_s3tc != 0;
+        _compressedTextureArrays = _workers.Submit([this, compress]() {
+            std::vector<CompressedTextureArray> arrays;
+            TextureCompressionStats stats;
+            TextureCache cache(TextureCacheDirectory);
+            TextureCompression::CompressArrays(
+                _bspAsset->_textures,
+                _textureArrays,
+                compress,
+                &cache,
+                _workers,
+                arrays,
+                stats);
+
+            return arrays;
+        });
+
+        spdlog::info("{} textures in {} texture arrays", _bspAsset->_textures.size(), _textureArrays.Arrays().size());
     }
 
-    _vertexBuffer
-        .setup(_normalBlendingShader);
+    BuildFaces();
 
-    for (auto &bspEntity : _bspAsset->_entities)
+    // The upload priorities are the distances to the faces that use the texture
+    _textureArrayCenters.assign(_textureArrays.Arrays().size(), std::vector<glm::vec3>());
+    _lightmapCenters.assign(_lightmapIndices.size(), std::vector<glm::vec3>());
+    for (auto &face : _bspAsset->_faces)
     {
-        const auto entity = _registry.create();
-
-        if (bspEntity.classname == "worldspawn")
+        if (face.flags != 0 || face.vertexCount <= 0)
         {
-            _registry.emplace<ModelComponent>(entity, 0);
+            continue;
         }
 
-        if (bspEntity.classname == "info_player_deathmatch")
+        auto center = glm::vec3(0.0f);
+        for (int v = face.firstVertex; v < face.firstVertex + face.vertexCount; v++)
         {
-            std::istringstream iss(bspEntity.keyvalues["origin"]);
-            int x, y, z;
-
-            iss >> x >> y >> z;
-
-            _cam.SetPosition(glm::vec3(x, y, z));
+            center += _bspAsset->VertexPosition(_bspAsset->_vertices[v]);
         }
+        center /= float(face.vertexCount);
 
-        if (bspEntity.keyvalues.count("model") != 0 && bspEntity.classname.rfind("func_", 0) != 0)
+        if (face.texture < _textureArrays.Slots().size())
         {
-            ModelComponent mc = {0};
-
-            std::istringstream iss(bspEntity.keyvalues["model"]);
-            iss.get(); // get the astrix
-            iss >> (mc.Model);
-
-            if (mc.Model != 0)
-            {
-                _registry.emplace<ModelComponent>(entity, mc);
-            }
-            else
-            {
-                // todo, this probably is a mdl or spr file
-            }
+            _textureArrayCenters[_textureArrays.Slots()[face.texture].array].push_back(center);
         }
 
-        RenderComponent rc = {0, {255, 255, 255}, RenderModes::NormalBlending};
-
-        auto renderamt = bspEntity.keyvalues.find("renderamt");
-        if (renderamt != bspEntity.keyvalues.end())
+        if (face.lightmap < _lightmapCenters.size())
         {
-            std::istringstream(renderamt->second) >> (rc.Amount);
+            _lightmapCenters[face.lightmap].push_back(center);
         }
+    }
 
-        auto rendercolor = bspEntity.keyvalues.find("rendercolor");
-        if (rendercolor != bspEntity.keyvalues.end())
-        {
-            std::istringstream(rendercolor->second) >> (rc.Color[0]) >> (rc.Color[1]) >> (rc.Color[2]);
-        }
+    _worldMesh.Build(*_bspAsset, &_textureArrays);
 
-        auto rendermode = bspEntity.keyvalues.find("rendermode");
-        if (rendermode != bspEntity.keyvalues.end())
-        {
-            std::istringstream(rendermode->second) >> (rc.Mode);
-        }
+    // The vertices are built in their upload layout, so they go to GL without a copy
+    auto &vertices = _worldMesh.Vertices();
+    auto &indices = _worldMesh.Indices();
 
-        _registry.emplace<RenderComponent>(entity, rc);
+    _vertexBuffer.setup(vertices.data(), GLsizeiptr(vertices.size() * sizeof(valve::tVertex)));
+    _vertexBuffer.setupIndices(indices.data(), GLsizeiptr(indices.size() * sizeof(uint32_t)));
+    SetupWorldVertexAttributes(_normalBlendingShader, _solidBlendingShader);
+    _vertexBuffer.unbind();
 
-        auto origin = bspEntity.keyvalues.find("origin");
-        if (origin != bspEntity.keyvalues.end())
-        {
-            glm::vec3 originPosition;
+    _worldMesh.ReleaseGeometry();
 
-            std::istringstream(origin->second) >> originPosition.x >> originPosition.y >> originPosition.z;
+    // Only the software renderer draws the faces from the vertices of the asset, and it doesn't
+    // get here
+    std::vector<valve::tVertex>().swap(_bspAsset->_vertices);
 
-            _registry.emplace<OriginComponent>(entity, originPosition);
-        }
-        else
-        {
-            _registry.emplace<OriginComponent>(entity, glm::vec3(0.0f));
-        }
-    }
+    SetupEntities();
 
     for (int i = 0; i < 6; i++)
     {
@@ -480,146 +754,1078 @@ void GenMapApp::SetupBsp()
     }
 }
 
-void GenMapApp::Resize(
-    int width,
-    int height)
-{
-    glViewport(0, 0, width, height);
-
-    _projectionMatrix = glm::perspective(glm::radians(90.0f), float(width) / float(height), 0.1f, 4096.0f);
-}
-
-void GenMapApp::Destroy()
+void GenMapApp::SetupPlaceholderTextures()
 {
-    _bspAsset = nullptr;
+    const unsigned char grey[4] = {128, 128, 128, 255};
+    const unsigned char white[4] = {255, 255, 255, 255};
+
+    // A single layer works for every layer, the layer a shader samples is clamped
+    glGenTextures(1, &_placeholderTextureArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, _placeholderTextureArray);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, 1, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+
+    glGenTextures(1, &_placeholderLightmap);
+    glBindTexture(GL_TEXTURE_2D, _placeholderLightmap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
 }
 
-bool GenMapApp::Tick(
-    std::chrono::milliseconds::rep time,
-    const struct InputState &inputState)
+void GenMapApp::QueueTextureArray(
+    int index,
+    CompressedTextureArray &&array)
 {
-    const float speed = 0.4f;
-    float timeStep = float(time - _lastTime);
-
-    if (timeStep > 10)
-    {
-        _lastTime = time;
+    PROFILE_ZONE("GenMapApp::QueueTextureArray");
 
-        auto oldCamPosition = _cam.Position();
+    glActiveTexture(GL_TEXTURE0);
 
-        if (IsKeyboardButtonPushed(inputState, KeyboardButtons::KeySpace))
-        {
-            _skipClipping = !_skipClipping;
-        }
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
 
-        if (inputState.KeyboardButtonStates[KeyboardButtons::KeyLeft] || inputState.KeyboardButtonStates[KeyboardButtons::KeyA])
-        {
-            _cam.MoveLeft(speed * timeStep);
-        }
-        else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyRight] || inputState.KeyboardButtonStates[KeyboardButtons::KeyD])
-        {
-            _cam.MoveLeft(-speed * timeStep);
-        }
+    // The shader wraps the coordinates within the layer, repeating at the edges of the
+    // layer keeps the filtering there seamless
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-        if (inputState.KeyboardButtonStates[KeyboardButtons::KeyUp] || inputState.KeyboardButtonStates[KeyboardButtons::KeyW])
-        {
-            _cam.MoveForward(speed * timeStep);
-        }
-        else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyDown] || inputState.KeyboardButtonStates[KeyboardButtons::KeyS])
-        {
-            _cam.MoveForward(-speed * timeStep);
-        }
+    TextureUploadFormat format;
+    switch (array.format)
+    {
+        case TextureFormat::BC1:
+            format.internalFormat = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+            format.format = 0;
+            format.bytesPerPixel = 8;
+            break;
+        case TextureFormat::BC3:
+            format.internalFormat = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+            format.format = 0;
+            format.bytesPerPixel = 16;
+            break;
+        default:
+            break;
+    }
 
-        if (inputState.KeyboardButtonStates[KeyboardButtons::KeyQ])
-        {
-            _cam.MoveUp(speed * timeStep);
-        }
-        else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyZ])
-        {
-            _cam.MoveUp(-speed * timeStep);
-        }
+    auto upload = _textureUploads.Enqueue(GL_TEXTURE_2D_ARRAY, texture, format, array.layers, std::move(array.levels));
+    _pendingTextures.push_back(PendingTexture{upload, texture, false, size_t(index)});
+}
 
-        static int lastPointerX = inputState.MousePointerPosition[0];
-        static int lastPointerY = inputState.MousePointerPosition[1];
+void GenMapApp::UpdateTextureUploads(
+    bool finish)
+{
+    PROFILE_ZONE("GenMapApp::UpdateTextureUploads");
+    ALLOCATION_SCOPE("render.upload");
 
-        int diffX = -(inputState.MousePointerPosition[0] - lastPointerX);
-        int diffY = -(inputState.MousePointerPosition[1] - lastPointerY);
+    if (_compressedTextureArrays.valid() && (finish || _compressedTextureArrays.wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+    {
+        auto arrays = _compressedTextureArrays.get();
 
-        lastPointerX = inputState.MousePointerPosition[0];
-        lastPointerY = inputState.MousePointerPosition[1];
+        SetupTextureResidency(arrays);
+        UpdateTextureResidency(finish, &arrays);
+    }
+    else
+    {
+        UpdateTextureResidency(finish);
+    }
 
-        if (inputState.MouseButtonStates[MouseButtons::LeftButton])
-        {
-            _cam.RotateZ(glm::radians(float(diffX) * 0.1f));
-            _cam.RotateX(glm::radians(float(diffY) * 0.1f));
-        }
+    if (_pendingTextures.empty())
+    {
+        return;
+    }
 
-        auto newCamPosition = _cam.Position();
+    auto &position = _renderCam.Position();
+    for (auto &pending : _pendingTextures)
+    {
+        auto &centers = pending.lightmap ? _lightmapCenters[pending.index] : _textureArrayCenters[pending.index];
 
-        if (glm::length(newCamPosition - oldCamPosition) > 0.001f)
-        {
-            glm::vec3 target;
+        _textureUploads.SetPriority(pending.upload, ClosestDistance(centers, position));
+    }
 
-            _bspAsset->restartCount = 0;
-            auto tracedPos = _bspAsset->IsInContents(oldCamPosition, newCamPosition, target, _bspAsset->_bspFile->_modelData[0].headnode[0]);
+    if (finish)
+    {
+        _textureUploads.Finish();
+    }
+    else
+    {
+        _textureUploads.Update();
+    }
 
-            if (!_skipClipping)
+    // The placeholders are swapped out as soon as the textures are resident
+    _pendingTextures.erase(
+        std::remove_if(_pendingTextures.begin(), _pendingTextures.end(), [this](const PendingTexture &pending) {
+            if (!_textureUploads.IsResident(pending.upload))
             {
-                _cam.SetPosition(target);
+                return false;
             }
 
-            _trail.emplace_back(target.x, target.y, target.z);
+            (pending.lightmap ? _lightmapIndices : _textureIndices)[pending.index] = pending.texture;
 
-            if (tracedPos)
+            // The lightmap pages are never evicted, so only GL needs their data
+            if (pending.lightmap)
             {
-                _trail.emplace_back(1.0f, 0.0f, 0.0f);
+                _bspAsset->_lightMaps[pending.index]->ClearData();
             }
             else
             {
-                _trail.emplace_back(0.0f, 1.0f, 0.0f);
+                _textureResidency.ArrayLoaded(int(pending.index));
             }
 
-            oldCamPosition = target;
-        }
+            return true;
+        }),
+        _pendingTextures.end());
+
+    if (_pendingTextures.empty() && !_compressedTextureArrays.valid())
+    {
+        spdlog::debug(
+            "world textures resident, {} KiB of texture arrays and {} KiB of decoded textures",
+            _textureResidency.GpuBytes() / 1024,
+            _textureResidency.CpuBytes() / 1024);
     }
+}
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+void GenMapApp::SetupTextureResidency(
+    const std::vector<CompressedTextureArray> &arrays)
+{
+    PROFILE_ZONE("GenMapApp::SetupTextureResidency");
 
-    RenderSky();
-    RenderBsp();
-    RenderTrail();
+    auto &textures = _bspAsset->_textures;
+    auto &layout = _textureArrays.Arrays();
 
-    return true; // to keep running
-}
+    std::vector<size_t> arrayBytes(layout.size(), 0);
+    _textureArrayFormats.assign(layout.size(), TextureFormat::RGBA8);
+    _textureKeys.assign(textures.size(), 0);
+    for (size_t a = 0; a < layout.size() && a < arrays.size(); a++)
+    {
+        arrayBytes[a] = TextureCompression::ArraySize(arrays[a]);
+        _textureArrayFormats[a] = arrays[a].format;
+
+        for (size_t l = 0; l < layout[a].textures.size() && l < arrays[a].keys.size(); l++)
+        {
+            _textureKeys[layout[a].textures[l]] = arrays[a].keys[l];
+        }
+    }
+
+    std::vector<size_t> textureBytes(textures.size(), 0);
+    for (size_t t = 0; t < textures.size(); t++)
+    {
+        textureBytes[t] = size_t(textures[t]->DataSize());
+    }
+
+    // Brush entities are not in the leafs, their textures stay resident
+    _modelTextures.assign(textures.size(), false);
+    for (size_t m = 1; m < _bspAsset->_models.size(); m++)
+    {
+        auto &model = _bspAsset->_models[m];
+
+        for (int f = model.firstFace; f < model.firstFace + model.faceCount; f++)
+        {
+            auto texture = _bspAsset->_faces[size_t(f)].texture;
+
+            if (texture < _modelTextures.size())
+            {
+                _modelTextures[texture] = true;
+            }
+        }
+    }
+
+    auto gpuBudget = EnvironmentMegabytes("GENMAP_TEXTURE_BUDGET_MB", TextureBudgetMegabytes);
+    auto cpuBudget = EnvironmentMegabytes("GENMAP_DECODED_TEXTURE_BUDGET_MB", DecodedTextureBudgetMegabytes);
+
+    _textureResidency.Setup(_textureArrays, arrayBytes, textureBytes, gpuBudget, cpuBudget);
+    _textureResidencyActive = true;
+
+    _referencedTextures.clear();
+    _referencedLeafs.clear();
+
+    spdlog::info("texture budgets of {} MiB for texture arrays and {} MiB for decoded textures", gpuBudget / (1024 * 1024), cpuBudget / (1024 * 1024));
+}
+
+CompressedTextureArray GenMapApp::LoadTextureArray(
+    int index)
+{
+    PROFILE_ZONE("GenMapApp::LoadTextureArray");
+    ALLOCATION_SCOPE("render.textures");
+
+    auto &layout = _textureArrays.Arrays()[size_t(index)];
+
+    CompressedTextureArray array;
+    array.format = _textureArrayFormats[size_t(index)];
+    array.width = layout.width;
+    array.height = layout.height;
+    array.layers = int(layout.textures.size());
+
+    TextureCache cache(TextureCacheDirectory);
+    std::vector<valve::MipLevel> levels;
+    for (auto t : layout.textures)
+    {
+        auto key = _textureKeys[size_t(t)];
+
+        if (key == 0 || !cache.Load(key, array.format, levels))
+        {
+            auto &texture = *_bspAsset->_textures[size_t(t)];
+
+            // Released textures are decoded again from the BSP or the WADs
+            if (texture.Data() == nullptr)
+            {
+                _bspAsset->DecodeTexture(size_t(t), texture);
+            }
+
+            TextureCompression::CompressLayer(texture, array.width, array.height, array.format, levels, &cache, nullptr, &key);
+        }
+
+        TextureCompression::AppendLayer(array, levels);
+        array.keys.push_back(key);
+    }
+
+    return array;
+}
+
+void GenMapApp::FindReferencedTextures()
+{
+    PROFILE_ZONE("GenMapApp::FindReferencedTextures");
+
+    auto &bspFile = *_bspAsset->_bspFile;
+    auto textureCount = _bspAsset->_textures.size();
+
+    _cameraLeafs.clear();
+    _bspAsset->LeafsInSphere(_renderCam.Position(), TextureResidencyRadius, _cameraLeafs);
+    std::sort(_cameraLeafs.begin(), _cameraLeafs.end());
+    _cameraLeafs.erase(std::unique(_cameraLeafs.begin(), _cameraLeafs.end()), _cameraLeafs.end());
+
+    // The camera stays in the same leafs for most frames
+    if (!_referencedTextures.empty() && _cameraLeafs == _referencedLeafs)
+    {
+        return;
+    }
+
+    _referencedLeafs = _cameraLeafs;
+    _referencedTextures = _modelTextures;
+
+    // Outside of the map, or in a leaf without visibility info, everything can be seen
+    std::vector<bool> visible;
+    std::vector<bool> potentiallyVisible(bspFile._leafData.size(), false);
+    auto everything = _cameraLeafs.empty();
+    for (auto leaf : _cameraLeafs)
+    {
+        if (!_bspAsset->VisibleLeafs(leaf, visible))
+        {
+            everything = true;
+            break;
+        }
+
+        for (size_t l = 0; l < visible.size(); l++)
+        {
+            if (visible[l])
+            {
+                potentiallyVisible[l] = true;
+            }
+        }
+    }
+
+    if (everything)
+    {
+        _referencedTextures.assign(textureCount, true);
+
+        return;
+    }
+
+    for (size_t l = 0; l < potentiallyVisible.size(); l++)
+    {
+        if (!potentiallyVisible[l])
+        {
+            continue;
+        }
+
+        auto &leaf = bspFile._leafData[l];
+        for (size_t m = leaf.firstMarkSurface; m < size_t(leaf.firstMarkSurface) + leaf.markSurfacesCount && m < bspFile._marksurfaceData.size(); m++)
+        {
+            auto face = size_t(bspFile._marksurfaceData[m]);
+
+            if (face < _bspAsset->_faces.size() && _bspAsset->_faces[face].texture < textureCount)
+            {
+                _referencedTextures[_bspAsset->_faces[face].texture] = true;
+            }
+        }
+    }
+}
+
+void GenMapApp::UpdateTextureResidency(
+    bool finish,
+    std::vector<CompressedTextureArray> *compressed)
+{
+    PROFILE_ZONE("GenMapApp::UpdateTextureResidency");
+    ALLOCATION_SCOPE("render.textures");
+
+    if (!_textureResidencyActive)
+    {
+        return;
+    }
+
+    FindReferencedTextures();
+    _textureResidency.Update(_referencedTextures);
+
+    // Only resident arrays are evicted, so none of them has an upload left
+    for (auto a : _textureResidency.ArraysToEvict())
+    {
+        glDeleteTextures(1, &_textureIndices[size_t(a)]);
+        _textureIndices[size_t(a)] = _placeholderTextureArray;
+    }
+
+    for (auto t : _textureResidency.TexturesToRelease())
+    {
+        _bspAsset->_textures[size_t(t)]->ClearData();
+    }
+
+    for (auto a : _textureResidency.ArraysToLoad())
+    {
+        if (compressed != nullptr && size_t(a) < compressed->size())
+        {
+            QueueTextureArray(a, std::move((*compressed)[size_t(a)]));
+
+            continue;
+        }
+
+        _textureArraysToLoad.push_back(a);
+    }
+
+    auto &residency = _textureResidency;
+    if (!residency.ArraysToLoad().empty() || !residency.ArraysToEvict().empty() || !residency.TexturesToRelease().empty())
+    {
+        spdlog::debug(
+            "loading {} texture arrays, evicted {} texture arrays and released {} textures",
+            residency.ArraysToLoad().size(),
+            residency.ArraysToEvict().size(),
+            residency.TexturesToRelease().size());
+    }
+
+    // With finish set the waiting arrays are loaded here, a few at a time like every frame
+    while (true)
+    {
+        // The textures decoded again for a load count against the budget until they are released
+        _textureArrayLoads.erase(
+            std::remove_if(_textureArrayLoads.begin(), _textureArrayLoads.end(), [this, finish](TextureArrayLoad &load) {
+                if (!finish && load.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                {
+                    return false;
+                }
+
+                QueueTextureArray(load.array, load.result.get());
+
+                for (auto t : _textureArrays.Arrays()[size_t(load.array)].textures)
+                {
+                    if (_bspAsset->_textures[size_t(t)]->Data() != nullptr)
+                    {
+                        _textureResidency.TextureDecoded(t);
+                    }
+                }
+
+                return true;
+            }),
+            _textureArrayLoads.end());
+
+        while (_textureArrayLoads.size() < MaxTextureArrayLoads && !_textureArraysToLoad.empty())
+        {
+            auto a = _textureArraysToLoad.front();
+            _textureArraysToLoad.pop_front();
+
+            auto result = _workers.Submit([this, a]() {
+                return LoadTextureArray(a);
+            });
+
+            _textureArrayLoads.push_back(TextureArrayLoad{a, std::move(result)});
+        }
+
+        if (!finish || _textureArrayLoads.empty())
+        {
+            break;
+        }
+    }
+}
+
+void GenMapApp::BuildFaces()
+{
+    PROFILE_ZONE("GenMapApp::BuildFaces");
+    ALLOCATION_SCOPE("render.faces");
+
+    _faces.reserve(_bspAsset->_faces.size());
+    for (size_t f = 0; f < _bspAsset->_faces.size(); f++)
+    {
+        auto &face = _bspAsset->_faces[f];
+
+        FaceType ft;
+        ft.flags = face.flags;
+        ft.firstVertex = 0;
+        ft.vertexCount = 0;
+        ft.lightmapIndex = 0;
+        ft.textureIndex = 0;
+
+        if (face.flags == 0)
+        {
+            ft.firstVertex = face.firstVertex;
+            ft.vertexCount = face.vertexCount;
+            ft.lightmapIndex = face.lightmap;
+            ft.textureIndex = face.texture;
+        }
+
+        _faces.push_back(ft);
+    }
+}
+
+void GenMapApp::SetupEntities()
+{
+    PROFILE_ZONE("GenMapApp::SetupEntities");
+    ALLOCATION_SCOPE("render.entities");
+
+    for (auto &bspEntity : _bspAsset->_entities)
+    {
+        const auto entity = _registry.create();
+
+        if (bspEntity.classname == "worldspawn")
+        {
+            _registry.emplace<ModelComponent>(entity, 0);
+        }
+
+        if (bspEntity.classname == "info_player_deathmatch")
+        {
+            std::istringstream iss(bspEntity.keyvalues["origin"]);
+            int x, y, z;
+
+            iss >> x >> y >> z;
+
+            _cam.SetPosition(glm::vec3(x, y, z));
+        }
+
+        if (bspEntity.keyvalues.count("model") != 0 && bspEntity.classname.rfind("func_", 0) != 0)
+        {
+            ModelComponent mc = {0};
+
+            std::istringstream iss(bspEntity.keyvalues["model"]);
+            iss.get(); // get the astrix
+            iss >> (mc.Model);
+
+            if (mc.Model != 0)
+            {
+                _registry.emplace<ModelComponent>(entity, mc);
+            }
+            else if (!SetupStudioEntity(entity, bspEntity))
+            {
+                // todo, this probably is a spr file
+            }
+        }
+
+        RenderComponent rc = {0, {255, 255, 255}, RenderModes::NormalBlending};
+
+        auto renderamt = bspEntity.keyvalues.find("renderamt");
+        if (renderamt != bspEntity.keyvalues.end())
+        {
+            std::istringstream(renderamt->second) >> (rc.Amount);
+        }
+
+        auto rendercolor = bspEntity.keyvalues.find("rendercolor");
+        if (rendercolor != bspEntity.keyvalues.end())
+        {
+            std::istringstream(rendercolor->second) >> (rc.Color[0]) >> (rc.Color[1]) >> (rc.Color[2]);
+        }
+
+        auto rendermode = bspEntity.keyvalues.find("rendermode");
+        if (rendermode != bspEntity.keyvalues.end())
+        {
+            std::istringstream(rendermode->second) >> (rc.Mode);
+        }
+
+        _registry.emplace<RenderComponent>(entity, rc);
+
+        auto origin = bspEntity.keyvalues.find("origin");
+        if (origin != bspEntity.keyvalues.end())
+        {
+            glm::vec3 originPosition;
+
+            std::istringstream(origin->second) >> originPosition.x >> originPosition.y >> originPosition.z;
+
+            _registry.emplace<OriginComponent>(entity, originPosition);
+        }
+        else
+        {
+            _registry.emplace<OriginComponent>(entity, glm::vec3(0.0f));
+        }
+    }
+}
+
+bool GenMapApp::SetupStudioEntity(
+    entt::entity entity,
+    valve::hl1::tBSPEntity &bspEntity)
+{
+    auto &modelName = bspEntity.keyvalues["model"];
+
+    // studio models upload their textures, there is no GL context to upload to when headless
+    if (_headless || modelName.size() < 4 || modelName.compare(modelName.size() - 4, 4, ".mdl") != 0)
+    {
+        return false;
+    }
+
+    // every entity using the same file shares the model, its textures and uploaded meshes
+    auto model = _studioModels.Get(modelName);
+
+    if (model == nullptr)
+    {
+        return false;
+    }
+
+    auto instance = std::make_unique<StudioEntity>(model);
+
+    int value = 0;
+
+    if (std::istringstream(bspEntity.keyvalues["sequence"]) >> value)
+    {
+        instance->SetSequence(value);
+    }
+
+    if (std::istringstream(bspEntity.keyvalues["body"]) >> value)
+    {
+        instance->SetBodygroup(0, value);
+    }
+
+    if (std::istringstream(bspEntity.keyvalues["skin"]) >> value)
+    {
+        instance->SetSkin(value);
+    }
+
+    StudioComponent sc = {instance.get(), glm::vec3(0.0f)};
+
+    std::istringstream(bspEntity.keyvalues["angles"]) >> (sc.Angles.x) >> (sc.Angles.y) >> (sc.Angles.z);
+
+    _registry.emplace<StudioComponent>(entity, sc);
+
+    _studioEntities.push_back(std::move(instance));
+
+    return true;
+}
+
+void GenMapApp::Resize(
+    int width,
+    int height)
+{
+    glViewport(0, 0, width, height);
+
+    _projectionMatrix = glm::perspective(glm::radians(90.0f), float(width) / float(height), 0.1f, 4096.0f);
+}
+
+GenMapApp::~GenMapApp()
+{
+    StopSimulationThread();
+
+    // The compression and the loads read the textures of the map
+    if (_compressedTextureArrays.valid())
+    {
+        _compressedTextureArrays.wait();
+    }
+
+    for (auto &load : _textureArrayLoads)
+    {
+        load.result.wait();
+    }
+}
+
+void GenMapApp::Destroy()
+{
+    StopSimulationThread();
+
+    if (_compressedTextureArrays.valid())
+    {
+        _compressedTextureArrays.wait();
+    }
+
+    for (auto &load : _textureArrayLoads)
+    {
+        load.result.wait();
+    }
+
+    if (!_recordingFilename.empty())
+    {
+        if (_recording.Save(_recordingFilename))
+        {
+            spdlog::info("recorded {} frames to {}", _recording.FrameCount(), _recordingFilename);
+        }
+
+        _recordingFilename.clear();
+    }
+
+    _studioEntities.clear();
+    _studioModels.Clear();
+    _studioRenderer.ClearModels();
+    _trailBuffer.cleanup();
+    _textureUploads.Cleanup();
+    _bspAsset = nullptr;
+}
+
+bool GenMapApp::Tick(
+    std::chrono::milliseconds::rep time,
+    const struct InputState &inputState)
+{
+    if (_replaying)
+    {
+        return ReplayTick();
+    }
+
+    if (!_recordingFilename.empty())
+    {
+        _recording.Add(time, inputState);
+    }
+
+    return TickFrame(time, inputState);
+}
+
+void GenMapApp::RecordInput(
+    const std::string &filename)
+{
+    _recording.Clear();
+    _recordingFilename = filename;
+}
+
+bool GenMapApp::ReplayInput(
+    const std::string &recordingFilename,
+    const std::string &reportFilename)
+{
+    if (!_recording.Load(recordingFilename))
+    {
+        return false;
+    }
+
+    spdlog::info("replaying {} frames from {}", _recording.FrameCount(), recordingFilename);
+
+    _replaying = true;
+    _replayFrame = 0;
+    _replayReportFilename = reportFilename;
+    _replayFrameTimes.clear();
+    _replayFrameStats.clear();
+
+    return true;
+}
+
+bool GenMapApp::ReplayTick()
+{
+    auto now = std::chrono::steady_clock::now();
+
+    // A frame lasts until the next tick starts, so its time includes the swap
+    if (_replayFrame > 0)
+    {
+        _replayFrameTimes.push_back(std::chrono::duration<double, std::milli>(now - _replayFrameStart).count());
+        _replayFrameStats.push_back(_frameStats);
+    }
+
+    _replayFrameStart = now;
+
+    if (_replayFrame >= _recording.FrameCount())
+    {
+        WriteReplayReport();
+
+        return false;
+    }
+
+    _replayPreviousInputState = _replayInputState;
+    _recording.Apply(_replayFrame, _replayInputState);
+    _replayInputState.PreviousState = &_replayPreviousInputState;
+
+    auto time = _recording.Time(_replayFrame);
+    _replayFrame++;
+
+    return TickFrame(time, _replayInputState);
+}
+
+void GenMapApp::WriteReplayReport()
+{
+    if (_replayFrameTimes.empty())
+    {
+        return;
+    }
+
+    auto frameTimes = _replayFrameTimes;
+    std::sort(frameTimes.begin(), frameTimes.end());
+
+    auto percentile = [&frameTimes](int p) {
+        return frameTimes[std::min(frameTimes.size() - 1, frameTimes.size() * p / 100)];
+    };
+
+    double totalTime = 0.0, totalFaces = 0.0, totalDrawCalls = 0.0;
+    FrameStats minStats = _replayFrameStats.front(), maxStats = _replayFrameStats.front();
+    for (size_t i = 0; i < frameTimes.size(); i++)
+    {
+        auto &stats = _replayFrameStats[i];
+
+        totalTime += frameTimes[i];
+        totalFaces += stats.facesDrawn;
+        totalDrawCalls += stats.drawCalls;
+
+        minStats.facesDrawn = std::min(minStats.facesDrawn, stats.facesDrawn);
+        minStats.drawCalls = std::min(minStats.drawCalls, stats.drawCalls);
+        maxStats.facesDrawn = std::max(maxStats.facesDrawn, stats.facesDrawn);
+        maxStats.drawCalls = std::max(maxStats.drawCalls, stats.drawCalls);
+    }
+
+    auto frameCount = double(frameTimes.size());
+
+    spdlog::info(
+        "replay: {} frames, {:.3f} ms mean, {:.3f} ms p50, {:.3f} ms p90, {:.3f} ms p99, {:.3f} ms max",
+        frameTimes.size(),
+        totalTime / frameCount,
+        percentile(50),
+        percentile(90),
+        percentile(99),
+        frameTimes.back());
+
+    spdlog::info(
+        "replay: {:.1f} faces and {:.1f} draw calls per frame",
+        totalFaces / frameCount,
+        totalDrawCalls / frameCount);
+
+    if (_replayReportFilename.empty())
+    {
+        return;
+    }
+
+    std::ofstream report(_replayReportFilename);
+
+    report << "{\n";
+    report << "  \"frames\": " << frameTimes.size() << ",\n";
+    report << "  \"frame_ms\": {\"mean\": " << totalTime / frameCount
+           << ", \"p50\": " << percentile(50)
+           << ", \"p90\": " << percentile(90)
+           << ", \"p95\": " << percentile(95)
+           << ", \"p99\": " << percentile(99)
+           << ", \"max\": " << frameTimes.back() << "},\n";
+    report << "  \"faces_drawn\": {\"mean\": " << totalFaces / frameCount
+           << ", \"min\": " << minStats.facesDrawn
+           << ", \"max\": " << maxStats.facesDrawn << "},\n";
+    report << "  \"draw_calls\": {\"mean\": " << totalDrawCalls / frameCount
+           << ", \"min\": " << minStats.drawCalls
+           << ", \"max\": " << maxStats.drawCalls << "}\n";
+    report << "}\n";
+}
+
+bool GenMapApp::TickFrame(
+    std::chrono::milliseconds::rep time,
+    const struct InputState &inputState)
+{
+    PROFILE_ZONE("GenMapApp::Tick");
+    ALLOCATION_SCOPE("frame");
+
+    _frameStats = FrameStats();
+
+    if (_simulationThread.joinable())
+    {
+        std::lock_guard<std::mutex> lock(_simulationLock);
+
+        _simulationInput = inputState;
+    }
+    else
+    {
+        StepSimulation(time, inputState);
+    }
+
+    PrepareRenderState();
+
+    // A replay waits for the textures the residency loads, like for the ones at startup
+    UpdateTextureUploads(_replaying);
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    RenderSky();
+    RenderBsp();
+    RenderStudioModels();
+    RenderTrail();
+
+    PROFILE_FRAME();
+
+    return true; // to keep running
+}
+
+void GenMapApp::Simulate(
+    float timeStep,
+    const struct InputState &inputState)
+{
+    PROFILE_ZONE("simulate");
+
+    const float speed = 0.4f;
+
+    auto oldCamPosition = _cam.Position();
+
+    if (IsKeyboardButtonPushed(inputState, KeyboardButtons::KeySpace))
+    {
+        _skipClipping = !_skipClipping;
+    }
+
+    if (inputState.KeyboardButtonStates[KeyboardButtons::KeyLeft] || inputState.KeyboardButtonStates[KeyboardButtons::KeyA])
+    {
+        _cam.MoveLeft(speed * timeStep);
+    }
+    else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyRight] || inputState.KeyboardButtonStates[KeyboardButtons::KeyD])
+    {
+        _cam.MoveLeft(-speed * timeStep);
+    }
+
+    if (inputState.KeyboardButtonStates[KeyboardButtons::KeyUp] || inputState.KeyboardButtonStates[KeyboardButtons::KeyW])
+    {
+        _cam.MoveForward(speed * timeStep);
+    }
+    else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyDown] || inputState.KeyboardButtonStates[KeyboardButtons::KeyS])
+    {
+        _cam.MoveForward(-speed * timeStep);
+    }
+
+    if (inputState.KeyboardButtonStates[KeyboardButtons::KeyQ])
+    {
+        _cam.MoveUp(speed * timeStep);
+    }
+    else if (inputState.KeyboardButtonStates[KeyboardButtons::KeyZ])
+    {
+        _cam.MoveUp(-speed * timeStep);
+    }
+
+    static int lastPointerX = inputState.MousePointerPosition[0];
+    static int lastPointerY = inputState.MousePointerPosition[1];
+
+    int diffX = -(inputState.MousePointerPosition[0] - lastPointerX);
+    int diffY = -(inputState.MousePointerPosition[1] - lastPointerY);
+
+    lastPointerX = inputState.MousePointerPosition[0];
+    lastPointerY = inputState.MousePointerPosition[1];
+
+    if (inputState.MouseButtonStates[MouseButtons::LeftButton])
+    {
+        _cam.RotateZ(glm::radians(float(diffX) * 0.1f));
+        _cam.RotateX(glm::radians(float(diffY) * 0.1f));
+    }
+
+    auto newCamPosition = _cam.Position();
+
+    if (glm::length(newCamPosition - oldCamPosition) > 0.001f)
+    {
+        glm::vec3 target;
+
+        PROFILE_ZONE("collision");
+
+        _bspAsset->restartCount = 0;
+        auto tracedPos = _bspAsset->IsInContents(oldCamPosition, newCamPosition, target, _bspAsset->_bspFile->_modelData[0].headnode[0]);
+
+        if (!_skipClipping)
+        {
+            _cam.SetPosition(target);
+        }
+
+        TrailVertexType trailVertex;
+        trailVertex.pos = target;
+
+        if (tracedPos)
+        {
+            trailVertex.color = glm::vec3(1.0f, 0.0f, 0.0f);
+        }
+        else
+        {
+            trailVertex.color = glm::vec3(0.0f, 1.0f, 0.0f);
+        }
+
+        // The trail buffer is GL state, the render thread appends the points
+        std::lock_guard<std::mutex> lock(_simulationLock);
+
+        _pendingTrail.push_back(trailVertex);
+    }
+}
+
+void GenMapApp::StepSimulation(
+    std::chrono::milliseconds::rep time,
+    const struct InputState &inputState)
+{
+    // The first tick only starts the clock, so a replay begins with the same steps
+    if (_lastTime < 0)
+    {
+        _lastTime = time;
+    }
+
+    _simulationAccumulator += time - _lastTime;
+    _lastTime = time;
+
+    // Only the first step of a tick sees the buttons that were pushed since the last tick
+    InputState heldInputState = inputState;
+    heldInputState.PreviousState = &heldInputState;
+
+    bool firstStep = true;
+    while (_simulationAccumulator >= SimulationStep)
+    {
+        _simulationAccumulator -= SimulationStep;
+        _simulationTime += SimulationStep;
+
+        Simulate(float(SimulationStep), firstStep ? inputState : heldInputState);
+        PublishSnapshot();
+
+        firstStep = false;
+    }
+}
+
+void GenMapApp::PublishSnapshot()
+{
+    std::lock_guard<std::mutex> lock(_simulationLock);
+
+    _snapshots[0] = _snapshots[1];
+    _snapshots[1].camera = _cam;
+    _snapshots[1].time = _simulationTime;
+    _snapshots[1].published = std::chrono::steady_clock::now();
+}
+
+void GenMapApp::StartSimulationThread()
+{
+    _simulationStop = false;
+    _simulationThread = std::thread([this]() {
+        SimulationLoop();
+    });
+}
+
+void GenMapApp::StopSimulationThread()
+{
+    if (!_simulationThread.joinable())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_simulationLock);
+
+        _simulationStop = true;
+    }
+
+    _simulationWake.notify_all();
+    _simulationThread.join();
+}
+
+void GenMapApp::SimulationLoop()
+{
+    PROFILE_THREAD("simulation");
+    ALLOCATION_SCOPE("simulation");
+
+    using clock = std::chrono::steady_clock;
+
+    const auto step = std::chrono::milliseconds(SimulationStep);
+
+    InputState inputState, previousInputState;
+    auto nextStep = clock::now() + step;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_simulationLock);
+
+            _simulationWake.wait_until(lock, nextStep, [this]() { return _simulationStop; });
+
+            if (_simulationStop)
+            {
+                return;
+            }
+
+            previousInputState = inputState;
+            inputState = _simulationInput;
+        }
+
+        inputState.PreviousState = &previousInputState;
+
+        _simulationTime += SimulationStep;
+        Simulate(float(SimulationStep), inputState);
+        PublishSnapshot();
+
+        nextStep += step;
+
+        // Don't try to catch up after a stall, like a breakpoint, drop the missed steps instead
+        auto now = clock::now();
+        if (now - nextStep > std::chrono::milliseconds(100))
+        {
+            nextStep = now + step;
+        }
+    }
+}
+
+void GenMapApp::PrepareRenderState()
+{
+    PROFILE_ZONE("GenMapApp::PrepareRenderState");
+
+    SimulationSnapshot previous, latest;
+    std::vector<TrailVertexType> trail;
+
+    {
+        std::lock_guard<std::mutex> lock(_simulationLock);
+
+        previous = _snapshots[0];
+        latest = _snapshots[1];
+        trail.swap(_pendingTrail);
+    }
+
+    // The render lags one step behind the simulation, so it always has two states to blend
+    float amount = 1.0f;
+    if (_simulationThread.joinable())
+    {
+        auto sincePublished = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - latest.published);
+
+        amount = std::clamp(sincePublished.count() / float(SimulationStep), 0.0f, 1.0f);
+    }
+    else
+    {
+        amount = float(_simulationAccumulator) / float(SimulationStep);
+    }
+
+    _renderCam = Camera::Interpolate(previous.camera, latest.camera, amount);
+
+    // Studio models are animated here and not on the simulation thread, their bones are set up
+    // by the render workers
+    auto renderTime = double(previous.time) + double(latest.time - previous.time) * double(amount);
+    if (_animationTime < 0.0)
+    {
+        _animationTime = renderTime;
+    }
+
+    if (renderTime > _animationTime)
+    {
+        AdvanceStudioModels(float((renderTime - _animationTime) / 1000.0));
+        _animationTime = renderTime;
+    }
+
+    if (!trail.empty())
+    {
+        _trailBuffer.append(trail.data(), GLsizei(trail.size()));
+    }
+}
+
+void GenMapApp::RenderTrail()
+{
+    PROFILE_GPU_ZONE("GenMapApp::RenderTrail");
+    ALLOCATION_SCOPE("render.trail");
 
-void GenMapApp::RenderTrail()
-{
     // glDisable(GL_DEPTH_TEST);
-    if (_trail.size() < 3)
+    if (_trailBuffer.count() < 3)
     {
         return;
     }
 
     _trailShader.use();
 
-    _trailShader.setupMatrices(_projectionMatrix * _cam.GetViewMatrix());
-
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, _trail.size() * sizeof(glm::vec3), _trail.data(), GL_DYNAMIC_DRAW);
+    _trailShader.setupMatrices(_projectionMatrix * _renderCam.GetViewMatrix());
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)0);
-    glEnableVertexAttribArray(0);
+    _trailBuffer.bind();
 
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void *)(sizeof(float) * 3));
-    glEnableVertexAttribArray(1);
+    // A wrapped trail is split in two ranges, so it is drawn as strips instead of a loop
+    _trailBuffer.ranges([this](GLsizei first, GLsizei count) {
+        glDrawArrays(GL_LINE_STRIP, first, count);
+        _frameStats.drawCalls++;
+    });
 
-    glDrawArrays(GL_LINE_LOOP, 0, _trail.size());
+    _trailBuffer.fence();
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    _trailBuffer.unbind();
 }
 
 void GenMapApp::RenderSky()
 {
+    PROFILE_GPU_ZONE("GenMapApp::RenderSky");
+
     glEnable(GL_TEXTURE_2D);
     glDisable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
@@ -627,7 +1833,7 @@ void GenMapApp::RenderSky()
 
     _skyShader.use();
 
-    _skyShader.setupMatrices(_projectionMatrix * (_cam.GetViewMatrix() * glm::rotate(glm::translate(glm::mat4(1.0f), _cam.Position()), glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f))));
+    _skyShader.setupMatrices(_projectionMatrix * (_renderCam.GetViewMatrix() * glm::rotate(glm::translate(glm::mat4(1.0f), _renderCam.Position()), glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f))));
 
     _skyVertexBuffer.bind();
     glActiveTexture(GL_TEXTURE0);
@@ -639,88 +1845,376 @@ void GenMapApp::RenderSky()
         glDrawArrays(GL_QUADS, i * 4, 4);
     }
 
+    _frameStats.drawCalls += SkyTextures::Count;
+
     _skyVertexBuffer.unbind();
 }
 
 void GenMapApp::RenderBsp()
 {
+    PROFILE_GPU_ZONE("GenMapApp::RenderBsp");
+
+    RecordBspCommands(_projectionMatrix * _renderCam.GetViewMatrix());
+
+    _bspCommands.Sort();
+
     _vertexBuffer.bind();
 
     glEnable(GL_DEPTH_TEST);
 
-    auto m = _projectionMatrix * _cam.GetViewMatrix();
+    BspCommandBackend backend(_normalBlendingShader, _solidBlendingShader, _textureIndices, _textureArrays, _lightmapIndices);
+
+    auto stats = _bspCommands.Replay(backend);
+
+    _frameStats.drawCalls += stats.draws;
+
+    _vertexBuffer.unbind();
+}
+
+void GenMapApp::AdvanceStudioModels(
+    float timeStep)
+{
+    PROFILE_ZONE("GenMapApp::AdvanceStudioModels");
+
+    for (auto &instance : _studioEntities)
+    {
+        instance->AdvanceFrame(timeStep);
+    }
+}
+
+void GenMapApp::RenderStudioModels()
+{
+    PROFILE_GPU_ZONE("GenMapApp::RenderStudioModels");
+    ALLOCATION_SCOPE("render.studio");
+
+    auto view = _registry.view<StudioComponent>();
 
+    _studioEntitiesToSetUp.clear();
+    for (auto entity : view)
+    {
+        _studioEntitiesToSetUp.push_back(view.get<StudioComponent>(entity).Instance);
+    }
+
+    if (_studioEntitiesToSetUp.empty())
+    {
+        return;
+    }
+
+    StudioEntity::SetUpBones(_studioEntitiesToSetUp, _workers);
+
+    for (auto entity : view)
+    {
+        const auto &studioComponent = view.get<StudioComponent>(entity);
+        auto origin = _registry.get<OriginComponent>(entity).Origin;
+
+        // the angles key is pitch, yaw and roll in degrees, studio models face down the x axis
+        auto transform = glm::translate(glm::mat4(1.0f), origin);
+        transform = glm::rotate(transform, glm::radians(studioComponent.Angles.y), glm::vec3(0.0f, 0.0f, 1.0f));
+        transform = glm::rotate(transform, glm::radians(studioComponent.Angles.x), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform = glm::rotate(transform, glm::radians(studioComponent.Angles.z), glm::vec3(1.0f, 0.0f, 0.0f));
+
+        studioComponent.Instance->QueueModel(_studioRenderer, transform);
+    }
+
+    glEnable(GL_DEPTH_TEST);
     glDisable(GL_BLEND);
-    RenderModelsByRenderMode(RenderModes::NormalBlending, _normalBlendingShader, m);
+    glEnable(GL_CULL_FACE);
+    glCullFace(GL_FRONT);
+
+    _frameStats.drawCalls += _studioRenderer.RenderInstances(_projectionMatrix * _renderCam.GetViewMatrix());
+}
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_ONE, GL_DST_ALPHA);
-    RenderModelsByRenderMode(RenderModes::TextureBlending, _normalBlendingShader, m);
+bool GenMapApp::RunHeadless(
+    const std::string &cameraScript,
+    const std::string &outputDirectory,
+    int width,
+    int height)
+{
+    PROFILE_ZONE("GenMapApp::RunHeadless");
+    ALLOCATION_SCOPE("headless");
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    RenderModelsByRenderMode(RenderModes::SolidBlending, _solidBlendingShader, m);
+    _headless = true;
 
-    _vertexBuffer.unbind();
+    spdlog::info("{} @ {}", _fs.Mod().generic_string(), _fs.Root().generic_string());
+
+    _bspAsset = std::make_unique<valve::hl1::BspAsset>(&_fs);
+    if (!_bspAsset->Load(_map))
+    {
+        return false;
+    }
+
+    BuildFaces();
+    SetupEntities();
+    SortEntitiesByRenderMode();
+
+    std::ifstream script(cameraScript);
+
+    if (!script.is_open())
+    {
+        spdlog::error("failed to open camera script {}", cameraScript);
+
+        return false;
+    }
+
+    SoftwareRenderer renderer;
+
+    if (!renderer.Setup(width, height, std::thread::hardware_concurrency()))
+    {
+        return false;
+    }
+
+    auto projection = glm::perspective(glm::radians(90.0f), float(width) / float(height), 0.1f, 4096.0f);
+
+    std::string line;
+    while (std::getline(script, line))
+    {
+        std::string name;
+        glm::vec3 position(0.0f);
+        float pitch = 0.0f, yaw = 0.0f;
+
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (!(std::istringstream(line) >> name >> position.x >> position.y >> position.z >> pitch >> yaw))
+        {
+            spdlog::error("invalid camera line \"{}\"", line);
+
+            continue;
+        }
+
+        // the same rotations the mouse makes
+        Camera camera;
+        camera.SetPosition(position);
+        camera.RotateZ(glm::radians(yaw));
+        camera.RotateX(glm::radians(pitch));
+
+        auto start = std::chrono::steady_clock::now();
+
+        renderer.Clear(glm::vec4(0.0f, 0.45f, 0.7f, 1.0f));
+        RenderBspSoftware(renderer, projection * camera.GetViewMatrix());
+        renderer.Flush();
+
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        spdlog::info("{} rendered in {:.2f} ms", name, elapsed);
+
+        if (!renderer.SavePng((std::filesystem::path(outputDirectory) / (name + ".png")).string()))
+        {
+            return false;
+        }
+    }
+
+    return true;
 }
 
-void GenMapApp::RenderModelsByRenderMode(
-    RenderModes mode,
-    ShaderType &shader,
+void GenMapApp::RenderBspSoftware(
+    SoftwareRenderer &renderer,
     const glm::mat4 &matrix)
 {
-    auto view = _registry.view<RenderComponent, ModelComponent, OriginComponent>();
+    PROFILE_ZONE("GenMapApp::RenderBspSoftware");
+    ALLOCATION_SCOPE("software.raster");
+
+    auto group = _registry.group<RenderComponent, ModelComponent, OriginComponent>();
+
+    const RenderModes modes[] = {
+        RenderModes::NormalBlending,
+        RenderModes::TextureBlending,
+        RenderModes::SolidBlending,
+    };
+
+    std::vector<VertexType> fan;
+
+    for (auto mode : modes)
+    {
+        auto &range = _renderModeRanges[mode];
+
+        for (size_t e = range.first; e < range.second; e++)
+        {
+            const auto &[renderComponent, modelComponent, originComponent] = group.get<RenderComponent, ModelComponent, OriginComponent>(group[e]);
+
+            auto blendMode = SoftwareRenderer::BlendModes::Opaque;
+            auto color = glm::vec4(1.0f);
+
+            if (mode == RenderModes::TextureBlending)
+            {
+                blendMode = SoftwareRenderer::BlendModes::Additive;
+                color.a = float(renderComponent.Amount) / 255.0f;
+            }
+            else if (mode == RenderModes::SolidBlending)
+            {
+                blendMode = SoftwareRenderer::BlendModes::AlphaTest;
+                color.a = float(renderComponent.Amount) / 255.0f;
+            }
+
+            renderer.SetMatrix(glm::translate(matrix, originComponent.Origin));
+
+            const auto &model = _bspAsset->_models[modelComponent.Model];
+
+            for (int i = model.firstFace; i < model.firstFace + model.faceCount; i++)
+            {
+                if (_faces[i].flags > 0)
+                {
+                    continue;
+                }
+
+                fan.clear();
+                for (GLuint v = _faces[i].firstVertex; v < _faces[i].firstVertex + _faces[i].vertexCount; v++)
+                {
+                    auto &vertex = _bspAsset->_vertices[v];
+                    auto texcoords = valve::hl1::BspAsset::VertexTexcoords(vertex);
+                    auto lightmapTexcoords = valve::hl1::BspAsset::VertexLightmapTexcoords(vertex);
+
+                    VertexType decoded;
+                    decoded.pos = _bspAsset->VertexPosition(vertex);
+                    decoded.uvs = glm::vec4(lightmapTexcoords.x, lightmapTexcoords.y, texcoords.x, texcoords.y);
+                    fan.push_back(decoded);
+                }
+
+                renderer.DrawFan(
+                    fan.data(),
+                    _faces[i].vertexCount,
+                    _bspAsset->_textures[_faces[i].textureIndex],
+                    _bspAsset->_lightMaps[_faces[i].lightmapIndex],
+                    color,
+                    blendMode);
+            }
+        }
+    }
+}
+
+void GenMapApp::SortEntitiesByRenderMode()
+{
+    PROFILE_ZONE("GenMapApp::SortEntitiesByRenderMode");
+
+    // The owning group keeps the render, model and origin components packed in the same
+    // order, sorting it by render mode gives every mode one contiguous range in that order
+    auto group = _registry.group<RenderComponent, ModelComponent, OriginComponent>();
 
-    shader.use();
+    group.sort<RenderComponent>([](const RenderComponent &lhs, const RenderComponent &rhs) {
+        return lhs.Mode < rhs.Mode;
+    });
 
-    if (mode == RenderModes::NormalBlending)
+    for (auto &range : _renderModeRanges)
     {
-        shader.setupColor(glm::vec4(
-            1.0f,
-            1.0f,
-            1.0f,
-            1.0f));
+        range = {0, 0};
     }
 
-    for (auto entity : view)
+    for (size_t i = 0; i < group.size(); i++)
     {
-        auto renderComponent = _registry.get<RenderComponent>(entity);
+        auto mode = group.get<RenderComponent>(group[i]).Mode;
 
-        if (renderComponent.Mode != mode)
+        if (mode < 0 || mode >= RenderModes::RenderModesCount)
         {
             continue;
         }
 
-        if (mode == RenderModes::TextureBlending || mode == RenderModes::SolidBlending)
+        if (_renderModeRanges[mode].second == 0)
         {
-            shader.setupColor(glm::vec4(
-                1.0f,
-                1.0f,
-                1.0f,
-                float(renderComponent.Amount) / 255.0f));
+            _renderModeRanges[mode].first = i;
         }
 
-        auto modelComponent = _registry.get<ModelComponent>(entity);
-        auto originComponent = _registry.get<OriginComponent>(entity);
+        _renderModeRanges[mode].second = i + 1;
+    }
+}
+
+void GenMapApp::RecordBspCommands(
+    const glm::mat4 &matrix)
+{
+    PROFILE_ZONE("GenMapApp::RecordBspCommands");
+    ALLOCATION_SCOPE("render.faces");
+
+    // The world model holds most of the batches, so models are split into jobs of at most this
+    // many batches to spread them over the workers
+    const size_t BatchesPerJob = 64;
+
+    // Fewer jobs are recorded on the calling thread, waking the workers costs more than they save
+    const size_t MinJobsForWorkers = 4;
+
+    class Job
+    {
+    public:
+        uint8_t pass;
+        RenderModes mode;
+        uint32_t transform;
+        size_t firstBatch;
+        size_t lastBatch;
+    };
+
+    // In the order the modes were rendered in, the blended modes after the opaque one
+    const RenderModes modes[] = {
+        RenderModes::NormalBlending,
+        RenderModes::TextureBlending,
+        RenderModes::SolidBlending,
+    };
+
+    auto group = _registry.group<RenderComponent, ModelComponent, OriginComponent>();
+    auto &batches = _worldMesh.Batches();
 
-        shader.setupMatrices(glm::translate(matrix, originComponent.Origin));
+    _bspCommands.Reset(_workers.ThreadCount());
 
-        auto model = _bspAsset->_models[modelComponent.Model];
+    std::vector<Job> jobs;
 
-        for (int i = model.firstFace; i < model.firstFace + model.faceCount; i++)
+    for (uint8_t pass = 0; pass < 3; pass++)
+    {
+        auto mode = modes[pass];
+        auto &range = _renderModeRanges[mode];
+
+        for (size_t e = range.first; e < range.second; e++)
         {
-            if (_faces[i].flags > 0)
+            const auto &[renderComponent, modelComponent, originComponent] = group.get<RenderComponent, ModelComponent, OriginComponent>(group[e]);
+
+            auto color = glm::vec4(1.0f);
+            if (mode == RenderModes::TextureBlending || mode == RenderModes::SolidBlending)
+            {
+                color.a = float(renderComponent.Amount) / 255.0f;
+            }
+
+            auto transform = _bspCommands.AddTransform(glm::translate(matrix, originComponent.Origin) * _bspAsset->VertexDequantization(), color);
+
+            auto modelBatches = _worldMesh.ModelBatches(modelComponent.Model);
+
+            for (auto first = modelBatches.first; first < modelBatches.second; first += BatchesPerJob)
             {
-                continue;
+                jobs.push_back(Job{pass, mode, transform, first, std::min(first + BatchesPerJob, modelBatches.second)});
             }
 
-            glActiveTexture(GL_TEXTURE0);
-            glBindTexture(GL_TEXTURE_2D, _textureIndices[_faces[i].textureIndex]);
+            for (auto b = modelBatches.first; b < modelBatches.second; b++)
+            {
+                _frameStats.facesDrawn += int(batches[b].faceCount);
+            }
+        }
+    }
+
+    std::atomic<size_t> nextJob(0);
+
+    // Every list is filled by one thread, the threads take the jobs in turns
+    auto record = [this, &jobs, &nextJob, &batches](size_t listIndex) {
+        PROFILE_ZONE("GenMapApp::RecordBspCommands worker");
+        ALLOCATION_SCOPE("render.faces");
+
+        auto &list = _bspCommands.List((unsigned int)listIndex);
+
+        for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+        {
+            auto &job = jobs[j];
 
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_2D, _lightmapIndices[_faces[i].lightmapIndex]);
+            for (auto b = job.firstBatch; b < job.lastBatch; b++)
+            {
+                auto &batch = batches[b];
 
-            glDrawArrays(GL_TRIANGLE_FAN, _faces[i].firstVertex, _faces[i].vertexCount);
+                list.Draw(job.pass, uint8_t(job.mode), batch.texture, batch.lightmap, job.transform, batch.firstIndex, batch.indexCount);
+            }
         }
+    };
+
+    if (jobs.size() < MinJobsForWorkers)
+    {
+        record(0);
+
+        return;
     }
+
+    _workers.ParallelFor(std::min(size_t(_bspCommands.ListCount()), jobs.size()), record);
 }
@@ -7,12 +7,29 @@
 #include "hl1filesystem.h"
 #include "include/glbuffer.h"
 #include "include/glshader.h"
+#include "inputrecording.h"
+#include "mdl/studiomodel.h"
+#include "rendercommands.h"
+#include "softwarerenderer.h"
+#include "texturearrays.h"
+#include "texturecompression.h"
+#include "textureresidency.h"
+#include "textureuploads.h"
+#include "workerpool.h"
+#include "worldmesh.h"
 
 #include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <entt/entt.hpp>
+#include <future>
 #include <glm/glm.hpp>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 class FaceType
@@ -25,6 +42,49 @@ public:
     int flags;
 };
 
+// What was drawn in a frame, reported by the input replay
+class FrameStats
+{
+public:
+    int facesDrawn = 0;
+    int drawCalls = 0;
+};
+
+// A texture that is still being uploaded, a placeholder is bound in its place until then
+class PendingTexture
+{
+public:
+    int upload = -1;
+    GLuint texture = 0;
+    bool lightmap = false;
+    size_t index = 0; // into the lightmap or texture array indices
+};
+
+// A texture array that is built again on the worker pool after it was evicted
+class TextureArrayLoad
+{
+public:
+    int array = 0;
+    std::future<CompressedTextureArray> result;
+};
+
+class TrailVertexType
+{
+public:
+    glm::vec3 pos;
+    glm::vec3 color;
+};
+
+// The state a simulation step hands to the renderer, the renderer interpolates between the
+// previous and the latest snapshot
+class SimulationSnapshot
+{
+public:
+    Camera camera;
+    std::chrono::milliseconds::rep time = 0; // simulation time of the step
+    std::chrono::steady_clock::time_point published;
+};
+
 class GenMapApp
 {
 public:
@@ -39,6 +99,11 @@ public:
         Count,
     };
 
+    // The simulation always advances in steps of this many milliseconds
+    static const int SimulationStep = 10;
+
+    ~GenMapApp();
+
     void SetFilename(
         const char *root,
         const char *map);
@@ -49,6 +114,14 @@ public:
 
     void SetupBsp();
 
+    void BuildFaces();
+
+    void SetupEntities();
+
+    bool SetupStudioEntity(
+        entt::entity entity,
+        valve::hl1::tBSPEntity &bspEntity);
+
     void Resize(
         int width,
         int height);
@@ -58,19 +131,115 @@ public:
         std::chrono::milliseconds::rep time,
         const struct InputState &inputState);
 
+    // Records the time and input of every tick, the recording is saved when the application is
+    // destroyed
+    void RecordInput(
+        const std::string &filename);
+
+    // Ignores the time and input the ticks are called with and replays the recording instead.
+    // After its last frame the application stops and the frame times, faces drawn and draw
+    // calls per frame are logged and written to reportFilename when it is not empty.
+    bool ReplayInput(
+        const std::string &recordingFilename,
+        const std::string &reportFilename);
+
+    // One fixed step of camera movement and collision. Only touches the simulation camera and
+    // the pending trail points, so it can run on the simulation thread.
+    void Simulate(
+        float timeStep,
+        const struct InputState &inputState);
+
     void RenderTrail();
 
     void RenderSky();
 
     void RenderBsp();
 
-    void RenderModelsByRenderMode(
-        RenderModes mode,
-        ShaderType &shader,
+    void AdvanceStudioModels(
+        float timeStep);
+
+    void RenderStudioModels();
+
+    // Renders a screenshot for every line of the camera script on the CPU, without a window or
+    // GL context. A line is a name followed by the position and the pitch and yaw in degrees.
+    bool RunHeadless(
+        const std::string &cameraScript,
+        const std::string &outputDirectory,
+        int width,
+        int height);
+
+    void RenderBspSoftware(
+        SoftwareRenderer &renderer,
+        const glm::mat4 &matrix);
+
+    void SortEntitiesByRenderMode();
+
+    // Records a draw packet for every world mesh batch of the brush entities on worker threads,
+    // RenderBsp sorts and replays them
+    void RecordBspCommands(
         const glm::mat4 &matrix);
 
 private:
+    bool TickFrame(
+        std::chrono::milliseconds::rep time,
+        const struct InputState &inputState);
+
+    bool ReplayTick();
+
+    void WriteReplayReport();
+
+    // Steps the simulation on the calling thread for as many steps as fit in the time since the
+    // last tick. Used when replaying so the steps only depend on the recording.
+    void StepSimulation(
+        std::chrono::milliseconds::rep time,
+        const struct InputState &inputState);
+
+    void PublishSnapshot();
+
+    void StartSimulationThread();
+
+    void StopSimulationThread();
+
+    void SimulationLoop();
+
+    // Interpolates the render camera between the snapshots, advances the studio models to the
+    // interpolated time and moves the trail points of the new steps into the trail buffer
+    void PrepareRenderState();
+
+    void SetupPlaceholderTextures();
+
+    void QueueTextureArray(
+        int index,
+        CompressedTextureArray &&array);
+
+    // Sets up the residency with the sizes and cache keys of the arrays compressed at load
+    void SetupTextureResidency(
+        const std::vector<CompressedTextureArray> &arrays);
+
+    // Loads the layers of the array from the cache, or decodes and compresses the textures that
+    // are not in it. Runs on the worker pool.
+    CompressedTextureArray LoadTextureArray(
+        int index);
+
+    // Marks the textures of the faces in the PVS of the leafs around the camera
+    void FindReferencedTextures();
+
+    // Evicts and loads texture arrays and releases decoded textures as the residency decides.
+    // Arrays in compressed are queued from there instead of built again, the others are built
+    // again on the worker pool, a few at a time. With finish set it waits for all of them.
+    void UpdateTextureResidency(
+        bool finish,
+        std::vector<CompressedTextureArray> *compressed = nullptr);
+
+    // Queues the texture arrays once they are compressed, uploads the closest textures within
+    // the frame budget and binds the ones that became resident. With finish set it uploads
+    // everything.
+    void UpdateTextureUploads(
+        bool finish);
+
     valve::hl1::FileSystem _fs;
+    WorkerPool _workers; // for the work that is spread over cores every frame
+    bool _headless = false;
     std::string _map;
     std::unique_ptr<valve::hl1::BspAsset> _bspAsset = nullptr;
     glm::mat4 _projectionMatrix = glm::mat4(1.0f);
@@ -80,17 +249,63 @@ private:
     GLuint _skyTextureIndices[6] = {0, 0, 0, 0, 0, 0};
     ShaderType _normalBlendingShader;
     ShaderType _solidBlendingShader;
-    BufferType _vertexBuffer;
-    std::vector<GLuint> _textureIndices;
+    StaticBufferType _vertexBuffer;
+    WorldMesh _worldMesh;
+    TextureArrayLayout _textureArrays;
+    std::vector<GLuint> _textureIndices; // one per texture array
     std::vector<GLuint> _lightmapIndices;
+    TextureUploadScheduler _textureUploads;
+    std::future<std::vector<CompressedTextureArray>> _compressedTextureArrays;
+    std::vector<PendingTexture> _pendingTextures;
+    std::vector<std::vector<glm::vec3>> _textureArrayCenters; // of the faces using every array
+    std::vector<std::vector<glm::vec3>> _lightmapCenters;
+    TextureResidency _textureResidency;
+    bool _textureResidencyActive = false;
+    std::vector<TextureFormat> _textureArrayFormats;
+    std::vector<uint64_t> _textureKeys; // cache key of the layer of every texture
+    std::vector<TextureArrayLoad> _textureArrayLoads;
+    std::deque<int> _textureArraysToLoad; // waiting for one of the loads to finish
+    std::vector<bool> _modelTextures; // used by brush entities, always referenced
+    std::vector<bool> _referencedTextures;
+    std::vector<int> _referencedLeafs; // the leafs _referencedTextures was found for
+    std::vector<int> _cameraLeafs;
+    GLuint _placeholderTextureArray = 0;
+    GLuint _placeholderLightmap = 0;
     std::vector<FaceType> _faces;
     std::map<GLuint, FaceType> _facesByLightmapAtlas;
-    Camera _cam;
+    Camera _cam;       // owned by the simulation once it is running
+    Camera _renderCam; // what the frame is rendered with
     entt::registry _registry;
+    std::pair<size_t, size_t> _renderModeRanges[RenderModes::RenderModesCount];
+    RenderCommandQueue _bspCommands;
 
-    unsigned int VBO;
-    std::chrono::milliseconds::rep _lastTime;
-    std::vector<glm::vec3> _trail;
+    std::chrono::milliseconds::rep _lastTime = -1;
+    std::chrono::milliseconds::rep _simulationTime = 0;
+    std::chrono::milliseconds::rep _simulationAccumulator = 0;
+    double _animationTime = -1.0;
+    std::thread _simulationThread;
+    std::mutex _simulationLock; // guards everything below that the threads share
+    std::condition_variable _simulationWake;
+    bool _simulationStop = false;
+    InputState _simulationInput;
+    SimulationSnapshot _snapshots[2]; // previous and latest
+    std::vector<TrailVertexType> _pendingTrail;
+    FrameStats _frameStats;
+    InputRecording _recording;
+    std::string _recordingFilename;
+    bool _replaying = false;
+    size_t _replayFrame = 0;
+    InputState _replayInputState;
+    InputState _replayPreviousInputState;
+    std::chrono::steady_clock::time_point _replayFrameStart;
+    std::vector<double> _replayFrameTimes;
+    std::vector<FrameStats> _replayFrameStats;
+    std::string _replayReportFilename;
+    StreamBufferType _trailBuffer;
+    StudioModelCache _studioModels{&_fs, &_workers};
+    RenderApi _studioRenderer;
+    std::vector<std::unique_ptr<StudioEntity>> _studioEntities;
+    std::vector<StudioEntity *> _studioEntitiesToSetUp;
 };
 
 #endif // GENMAPAPP_H
@@ -0,0 +1,604 @@
+#include "allocationtracker.h"
+#include "hl1bspasset.h"
+#include "hl1filesystem.h"
+#include "mdl/bonekernels.hpp"
+#include "mdl/studiomodel.h"
+#include "profiler.h"
+#include "texturecompression.h"
+#include "workerpool.h"
+#include "worldmesh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Times the stages of loading a map and the hot loops of the viewer without opening a window,
+// and writes the results as JSON so runs can be compared. Stage values are the median of the
+// iterations, the _first ones are of the first iteration, which also fills the caches.
+//
+// genmap_bench <root> <map>... [--iterations N] [--traces N] [--model <mdl> [--entities N]] [--output <file>] [--trace <file>]
+
+using Clock = std::chrono::high_resolution_clock;
+
+class StageResult
+{
+public:
+    std::string name;
+    std::vector<double> wallMs;
+    std::vector<size_t> allocations; // per iteration, like wallMs
+    std::vector<size_t> bytes;
+};
+
+class StageTimer
+{
+public:
+    void Begin(
+        const std::string &name)
+    {
+        End();
+
+        _name = name;
+        _start = Clock::now();
+        auto total = AllocationTracker::Total();
+        _allocations = total.allocations;
+        _bytes = total.bytes;
+    }
+
+    void End()
+    {
+        if (_name.empty())
+        {
+            return;
+        }
+
+        auto wallMs = std::chrono::duration<double, std::milli>(Clock::now() - _start).count();
+        auto total = AllocationTracker::Total();
+        auto &result = Find(_name);
+
+        result.wallMs.push_back(wallMs);
+        result.allocations.push_back(total.allocations - _allocations);
+        result.bytes.push_back(total.bytes - _bytes);
+
+        _name.clear();
+    }
+
+    const std::vector<StageResult> &Results() const
+    {
+        return _results;
+    }
+
+private:
+    std::string _name;
+    Clock::time_point _start;
+    size_t _allocations = 0;
+    size_t _bytes = 0;
+    std::vector<StageResult> _results;
+
+    StageResult &Find(
+        const std::string &name)
+    {
+        for (auto &result : _results)
+        {
+            if (result.name == name)
+            {
+                return result;
+            }
+        }
+
+        _results.push_back(StageResult());
+        _results.back().name = name;
+
+        return _results.back();
+    }
+};
+
+class KernelResult
+{
+public:
+    std::string name;
+    double batchedNsPerBone;
+    double scalarNsPerBone;
+};
+
+class StudioResult
+{
+public:
+    unsigned int threads;
+    size_t entities;
+    double wallMs;
+};
+
+static std::string JsonString(
+    const std::string &value)
+{
+    std::ostringstream out;
+
+    out << '"';
+    for (auto c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out << '\\' << c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            out << ' ';
+        }
+        else
+        {
+            out << c;
+        }
+    }
+    out << '"';
+
+    return out.str();
+}
+
+template <typename T>
+static T Median(
+    std::vector<T> values)
+{
+    if (values.empty())
+    {
+        return T();
+    }
+
+    std::sort(values.begin(), values.end());
+
+    return values[values.size() / 2];
+}
+
+static bool BenchLoad(
+    valve::hl1::FileSystem &fs,
+    const std::string &map,
+    int iterations,
+    int traceCount,
+    StageTimer &timer,
+    WorldMeshStats &meshStats,
+    TextureCompressionStats &textureStats)
+{
+    // Started before the timing, like the one of the viewer
+    WorkerPool workers;
+
+    for (int i = 0; i < iterations; i++)
+    {
+        valve::hl1::BspAsset bspAsset(&fs);
+
+        bspAsset.onLoadStage = [&timer](const char *stage) {
+            if (stage == nullptr)
+            {
+                timer.End();
+            }
+            else
+            {
+                timer.Begin(stage);
+            }
+        };
+
+        if (!bspAsset.Load(map))
+        {
+            spdlog::error("failed to load {}", map);
+
+            return false;
+        }
+
+        timer.Begin("mesh build");
+
+        WorldMesh mesh;
+        mesh.Build(bspAsset);
+        meshStats = mesh.Stats();
+
+        // Without the cache, so every run encodes all layers
+        timer.Begin("texture compression");
+
+        TextureArrayLayout textureArrays;
+        textureArrays.Build(bspAsset._textures);
+
+        std::vector<CompressedTextureArray> compressedArrays;
+        TextureCompression::CompressArrays(
+            bspAsset._textures,
+            textureArrays,
+            true,
+            nullptr,
+            workers,
+            compressedArrays,
+            textureStats);
+
+        timer.Begin("pvs decode");
+
+        auto visLeafs = valve::hl1::BspAsset::LoadVisLeafs(bspAsset._bspFile);
+
+        timer.End();
+
+        for (auto &visLeaf : visLeafs)
+        {
+            delete[] visLeaf.leafs;
+        }
+
+        // Random segments inside the world bounds, seeded so every run traces the same ones
+        auto &world = bspAsset._bspFile->_modelData[0];
+        std::mt19937 random(1234);
+        std::uniform_real_distribution<float> x(world.mins.x, world.maxs.x);
+        std::uniform_real_distribution<float> y(world.mins.y, world.maxs.y);
+        std::uniform_real_distribution<float> z(world.mins.z, world.maxs.z);
+
+        std::vector<glm::vec3> points(traceCount * 2);
+        for (auto &point : points)
+        {
+            point = glm::vec3(x(random), y(random), z(random));
+        }
+
+        timer.Begin("traces");
+
+        glm::vec3 target;
+        for (int t = 0; t < traceCount; t++)
+        {
+            bspAsset.IsInContents(points[t * 2], points[t * 2 + 1], target, world.headnode[0]);
+        }
+
+        timer.End();
+    }
+
+    return true;
+}
+
+template <typename Kernel>
+static double TimeKernel(
+    int boneCount,
+    Kernel kernel)
+{
+    const int minimumRuns = 1000;
+    const auto minimumTime = std::chrono::milliseconds(100);
+
+    auto start = Clock::now();
+    int runs = 0;
+
+    while (runs < minimumRuns || Clock::now() - start < minimumTime)
+    {
+        kernel();
+        runs++;
+    }
+
+    auto ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+    return ns / (double(runs) * boneCount);
+}
+
+static std::vector<KernelResult> BenchBoneKernels()
+{
+    std::vector<KernelResult> results;
+
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    static vec4_t q1[MAXSTUDIOBONES], q2[MAXSTUDIOBONES];
+    static vec3_t pos1[MAXSTUDIOBONES], pos2[MAXSTUDIOBONES];
+    static float local[MAXSTUDIOBONES][3][4];
+    static float out[MAXSTUDIOBONES][4][4];
+    static mstudiobone_t bones[MAXSTUDIOBONES];
+
+    for (int i = 0; i < MAXSTUDIOBONES; i++)
+    {
+        vec3_t angles = {unit(random) * 3.14f, unit(random) * 3.14f, unit(random) * 3.14f};
+        AngleQuaternion(angles, q1[i]);
+        angles[0] = unit(random) * 3.14f;
+        AngleQuaternion(angles, q2[i]);
+
+        for (int j = 0; j < 3; j++)
+        {
+            pos1[i][j] = unit(random) * 64.0f;
+            pos2[i][j] = unit(random) * 64.0f;
+        }
+
+        bones[i] = mstudiobone_t();
+        bones[i].parent = i == 0 ? -1 : int(random() % i);
+    }
+
+    BoneMatrixArraysScalar(q1, pos1, MAXSTUDIOBONES, local);
+
+    // The slerp updates q1 in place, it is restored before every run so it doesn't converge on
+    // q2. Both versions pay for the copy.
+    static vec4_t q[MAXSTUDIOBONES];
+    static vec3_t pos[MAXSTUDIOBONES];
+
+    results.push_back(KernelResult{
+        "SlerpBoneArrays",
+        TimeKernel(MAXSTUDIOBONES, [&]() {
+            memcpy(q, q1, sizeof(q));
+            memcpy(pos, pos1, sizeof(pos));
+            SlerpBoneArrays(q, pos, q2, pos2, 0.5f, MAXSTUDIOBONES);
+        }),
+        TimeKernel(MAXSTUDIOBONES, [&]() {
+            memcpy(q, q1, sizeof(q));
+            memcpy(pos, pos1, sizeof(pos));
+            SlerpBoneArraysScalar(q, pos, q2, pos2, 0.5f, MAXSTUDIOBONES);
+        }),
+    });
+
+    results.push_back(KernelResult{
+        "BoneMatrixArrays",
+        TimeKernel(MAXSTUDIOBONES, [&]() { BoneMatrixArrays(q1, pos1, MAXSTUDIOBONES, local); }),
+        TimeKernel(MAXSTUDIOBONES, [&]() { BoneMatrixArraysScalar(q1, pos1, MAXSTUDIOBONES, local); }),
+    });
+
+    results.push_back(KernelResult{
+        "ConcatBoneArrays",
+        TimeKernel(MAXSTUDIOBONES, [&]() { ConcatBoneArrays(bones, local, MAXSTUDIOBONES, out); }),
+        TimeKernel(MAXSTUDIOBONES, [&]() { ConcatBoneArraysScalar(bones, local, MAXSTUDIOBONES, out); }),
+    });
+
+    return results;
+}
+
+static std::vector<StudioResult> BenchStudioEntities(
+    valve::hl1::FileSystem &fs,
+    const std::string &modelname,
+    size_t entityCount,
+    int iterations)
+{
+    std::vector<StudioResult> results;
+
+    StudioModel model;
+    if (!model.Init(&fs, modelname, nullptr))
+    {
+        spdlog::error("failed to load {}", modelname);
+
+        return results;
+    }
+
+    std::vector<std::unique_ptr<StudioEntity>> entities;
+    std::vector<StudioEntity *> entityPointers;
+
+    for (size_t i = 0; i < entityCount; i++)
+    {
+        auto entity = std::make_unique<StudioEntity>(&model);
+
+        // SetSequence wraps -1 around to the last sequence
+        auto sequenceCount = entity->SetSequence(-1) + 1;
+        entity->SetSequence(int(i % sequenceCount));
+        entity->AdvanceFrame(0.01f * float(i));
+
+        entityPointers.push_back(entity.get());
+        entities.push_back(std::move(entity));
+    }
+
+    // The first pass queues the sequence groups on the loader thread, wait for them to load so
+    // every pass below does the same work
+    WorkerPool serial(1);
+    StudioEntity::SetUpBones(entityPointers, serial);
+    model.WaitForSequenceGroups();
+    StudioEntity::SetUpBones(entityPointers, serial);
+
+    auto maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned int threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        // The pool is started before the timing, like the one of the viewer
+        WorkerPool workers(threads);
+        std::vector<double> wallMs;
+
+        for (int i = 0; i < iterations; i++)
+        {
+            auto start = Clock::now();
+
+            StudioEntity::SetUpBones(entityPointers, workers);
+
+            wallMs.push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+
+        results.push_back(StudioResult{threads, entityCount, Median(wallMs)});
+
+        if (threads == maxThreads)
+        {
+            break;
+        }
+    }
+
+    return results;
+}
+
+static void WriteJson(
+    std::ostream &out,
+    int iterations,
+    const std::vector<std::pair<std::string, StageTimer>> &maps,
+    const std::vector<WorldMeshStats> &meshes,
+    const std::vector<TextureCompressionStats> &textures,
+    const std::vector<KernelResult> &kernels,
+    const std::vector<StudioResult> &studio)
+{
+    out << "{\n";
+    out << "  \"iterations\": " << iterations << ",\n";
+
+    out << "  \"maps\": [";
+    for (size_t m = 0; m < maps.size(); m++)
+    {
+        auto &stages = maps[m].second.Results();
+
+        out << (m == 0 ? "\n" : ",\n");
+        out << "    {\"map\": " << JsonString(maps[m].first) << ", \"stages\": [";
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            auto &stage = stages[i];
+
+            out << (i == 0 ? "\n" : ",\n");
+            out << "      {\"name\": " << JsonString(stage.name)
+                << ", \"wall_ms\": " << Median(stage.wallMs)
+                << ", \"wall_ms_min\": " << *std::min_element(stage.wallMs.begin(), stage.wallMs.end())
+                << ", \"allocations_median\": " << Median(stage.allocations)
+                << ", \"allocations_first\": " << stage.allocations.front()
+                << ", \"bytes_median\": " << Median(stage.bytes)
+                << ", \"bytes_first\": " << stage.bytes.front() << "}";
+        }
+        out << "\n    ]";
+
+        auto &mesh = meshes[m];
+        out << ", \"mesh\": {\"batches\": " << mesh.batches
+            << ", \"triangles\": " << mesh.triangles
+            << ", \"face_vertices\": " << mesh.faceVertices
+            << ", \"vertices\": " << mesh.vertices
+            << ", \"acmr_fans\": " << mesh.acmrFans
+            << ", \"acmr_indexed\": " << mesh.acmrIndexed
+            << ", \"acmr_optimized\": " << mesh.acmrOptimized << "}";
+
+        auto &texture = textures[m];
+        out << ", \"textures\": {\"layers\": " << texture.layers
+            << ", \"rgba_bytes\": " << texture.rgbaBytes
+            << ", \"compressed_bytes\": " << texture.bytes << "}}";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"bone_kernels\": [";
+    for (size_t i = 0; i < kernels.size(); i++)
+    {
+        auto &kernel = kernels[i];
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"name\": " << JsonString(kernel.name)
+            << ", \"ns_per_bone\": " << kernel.batchedNsPerBone
+            << ", \"scalar_ns_per_bone\": " << kernel.scalarNsPerBone << "}";
+    }
+    out << "\n  ],\n";
+
+    out << "  \"studio_setupbones\": [";
+    for (size_t i = 0; i < studio.size(); i++)
+    {
+        auto &result = studio[i];
+
+        out << (i == 0 ? "\n" : ",\n");
+        out << "    {\"threads\": " << result.threads
+            << ", \"entities\": " << result.entities
+            << ", \"wall_ms\": " << result.wallMs << "}";
+    }
+    out << (studio.empty() ? "],\n" : "\n  ],\n");
+
+    out << "  \"allocation_tags\": ";
+    AllocationTracker::WriteJson(out, "  ");
+    out << "\n";
+
+    out << "}\n";
+}
+
+int main(
+    int argc,
+    char *argv[])
+{
+    // The traces log every step at debug level
+    spdlog::set_level(spdlog::level::warn);
+
+    if (argc < 3)
+    {
+        std::cerr << "usage: genmap_bench <root> <map>... [--iterations N] [--traces N] [--model <mdl> [--entities N]] [--output <file>] [--trace <file>]" << std::endl;
+
+        return 1;
+    }
+
+    std::vector<std::string> maps;
+    int iterations = 5;
+    int traceCount = 10000;
+    std::string modelname;
+    size_t entityCount = 256;
+    std::string output;
+    std::string trace;
+
+    int i = 2;
+    for (; i < argc && argv[i][0] != '-'; i++)
+    {
+        maps.push_back(argv[i]);
+    }
+
+    for (; i + 1 < argc; i += 2)
+    {
+        std::string option = argv[i];
+
+        if (option == "--iterations")
+        {
+            iterations = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (option == "--traces")
+        {
+            traceCount = std::max(0, std::atoi(argv[i + 1]));
+        }
+        else if (option == "--model")
+        {
+            modelname = argv[i + 1];
+        }
+        else if (option == "--entities")
+        {
+            entityCount = size_t(std::max(1, std::atoi(argv[i + 1])));
+        }
+        else if (option == "--output")
+        {
+            output = argv[i + 1];
+        }
+        else if (option == "--trace")
+        {
+            trace = argv[i + 1];
+        }
+        else
+        {
+            std::cerr << "unknown option " << option << std::endl;
+
+            return 1;
+        }
+    }
+
+    PROFILE_THREAD("main");
+
+    valve::hl1::FileSystem fs;
+    fs.FindRootFromFilePath(argv[1]);
+
+    std::vector<std::pair<std::string, StageTimer>> results;
+    std::vector<WorldMeshStats> meshes;
+    std::vector<TextureCompressionStats> textures;
+    for (auto &map : maps)
+    {
+        StageTimer timer;
+        WorldMeshStats meshStats;
+        TextureCompressionStats textureStats;
+        if (!BenchLoad(fs, map, iterations, traceCount, timer, meshStats, textureStats))
+        {
+            return 1;
+        }
+
+        results.push_back(std::make_pair(map, timer));
+        meshes.push_back(meshStats);
+        textures.push_back(textureStats);
+    }
+
+    auto kernels = BenchBoneKernels();
+
+    std::vector<StudioResult> studio;
+    if (!modelname.empty())
+    {
+        studio = BenchStudioEntities(fs, modelname, entityCount, iterations);
+    }
+
+    if (output.empty())
+    {
+        WriteJson(std::cout, iterations, results, meshes, textures, kernels, studio);
+    }
+    else
+    {
+        std::ofstream file(output);
+        WriteJson(file, iterations, results, meshes, textures, kernels, studio);
+    }
+
+    // Only written when the bench is built with GENMAP_PROFILER
+    if (!trace.empty())
+    {
+        PROFILE_WRITE_TRACE(trace);
+    }
+
+    return 0;
+}
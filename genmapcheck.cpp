@@ -0,0 +1,556 @@
+#include "include/glbuffer.h"
+#include "mdl/bonekernels.hpp"
+#include "rendercommands.h"
+#include "softwarerenderer.h"
+#include "texturearrays.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Checks the bookkeeping of the renderer that works without a GL context, so it runs headless
+// and in CI. Every failed check is logged, the exit code is the number of failed checks.
+//
+// genmap_check
+
+static int failures = 0;
+
+static void Check(
+    bool condition,
+    const std::string &what)
+{
+    if (!condition)
+    {
+        spdlog::error("check failed: {}", what);
+        failures++;
+    }
+}
+
+using RangeList = std::vector<std::pair<GLsizei, GLsizei>>;
+
+static RangeList Ranges(
+    const StreamBufferType &buffer)
+{
+    RangeList result;
+
+    buffer.ranges([&result](GLsizei first, GLsizei count) {
+        result.push_back(std::make_pair(first, count));
+    });
+
+    return result;
+}
+
+static void CheckStreamBuffer()
+{
+    StreamBufferType buffer;
+
+    Check(!buffer.setup(2, sizeof(int), true), "a stream buffer needs an element per region");
+    Check(buffer.setup(9, sizeof(int), true), "cpu stream buffer setup");
+    Check(buffer.mode() == StreamBufferType::Modes::Cpu, "cpu stream buffer mode");
+
+    int a[4] = {1, 2, 3, 4};
+    int b[4] = {5, 6, 7, 8};
+    int c[3] = {9, 10, 11};
+
+    Check(buffer.append(a, 0) == -1, "empty appends are refused");
+    Check(buffer.append(a, 10) == -1, "appends over the capacity are refused");
+
+    // Appends that follow each other merge into one range
+    Check(buffer.append(a, 4) == 0, "first append starts at 0");
+    Check(buffer.append(b, 4) == 4, "second append follows the first");
+    Check(Ranges(buffer) == RangeList{{0, 8}}, "contiguous appends merge");
+    Check(buffer.count() == 8, "count of merged appends");
+
+    // Not enough room before the end, the append wraps to the front and discards the oldest
+    // elements it overwrites
+    Check(buffer.append(c, 3) == 0, "append wraps to the front");
+    Check(Ranges(buffer) == RangeList({{3, 5}, {0, 3}}), "wrapped append discards the overwritten elements");
+    Check(buffer.count() == 8, "count after wrapping");
+    Check(*reinterpret_cast<const int *>(buffer.data(0)) == 9, "wrapped data is at the front");
+    Check(*reinterpret_cast<const int *>(buffer.data(3)) == 4, "live data is kept");
+
+    // An append over the front of the oldest range trims it
+    Check(buffer.append(a, 4) == 3, "append after the wrapped one");
+    Check(Ranges(buffer) == RangeList({{7, 1}, {0, 7}}), "overwritten ranges are dropped");
+    Check(buffer.count() == 8, "count after overwriting");
+
+    buffer.release();
+    Check(buffer.count() == 0 && Ranges(buffer).empty(), "release forgets the live elements");
+
+    Check(buffer.append(b, 2) == 7, "append after release continues at the head");
+    Check(buffer.append(c, 3) == 0, "append after release wraps");
+    Check(Ranges(buffer) == RangeList({{7, 2}, {0, 3}}), "ranges after release");
+
+    // Without GL there is nothing to wait for
+    buffer.fence();
+    Check(buffer.stalls() == 0, "cpu stream buffers never stall");
+
+    buffer.cleanup();
+    Check(buffer.count() == 0, "cleanup forgets the live elements");
+}
+
+// Largest difference relative to the reference, absolute below 1 so values near 0 count too
+static float MaxError(
+    const float *values,
+    const float *reference,
+    size_t count)
+{
+    float result = 0.0f;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        auto error = std::fabs(values[i] - reference[i]) / std::max(1.0f, std::fabs(reference[i]));
+
+        result = std::max(result, error);
+    }
+
+    return result;
+}
+
+static void CheckBoneKernels()
+{
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    static vec4_t q1[MAXSTUDIOBONES], q2[MAXSTUDIOBONES], q[MAXSTUDIOBONES], qScalar[MAXSTUDIOBONES];
+    static vec3_t pos1[MAXSTUDIOBONES], pos2[MAXSTUDIOBONES], pos[MAXSTUDIOBONES], posScalar[MAXSTUDIOBONES];
+    static float local[MAXSTUDIOBONES][3][4], localScalar[MAXSTUDIOBONES][3][4];
+    static float out[MAXSTUDIOBONES][4][4], outScalar[MAXSTUDIOBONES][4][4];
+    static mstudiobone_t bones[MAXSTUDIOBONES];
+
+    float slerpError = 0.0f;
+    float matrixError = 0.0f;
+    float concatError = 0.0f;
+
+    // Counts that are not a multiple of the SSE width run the remainder separately
+    const int counts[] = {1, 3, 4, 7, 13, MAXSTUDIOBONES};
+    const float fractions[] = {0.0f, 0.25f, 0.5f, 0.9f, 1.0f};
+
+    for (int run = 0; run < 64; run++)
+    {
+        for (int i = 0; i < MAXSTUDIOBONES; i++)
+        {
+            vec3_t angles = {unit(random) * 3.14f, unit(random) * 3.14f, unit(random) * 3.14f};
+            AngleQuaternion(angles, q1[i]);
+
+            // Also nearly equal and opposite rotations, the edge cases of the slerp
+            if (run % 4 == 1)
+            {
+                angles[0] += unit(random) * 1e-4f;
+            }
+            else
+            {
+                angles[0] = unit(random) * 3.14f;
+            }
+            AngleQuaternion(angles, q2[i]);
+
+            if (run % 4 == 2)
+            {
+                for (int j = 0; j < 4; j++)
+                {
+                    q2[i][j] = -q2[i][j];
+                }
+            }
+
+            for (int j = 0; j < 3; j++)
+            {
+                pos1[i][j] = unit(random) * 64.0f;
+                pos2[i][j] = unit(random) * 64.0f;
+            }
+
+            bones[i] = mstudiobone_t();
+            bones[i].parent = i == 0 ? -1 : int(random() % i);
+        }
+
+        auto count = counts[run % (sizeof(counts) / sizeof(counts[0]))];
+        auto s = fractions[run % (sizeof(fractions) / sizeof(fractions[0]))];
+
+        memcpy(q, q1, sizeof(q));
+        memcpy(pos, pos1, sizeof(pos));
+        memcpy(qScalar, q1, sizeof(qScalar));
+        memcpy(posScalar, pos1, sizeof(posScalar));
+
+        SlerpBoneArrays(q, pos, q2, pos2, s, count);
+        SlerpBoneArraysScalar(qScalar, posScalar, q2, pos2, s, count);
+
+        slerpError = std::max(slerpError, MaxError(&q[0][0], &qScalar[0][0], size_t(count) * 4));
+        slerpError = std::max(slerpError, MaxError(&pos[0][0], &posScalar[0][0], size_t(count) * 3));
+
+        BoneMatrixArrays(qScalar, posScalar, count, local);
+        BoneMatrixArraysScalar(qScalar, posScalar, count, localScalar);
+
+        matrixError = std::max(matrixError, MaxError(&local[0][0][0], &localScalar[0][0][0], size_t(count) * 12));
+
+        ConcatBoneArrays(bones, localScalar, count, out);
+        ConcatBoneArraysScalar(bones, localScalar, count, outScalar);
+
+        concatError = std::max(concatError, MaxError(&out[0][0][0], &outScalar[0][0][0], size_t(count) * 16));
+    }
+
+    Check(slerpError <= BoneKernelTolerance, fmt::format("SlerpBoneArrays is off the scalar path by {}", slerpError));
+    Check(matrixError <= BoneKernelTolerance, fmt::format("BoneMatrixArrays is off the scalar path by {}", matrixError));
+    Check(concatError <= BoneKernelTolerance, fmt::format("ConcatBoneArrays is off the scalar path by {}", concatError));
+
+    spdlog::info("bone kernels within {} of the scalar path: slerp {}, matrix {}, concat {}", BoneKernelTolerance, slerpError, matrixError, concatError);
+}
+
+// Writes down what the queue tells it, transforms are told apart by their color
+class RecordingBackend : public RenderCommandBackend
+{
+public:
+    std::vector<int> pipelines;
+    std::vector<int> transforms;
+    std::vector<std::pair<uint32_t, uint32_t>> textures;
+    using DrawList = std::vector<std::pair<uint32_t, uint32_t>>;
+
+    DrawList draws; // first and count
+
+    void SetPipeline(
+        uint8_t pipeline) override
+    {
+        pipelines.push_back(pipeline);
+    }
+
+    void SetTransform(
+        const DrawTransform &transform) override
+    {
+        transforms.push_back(int(transform.color.x));
+    }
+
+    void SetTextures(
+        uint32_t texture,
+        uint32_t lightmap) override
+    {
+        textures.push_back(std::make_pair(texture, lightmap));
+    }
+
+    void Draw(
+        uint32_t first,
+        uint32_t count) override
+    {
+        draws.push_back(std::make_pair(first, count));
+    }
+};
+
+static void CheckRenderCommandQueue()
+{
+    DrawPacket low;
+    low.pipeline = 15;
+    low.texture = (1 << RenderCommandQueue::TextureBits) - 1;
+    low.lightmap = (1 << RenderCommandQueue::LightmapBits) - 1;
+    low.transform = (1 << RenderCommandQueue::TransformBits) - 1;
+
+    DrawPacket high;
+    high.pass = 1;
+
+    Check(RenderCommandQueue::Key(low) < RenderCommandQueue::Key(high), "the pass is the most significant part of the key");
+
+    high = low;
+    high.pass = 0;
+    high.pipeline = 0;
+    high.texture = 0;
+
+    Check(RenderCommandQueue::Key(high) < RenderCommandQueue::Key(low), "the pipeline sorts before the texture");
+
+    RenderCommandQueue queue;
+
+    queue.Reset(2);
+
+    auto t0 = queue.AddTransform(glm::mat4(1.0f), glm::vec4(0.0f));
+    auto t1 = queue.AddTransform(glm::mat4(1.0f), glm::vec4(1.0f));
+
+    // Recorded out of order over two lists, like the workers do
+    queue.List(1).Draw(1, 2, 5, 0, t0, 30, 3);
+    queue.List(1).Draw(0, 1, 7, 1, t1, 20, 3);
+    queue.List(1).Draw(0, 1, 7, 1, 99, 60, 3);
+    queue.List(0).Draw(1, 1, 9, 0, t0, 50, 3);
+    queue.List(0).Draw(0, 3, 1, 0, t0, 40, 3);
+    queue.List(0).Draw(0, 1, 7, 1, t1, 10, 3);
+    queue.List(0).Draw(0, 1, 3, 1, t0, 0, 6);
+    queue.List(0).Draw(1, 1, 9, 0, t0, 56, 2);
+
+    queue.Sort();
+
+    Check(queue.Packets().size() == 8, "sort merges the lists");
+
+    RecordingBackend backend;
+    auto stats = queue.Replay(backend);
+
+    // By pass, pipeline and texture, draws with the same key by their first vertex. The draw
+    // with the unknown transform is skipped.
+    Check(backend.draws == RecordingBackend::DrawList({{0, 6}, {10, 3}, {20, 3}, {40, 3}, {50, 3}, {56, 2}, {30, 3}}), "replay order and ranges of the draws");
+    Check(backend.pipelines == std::vector<int>({1, 3, 1, 2}), "a pass change sets the pipeline again");
+    Check(backend.transforms == std::vector<int>({0, 1, 0, 0, 0}), "transforms are set when they change");
+    Check(backend.textures.size() == 5 && backend.textures[1] == std::make_pair(7u, 1u), "textures are set when they change");
+
+    Check(stats.draws == 7, "replay skips draws with an unknown transform");
+    Check(stats.pipelineChanges == 4, "pipeline changes");
+    Check(stats.transformChanges == 5, "transform changes");
+    Check(stats.textureChanges == 5, "texture changes");
+
+    queue.Reset(1);
+    queue.Sort();
+
+    Check(queue.ListCount() == 2 && queue.Packets().empty(), "reset keeps the lists and clears them");
+}
+
+static void CheckTextureArrays()
+{
+    Check(TextureArrayLayout::SizeClass(0) == 1, "size class of an empty texture");
+    Check(TextureArrayLayout::SizeClass(1) == 1, "size class of 1");
+    Check(TextureArrayLayout::SizeClass(3) == 4, "size classes round up");
+    Check(TextureArrayLayout::SizeClass(64) == 64, "powers of two are their own size class");
+    Check(TextureArrayLayout::SizeClass(65) == 128, "size class just over a power of two");
+
+    // More textures of one class than an array holds, then other classes
+    std::vector<std::unique_ptr<valve::Texture>> owned;
+    std::vector<valve::Texture *> textures;
+
+    for (int t = 0; t < TextureArrayLayout::MaxLayers + 6; t++)
+    {
+        owned.push_back(std::make_unique<valve::Texture>());
+        owned.back()->SetDimentions(16, 16);
+    }
+
+    owned.push_back(std::make_unique<valve::Texture>());
+    owned.back()->SetDimentions(24, 10);
+
+    owned.push_back(std::make_unique<valve::Texture>());
+
+    for (auto &texture : owned)
+    {
+        textures.push_back(texture.get());
+    }
+
+    TextureArrayLayout layout;
+    layout.Build(textures);
+
+    auto &arrays = layout.Arrays();
+    auto &slots = layout.Slots();
+    auto last = TextureArrayLayout::MaxLayers + 5;
+
+    Check(slots.size() == textures.size(), "a slot for every texture");
+    Check(arrays.size() == 4, "arrays are split at MaxLayers and by size class");
+
+    if (arrays.size() != 4 || slots.size() != textures.size())
+    {
+        return;
+    }
+
+    Check(arrays[0].width == 16 && arrays[0].height == 16, "size of the first array");
+    Check(arrays[0].textures.size() == size_t(TextureArrayLayout::MaxLayers), "the first array is full");
+    Check(arrays[1].textures.size() == 6, "the rest of the class goes to a new array");
+    Check(slots[TextureArrayLayout::MaxLayers].array == 1 && slots[TextureArrayLayout::MaxLayers].layer == 0, "first slot over MaxLayers");
+    Check(slots[last].array == 1 && slots[last].layer == 5, "last slot of the split class");
+    Check(slots[0].scale.x == 1.0f && slots[0].scale.y == 1.0f, "textures that fill their class have a scale of 1");
+
+    Check(arrays[2].width == 32 && arrays[2].height == 16, "width and height have their own size class");
+    Check(slots[last + 1].array == 2, "slot of the 24x10 texture");
+    Check(slots[last + 1].scale.x == 0.75f && slots[last + 1].scale.y == 0.625f, "scale of the 24x10 texture");
+    Check(arrays[2].scales[0].x == 0.75f && arrays[2].scales[0].y == 0.625f, "the array keeps the scale of its layers");
+
+    Check(arrays[3].width == 1 && arrays[3].height == 1, "textures without data get a 1x1 slot");
+    Check(slots[last + 2].array == 3 && slots[last + 2].scale.x == 1.0f, "slot of the texture without data");
+
+    // A source that is not a power of two. The layer wraps from its last texel to the first
+    // one of the texture, so its last column and row have to be the texture's last ones. The
+    // padding in between starts with the texture's first texels, when there is room for them.
+    const int width = 3;
+    const int height = 5;
+    unsigned char pixels[width * height * 3];
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            auto pixel = pixels + (y * width + x) * 3;
+
+            pixel[0] = (unsigned char)(x * 16 + y);
+            pixel[1] = (unsigned char)x;
+            pixel[2] = (unsigned char)y;
+        }
+    }
+
+    valve::Texture source;
+    source.SetData(width, height, 3, pixels);
+
+    auto classWidth = TextureArrayLayout::SizeClass(width);
+    auto classHeight = TextureArrayLayout::SizeClass(height);
+    std::vector<unsigned char> rgba;
+
+    TextureArrayLayout::PadToSizeClass(source, classWidth, classHeight, rgba);
+
+    Check(rgba.size() == size_t(classWidth * classHeight * 4), "padded layer size");
+
+    // Source column and row of every column and row of the 4x8 layer
+    const int columns[] = {0, 1, 2, 2};
+    const int rows[] = {0, 1, 2, 3, 4, 0, 3, 4};
+
+    bool padded = classWidth == 4 && classHeight == 8 && rgba.size() == size_t(classWidth * classHeight * 4);
+
+    for (int y = 0; padded && y < classHeight; y++)
+    {
+        for (int x = 0; x < classWidth; x++)
+        {
+            auto pixel = rgba.data() + (y * classWidth + x) * 4;
+            auto expected = pixels + (rows[y] * width + columns[x]) * 3;
+
+            padded = padded && pixel[0] == expected[0] && pixel[1] == expected[1] && pixel[2] == expected[2] && pixel[3] == 255;
+        }
+    }
+
+    Check(padded, "a 3x5 texture is padded to its 4x8 layer with its edge texels");
+
+    valve::Texture empty;
+    TextureArrayLayout::PadToSizeClass(empty, 2, 2, rgba);
+
+    Check(std::all_of(rgba.begin(), rgba.end(), [](unsigned char c) { return c == 255; }), "a texture without data pads to white");
+}
+
+static bool Near(
+    const glm::vec4 &a,
+    const glm::vec4 &b)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        if (std::fabs(a[i] - b[i]) > 1.0f / 255.0f)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// A quad from x0 to x1 over the height of the screen, with the texture over its width
+static void DrawQuad(
+    SoftwareRenderer &renderer,
+    float x0,
+    float x1,
+    float z,
+    valve::Texture *texture,
+    const glm::vec4 &color,
+    SoftwareRenderer::BlendModes mode)
+{
+    VertexType vertices[4];
+
+    vertices[0].pos = glm::vec3(x0, -1.0f, z);
+    vertices[1].pos = glm::vec3(x1, -1.0f, z);
+    vertices[2].pos = glm::vec3(x1, 1.0f, z);
+    vertices[3].pos = glm::vec3(x0, 1.0f, z);
+    vertices[0].uvs = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    vertices[1].uvs = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);
+    vertices[2].uvs = glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
+    vertices[3].uvs = glm::vec4(0.0f, 0.0f, 0.0f, 0.0f);
+
+    renderer.DrawFan(vertices, 4, texture, nullptr, color, mode);
+}
+
+static void CheckSoftwareRenderer()
+{
+    const int size = 2 * SoftwareRenderer::TileSize;
+    const glm::vec4 background(0.0f, 0.0f, 0.0f, 1.0f);
+    const glm::vec4 red(0.5f, 0.0f, 0.0f, 1.0f);
+
+    SoftwareRenderer renderer;
+
+    Check(!renderer.Setup(0, size, 1), "an empty software framebuffer is refused");
+    Check(renderer.Setup(size, size, 2), "software renderer setup");
+
+    // A floor reaching from in front of the camera to behind it, only what is in front of the
+    // near plane is drawn. It covers the bottom row of tiles and stops short of the horizon.
+    renderer.SetMatrix(glm::perspective(1.5707964f, 1.0f, 1.0f, 100.0f));
+    renderer.Clear(background);
+
+    VertexType floor[4];
+    floor[0].pos = glm::vec3(-10.0f, -1.0f, 10.0f);
+    floor[1].pos = glm::vec3(10.0f, -1.0f, 10.0f);
+    floor[2].pos = glm::vec3(10.0f, -1.0f, -10.0f);
+    floor[3].pos = glm::vec3(-10.0f, -1.0f, -10.0f);
+
+    renderer.DrawFan(floor, 4, nullptr, nullptr, red, SoftwareRenderer::BlendModes::Opaque);
+    renderer.Flush();
+
+    Check(Near(renderer.Pixel(4, size - 10), red), "the clipped floor covers the bottom left tile");
+    Check(Near(renderer.Pixel(size - 4, size - 10), red), "the clipped floor covers the bottom right tile");
+    Check(Near(renderer.Pixel(size / 2, size / 2 - 8), background), "the floor stays below the horizon");
+    Check(Near(renderer.Pixel(size / 2, 4), background), "nothing behind the camera is drawn");
+
+    // The blend modes, in screen space with the depth in z
+    renderer.SetMatrix(glm::mat4(1.0f));
+    renderer.Clear(background);
+
+    // The left texel is transparent, the texture is clamped so it is not blended with the right
+    unsigned char texels[] = {255, 255, 255, 0, 0, 0, 255, 255};
+    valve::Texture texture;
+    texture.SetData(2, 1, 4, texels, false);
+
+    DrawQuad(renderer, -1.0f, 1.0f, 0.5f, nullptr, red, SoftwareRenderer::BlendModes::Opaque);
+    DrawQuad(renderer, -1.0f, 0.0f, 0.0f, nullptr, glm::vec4(0.0f, 0.25f, 0.0f, 1.0f), SoftwareRenderer::BlendModes::Additive);
+    DrawQuad(renderer, 0.0f, 1.0f, 0.0f, &texture, glm::vec4(1.0f), SoftwareRenderer::BlendModes::AlphaTest);
+    DrawQuad(renderer, -1.0f, 1.0f, 0.9f, nullptr, glm::vec4(1.0f), SoftwareRenderer::BlendModes::Opaque);
+    renderer.Flush();
+
+    auto y = size / 2;
+
+    Check(Near(renderer.Pixel(16, y), glm::vec4(0.5f, 0.25f, 0.0f, 1.0f)), "additive blending adds to the opaque quad");
+    Check(Near(renderer.Pixel(size / 2 + 6, y), red), "the alpha test discards transparent texels");
+    Check(Near(renderer.Pixel(size - 8, y), glm::vec4(0.0f, 0.0f, 1.0f, 1.0f)), "the alpha test keeps opaque texels");
+
+    // The screenshot is RGB8 in a single stored deflate block at this size
+    auto filename = (std::filesystem::temp_directory_path() / "genmap_check.png").string();
+
+    Check(renderer.SavePng(filename), "saving the software framebuffer");
+
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    std::vector<unsigned char> png((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    std::filesystem::remove(filename);
+
+    const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    const size_t rowSize = size_t(size) * 3 + 1;
+    const size_t pixels = 8 + 25 + 8 + 2 + 5; // signature, IHDR, IDAT header, zlib and block header
+
+    Check(png.size() == pixels + rowSize * size + 4 + 4 + 12, "png size");
+
+    if (png.size() != pixels + rowSize * size + 4 + 4 + 12)
+    {
+        return;
+    }
+
+    Check(std::equal(signature, signature + 8, png.begin()), "png signature");
+    Check(png[16 + 3] == size && png[20 + 3] == size && png[24] == 8 && png[25] == 2, "png header of an RGB8 image");
+
+    auto pixel = png.begin() + pixels + rowSize * size_t(y) + 1;
+
+    Check(pixel[16 * 3] == 128 && pixel[16 * 3 + 1] == 64 && pixel[16 * 3 + 2] == 0, "png pixel of the additive quad");
+    Check(pixel[(size - 8) * 3] == 0 && pixel[(size - 8) * 3 + 2] == 255, "png pixel of the alpha tested quad");
+}
+
+int main()
+{
+    CheckStreamBuffer();
+    CheckBoneKernels();
+    CheckRenderCommandQueue();
+    CheckTextureArrays();
+    CheckSoftwareRenderer();
+
+    if (failures > 0)
+    {
+        spdlog::error("{} checks failed", failures);
+    }
+    else
+    {
+        spdlog::info("all checks passed");
+    }
+
+    return failures;
+}
@@ -1,7 +1,11 @@
 #include "hl1bspasset.h"
 
+#include "allocationtracker.h"
 #include "hl1bsptypes.h"
+#include "profiler.h"
 #include "stb_rect_pack.h"
+#include <algorithm>
+#include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <iostream>
 #include <spdlog/spdlog.h>
@@ -36,11 +40,16 @@ BspAsset::BspAsset(
 {}
 
 BspAsset::~BspAsset()
-{}
+{
+    WadAsset::UnloadWads(_wads);
+}
 
 bool BspAsset::Load(
     const std::string &filename)
 {
+    PROFILE_ZONE("BspAsset::Load");
+    ALLOCATION_SCOPE("bsp.load");
+
     auto location = _fs->LocateFile(filename);
 
     if (location.empty())
@@ -54,38 +63,87 @@ bool BspAsset::Load(
 
     std::vector<byte> data;
 
+    LoadStage("bsp read");
+
     if (!_fs->LoadFile(fullpath.string(), data))
     {
+        LoadStage(nullptr);
+
         return false;
     }
 
-    _bspFile = std::make_unique<BspFile>(data.data());
+    LoadStage("bsp parse");
+
+    {
+        PROFILE_ZONE("BspFile");
+        ALLOCATION_SCOPE("bsp.parse");
+
+        _bspFile = std::make_unique<BspFile>(data.data());
+    }
+
+    LoadStage("entity parse");
 
     _entities = BspAsset::LoadEntities(_bspFile);
 
     //    _visLeafs = BspAsset::LoadVisLeafs(_bspFile);
 
-    std::vector<WadAsset *> wads;
     _worldspawn = _entities.front();
     if (_worldspawn.classname != "worldspawn")
     {
         _worldspawn = *FindEntityByClassname("worldspawn");
     }
 
-    wads = WadAsset::LoadWads(_worldspawn.keyvalues["wad"], _fs);
+    LoadStage("wad load");
+
+    WadAsset::UnloadWads(_wads);
+    _wads = WadAsset::LoadWads(_worldspawn.keyvalues["wad"], _fs);
+
+    LoadStage("texture decode");
+
+    LoadTextures(_textures);
+
+    LoadStage("lightmap extraction");
 
-    LoadTextures(_textures, wads);
-    WadAsset::UnloadWads(wads);
+    std::vector<glm::vec4> extents;
+    std::vector<Texture *> faceLightmaps;
+    LoadLightmaps(faceLightmaps, extents);
 
-    LoadFacesWithLightmaps(_faces, _lightMaps, _vertices);
+    LoadStage("lightmap packing");
+
+    std::vector<LightmapPlacement> placements;
+    PackLightmaps(faceLightmaps, _lightMaps, placements);
+
+    LoadStage("vertex build");
+
+    LoadFaces(_faces, _vertices, faceLightmaps, extents, placements);
+
+    for (auto faceLightmap : faceLightmaps)
+    {
+        delete faceLightmap;
+    }
+
+    LoadStage("models");
 
     LoadModels();
 
+    LoadStage("sky textures");
+
     LoadSkyTextures();
 
+    LoadStage(nullptr);
+
     return true;
 }
 
+void BspAsset::LoadStage(
+    const char *stage)
+{
+    if (onLoadStage)
+    {
+        onLoadStage(stage);
+    }
+}
+
 void SkipAllSpaceCharacters(
     const valve::byte *&itr,
     const valve::byte *end)
@@ -124,6 +182,9 @@ void MoveToNextEntity(
 
 bool valve::hl1::BspAsset::LoadSkyTextures()
 {
+    PROFILE_ZONE("BspAsset::LoadSkyTextures");
+    ALLOCATION_SCOPE("bsp.sky");
+
     const char *shortNames[] = {"bk", "dn", "ft", "lf", "rt", "up"};
     std::string sky = "dusk";
 
@@ -194,6 +255,9 @@ bool valve::hl1::BspAsset::LoadSkyTextures()
 std::vector<sBSPEntity> BspAsset::LoadEntities(
     std::unique_ptr<BspFile> &bspFile)
 {
+    PROFILE_ZONE("BspAsset::LoadEntities");
+    ALLOCATION_SCOPE("bsp.entities");
+
     const byte *itr = bspFile->_entityData.data();
     const byte *end = bspFile->_entityData.data() + bspFile->_entityData.size();
 
@@ -248,6 +312,9 @@ tBSPEntity *BspAsset::FindEntityByClassname(
 std::vector<tBSPVisLeaf> BspAsset::LoadVisLeafs(
     std::unique_ptr<BspFile> &bspFile)
 {
+    PROFILE_ZONE("BspAsset::LoadVisLeafs");
+    ALLOCATION_SCOPE("bsp.visleafs");
+
     std::vector<tBSPVisLeaf> visLeafs = std::vector<tBSPVisLeaf>(bspFile->_leafData.size());
 
     for (unsigned int i = 0; i < bspFile->_leafData.size(); i++)
@@ -308,31 +375,190 @@ std::vector<tBSPVisLeaf> BspAsset::LoadVisLeafs(
     return visLeafs;
 }
 
-bool BspAsset::LoadFacesWithLightmaps(
-    std::vector<tFace> &faces,
+bool BspAsset::LoadLightmaps(
     std::vector<Texture *> &tempLightmaps,
-    std::vector<tVertex> &vertices)
+    std::vector<glm::vec4> &extents)
 {
-    // Allocate the arrays for faces and lightmaps
+    PROFILE_ZONE("BspAsset::LoadLightmaps");
+    ALLOCATION_SCOPE("bsp.lightmaps");
+
+    // Allocate the arrays for lightmaps and the surface extents the face uvs are based on
     tempLightmaps.resize(_bspFile->_faceData.size());
+    extents.resize(_bspFile->_faceData.size());
 
     Texture whiteTexture;
     unsigned char data[8 * 8 * 3];
     memset(data, 255, 8 * 8 * 3);
     whiteTexture.SetData(8, 8, 3, data);
 
+    for (unsigned int f = 0; f < _bspFile->_faceData.size(); f++)
+    {
+        tBSPFace &in = _bspFile->_faceData[f];
+
+        // Calculate and grab the lightmap buffer
+        float min[2], max[2];
+        CalculateSurfaceExtents(in, min, max);
+
+        extents[f] = glm::vec4(min[0], min[1], max[0], max[1]);
+
+        tempLightmaps[f] = new Texture();
+        tempLightmaps[f]->SetRepeat(false);
+
+        // Skip the lightmaps for faces with special flags
+        if (_bspFile->_texinfoData[in.texinfo].flags == 0)
+        {
+            if (!LoadLightmap(in, *tempLightmaps[f], min, max))
+            {
+                spdlog::error("failed to load lightmap {}", f);
+            }
+        }
+        else
+        {
+            tempLightmaps[f]->CopyFrom(whiteTexture);
+        }
+    }
+
+    return true;
+}
+
+glm::mat4 BspAsset::VertexDequantization() const
+{
+    return glm::scale(glm::translate(glm::mat4(1.0f), _vertexOrigin), glm::vec3(_vertexScale));
+}
+
+glm::vec3 BspAsset::VertexPosition(
+    const tVertex &vertex) const
+{
+    return _vertexOrigin + glm::vec3(vertex.position[0], vertex.position[1], vertex.position[2]) * _vertexScale;
+}
+
+glm::vec2 BspAsset::VertexTexcoords(
+    const tVertex &vertex)
+{
+    return glm::vec2(vertex.texcoords[0], vertex.texcoords[1]) * (tVertex::TexcoordRange / 65535.0f);
+}
+
+glm::vec2 BspAsset::VertexLightmapTexcoords(
+    const tVertex &vertex)
+{
+    return glm::vec2(vertex.lightmapTexcoords[0], vertex.lightmapTexcoords[1]) / 65535.0f;
+}
+
+bool BspAsset::PackLightmaps(
+    const std::vector<Texture *> &faceLightmaps,
+    std::vector<Texture *> &pages,
+    std::vector<LightmapPlacement> &placements)
+{
+    PROFILE_ZONE("BspAsset::PackLightmaps");
+    ALLOCATION_SCOPE("bsp.lightmaps");
+
+    // Every lightmap gets a one texel border, so filtering never reaches the neighbours
+    std::vector<stbrp_rect> remaining(faceLightmaps.size());
+    for (size_t f = 0; f < faceLightmaps.size(); f++)
+    {
+        remaining[f].id = int(f);
+        remaining[f].w = faceLightmaps[f]->Width() + 2;
+        remaining[f].h = faceLightmaps[f]->Height() + 2;
+    }
+
+    placements.resize(faceLightmaps.size());
+
+    std::vector<stbrp_node> nodes(LightmapPageSize);
+    std::vector<stbrp_rect> next;
+
+    while (!remaining.empty())
+    {
+        stbrp_context context;
+        stbrp_init_target(&context, LightmapPageSize, LightmapPageSize, nodes.data(), int(nodes.size()));
+        stbrp_pack_rects(&context, remaining.data(), int(remaining.size()));
+
+        auto page = new Texture();
+        page->SetDimentions(LightmapPageSize, LightmapPageSize, 3);
+        page->SetRepeat(false);
+
+        next.clear();
+        for (auto &rect : remaining)
+        {
+            if (!rect.was_packed)
+            {
+                next.push_back(rect);
+
+                continue;
+            }
+
+            auto &placement = placements[rect.id];
+            placement.page = (unsigned int)pages.size();
+            placement.x = rect.x + 1;
+            placement.y = rect.y + 1;
+
+            page->FillAtPosition(*faceLightmaps[rect.id], glm::vec2(placement.x, placement.y), true);
+        }
+
+        pages.push_back(page);
+
+        if (next.size() == remaining.size())
+        {
+            spdlog::error("{} lightmaps do not fit in a {}x{} page", next.size(), LightmapPageSize, LightmapPageSize);
+
+            return false;
+        }
+
+        remaining.swap(next);
+    }
+
+    spdlog::debug("packed {} lightmaps into {} pages", faceLightmaps.size(), pages.size());
+
+    return true;
+}
+
+bool BspAsset::LoadFaces(
+    std::vector<tFace> &faces,
+    std::vector<tVertex> &vertices,
+    const std::vector<Texture *> &faceLightmaps,
+    const std::vector<glm::vec4> &extents,
+    const std::vector<LightmapPlacement> &placements)
+{
+    PROFILE_ZONE("BspAsset::LoadFaces");
+    ALLOCATION_SCOPE("bsp.faces");
+
+    // Positions are quantized to int16 steps of the largest half extent of the map, which keeps a
+    // step below an eighth of a unit for maps inside the +-4096 limit
+    if (!_bspFile->_verticesData.empty())
+    {
+        glm::vec3 mins(_bspFile->_verticesData[0].point), maxs(mins);
+        for (auto &vertex : _bspFile->_verticesData)
+        {
+            mins = glm::min(mins, glm::vec3(vertex.point));
+            maxs = glm::max(maxs, glm::vec3(vertex.point));
+        }
+
+        auto halfExtents = (maxs - mins) * 0.5f;
+
+        _vertexOrigin = (mins + maxs) * 0.5f;
+        _vertexScale = std::max(std::max(halfExtents.x, halfExtents.y), std::max(halfExtents.z, 1.0f)) / 32767.0f;
+    }
+
+    auto quantizeUnorm = [](float value) {
+        return uint16_t(std::clamp(value, 0.0f, 1.0f) * 65535.0f + 0.5f);
+    };
+
+    int clampedFaces = 0;
+    std::vector<glm::vec4> texcoords;
+
+    vertices.reserve(vertices.size() + _bspFile->_surfedgeData.size());
     faces.reserve(faces.size() + _bspFile->_faceData.size());
     for (unsigned int f = 0; f < _bspFile->_faceData.size(); f++)
     {
         tBSPFace &in = _bspFile->_faceData[f];
-        tBSPMipTexHeader *mip = GetMiptex(_bspFile->_texinfoData[in.texinfo].miptexIndex);
+        tBSPTexInfo &ti = _bspFile->_texinfoData[in.texinfo];
+        tBSPMipTexHeader *mip = GetMiptex(ti.miptexIndex);
         tFace out;
 
         out.firstVertex = vertices.size();
         out.vertexCount = in.edgeCount;
-        out.flags = _bspFile->_texinfoData[in.texinfo].flags;
-        out.texture = _bspFile->_texinfoData[in.texinfo].miptexIndex;
-        out.lightmap = f;
+        out.flags = ti.flags;
+        out.texture = ti.miptexIndex;
+        out.lightmap = placements[f].page;
         out.plane = glm::vec4(
             _bspFile->_planes[in.planeIndex].normal[0],
             _bspFile->_planes[in.planeIndex].normal[1],
@@ -348,143 +574,179 @@ bool BspAsset::LoadFacesWithLightmaps(
             out.plane[3] = -out.plane[3];
         }
 
-        // Calculate and grab the lightmap buffer
-        float min[2], max[2];
-        CalculateSurfaceExtents(in, min, max);
+        float lw = float(faceLightmaps[f]->Width());
+        float lh = float(faceLightmaps[f]->Height());
+        float pageX = float(placements[f].x);
+        float pageY = float(placements[f].y);
+        const float pageSize = float(LightmapPageSize);
+        float halfsizew = (extents[f].x + extents[f].z) / 2.0f;
+        float halfsizeh = (extents[f].y + extents[f].w) / 2.0f;
+
+        // The texture coordinates of the face, to find the repeat it starts in before they are
+        // quantized
+        texcoords.clear();
+        glm::vec2 firstRepeat(0.0f);
+        for (int e = 0; e < in.edgeCount; e++)
+        {
+            int ei = _bspFile->_surfedgeData[in.firstEdge + e];
+            glm::vec3 position = _bspFile->_verticesData[_bspFile->_edgeData[ei < 0 ? -ei : ei].vertex[ei < 0 ? 1 : 0]].point;
 
-        tempLightmaps[f] = new Texture();
-        tempLightmaps[f]->SetRepeat(false);
+            float s = glm::dot(position, glm::vec3(ti.vecs[0][0], ti.vecs[0][1], ti.vecs[0][2])) + ti.vecs[0][3];
+            float t = glm::dot(position, glm::vec3(ti.vecs[1][0], ti.vecs[1][1], ti.vecs[1][2])) + ti.vecs[1][3];
 
-        // Skip the lightmaps for faces with special flags
-        if (out.flags == 0)
-        {
-            if (!LoadLightmap(in, *tempLightmaps[f], min, max))
+            // The texture coordinates in xy and the lightmap coordinates in the page in zw
+            texcoords.push_back(glm::vec4(
+                s / float(mip->width),
+                t / float(mip->height),
+                (pageX + (lw / 2.0f) + (s - halfsizew) / 16.0f) / pageSize,
+                (pageY + (lh / 2.0f) + (t - halfsizeh) / 16.0f) / pageSize));
+
+            if (e == 0)
             {
-                spdlog::error("failed to load lightmap {}", f);
+                firstRepeat = glm::vec2(texcoords.back().x, texcoords.back().y);
             }
-        }
-        else
-        {
-            tempLightmaps[f]->CopyFrom(whiteTexture);
+            firstRepeat = glm::min(firstRepeat, glm::vec2(texcoords.back().x, texcoords.back().y));
         }
 
-        float lw = float(tempLightmaps[f]->Width());
-        float lh = float(tempLightmaps[f]->Height());
-        float halfsizew = (min[0] + max[0]) / 2.0f;
-        float halfsizeh = (min[1] + max[1]) / 2.0f;
+        firstRepeat = glm::floor(firstRepeat);
 
-        // Create a vertex list for this face
+        bool clamped = false;
         for (int e = 0; e < in.edgeCount; e++)
         {
-            tVertex v;
-
-            // Get the edge index
             int ei = _bspFile->_surfedgeData[in.firstEdge + e];
-            // Determine the vertex based on the edge index
-            v.position = _bspFile->_verticesData[_bspFile->_edgeData[ei < 0 ? -ei : ei].vertex[ei < 0 ? 1 : 0]].point;
+            glm::vec3 position = _bspFile->_verticesData[_bspFile->_edgeData[ei < 0 ? -ei : ei].vertex[ei < 0 ? 1 : 0]].point;
+            auto quantized = glm::round((position - _vertexOrigin) / _vertexScale);
 
-            // Copy the normal from the plane
-            v.normal = glm::vec3(out.plane);
+            auto &uv = texcoords[e];
+            auto s = (uv.x - firstRepeat.x) / tVertex::TexcoordRange;
+            auto t = (uv.y - firstRepeat.y) / tVertex::TexcoordRange;
 
-            // Reset the bone so its not used
-            v.bone = -1;
+            clamped = clamped || s > 1.0f || t > 1.0f;
 
-            tBSPTexInfo &ti = _bspFile->_texinfoData[in.texinfo];
-            float s = glm::dot(v.position, glm::vec3(ti.vecs[0][0], ti.vecs[0][1], ti.vecs[0][2])) + ti.vecs[0][3];
-            float t = glm::dot(v.position, glm::vec3(ti.vecs[1][0], ti.vecs[1][1], ti.vecs[1][2])) + ti.vecs[1][3];
-
-            // Calculate the texture texcoords
-            v.texcoords[0] = glm::vec2(s / float(mip->width), t / float(mip->height));
-
-            // Calculate the lightmap texcoords
-            v.texcoords[1] = glm::vec2(((lw / 2.0f) + (s - halfsizew) / 16.0f) / lw, ((lh / 2.0f) + (t - halfsizeh) / 16.0f) / lh);
+            tVertex v;
+            v.position[0] = int16_t(quantized.x);
+            v.position[1] = int16_t(quantized.y);
+            v.position[2] = int16_t(quantized.z);
+            v.layer = 0;
+            v.texcoords[0] = quantizeUnorm(s);
+            v.texcoords[1] = quantizeUnorm(t);
+            v.lightmapTexcoords[0] = quantizeUnorm(uv.z);
+            v.lightmapTexcoords[1] = quantizeUnorm(uv.w);
 
             vertices.push_back(v);
         }
+
+        if (clamped && out.flags == 0)
+        {
+            clampedFaces++;
+        }
+
         faces.push_back(out);
     }
 
+    if (clampedFaces > 0)
+    {
+        spdlog::warn("{} faces repeat their texture more than {} times, their texture coordinates are clamped", clampedFaces, int(tVertex::TexcoordRange));
+    }
+
     return true;
 }
 
 bool BspAsset::LoadTextures(
-    std::vector<Texture *> &textures,
-    const std::vector<WadAsset *> &wads)
+    std::vector<Texture *> &textures)
 {
-    auto count = int(*_bspFile->_textureData.data());
-    auto offsetPtr = (int *)(_bspFile->_textureData.data() + sizeof(int));
-    std::vector<int> textureTable(offsetPtr, offsetPtr + count);
+    PROFILE_ZONE("BspAsset::LoadTextures");
+    ALLOCATION_SCOPE("wad.decode");
 
     auto textureCount = int(*_bspFile->_textureData.data());
 
     textures.reserve(textures.size() + textureCount);
     for (int t = 0; t < textureCount; t++)
     {
-        const unsigned char *textureData = _bspFile->_textureData.data() + textureTable[t];
+        auto tex = new Texture();
 
-        tBSPMipTexHeader *miptex = (tBSPMipTexHeader *)textureData;
+        DecodeTexture(size_t(t), *tex);
 
-        auto tex = new Texture(miptex->name);
+        textures.push_back(tex);
+    }
 
-        if (miptex->offsets[0] == 0)
-        {
-            for (std::vector<WadAsset *>::const_iterator i = wads.cbegin(); i != wads.cend(); ++i)
-            {
-                WadAsset *wad = *i;
+    return true;
+}
 
-                textureData = wad->LumpData(wad->IndexOf(miptex->name));
+bool BspAsset::DecodeTexture(
+    size_t index,
+    Texture &texture)
+{
+    PROFILE_ZONE("BspAsset::DecodeTexture");
 
-                if (textureData != nullptr)
-                {
-                    break;
-                }
+    auto miptex = GetMiptex(int(index));
+
+    if (miptex == nullptr)
+    {
+        return false;
+    }
+
+    texture.SetName(miptex->name);
+
+    // The WADs read their lumps on demand, which isn't thread safe
+    std::lock_guard<std::mutex> lock(_wadLock);
+
+    const unsigned char *textureData = reinterpret_cast<const unsigned char *>(miptex);
+    WadAsset *lumpWad = nullptr;
+    int lump = -1;
+
+    if (miptex->offsets[0] == 0)
+    {
+        textureData = nullptr;
+
+        for (auto wad : _wads)
+        {
+            lump = wad->IndexOf(miptex->name);
+            textureData = wad->LumpData(lump);
+
+            if (textureData != nullptr)
+            {
+                lumpWad = wad;
+                break;
             }
         }
+    }
 
-        if (textureData != nullptr)
-        {
-            miptex = (tBSPMipTexHeader *)textureData;
-            int s = miptex->width * miptex->height;
-            int bpp = 4;
-            int paletteOffset = miptex->offsets[0] + s + (s / 4) + (s / 16) + (s / 64) + sizeof(short);
+    if (textureData == nullptr)
+    {
+        spdlog::error("Texture \"{0}\" not found, using default texture", miptex->name);
 
-            // Get the miptex data and palette
-            const unsigned char *source0 = textureData + miptex->offsets[0];
-            const unsigned char *palette = textureData + paletteOffset;
+        // The data can be freed when the texture is decoded again
+        texture.SetData(texture.Width(), texture.Height(), 4, nullptr);
+        texture.DefaultTexture();
 
-            unsigned char *destination = new unsigned char[s * bpp];
+        return false;
+    }
 
-            for (int i = 0; i < s; i++)
-            {
-                unsigned r = palette[source0[i] * 3];
-                unsigned g = palette[source0[i] * 3 + 1];
-                unsigned b = palette[source0[i] * 3 + 2];
-                unsigned a = 255;
+    auto header = reinterpret_cast<const tBSPMipTexHeader *>(textureData);
+    int s = header->width * header->height;
+    int bpp = 4;
+    int paletteOffset = header->offsets[0] + s + (s / 4) + (s / 16) + (s / 64) + sizeof(short);
 
-                // Do we need a transparent pixel
-                if (tex->Name()[0] == '{' && b >= 255)
-                {
-                    r = g = b = a = 0;
-                }
+    // Get the miptex data and palette
+    const unsigned char *source0 = textureData + header->offsets[0];
+    const unsigned char *palette = textureData + paletteOffset;
 
-                destination[i * 4 + 0] = r;
-                destination[i * 4 + 1] = g;
-                destination[i * 4 + 2] = b;
-                destination[i * 4 + 3] = a;
-            }
+    unsigned char *destination = new unsigned char[s * bpp];
 
-            tex->SetData(miptex->width, miptex->height, bpp, destination);
+    // Do we need transparent pixels
+    auto alpha = texture.Name()[0] == '{' ? PaletteAlpha::BlueIsTransparent : PaletteAlpha::Opaque;
 
-            delete[] destination;
-        }
-        else
-        {
-            spdlog::error("Texture \"{0}\" not found, using default texture", miptex->name);
+    ExpandPalette(source0, s, palette, alpha, destination);
 
-            tex->DefaultTexture();
-        }
+    texture.SetData(header->width, header->height, bpp, destination);
 
-        textures.push_back(tex);
+    delete[] destination;
+
+    // The decoded texture is all that is needed, the lump is read again when it is decoded again
+    if (lumpWad != nullptr)
+    {
+        lumpWad->UnloadLump(lump);
     }
 
     return true;
@@ -566,6 +828,108 @@ glm::vec3 BspAsset::Trace(
     return Trace(from, to, nextClipNode);
 }
 
+int BspAsset::PointInLeaf(
+    const glm::vec3 &point) const
+{
+    if (_bspFile->_nodeData.empty())
+    {
+        return 0;
+    }
+
+    int node = _bspFile->_modelData[0].headnode[0];
+
+    while (node >= 0)
+    {
+        auto &plane = _bspFile->_planes[_bspFile->_nodeData[node].planeIndex];
+
+        node = _bspFile->_nodeData[node].children[dist(plane, point) >= 0.0f ? 0 : 1];
+    }
+
+    return -(node + 1);
+}
+
+void BspAsset::LeafsInSphere(
+    const glm::vec3 &center,
+    float radius,
+    std::vector<int> &leafs) const
+{
+    if (_bspFile->_nodeData.empty())
+    {
+        return;
+    }
+
+    std::vector<int> nodes = {_bspFile->_modelData[0].headnode[0]};
+
+    while (!nodes.empty())
+    {
+        auto node = nodes.back();
+        nodes.pop_back();
+
+        if (node < 0)
+        {
+            if (node != -1)
+            {
+                leafs.push_back(-(node + 1));
+            }
+            continue;
+        }
+
+        auto &plane = _bspFile->_planes[_bspFile->_nodeData[node].planeIndex];
+        auto d = dist(plane, center);
+
+        if (d > -radius)
+        {
+            nodes.push_back(_bspFile->_nodeData[node].children[0]);
+        }
+
+        if (d < radius)
+        {
+            nodes.push_back(_bspFile->_nodeData[node].children[1]);
+        }
+    }
+}
+
+bool BspAsset::VisibleLeafs(
+    int leaf,
+    std::vector<bool> &visible) const
+{
+    visible.assign(_bspFile->_leafData.size(), false);
+
+    if (leaf <= 0 || size_t(leaf) >= _bspFile->_leafData.size() || _bspFile->_visData.empty() || _bspFile->_leafData[leaf].visofs < 0)
+    {
+        return false;
+    }
+
+    visible[leaf] = true;
+
+    // Run length encoded like in LoadVisLeafs, a zero byte is followed by the number of bytes
+    // that are zero
+    size_t visOffset = size_t(_bspFile->_leafData[leaf].visofs);
+    for (int j = 1; j < _bspFile->_modelData[0].visLeafs && visOffset < _bspFile->_visData.size(); visOffset++)
+    {
+        if (_bspFile->_visData[visOffset] == 0)
+        {
+            visOffset++;
+            if (visOffset < _bspFile->_visData.size())
+            {
+                j += (_bspFile->_visData[visOffset] << 3);
+            }
+        }
+        else
+        {
+            for (byte bit = 1; bit; bit <<= 1, j++)
+            {
+                if ((_bspFile->_visData[visOffset] & bit) && size_t(j) < visible.size())
+                {
+                    visible[j] = true;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
 bool BspAsset::IsInContents(
     const glm::vec3 &from,
     const glm::vec3 &to,
@@ -709,6 +1073,9 @@ bool BspAsset::LoadLightmap(
 
 bool BspAsset::LoadModels()
 {
+    PROFILE_ZONE("BspAsset::LoadModels");
+    ALLOCATION_SCOPE("bsp.models");
+
     _models.reserve(_bspFile->_modelData.size());
     for (unsigned int m = 0; m < _bspFile->_modelData.size(); m++)
     {
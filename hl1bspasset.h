@@ -5,6 +5,8 @@
 #include "hl1wadasset.h"
 #include "hltexture.h"
 
+#include <functional>
+#include <mutex>
 #include <string>
 
 namespace valve
@@ -85,6 +87,45 @@ namespace valve
                 const glm::vec3 &to,
                 int clipNodeIndex = -1);
 
+            // The leaf of the world model the point is in, 0 is the solid leaf
+            int PointInLeaf(
+                const glm::vec3 &point) const;
+
+            // Adds the leafs of the world model the sphere touches
+            void LeafsInSphere(
+                const glm::vec3 &center,
+                float radius,
+                std::vector<int> &leafs) const;
+
+            // Sets the flags of the leafs in the PVS of the leaf, visible has a flag for every
+            // leaf. Returns false when the leaf has no visibility info, everything is visible then.
+            bool VisibleLeafs(
+                int leaf,
+                std::vector<bool> &visible) const;
+
+            // Decodes the texture again from the BSP or the WADs, for textures whose data was
+            // freed. Can be called from any thread.
+            bool DecodeTexture(
+                size_t index,
+                Texture &texture);
+
+            // Maps the quantized vertex positions to map units, for the vertex shader
+            glm::mat4 VertexDequantization() const;
+
+            glm::vec3 VertexPosition(
+                const tVertex &vertex) const;
+
+            // Relative to the integer repeat the face starts in
+            static glm::vec2 VertexTexcoords(
+                const tVertex &vertex);
+
+            static glm::vec2 VertexLightmapTexcoords(
+                const tVertex &vertex);
+
+            // Called with the name of every stage of Load before it starts, and with nullptr when
+            // Load is done
+            std::function<void(const char *stage)> onLoadStage;
+
             int restartCount = 0;
             bool IsInContents(
                 const glm::vec3 &from,
@@ -103,10 +144,25 @@ namespace valve
             std::vector<Texture *> _textures;
             std::vector<Texture *> _lightMaps;
             std::vector<tVertex> _vertices;
+            glm::vec3 _vertexOrigin = glm::vec3(0.0f); // center of the map bounds
+            float _vertexScale = 1.0f;                 // map units per quantization step
             std::vector<tFace> _faces;
             valve::Texture *_skytextures[6] = {nullptr, nullptr, nullptr, nullptr, nullptr, nullptr};
 
+            // Lightmaps are packed into pages of this size, _lightMaps holds the pages
+            static const int LightmapPageSize = 1024;
+
         private:
+            // Where the lightmap of a face is in the pages, the lightmap starts one texel in so
+            // it can have a border
+            class LightmapPlacement
+            {
+            public:
+                unsigned int page = 0;
+                int x = 0;
+                int y = 0;
+            };
+
             void CalculateSurfaceExtents(
                 const tBSPFace &in,
                 float min[2],
@@ -118,22 +174,40 @@ namespace valve
                 float min[2],
                 float max[2]);
 
-            bool LoadFacesWithLightmaps(
-                std::vector<tFace> &faces,
+            bool LoadLightmaps(
                 std::vector<Texture *> &lightmaps,
-                std::vector<tVertex> &vertices);
+                std::vector<glm::vec4> &extents);
+
+            bool PackLightmaps(
+                const std::vector<Texture *> &faceLightmaps,
+                std::vector<Texture *> &pages,
+                std::vector<LightmapPlacement> &placements);
+
+            bool LoadFaces(
+                std::vector<tFace> &faces,
+                std::vector<tVertex> &vertices,
+                const std::vector<Texture *> &faceLightmaps,
+                const std::vector<glm::vec4> &extents,
+                const std::vector<LightmapPlacement> &placements);
+
+            void LoadStage(
+                const char *stage);
 
             bool LoadSkyTextures();
 
             bool LoadTextures(
-                std::vector<Texture *> &textures,
-                const std::vector<WadAsset *> &wads);
+                std::vector<Texture *> &textures);
 
             bool LoadModels();
 
             static std::vector<sBSPEntity> LoadEntities(
                 std::unique_ptr<BspFile> &bspFile);
 
+            // Kept open so textures can be decoded again
+            std::vector<WadAsset *> _wads;
+            std::mutex _wadLock;
+
+        public:
             static std::vector<tBSPVisLeaf> LoadVisLeafs(
                 std::unique_ptr<BspFile> &bspFile);
         };
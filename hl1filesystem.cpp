@@ -2,6 +2,20 @@
 
 #include <spdlog/spdlog.h>
 
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 using namespace valve::hl1;
 
 FileSystemSearchPath::FileSystemSearchPath(
@@ -62,6 +76,116 @@ bool FileSystemSearchPath::LoadFile(
     return true;
 }
 
+bool FileSystemSearchPath::MapFile(
+    const std::string &filename,
+    valve::FileView &view)
+{
+    std::error_code ec;
+    auto size = std::filesystem::file_size(filename, ec);
+
+    if (ec)
+    {
+        spdlog::error("File not found: {0}", filename);
+
+        return false;
+    }
+
+    if (MapFileRange(filename, 0, size, view))
+    {
+        return true;
+    }
+
+    auto data = std::make_shared<std::vector<valve::byte>>();
+
+    if (!LoadFile(filename, *data))
+    {
+        return false;
+    }
+
+    view = valve::FileView(data, data->data(), data->size());
+
+    return true;
+}
+
+bool FileSystemSearchPath::MapFileRange(
+    const std::filesystem::path &path,
+    size_t offset,
+    size_t size,
+    valve::FileView &view)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    // views have to start at a multiple of the allocation granularity
+    auto start = offset - offset % info.dwAllocationGranularity;
+    auto length = size + (offset - start);
+
+    auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    auto mapping = CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+
+    CloseHandle(file);
+
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+
+    auto base = MapViewOfFile(mapping, FILE_MAP_COPY, DWORD(uint64_t(start) >> 32), DWORD(start & 0xFFFFFFFF), length);
+
+    CloseHandle(mapping);
+
+    if (base == nullptr)
+    {
+        spdlog::warn("failed to map {}, reading it instead", path.string());
+
+        return false;
+    }
+
+    auto handle = std::shared_ptr<void>(base, [](void *p) { UnmapViewOfFile(p); });
+#else
+    // views have to start at a multiple of the page size
+    auto page = size_t(sysconf(_SC_PAGESIZE));
+    auto start = offset - offset % page;
+    auto length = size + (offset - start);
+
+    auto file = open(path.c_str(), O_RDONLY);
+
+    if (file < 0)
+    {
+        return false;
+    }
+
+    auto base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, off_t(start));
+
+    close(file);
+
+    if (base == MAP_FAILED)
+    {
+        spdlog::warn("failed to map {}, reading it instead", path.string());
+
+        return false;
+    }
+
+    auto handle = std::shared_ptr<void>(base, [length](void *p) { munmap(p, length); });
+#endif
+
+    view = valve::FileView(handle, (valve::byte *)base + (offset - start), size);
+
+    return true;
+}
+
 PakSearchPath::PakSearchPath(
     const std::filesystem::path &root)
     : FileSystemSearchPath(root)
@@ -150,6 +274,9 @@ bool PakSearchPath::LoadFile(
         if (relativeFilename == std::string(f.name))
         {
             data.resize(f.filelen);
+
+            std::lock_guard<std::mutex> lock(_pakLock);
+
             _pakFile.seekg(f.filepos, std::fstream::beg);
             _pakFile.read((char *)data.data(), f.filelen);
 
@@ -160,6 +287,44 @@ bool PakSearchPath::LoadFile(
     return false;
 }
 
+bool PakSearchPath::MapFile(
+    const std::string &filename,
+    valve::FileView &view)
+{
+    if (!_pakFile.is_open())
+    {
+        return false;
+    }
+
+    auto relativeFilename = filename.substr(_root.string().length() + 1);
+
+    for (auto f : _files)
+    {
+        if (relativeFilename != std::string(f.name))
+        {
+            continue;
+        }
+
+        if (MapFileRange(_root, f.filepos, f.filelen, view))
+        {
+            return true;
+        }
+
+        auto data = std::make_shared<std::vector<valve::byte>>();
+
+        if (!LoadFile(filename, *data))
+        {
+            return false;
+        }
+
+        view = valve::FileView(data, data->data(), data->size());
+
+        return true;
+    }
+
+    return false;
+}
+
 std::string FileSystem::LocateFile(
     const std::string &relativeFilename)
 {
@@ -195,6 +360,26 @@ bool FileSystem::LoadFile(
     return false;
 }
 
+bool FileSystem::MapFile(
+    const std::string &filename,
+    valve::FileView &view)
+{
+    for (auto &searchPath : _searchPaths)
+    {
+        if (!searchPath->IsInSearchPath(filename))
+        {
+            continue;
+        }
+
+        if (searchPath->MapFile(filename, view))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void FileSystem::SetRootAndMod(
     const std::filesystem::path &root,
     const std::filesystem::path &mod)
@@ -6,6 +6,7 @@
 
 #include <filesystem>
 #include <fstream>
+#include <mutex>
 #include <string>
 
 namespace valve
@@ -33,7 +34,17 @@ namespace valve
                 const std::string &filename,
                 std::vector<valve::byte> &data);
 
+            virtual bool MapFile(
+                const std::string &filename,
+                valve::FileView &view);
+
         protected:
+            static bool MapFileRange(
+                const std::filesystem::path &path,
+                size_t offset,
+                size_t size,
+                valve::FileView &view);
+
             std::filesystem::path _root;
         };
 
@@ -56,8 +67,13 @@ namespace valve
                 const std::string &filename,
                 std::vector<valve::byte> &data);
 
+            virtual bool MapFile(
+                const std::string &filename,
+                valve::FileView &view);
+
         private:
             void OpenPakFile();
+            std::mutex _pakLock; // loads come from the loader thread as well
             std::ifstream _pakFile;
             valve::hl1::tPAKHeader _header;
             std::vector<valve::hl1::tPAKLump> _files;
@@ -77,6 +93,10 @@ namespace valve
                 const std::string &filename,
                 std::vector<valve::byte> &data) override;
 
+            virtual bool MapFile(
+                const std::string &filename,
+                valve::FileView &view) override;
+
             const std::filesystem::path &Root() const;
             const std::filesystem::path &Mod() const;
 
@@ -1,5 +1,8 @@
 #include "hl1wadasset.h"
 
+#include "allocationtracker.h"
+#include "profiler.h"
+
 #include <algorithm>
 #include <cctype>
 #include <spdlog/spdlog.h>
@@ -115,6 +118,18 @@ valve::byteptr WadAsset::LumpData(
     return _loadedLumps[index];
 }
 
+void WadAsset::UnloadLump(
+    int index)
+{
+    if (index >= _header.lumpsCount || index < 0 || _loadedLumps[index] == nullptr)
+    {
+        return;
+    }
+
+    delete[] (_loadedLumps[index]);
+    _loadedLumps[index] = nullptr;
+}
+
 std::vector<std::string> split(
     const std::string &subject,
     const char delim = '\n')
@@ -156,6 +171,9 @@ std::vector<WadAsset *> WadAsset::LoadWads(
     const std::string &wads,
     IFileSystem *fs)
 {
+    PROFILE_ZONE("WadAsset::LoadWads");
+    ALLOCATION_SCOPE("wad.load");
+
     std::vector<WadAsset *> result;
 
     std::istringstream f(wads);
@@ -34,6 +34,10 @@ namespace valve
             byteptr LumpData(
                 int index);
 
+            // Frees the data LumpData read, it is read from the file again when needed
+            void UnloadLump(
+                int index);
+
             static std::string FindWad(
                 const std::string &wad,
                 const std::vector<std::string> &hints);
@@ -1,10 +1,290 @@
 #include "hltexture.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <glm/glm.hpp>
 
 using namespace valve;
 
+void valve::ExpandPalette(
+    const unsigned char *indices,
+    int count,
+    const unsigned char *palette,
+    PaletteAlpha alpha,
+    unsigned char *rgba)
+{
+    uint32_t table[256];
+
+    for (int i = 0; i < 256; i++)
+    {
+        unsigned char pixel[4] = {palette[i * 3], palette[i * 3 + 1], palette[i * 3 + 2], 255};
+
+        if ((alpha == PaletteAlpha::BlueIsTransparent && pixel[2] >= 255) || (alpha == PaletteAlpha::LastIsTransparent && i == 255))
+        {
+            pixel[0] = pixel[1] = pixel[2] = pixel[3] = 0;
+        }
+
+        memcpy(&table[i], pixel, sizeof(uint32_t));
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(rgba + i * 4, &table[indices[i]], sizeof(uint32_t));
+    }
+}
+
+void valve::BuildMipChain(
+    const unsigned char *rgba,
+    int width,
+    int height,
+    std::vector<MipLevel> &levels)
+{
+    levels.clear();
+
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    MipLevel base;
+    base.width = width;
+    base.height = height;
+    base.data.assign(rgba, rgba + size_t(width) * size_t(height) * 4);
+    levels.push_back(std::move(base));
+
+    while (levels.back().width > 1 || levels.back().height > 1)
+    {
+        auto &source = levels.back();
+
+        MipLevel level;
+        level.width = std::max(1, source.width / 2);
+        level.height = std::max(1, source.height / 2);
+        level.data.resize(size_t(level.width) * size_t(level.height) * 4);
+
+        for (int y = 0; y < level.height; y++)
+        {
+            // a side of one pixel is averaged with itself
+            auto row0 = source.data.data() + size_t(std::min(y * 2, source.height - 1)) * source.width * 4;
+            auto row1 = source.data.data() + size_t(std::min(y * 2 + 1, source.height - 1)) * source.width * 4;
+
+            for (int x = 0; x < level.width; x++)
+            {
+                auto x0 = std::min(x * 2, source.width - 1) * 4;
+                auto x1 = std::min(x * 2 + 1, source.width - 1) * 4;
+                auto out = level.data.data() + (size_t(y) * level.width + x) * 4;
+
+                for (int c = 0; c < 4; c++)
+                {
+                    out[c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+                }
+            }
+        }
+
+        levels.push_back(std::move(level));
+    }
+}
+
+namespace
+{
+    float SrgbToLinear(
+        unsigned char value)
+    {
+        static const auto table = []() {
+            std::array<float, 256> result;
+
+            for (int i = 0; i < 256; i++)
+            {
+                auto c = float(i) / 255.0f;
+                result[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+
+            return result;
+        }();
+
+        return table[value];
+    }
+
+    unsigned char LinearToSrgb(
+        float value)
+    {
+        value = std::min(std::max(value, 0.0f), 1.0f);
+
+        auto c = value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow(value, 1.0f / 2.4f) - 0.055f;
+
+        return (unsigned char)(c * 255.0f + 0.5f);
+    }
+
+    // A level in linear light with straight alpha, 4 floats per texel
+    class LinearLevel
+    {
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<float> data;
+    };
+
+    float AlphaCoverage(
+        const LinearLevel &level,
+        float alphaTestReference,
+        float scale)
+    {
+        size_t covered = 0;
+
+        for (size_t i = 3; i < level.data.size(); i += 4)
+        {
+            if (level.data[i] * scale > alphaTestReference)
+            {
+                covered++;
+            }
+        }
+
+        return float(covered) / float(level.data.size() / 4);
+    }
+
+    // Finds the alpha scale that gets closest to the coverage by bisection, coverage only grows
+    // with the scale. Coverage moves in steps, so the closest scale seen is kept rather than the
+    // last one.
+    float AlphaScaleForCoverage(
+        const LinearLevel &level,
+        float alphaTestReference,
+        float coverage)
+    {
+        float low = 0.0f, high = 4.0f, scale = 1.0f;
+        float bestScale = 1.0f, bestError = 2.0f;
+
+        for (int i = 0; i < 12; i++)
+        {
+            auto scaledCoverage = AlphaCoverage(level, alphaTestReference, scale);
+            auto error = std::abs(scaledCoverage - coverage);
+
+            if (error < bestError)
+            {
+                bestScale = scale;
+                bestError = error;
+            }
+
+            if (scaledCoverage > coverage)
+            {
+                high = scale;
+            }
+            else
+            {
+                low = scale;
+            }
+
+            scale = (low + high) * 0.5f;
+        }
+
+        return bestScale;
+    }
+
+    void ToMipLevel(
+        const LinearLevel &level,
+        float alphaScale,
+        MipLevel &out)
+    {
+        out.width = level.width;
+        out.height = level.height;
+        out.data.resize(level.data.size());
+
+        for (size_t i = 0; i < level.data.size(); i += 4)
+        {
+            out.data[i] = LinearToSrgb(level.data[i]);
+            out.data[i + 1] = LinearToSrgb(level.data[i + 1]);
+            out.data[i + 2] = LinearToSrgb(level.data[i + 2]);
+            out.data[i + 3] = (unsigned char)(std::min(level.data[i + 3] * alphaScale, 1.0f) * 255.0f + 0.5f);
+        }
+    }
+} // namespace
+
+void valve::BuildGammaCorrectMipChain(
+    const unsigned char *rgba,
+    int width,
+    int height,
+    float alphaTestReference,
+    std::vector<MipLevel> &levels)
+{
+    levels.clear();
+
+    if (width <= 0 || height <= 0)
+    {
+        return;
+    }
+
+    MipLevel base;
+    base.width = width;
+    base.height = height;
+    base.data.assign(rgba, rgba + size_t(width) * size_t(height) * 4);
+    levels.push_back(std::move(base));
+
+    // Every level is filtered from the unscaled level before it, the alpha scale is only applied
+    // to the output
+    LinearLevel source;
+    source.width = width;
+    source.height = height;
+    source.data.resize(size_t(width) * size_t(height) * 4);
+    for (size_t i = 0; i < source.data.size(); i += 4)
+    {
+        source.data[i] = SrgbToLinear(rgba[i]);
+        source.data[i + 1] = SrgbToLinear(rgba[i + 1]);
+        source.data[i + 2] = SrgbToLinear(rgba[i + 2]);
+        source.data[i + 3] = float(rgba[i + 3]) / 255.0f;
+    }
+
+    auto alphaTested = alphaTestReference > 0.0f;
+    auto coverage = alphaTested ? AlphaCoverage(source, alphaTestReference, 1.0f) : 0.0f;
+
+    LinearLevel level;
+    while (source.width > 1 || source.height > 1)
+    {
+        level.width = std::max(1, source.width / 2);
+        level.height = std::max(1, source.height / 2);
+        level.data.resize(size_t(level.width) * size_t(level.height) * 4);
+
+        for (int y = 0; y < level.height; y++)
+        {
+            // a side of one pixel is averaged with itself
+            auto row0 = source.data.data() + size_t(std::min(y * 2, source.height - 1)) * source.width * 4;
+            auto row1 = source.data.data() + size_t(std::min(y * 2 + 1, source.height - 1)) * source.width * 4;
+
+            for (int x = 0; x < level.width; x++)
+            {
+                auto x0 = std::min(x * 2, source.width - 1) * 4;
+                auto x1 = std::min(x * 2 + 1, source.width - 1) * 4;
+                const float *texels[4] = {row0 + x0, row0 + x1, row1 + x0, row1 + x1};
+                auto out = level.data.data() + (size_t(y) * level.width + x) * 4;
+
+                float alpha = texels[0][3] + texels[1][3] + texels[2][3] + texels[3][3];
+
+                for (int c = 0; c < 3; c++)
+                {
+                    if (alpha > 0.0f)
+                    {
+                        out[c] = (texels[0][c] * texels[0][3] + texels[1][c] * texels[1][3] + texels[2][c] * texels[2][3] + texels[3][c] * texels[3][3]) / alpha;
+                    }
+                    else
+                    {
+                        out[c] = (texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c]) * 0.25f;
+                    }
+                }
+
+                out[3] = alpha * 0.25f;
+            }
+        }
+
+        auto alphaScale = alphaTested ? AlphaScaleForCoverage(level, alphaTestReference, coverage) : 1.0f;
+
+        MipLevel mip;
+        ToMipLevel(level, alphaScale, mip);
+        levels.push_back(std::move(mip));
+
+        std::swap(source, level);
+    }
+}
+
 Texture::Texture() = default;
 
 Texture::Texture(
@@ -293,3 +573,8 @@ unsigned char *Texture::Data()
 {
     return _data;
 }
+
+const unsigned char *Texture::Data() const
+{
+    return _data;
+}
@@ -3,10 +3,54 @@
 
 #include <glm/glm.hpp>
 #include <string>
+#include <vector>
 
 namespace valve
 {
 
+    enum class PaletteAlpha
+    {
+        Opaque,
+        BlueIsTransparent, // the pure blue of '{' world textures
+        LastIsTransparent, // index 255 of masked studio textures
+    };
+
+    class MipLevel
+    {
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<unsigned char> data;
+    };
+
+    // Converts count 8 bit palette indices to RGBA, the 256 colors are expanded to 32 bit
+    // pixels once so every index is a single table lookup and store
+    void ExpandPalette(
+        const unsigned char *indices,
+        int count,
+        const unsigned char *palette,
+        PaletteAlpha alpha,
+        unsigned char *rgba);
+
+    // Builds the mip chain of an RGBA image down to 1x1 with a 2x2 box filter, level 0 is a
+    // copy of the source. Sizes do not have to be a power of two.
+    void BuildMipChain(
+        const unsigned char *rgba,
+        int width,
+        int height,
+        std::vector<MipLevel> &levels);
+
+    // Like BuildMipChain, but averages the colors in linear light and weights them by alpha, so
+    // transparent texels don't darken the edges around them. With an alphaTestReference above 0
+    // the alpha of every level is scaled to cover as many texels at that reference as level 0,
+    // so alpha tested textures don't fade out in the distance.
+    void BuildGammaCorrectMipChain(
+        const unsigned char *rgba,
+        int width,
+        int height,
+        float alphaTestReference,
+        std::vector<MipLevel> &levels);
+
     class Texture
     {
     public:
@@ -82,6 +126,8 @@ namespace valve
 
         unsigned char *Data();
 
+        const unsigned char *Data() const;
+
     private:
         std::string _name;
         int _width = 0;
@@ -1,8 +1,10 @@
 #ifndef _HLTYPES_H_
 #define _HLTYPES_H_
 
+#include <cstdint>
 #include <filesystem>
 #include <glm/glm.hpp>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -57,12 +59,18 @@ namespace valve
         }
     };
 
+    // World vertex in the layout it is uploaded in, 16 bytes. The position is quantized to the
+    // bounds of the map, BspAsset::VertexPosition maps it back. The texture coordinates start at
+    // the integer repeat the face starts in and cover TexcoordRange repeats as unorm16, the
+    // lightmap coordinates are unorm16 in the lightmap page of the face.
     typedef struct sVertex
     {
-        glm::vec3 position;
-        glm::vec2 texcoords[2];
-        glm::vec3 normal;
-        int bone;
+        static constexpr float TexcoordRange = 32.0f;
+
+        int16_t position[3];
+        int16_t layer; // texture array layer, set by WorldMesh
+        uint16_t texcoords[2];
+        uint16_t lightmapTexcoords[2];
 
     } tVertex;
 
@@ -78,11 +86,30 @@ namespace valve
 
     } tFace;
 
+    // Copy on write view of a file, or of a file inside a pak. Writes stay private to the view and
+    // the mapping is released when the last copy of the view goes away.
+    class FileView
+    {
+    public:
+        FileView() = default;
+        FileView(std::shared_ptr<void> mapping, byte *data, size_t size) : _mapping(mapping), _data(data), _size(size) {}
+
+        byte *Data() const { return _data; }
+        size_t Size() const { return _size; }
+        bool Empty() const { return _data == nullptr; }
+
+    private:
+        std::shared_ptr<void> _mapping;
+        byte *_data = nullptr;
+        size_t _size = 0;
+    };
+
     class IFileSystem
     {
     public:
         virtual std::string LocateFile(const std::string &relativeFilename) = 0;
         virtual bool LoadFile(const std::string &filename, std::vector<byte> &data) = 0;
+        virtual bool MapFile(const std::string &filename, FileView &view) = 0;
 
         const std::filesystem::path &Root() const { return _root; }
         const std::string &Mod() const { return _mod; }
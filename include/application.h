@@ -178,7 +178,8 @@ bool IsKeyboardButtonPushed(
 
 #endif // APPLICATION_H
 
-#ifdef APPLICATION_IMPLEMENTATION
+#if defined(APPLICATION_IMPLEMENTATION) && !defined(APPLICATION_IMPLEMENTED)
+#define APPLICATION_IMPLEMENTED
 
 bool IsKeyboardButtonPushed(
     const struct InputState &inputState,
@@ -937,6 +938,428 @@ Win32Application *CreateApplication(
 #endif // _WIN32
 
 #ifdef __linux__
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Renders offscreen into a framebuffer object on an EGL context without a surface, which Mesa
+// provides with llvmpipe on machines without a GPU. There is no window, so frames are driven by
+// a fixed clock and input comes from an optional frame script. The options come from the
+// environment:
+//
+//     GENMAP_WIDTH, GENMAP_HEIGHT  size of the framebuffer, 1280x720 by default
+//     GENMAP_FRAMES                number of frames to run, 600 by default
+//     GENMAP_FRAME_TIME            milliseconds the clock advances per frame, 16 by default
+//     GENMAP_FRAME_SCRIPT          input script, every line is a frame number and a command:
+//                                      <frame> key <code> down|up
+//                                      <frame> button left|right|middle down|up
+//                                      <frame> pointer <x> <y>
+//                                      <frame> quit
+//
+// Every frame ends with glFinish, so the frame times reported at the end include the work of
+// the GL driver and not only the submission.
+class LinuxOffscreenApplication
+{
+public:
+    bool Startup(
+        std::function<bool()> intialize,
+        std::function<void(int width, int height)> resize,
+        std::function<void()> destroy);
+
+    int Run(
+        std::function<bool(std::chrono::milliseconds::rep time, const struct InputState &inputState)> tick);
+
+private:
+    class ScriptCommand
+    {
+    public:
+        int frame;
+        std::string command;
+        std::string arguments;
+    };
+
+    std::function<void(int width, int height)> _resize;
+    std::function<void()> _destroy;
+    EGLDisplay _display = EGL_NO_DISPLAY;
+    EGLContext _context = EGL_NO_CONTEXT;
+    GLuint _framebuffer = 0;
+    GLuint _renderbuffers[2] = {0, 0};
+    int _width = 1280;
+    int _height = 720;
+    int _frameCount = 600;
+    int _frameTime = 16;
+    std::vector<ScriptCommand> _script;
+    InputState _inputState;
+    InputState _previousInputState;
+
+    bool LoadScript(
+        const std::string &filename);
+
+    void RunScript(
+        int frame,
+        bool &running);
+
+    virtual void Destroy(
+        const char *errorMessage = nullptr);
+};
+
+static int EnvironmentInt(
+    const char *name,
+    int defaultValue)
+{
+    auto value = std::getenv(name);
+
+    if (value == nullptr || std::atoi(value) <= 0)
+    {
+        return defaultValue;
+    }
+
+    return std::atoi(value);
+}
+
+bool LinuxOffscreenApplication::Startup(
+    std::function<bool()> intialize,
+    std::function<void(int width, int height)> resize,
+    std::function<void()> destroy)
+{
+    _resize = resize;
+    _destroy = destroy;
+
+    _width = EnvironmentInt("GENMAP_WIDTH", _width);
+    _height = EnvironmentInt("GENMAP_HEIGHT", _height);
+    _frameCount = EnvironmentInt("GENMAP_FRAMES", _frameCount);
+    _frameTime = EnvironmentInt("GENMAP_FRAME_TIME", _frameTime);
+
+    auto script = std::getenv("GENMAP_FRAME_SCRIPT");
+    if (script != nullptr && !LoadScript(script))
+    {
+        spdlog::error("Failed to load frame script {}", script);
+        return false;
+    }
+
+    auto eglGetPlatformDisplayEXT = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT != nullptr)
+    {
+        _display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+
+    if (_display == EGL_NO_DISPLAY)
+    {
+        _display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+
+    EGLint major = 0, minor = 0;
+    if (_display == EGL_NO_DISPLAY || eglInitialize(_display, &major, &minor) == EGL_FALSE)
+    {
+        _display = EGL_NO_DISPLAY;
+        Destroy("Failed to initialize EGL");
+        return false;
+    }
+
+    spdlog::debug("EGL_VERSION                 : {0}.{1}", major, minor);
+
+    if (eglBindAPI(EGL_OPENGL_API) == EGL_FALSE)
+    {
+        Destroy("EGL does not support desktop OpenGL");
+        return false;
+    }
+
+    // A surfaceless display has no window configs, nothing is rendered to the surface of the
+    // config anyway. Without any config EGL_KHR_no_config_context still creates a context.
+    EGLint configAttribs[] =
+        {
+            EGL_SURFACE_TYPE,
+            EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE,
+            EGL_OPENGL_BIT,
+            EGL_NONE,
+        };
+
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint configCount = 0;
+    if (eglChooseConfig(_display, configAttribs, &config, 1, &configCount) == EGL_FALSE || configCount == 0)
+    {
+        config = EGL_NO_CONFIG_KHR;
+    }
+
+    // The renderer still uses a few compatibility profile calls, fall back to core when the
+    // driver has no compatibility profile
+    EGLint profiles[] = {
+        EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    };
+
+    for (auto profile : profiles)
+    {
+        EGLint contextAttribs[] =
+            {
+                EGL_CONTEXT_MAJOR_VERSION,
+                3,
+                EGL_CONTEXT_MINOR_VERSION,
+                3,
+                EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                profile,
+                EGL_NONE,
+            };
+
+        _context = eglCreateContext(_display, config, EGL_NO_CONTEXT, contextAttribs);
+        if (_context != EGL_NO_CONTEXT)
+        {
+            break;
+        }
+    }
+
+    if (_context == EGL_NO_CONTEXT)
+    {
+        Destroy("Failed to create opengl context (v3.3)");
+        return false;
+    }
+
+    if (eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, _context) == EGL_FALSE)
+    {
+        Destroy("Failed to make the opengl context current without a surface");
+        return false;
+    }
+
+    gladLoadGLLoader((GLADloadproc)eglGetProcAddress);
+
+    spdlog::debug("GL_VERSION                  : {0}", (const char *)glGetString(GL_VERSION));
+    spdlog::debug("GL_SHADING_LANGUAGE_VERSION : {0}", (const char *)glGetString(GL_SHADING_LANGUAGE_VERSION));
+    spdlog::debug("GL_RENDERER                 : {0}", (const char *)glGetString(GL_RENDERER));
+    spdlog::debug("GL_VENDOR                   : {0}", (const char *)glGetString(GL_VENDOR));
+
+    // Without a surface there is no default framebuffer, this one takes its place
+    glGenRenderbuffers(2, _renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, _renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, _width, _height);
+    glBindRenderbuffer(GL_RENDERBUFFER, _renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, _width, _height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    glGenFramebuffers(1, &_framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, _framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _renderbuffers[0]);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, _renderbuffers[1]);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        Destroy("Failed to create the offscreen framebuffer");
+        return false;
+    }
+
+    if (!intialize())
+    {
+        Destroy("Initialize failed");
+        return false;
+    }
+
+    glViewport(0, 0, _width, _height);
+    _resize(_width, _height);
+
+    return true;
+}
+
+std::chrono::milliseconds::rep CurrentTime()
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+int LinuxOffscreenApplication::Run(
+    std::function<bool(std::chrono::milliseconds::rep time, const struct InputState &inputState)> tick)
+{
+    bool running = true;
+
+    _inputState.PreviousState = &_previousInputState;
+
+    std::vector<double> frameTimes;
+    frameTimes.reserve(_frameCount);
+
+    // The scripted clock starts at the real time, the first frame is then a normal time step
+    auto time = CurrentTime();
+
+    for (int frame = 0; running && frame < _frameCount; frame++)
+    {
+        memcpy(&_previousInputState, &_inputState, sizeof(InputState));
+
+        RunScript(frame, running);
+
+        if (!running)
+        {
+            break;
+        }
+
+        time += _frameTime;
+
+        auto start = std::chrono::steady_clock::now();
+
+        running = tick(time, _inputState);
+
+        glFinish();
+
+        frameTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    if (!frameTimes.empty())
+    {
+        auto total = 0.0;
+        for (auto frameTime : frameTimes)
+        {
+            total += frameTime;
+        }
+
+        std::sort(frameTimes.begin(), frameTimes.end());
+
+        spdlog::info(
+            "{} frames, {:.3f} ms mean, {:.3f} ms median, {:.3f} ms 95th percentile, {:.3f} ms max",
+            frameTimes.size(),
+            total / frameTimes.size(),
+            frameTimes[frameTimes.size() / 2],
+            frameTimes[frameTimes.size() * 95 / 100],
+            frameTimes.back());
+    }
+
+    Destroy();
+
+    return 0;
+}
+
+bool LinuxOffscreenApplication::LoadScript(
+    const std::string &filename)
+{
+    std::ifstream file(filename);
+
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+        ScriptCommand command;
+
+        if (!(stream >> command.frame >> command.command))
+        {
+            continue;
+        }
+
+        std::getline(stream, command.arguments);
+        _script.push_back(command);
+    }
+
+    std::stable_sort(_script.begin(), _script.end(), [](const ScriptCommand &a, const ScriptCommand &b) {
+        return a.frame < b.frame;
+    });
+
+    return true;
+}
+
+void LinuxOffscreenApplication::RunScript(
+    int frame,
+    bool &running)
+{
+    for (auto &command : _script)
+    {
+        if (command.frame != frame)
+        {
+            continue;
+        }
+
+        std::istringstream arguments(command.arguments);
+
+        if (command.command == "key")
+        {
+            int code = 0;
+            std::string state;
+            if (arguments >> code >> state && code >= 0 && code < KeyboardButtons::KeyboardButtonsCount)
+            {
+                _inputState.KeyboardButtonStates[code] = (state == "down");
+            }
+        }
+        else if (command.command == "button")
+        {
+            std::string button, state;
+            if (arguments >> button >> state)
+            {
+                auto index = button == "left" ? MouseButtons::LeftButton : button == "right" ? MouseButtons::RightButton
+                                                                                              : MouseButtons::MiddleButton;
+                _inputState.MouseButtonStates[index] = (state == "down");
+            }
+        }
+        else if (command.command == "pointer")
+        {
+            arguments >> _inputState.MousePointerPosition[0] >> _inputState.MousePointerPosition[1];
+        }
+        else if (command.command == "quit")
+        {
+            running = false;
+        }
+        else
+        {
+            spdlog::warn("Unknown frame script command {}", command.command);
+        }
+    }
+}
+
+void LinuxOffscreenApplication::Destroy(
+    const char *errorMessage)
+{
+    if (errorMessage != nullptr)
+    {
+        spdlog::error(errorMessage);
+    }
+
+    _destroy();
+
+    if (_framebuffer != 0)
+    {
+        glDeleteFramebuffers(1, &_framebuffer);
+        glDeleteRenderbuffers(2, _renderbuffers);
+        _framebuffer = 0;
+    }
+
+    if (_display != EGL_NO_DISPLAY)
+    {
+        eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+
+        if (_context != EGL_NO_CONTEXT)
+        {
+            eglDestroyContext(_display, _context);
+            _context = EGL_NO_CONTEXT;
+        }
+
+        eglTerminate(_display);
+        _display = EGL_NO_DISPLAY;
+    }
+}
+
+LinuxOffscreenApplication *CreateApplication(
+    std::function<bool()> initialize,
+    std::function<void(int width, int height)> resize,
+    std::function<void()> destroy)
+{
+    static LinuxOffscreenApplication app;
+
+    if (app.Startup(initialize, resize, destroy))
+    {
+        return &app;
+    }
+
+    spdlog::error("Create application failed");
+
+    return nullptr;
+}
+
 #endif // __linux__
 
 void InputState::OnKeyboardButtonDown(
@@ -1007,6 +1430,11 @@ int Application::Run(TApp &t)
         [&](int w, int h) { t.Resize(w, h); },
         [&]() { t.Destroy(); });
 
+    if (app == nullptr)
+    {
+        return 1;
+    }
+
     return app->Run([&](std::chrono::milliseconds::rep time, const struct InputState &inputState) { return t.Tick(time, inputState); });
 }
 
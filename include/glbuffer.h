@@ -4,8 +4,12 @@
 #include "glad/glad.h"
 #include "glshader.h"
 
+#include <algorithm>
+#include <cstring>
+#include <deque>
 #include <glm/glm.hpp>
 #include <map>
+#include <utility>
 #include <vector>
 
 class VertexType
@@ -128,4 +132,470 @@ private:
     unsigned int _vertexBufferId = 0;
 };
 
+// Vertex buffer for data that is built once in its final layout and uploaded without a copy.
+// The vertex array stays bound after setup, so the caller can set up its attributes and add
+// the indices.
+class StaticBufferType
+{
+public:
+    StaticBufferType() = default;
+
+    virtual ~StaticBufferType() = default;
+
+    bool setup(
+        const void *data,
+        GLsizeiptr size)
+    {
+        glGenVertexArrays(1, &_vertexArrayId);
+        glGenBuffers(1, &_vertexBufferId);
+
+        glBindVertexArray(_vertexArrayId);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBufferId);
+
+        glBufferData(
+            GL_ARRAY_BUFFER,
+            size,
+            data,
+            GL_STATIC_DRAW);
+
+        return true;
+    }
+
+    // Called after setup while the vertex array is bound, the vertex array keeps the binding
+    bool setupIndices(
+        const void *data,
+        GLsizeiptr size)
+    {
+        glGenBuffers(1, &_indexBufferId);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBufferId);
+
+        glBufferData(
+            GL_ELEMENT_ARRAY_BUFFER,
+            size,
+            data,
+            GL_STATIC_DRAW);
+
+        return true;
+    }
+
+    void bind()
+    {
+        glBindVertexArray(_vertexArrayId);
+    }
+
+    void unbind()
+    {
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void cleanup()
+    {
+        if (_indexBufferId != 0)
+        {
+            glDeleteBuffers(1, &_indexBufferId);
+            _indexBufferId = 0;
+        }
+        if (_vertexBufferId != 0)
+        {
+            glDeleteBuffers(1, &_vertexBufferId);
+            _vertexBufferId = 0;
+        }
+        if (_vertexArrayId != 0)
+        {
+            glDeleteVertexArrays(1, &_vertexArrayId);
+            _vertexArrayId = 0;
+        }
+    }
+
+private:
+    unsigned int _vertexArrayId = 0;
+    unsigned int _vertexBufferId = 0;
+    unsigned int _indexBufferId = 0;
+};
+
+// Ring buffer for geometry that is appended to every frame. Only the appended elements are
+// written, the live elements (everything appended since the last release, minus what was
+// overwritten after the ring wrapped) can be drawn with ranges(). When the GL supports
+// ARB_buffer_storage the ring is persistently mapped and split in RegionCount regions that
+// are each guarded by a fence, so writing never stalls on data the GPU is still reading
+// unless the ring is smaller than the frames in flight. Without buffer storage every append
+// is a glBufferSubData of the new elements, and in cpu mode no GL calls are made at all.
+class StreamBufferType
+{
+public:
+    static const int RegionCount = 3;
+
+    enum class Modes
+    {
+        Cpu,
+        SubData,
+        Persistent,
+    };
+
+    StreamBufferType() = default;
+
+    virtual ~StreamBufferType() = default;
+
+    bool setup(
+        GLsizei capacity,
+        GLsizei stride,
+        bool cpuOnly = false)
+    {
+        if (capacity < RegionCount || stride <= 0)
+        {
+            return false;
+        }
+
+        _capacity = capacity;
+        _stride = stride;
+        _head = 0;
+        _ranges.clear();
+
+        if (cpuOnly)
+        {
+            _mode = Modes::Cpu;
+            _cpu.resize(size_t(_capacity) * size_t(_stride));
+            _mapped = _cpu.data();
+
+            return true;
+        }
+
+        auto size = GLsizeiptr(_capacity) * GLsizeiptr(_stride);
+
+        glGenVertexArrays(1, &_vertexArrayId);
+        glGenBuffers(1, &_vertexBufferId);
+
+        glBindVertexArray(_vertexArrayId);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBufferId);
+
+        if (GLAD_GL_ARB_buffer_storage)
+        {
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+            glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+            _mapped = reinterpret_cast<unsigned char *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+        }
+
+        if (_mapped != nullptr)
+        {
+            _mode = Modes::Persistent;
+        }
+        else
+        {
+            _mode = Modes::SubData;
+            glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        }
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        return true;
+    }
+
+    // Copies count elements into the ring and returns the index of the first one, or -1 when
+    // they do not fit. Elements of one append are always contiguous, when there is not enough
+    // room before the end of the ring they are written at the front.
+    GLsizei append(
+        const void *data,
+        GLsizei count)
+    {
+        if (count <= 0 || count > _capacity)
+        {
+            return -1;
+        }
+
+        GLsizei first = _head;
+
+        if (first + count > _capacity)
+        {
+            discard(first, _capacity);
+            first = 0;
+        }
+
+        discard(first, first + count);
+
+        // Only the elements the GPU may still read have to wait, the rest of a fenced region is
+        // free. Appending right after the elements of the last frame doesn't wait for it.
+        for (int region = regionOf(first); region <= regionOf(first + count - 1); region++)
+        {
+            auto &span = _fencedSpans[region];
+
+            if (first < span.second && span.first < first + count)
+            {
+                waitForRegion(region);
+            }
+        }
+
+        auto offset = size_t(first) * size_t(_stride);
+        auto size = size_t(count) * size_t(_stride);
+
+        if (_mode == Modes::SubData)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, _vertexBufferId);
+            glBufferSubData(GL_ARRAY_BUFFER, GLintptr(offset), GLsizeiptr(size), data);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        else
+        {
+            memcpy(_mapped + offset, data, size);
+        }
+
+        if (!_ranges.empty() && _ranges.back().first + _ranges.back().second == first)
+        {
+            _ranges.back().second += count;
+        }
+        else
+        {
+            _ranges.push_back({first, count});
+        }
+
+        _head = (first + count) % _capacity;
+
+        return first;
+    }
+
+    // Forgets all live elements, used for data that is only drawn in the frame it was appended
+    void release()
+    {
+        _ranges.clear();
+    }
+
+    // Must be called after the draws that read the live elements, they are not written again
+    // before the GPU is done with them
+    void fence()
+    {
+        if (_mode != Modes::Persistent)
+        {
+            return;
+        }
+
+        // The live elements in every region, a new fence also covers the span of the fence it
+        // replaces since it passes after it
+        std::pair<GLsizei, GLsizei> used[RegionCount];
+        bool live[RegionCount] = {false};
+        for (int region = 0; region < RegionCount; region++)
+        {
+            used[region] = _fencedSpans[region];
+        }
+
+        for (auto &range : _ranges)
+        {
+            for (int region = regionOf(range.first); region <= regionOf(range.first + range.second - 1); region++)
+            {
+                auto first = std::max(range.first, regionStart(region));
+                auto last = std::min(range.first + range.second, regionStart(region + 1));
+                auto &span = used[region];
+
+                live[region] = true;
+                if (span.first >= span.second)
+                {
+                    span = {first, last};
+                }
+                else
+                {
+                    span = {std::min(span.first, first), std::max(span.second, last)};
+                }
+            }
+        }
+
+        for (int region = 0; region < RegionCount; region++)
+        {
+            // Elements that stay live are drawn again, so their fence moves to this frame
+            if (!live[region])
+            {
+                continue;
+            }
+
+            if (_fences[region] != nullptr)
+            {
+                glDeleteSync(_fences[region]);
+            }
+
+            _fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            _fencedSpans[region] = used[region];
+        }
+    }
+
+    // Calls func(first, count) for every contiguous range of live elements, oldest first
+    template <class Func>
+    void ranges(
+        Func func) const
+    {
+        for (auto &range : _ranges)
+        {
+            func(range.first, range.second);
+        }
+    }
+
+    GLsizei count() const
+    {
+        GLsizei result = 0;
+
+        for (auto &range : _ranges)
+        {
+            result += range.second;
+        }
+
+        return result;
+    }
+
+    GLsizei capacity() const
+    {
+        return _capacity;
+    }
+
+    Modes mode() const
+    {
+        return _mode;
+    }
+
+    // Number of times an append had to wait for the GPU to release a region
+    int stalls() const
+    {
+        return _stalls;
+    }
+
+    const unsigned char *data(
+        GLsizei index) const
+    {
+        if (_mode == Modes::SubData)
+        {
+            return nullptr;
+        }
+
+        return _mapped + size_t(index) * size_t(_stride);
+    }
+
+    void bind()
+    {
+        glBindVertexArray(_vertexArrayId);
+        glBindBuffer(GL_ARRAY_BUFFER, _vertexBufferId);
+    }
+
+    void unbind()
+    {
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void cleanup()
+    {
+        for (int region = 0; region < RegionCount; region++)
+        {
+            if (_fences[region] != nullptr)
+            {
+                glDeleteSync(_fences[region]);
+                _fences[region] = nullptr;
+            }
+            _fencedSpans[region] = {0, 0};
+        }
+        if (_vertexBufferId != 0)
+        {
+            if (_mode == Modes::Persistent)
+            {
+                glBindBuffer(GL_ARRAY_BUFFER, _vertexBufferId);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &_vertexBufferId);
+            _vertexBufferId = 0;
+        }
+        if (_vertexArrayId != 0)
+        {
+            glDeleteVertexArrays(1, &_vertexArrayId);
+            _vertexArrayId = 0;
+        }
+        _mapped = nullptr;
+        _cpu.clear();
+        _ranges.clear();
+    }
+
+private:
+    Modes _mode = Modes::Cpu;
+    GLsizei _capacity = 0;
+    GLsizei _stride = 0;
+    GLsizei _head = 0;
+    std::deque<std::pair<GLsizei, GLsizei>> _ranges;
+    unsigned char *_mapped = nullptr;
+    std::vector<unsigned char> _cpu;
+    GLsync _fences[RegionCount] = {nullptr, nullptr, nullptr};
+    std::pair<GLsizei, GLsizei> _fencedSpans[RegionCount]; // elements the fence of a region covers
+    int _stalls = 0;
+    unsigned int _vertexArrayId = 0;
+    unsigned int _vertexBufferId = 0;
+
+    int regionOf(
+        GLsizei index) const
+    {
+        auto region = int((long long)(index)*RegionCount / _capacity);
+
+        return region < RegionCount ? region : RegionCount - 1;
+    }
+
+    // The first element of the region, the inverse of regionOf
+    GLsizei regionStart(
+        int region) const
+    {
+        if (region >= RegionCount)
+        {
+            return _capacity;
+        }
+
+        return GLsizei((region * (long long)(_capacity) + RegionCount - 1) / RegionCount);
+    }
+
+    // Drops the oldest live elements that are in [from, to), they are about to be overwritten
+    void discard(
+        GLsizei from,
+        GLsizei to)
+    {
+        while (!_ranges.empty())
+        {
+            auto &oldest = _ranges.front();
+            auto end = oldest.first + oldest.second;
+
+            if (oldest.first >= to || end <= from)
+            {
+                break;
+            }
+
+            if (end <= to)
+            {
+                _ranges.pop_front();
+            }
+            else
+            {
+                oldest.second = end - to;
+                oldest.first = to;
+            }
+        }
+    }
+
+    void waitForRegion(
+        int region)
+    {
+        if (_fences[region] == nullptr)
+        {
+            return;
+        }
+
+        auto result = glClientWaitSync(_fences[region], 0, 0);
+
+        if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+        {
+            _stalls++;
+
+            do
+            {
+                result = glClientWaitSync(_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            } while (result == GL_TIMEOUT_EXPIRED);
+        }
+
+        glDeleteSync(_fences[region]);
+        _fences[region] = nullptr;
+        _fencedSpans[region] = {0, 0};
+    }
+};
+
 #endif // GLBUFFER_H
@@ -0,0 +1,188 @@
+#include "inputrecording.h"
+
+#include <cstring>
+#include <fstream>
+#include <spdlog/spdlog.h>
+
+// "GMIR", the format version and the button counts, followed by the frames. Values are stored
+// little endian as they are in memory, frames field by field so there is no padding.
+static const char RecordingMagic[4] = {'G', 'M', 'I', 'R'};
+static const uint32_t RecordingVersion = 1;
+
+void InputRecording::Clear()
+{
+    _frames.clear();
+}
+
+void InputRecording::Add(
+    std::chrono::milliseconds::rep time,
+    const InputState &inputState)
+{
+    Frame frame;
+
+    frame.time = int64_t(time);
+
+    memset(frame.keys, 0, sizeof(frame.keys));
+    for (int i = 0; i < KeyboardButtons::KeyboardButtonsCount; i++)
+    {
+        if (inputState.KeyboardButtonStates[i])
+        {
+            frame.keys[i / 8] |= uint8_t(1 << (i % 8));
+        }
+    }
+
+    frame.mouseButtons = 0;
+    for (int i = 0; i < MouseButtons::MouseButtonsCount; i++)
+    {
+        if (inputState.MouseButtonStates[i])
+        {
+            frame.mouseButtons |= uint8_t(1 << i);
+        }
+    }
+
+    frame.pointer[0] = inputState.MousePointerPosition[0];
+    frame.pointer[1] = inputState.MousePointerPosition[1];
+
+    _frames.push_back(frame);
+}
+
+size_t InputRecording::FrameCount() const
+{
+    return _frames.size();
+}
+
+std::chrono::milliseconds::rep InputRecording::Time(
+    size_t frame) const
+{
+    return std::chrono::milliseconds::rep(_frames[frame].time);
+}
+
+void InputRecording::Apply(
+    size_t frame,
+    InputState &inputState) const
+{
+    auto &recorded = _frames[frame];
+
+    for (int i = 0; i < KeyboardButtons::KeyboardButtonsCount; i++)
+    {
+        inputState.KeyboardButtonStates[i] = (recorded.keys[i / 8] & (1 << (i % 8))) != 0;
+    }
+
+    for (int i = 0; i < MouseButtons::MouseButtonsCount; i++)
+    {
+        inputState.MouseButtonStates[i] = (recorded.mouseButtons & (1 << i)) != 0;
+    }
+
+    inputState.MousePointerPosition[0] = recorded.pointer[0];
+    inputState.MousePointerPosition[1] = recorded.pointer[1];
+}
+
+bool InputRecording::Save(
+    const std::string &filename) const
+{
+    std::ofstream file(filename, std::ios::binary);
+
+    if (!file)
+    {
+        spdlog::error("unable to write input recording {}", filename);
+
+        return false;
+    }
+
+    uint32_t keyboardButtons = KeyboardButtons::KeyboardButtonsCount;
+    uint32_t mouseButtons = MouseButtons::MouseButtonsCount;
+    uint64_t frameCount = _frames.size();
+
+    file.write(RecordingMagic, sizeof(RecordingMagic));
+    file.write((const char *)&RecordingVersion, sizeof(RecordingVersion));
+    file.write((const char *)&keyboardButtons, sizeof(keyboardButtons));
+    file.write((const char *)&mouseButtons, sizeof(mouseButtons));
+    file.write((const char *)&frameCount, sizeof(frameCount));
+
+    for (auto &frame : _frames)
+    {
+        file.write((const char *)&frame.time, sizeof(frame.time));
+        file.write((const char *)frame.keys, sizeof(frame.keys));
+        file.write((const char *)&frame.mouseButtons, sizeof(frame.mouseButtons));
+        file.write((const char *)frame.pointer, sizeof(frame.pointer));
+    }
+
+    return bool(file);
+}
+
+bool InputRecording::Load(
+    const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+
+    if (!file)
+    {
+        spdlog::error("unable to open input recording {}", filename);
+
+        return false;
+    }
+
+    char magic[4] = {0, 0, 0, 0};
+    uint32_t version = 0, keyboardButtons = 0, mouseButtons = 0;
+    uint64_t frameCount = 0;
+
+    file.read(magic, sizeof(magic));
+    file.read((char *)&version, sizeof(version));
+    file.read((char *)&keyboardButtons, sizeof(keyboardButtons));
+    file.read((char *)&mouseButtons, sizeof(mouseButtons));
+    file.read((char *)&frameCount, sizeof(frameCount));
+
+    if (!file || memcmp(magic, RecordingMagic, sizeof(magic)) != 0 || version != RecordingVersion)
+    {
+        spdlog::error("{} is not an input recording", filename);
+
+        return false;
+    }
+
+    if (keyboardButtons != KeyboardButtons::KeyboardButtonsCount || mouseButtons != MouseButtons::MouseButtonsCount)
+    {
+        spdlog::error("{} was recorded with a different set of buttons", filename);
+
+        return false;
+    }
+
+    // The count comes from the file, it has to fit in what is left of it before anything is
+    // reserved for it
+    const uint64_t frameSize = sizeof(Frame::time) + sizeof(Frame::keys) + sizeof(Frame::mouseButtons) + sizeof(Frame::pointer);
+
+    auto framesStart = file.tellg();
+    file.seekg(0, std::ios::end);
+    auto remaining = uint64_t(file.tellg() - framesStart);
+    file.seekg(framesStart);
+
+    if (!file || frameCount > remaining / frameSize)
+    {
+        spdlog::error("{} is truncated, it has room for {} of its {} frames", filename, remaining / frameSize, frameCount);
+
+        return false;
+    }
+
+    _frames.clear();
+    _frames.reserve(size_t(frameCount));
+
+    for (uint64_t i = 0; i < frameCount; i++)
+    {
+        Frame frame;
+
+        file.read((char *)&frame.time, sizeof(frame.time));
+        file.read((char *)frame.keys, sizeof(frame.keys));
+        file.read((char *)&frame.mouseButtons, sizeof(frame.mouseButtons));
+        file.read((char *)frame.pointer, sizeof(frame.pointer));
+
+        if (!file)
+        {
+            spdlog::error("{} is truncated after {} frames", filename, i);
+
+            return false;
+        }
+
+        _frames.push_back(frame);
+    }
+
+    return true;
+}
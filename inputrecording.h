@@ -0,0 +1,54 @@
+#ifndef INPUTRECORDING_H
+#define INPUTRECORDING_H
+
+#include "include/application.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The time and input state of every tick, so a fly-through can be replayed with exactly the
+// same frames. Only the buttons and pointer position are stored, PreviousState is up to the
+// replay.
+class InputRecording
+{
+public:
+    void Clear();
+
+    void Add(
+        std::chrono::milliseconds::rep time,
+        const InputState &inputState);
+
+    size_t FrameCount() const;
+
+    std::chrono::milliseconds::rep Time(
+        size_t frame) const;
+
+    // Copies the buttons and pointer position of the frame into inputState
+    void Apply(
+        size_t frame,
+        InputState &inputState) const;
+
+    bool Save(
+        const std::string &filename) const;
+
+    bool Load(
+        const std::string &filename);
+
+private:
+    static const int KeyBytes = (KeyboardButtons::KeyboardButtonsCount + 7) / 8;
+
+    class Frame
+    {
+    public:
+        int64_t time;
+        uint8_t keys[KeyBytes];
+        uint8_t mouseButtons;
+        int32_t pointer[2];
+    };
+
+    std::vector<Frame> _frames;
+};
+
+#endif // INPUTRECORDING_H
@@ -2,22 +2,9 @@
 #define APPLICATION_IMPLEMENTATION
 #include "include/application.h"
 
+#include "allocationtracker.h"
 #include "genmapapp.h"
-
-static int counter = 0;
-
-void *operator new(std::size_t sz)
-{
-    if (sz == 0)
-        ++sz; // avoid std::malloc(0) which may return nullptr on success
-
-    counter++;
-
-    if (void *ptr = std::malloc(sz))
-        return ptr;
-
-    throw std::bad_alloc{}; // required by [new.delete.single]/3
-}
+#include "profiler.h"
 
 int main(
     int argc,
@@ -25,6 +12,8 @@ int main(
 {
     spdlog::set_level(spdlog::level::debug); // Set global log level to debug
 
+    PROFILE_THREAD("main");
+
     GenMapApp t;
 
     if (argc > 2)
@@ -37,9 +26,41 @@ int main(
         spdlog::debug("loading map {0}", argv[1]);
     }
 
+    // genmap <root> <map> --headless <camera script> [output directory] [width] [height]
+    if (argc > 4 && std::string(argv[3]) == "--headless")
+    {
+        auto outputDirectory = argc > 5 ? argv[5] : ".";
+        auto width = argc > 6 ? std::atoi(argv[6]) : 1024;
+        auto height = argc > 7 ? std::atoi(argv[7]) : 768;
+
+        auto result = t.RunHeadless(argv[4], outputDirectory, width, height);
+
+        PROFILE_WRITE_TRACE("genmap.trace.json");
+
+        AllocationTracker::LogSummary();
+
+        return result ? 0 : 1;
+    }
+    // genmap <root> <map> --record <input recording>
+    // genmap <root> <map> --replay <input recording> [report]
+    // The Linux offscreen backend stops after GENMAP_FRAMES, set it to cover the whole replay.
+    else if (argc > 4 && std::string(argv[3]) == "--record")
+    {
+        t.RecordInput(argv[4]);
+    }
+    else if (argc > 4 && std::string(argv[3]) == "--replay")
+    {
+        if (!t.ReplayInput(argv[4], argc > 5 ? argv[5] : ""))
+        {
+            return 1;
+        }
+    }
+
     auto result = Application::Run<GenMapApp>(t);
 
-    std::cout << counter << " allocations" << std::endl;
+    PROFILE_WRITE_TRACE("genmap.trace.json");
+
+    AllocationTracker::LogSummary();
 
     return result;
 }
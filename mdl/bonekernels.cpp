@@ -0,0 +1,275 @@
+#include "bonekernels.hpp"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BONEKERNELS_SSE 1
+#include <emmintrin.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////
+
+void SlerpBoneArraysScalar(vec4_t q1[], vec3_t pos1[], const vec4_t q2[], const vec3_t pos2[], float s, int count)
+{
+    vec4_t q3, q4;
+    float s1 = 1.0f - s;
+
+    for (int i = 0; i < count; i++)
+    {
+        // QuaternionSlerp flips q when it is backwards, so work on a copy
+        q4[0] = q2[i][0];
+        q4[1] = q2[i][1];
+        q4[2] = q2[i][2];
+        q4[3] = q2[i][3];
+
+        QuaternionSlerp(q1[i], q4, s, q3);
+
+        q1[i][0] = q3[0];
+        q1[i][1] = q3[1];
+        q1[i][2] = q3[2];
+        q1[i][3] = q3[3];
+        pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s;
+        pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s;
+        pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s;
+    }
+}
+
+void BoneMatrixArraysScalar(const vec4_t q[], const vec3_t pos[], int count, float out[][3][4])
+{
+    for (int i = 0; i < count; i++)
+    {
+        QuaternionMatrix(q[i], out[i]);
+
+        out[i][0][3] = pos[i][0];
+        out[i][1][3] = pos[i][1];
+        out[i][2][3] = pos[i][2];
+    }
+}
+
+void ConcatBoneArraysScalar(const mstudiobone_t *pbones, const float local[][3][4], int count, float out[][4][4])
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (pbones[i].parent == -1)
+        {
+            memcpy(out[i], local[i], sizeof(float) * 12);
+        }
+        else
+        {
+            R_ConcatTransforms(out[pbones[i].parent], local[i], out[i]);
+        }
+    }
+}
+
+#ifdef BONEKERNELS_SSE
+
+////////////////////////////////////////////////////////////////////////
+
+// acos for x in [0, 1], Abramowitz and Stegun 4.4.46, absolute error below 2e-8
+static inline __m128 AcosPositive(__m128 x)
+{
+    __m128 p = _mm_set1_ps(-0.0012624911f);
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(0.0066700901f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(-0.0170881256f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(0.0308918810f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(-0.0501743046f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(0.0889789874f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(-0.2145988016f));
+    p = _mm_add_ps(_mm_mul_ps(p, x), _mm_set1_ps(1.5707963050f));
+
+    auto oneMinusX = _mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), x), _mm_setzero_ps());
+
+    return _mm_mul_ps(p, _mm_sqrt_ps(oneMinusX));
+}
+
+// sin for x in [0, pi/2], taylor series up to x^11
+static inline __m128 SinQuadrant(__m128 x)
+{
+    auto x2 = _mm_mul_ps(x, x);
+
+    __m128 p = _mm_set1_ps(-1.0f / 39916800.0f);
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f / 362880.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 5040.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f / 120.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 6.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f));
+
+    return _mm_mul_ps(p, x);
+}
+
+static inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void SlerpBoneArrays(vec4_t q1[], vec3_t pos1[], const vec4_t q2[], const vec3_t pos2[], float s, int count)
+{
+    const auto t = _mm_set1_ps(s);
+    const auto t1 = _mm_set1_ps(1.0f - s);
+    const auto one = _mm_set1_ps(1.0f);
+    const auto signBit = _mm_set1_ps(-0.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        // four quaternions side by side, transposed to one register per component
+        auto px = _mm_loadu_ps(q1[i + 0]);
+        auto py = _mm_loadu_ps(q1[i + 1]);
+        auto pz = _mm_loadu_ps(q1[i + 2]);
+        auto pw = _mm_loadu_ps(q1[i + 3]);
+        _MM_TRANSPOSE4_PS(px, py, pz, pw);
+
+        auto qx = _mm_loadu_ps(q2[i + 0]);
+        auto qy = _mm_loadu_ps(q2[i + 1]);
+        auto qz = _mm_loadu_ps(q2[i + 2]);
+        auto qw = _mm_loadu_ps(q2[i + 3]);
+        _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+        auto cosom = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(px, qx), _mm_mul_ps(py, qy)),
+            _mm_add_ps(_mm_mul_ps(pz, qz), _mm_mul_ps(pw, qw)));
+
+        // flip q where it is backwards, the same test as |p - q| > |p + q|
+        auto flip = _mm_and_ps(_mm_cmplt_ps(cosom, _mm_setzero_ps()), signBit);
+        qx = _mm_xor_ps(qx, flip);
+        qy = _mm_xor_ps(qy, flip);
+        qz = _mm_xor_ps(qz, flip);
+        qw = _mm_xor_ps(qw, flip);
+        cosom = _mm_xor_ps(cosom, flip);
+
+        auto omega = AcosPositive(_mm_min_ps(cosom, one));
+        auto sinom = SinQuadrant(omega);
+        auto sclp = _mm_div_ps(SinQuadrant(_mm_mul_ps(t1, omega)), sinom);
+        auto sclq = _mm_div_ps(SinQuadrant(_mm_mul_ps(t, omega)), sinom);
+
+        // nearly identical rotations are lerped
+        auto far = _mm_cmpgt_ps(_mm_sub_ps(one, cosom), _mm_set1_ps(0.00000001f));
+        sclp = Select(far, sclp, t1);
+        sclq = Select(far, sclq, t);
+
+        auto rx = _mm_add_ps(_mm_mul_ps(sclp, px), _mm_mul_ps(sclq, qx));
+        auto ry = _mm_add_ps(_mm_mul_ps(sclp, py), _mm_mul_ps(sclq, qy));
+        auto rz = _mm_add_ps(_mm_mul_ps(sclp, pz), _mm_mul_ps(sclq, qz));
+        auto rw = _mm_add_ps(_mm_mul_ps(sclp, pw), _mm_mul_ps(sclq, qw));
+        _MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+
+        _mm_storeu_ps(q1[i + 0], rx);
+        _mm_storeu_ps(q1[i + 1], ry);
+        _mm_storeu_ps(q1[i + 2], rz);
+        _mm_storeu_ps(q1[i + 3], rw);
+
+        // the positions of four bones are three registers of floats
+        auto a = &pos1[i][0];
+        auto b = &pos2[i][0];
+        for (int j = 0; j < 12; j += 4)
+        {
+            auto lerped = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(a + j), t1), _mm_mul_ps(_mm_loadu_ps(b + j), t));
+            _mm_storeu_ps(a + j, lerped);
+        }
+    }
+
+    SlerpBoneArraysScalar(q1 + i, pos1 + i, q2 + i, pos2 + i, s, count - i);
+}
+
+void BoneMatrixArrays(const vec4_t q[], const vec3_t pos[], int count, float out[][3][4])
+{
+    const auto two = _mm_set1_ps(2.0f);
+    const auto one = _mm_set1_ps(1.0f);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        auto x = _mm_loadu_ps(q[i + 0]);
+        auto y = _mm_loadu_ps(q[i + 1]);
+        auto z = _mm_loadu_ps(q[i + 2]);
+        auto w = _mm_loadu_ps(q[i + 3]);
+        _MM_TRANSPOSE4_PS(x, y, z, w);
+
+        auto xx = _mm_mul_ps(_mm_mul_ps(two, x), x);
+        auto yy = _mm_mul_ps(_mm_mul_ps(two, y), y);
+        auto zz = _mm_mul_ps(_mm_mul_ps(two, z), z);
+        auto xy = _mm_mul_ps(_mm_mul_ps(two, x), y);
+        auto xz = _mm_mul_ps(_mm_mul_ps(two, x), z);
+        auto yz = _mm_mul_ps(_mm_mul_ps(two, y), z);
+        auto wx = _mm_mul_ps(_mm_mul_ps(two, w), x);
+        auto wy = _mm_mul_ps(_mm_mul_ps(two, w), y);
+        auto wz = _mm_mul_ps(_mm_mul_ps(two, w), z);
+
+        __m128 rows[3][4] = {
+            {_mm_sub_ps(_mm_sub_ps(one, yy), zz), _mm_sub_ps(xy, wz), _mm_add_ps(xz, wy), _mm_setzero_ps()},
+            {_mm_add_ps(xy, wz), _mm_sub_ps(_mm_sub_ps(one, xx), zz), _mm_sub_ps(yz, wx), _mm_setzero_ps()},
+            {_mm_sub_ps(xz, wy), _mm_add_ps(yz, wx), _mm_sub_ps(_mm_sub_ps(one, xx), yy), _mm_setzero_ps()},
+        };
+
+        // one register per matrix element of four bones, transposed back to a row per bone
+        for (int r = 0; r < 3; r++)
+        {
+            rows[r][3] = _mm_set_ps(pos[i + 3][r], pos[i + 2][r], pos[i + 1][r], pos[i + 0][r]);
+
+            _MM_TRANSPOSE4_PS(rows[r][0], rows[r][1], rows[r][2], rows[r][3]);
+
+            for (int b = 0; b < 4; b++)
+            {
+                _mm_storeu_ps(out[i + b][r], rows[r][b]);
+            }
+        }
+    }
+
+    BoneMatrixArraysScalar(q + i, pos + i, count - i, out + i);
+}
+
+void ConcatBoneArrays(const mstudiobone_t *pbones, const float local[][3][4], int count, float out[][4][4])
+{
+    // every bone depends on its parent, so instead of across bones the rows of one bone are
+    // computed as four wide linear combinations of the rows of the local transform
+    const auto translation = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+
+    for (int i = 0; i < count; i++)
+    {
+        auto l0 = _mm_loadu_ps(local[i][0]);
+        auto l1 = _mm_loadu_ps(local[i][1]);
+        auto l2 = _mm_loadu_ps(local[i][2]);
+
+        if (pbones[i].parent == -1)
+        {
+            _mm_storeu_ps(out[i][0], l0);
+            _mm_storeu_ps(out[i][1], l1);
+            _mm_storeu_ps(out[i][2], l2);
+
+            continue;
+        }
+
+        auto parent = out[pbones[i].parent];
+
+        for (int r = 0; r < 3; r++)
+        {
+            auto p = _mm_loadu_ps(parent[r]);
+
+            auto row = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)), l0);
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)), l1));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)), l2));
+            row = _mm_add_ps(row, _mm_and_ps(translation, p));
+
+            _mm_storeu_ps(out[i][r], row);
+        }
+    }
+}
+
+#else
+
+void SlerpBoneArrays(vec4_t q1[], vec3_t pos1[], const vec4_t q2[], const vec3_t pos2[], float s, int count)
+{
+    SlerpBoneArraysScalar(q1, pos1, q2, pos2, s, count);
+}
+
+void BoneMatrixArrays(const vec4_t q[], const vec3_t pos[], int count, float out[][3][4])
+{
+    BoneMatrixArraysScalar(q, pos, count, out);
+}
+
+void ConcatBoneArrays(const mstudiobone_t *pbones, const float local[][3][4], int count, float out[][4][4])
+{
+    ConcatBoneArraysScalar(pbones, local, count, out);
+}
+
+#endif // BONEKERNELS_SSE
@@ -0,0 +1,30 @@
+#ifndef BONEKERNELS_H
+#define BONEKERNELS_H
+
+#include "common/mathlib.h"
+#include "engine/studio.h"
+
+// Batched versions of the mathlib bone routines used by StudioEntity::SetUpBones. With SSE2
+// four bones are handled at once by transposing their quaternions to x, y, z and w vectors,
+// without it they fall back to the scalar mathlib code. Results match the scalar code within
+// BoneKernelTolerance.
+
+const float BoneKernelTolerance = 1e-5f;
+
+// q1 = slerp(q1, q2, s) and pos1 = lerp(pos1, pos2, s) for count bones, like QuaternionSlerp
+// q2 is not modified.
+void SlerpBoneArrays(vec4_t q1[], vec3_t pos1[], const vec4_t q2[], const vec3_t pos2[], float s, int count);
+
+// Builds the local 3x4 transform of count bones from their rotation and position
+void BoneMatrixArrays(const vec4_t q[], const vec3_t pos[], int count, float out[][3][4]);
+
+// Concatenates the local transforms down the bone hierarchy, parents always come before their
+// children in a studio model
+void ConcatBoneArrays(const mstudiobone_t *pbones, const float local[][3][4], int count, float out[][4][4]);
+
+// The scalar versions, kept as the reference the batched kernels are checked and timed against
+void SlerpBoneArraysScalar(vec4_t q1[], vec3_t pos1[], const vec4_t q2[], const vec3_t pos2[], float s, int count);
+void BoneMatrixArraysScalar(const vec4_t q[], const vec3_t pos[], int count, float out[][3][4]);
+void ConcatBoneArraysScalar(const mstudiobone_t *pbones, const float local[][3][4], int count, float out[][4][4]);
+
+#endif // BONEKERNELS_H
@@ -1,5 +1,9 @@
 #include "renderapi.hpp"
 
+#include "../allocationtracker.h"
+#include "../profiler.h"
+
+#include <algorithm>
 #include <iostream>
 
 GlShader::GlShader(int type, const char *source)
@@ -65,6 +69,11 @@ void GlProgram::attach(GLuint index)
     glAttachShader(_index, index);
 }
 
+void GlProgram::bindAttribLocation(GLuint index, const char *name)
+{
+    glBindAttribLocation(_index, index, name);
+}
+
 void GlProgram::link()
 {
     glLinkProgram(_index);
@@ -114,28 +123,33 @@ bool GlProgram::is_good() const
     return _index > 0;
 }
 
+RenderApi::~RenderApi()
+{
+    ClearModels();
+}
+
 void RenderApi::Setup()
 {
-    glGenBuffers(1, &_vbo);
+    _vertexStream.setup(1 << 18, VertexSize());
+    glGenBuffers(1, &_indexBuffer);
 
     GlShader vs = GlShader(
         GL_VERTEX_SHADER,
         GLSL(
             in vec3 a_position;
             in vec2 a_uv;
-            in uint a_bone;
+            in int a_bone;
 
             uniform mat4 u_matrix;
 
             layout(std140) uniform BonesBlock {
-                mat4 u_bones[16];
+                mat4 u_bones[128];
             };
 
             out vec2 f_uv;
 
             void main() {
-                mat4 m = u_matrix;
-                gl_Position = m * vec4(a_position.xyz, 1.0);
+                gl_Position = u_matrix * u_bones[a_bone] * vec4(a_position.xyz, 1.0);
                 f_uv = a_uv;
             }));
 
@@ -151,6 +165,7 @@ void RenderApi::Setup()
             void main() {
                 vec4 texel0;
                 texel0 = texture2D(u_tex0, f_uv);
+                if (texel0.a < 0.5) discard;
                 color = vec4(texel0.rgb, 1.0);
             }));
 
@@ -166,150 +181,506 @@ void RenderApi::Setup()
     _matrixUniform = _program->getUniformLocation("u_matrix");
     _textureUniform = _program->getUniformLocation("u_tex0");
 
-    int _u_bones = 0;
-    GLint uniform_block_index = glGetUniformBlockIndex(_program->_index, "u_bones");
-    std::cout << _program->_index << " " << uniform_block_index << " " << _u_bones << std::endl;
-    glUniformBlockBinding(_program->_index, uniform_block_index, _u_bones);
+    _bonesBlockUniform = _program->getUniformBlockIndex("BonesBlock");
+    _program->uniformBlockBinding(_bonesBlockUniform, 0);
+
     glGenBuffers(1, &_bonesBuffer);
     glBindBuffer(GL_UNIFORM_BUFFER, _bonesBuffer);
-    glBufferData(GL_UNIFORM_BUFFER, 32 * sizeof(glm::mat4), 0, GL_STREAM_DRAW);
+    glBufferData(GL_UNIFORM_BUFFER, MaxBones * sizeof(glm::mat4), 0, GL_STREAM_DRAW);
     glBindBuffer(GL_UNIFORM_BUFFER, 0);
-}
 
-static glm::mat4 mats[32];
-
-void copy_to_mat4(glm::mat4 &m, const float matrix[3][4])
-{
-    for (int i = 0; i < 4; i++)
+    for (auto &bone : _bones)
     {
-        m[i] = glm::vec4(matrix[i][1], matrix[i][2], matrix[i][3], 0.0f);
+        bone = glm::mat4(1.0f);
     }
+
+    GlShader instancedVs = GlShader(
+        GL_VERTEX_SHADER,
+        GLSL(
+            in vec3 a_position;
+            in vec2 a_uv;
+            in int a_bone;
+
+            uniform mat4 u_matrix;
+            uniform samplerBuffer u_palette;
+            uniform int u_paletteBase;
+            uniform int u_paletteStride;
+
+            out vec2 f_uv;
+
+            void main() {
+                int row = u_paletteBase + gl_InstanceID * u_paletteStride + a_bone * 3;
+                vec4 position = vec4(a_position.xyz, 1.0);
+                vec3 world = vec3(
+                    dot(texelFetch(u_palette, row + 0), position),
+                    dot(texelFetch(u_palette, row + 1), position),
+                    dot(texelFetch(u_palette, row + 2), position));
+                gl_Position = u_matrix * vec4(world, 1.0);
+                f_uv = a_uv;
+            }));
+
+    _instancedProgram = std::unique_ptr<GlProgram>(new GlProgram());
+
+    _instancedProgram->attach(instancedVs);
+    _instancedProgram->attach(fs);
+
+    // The uploaded vertex arrays are set up with the attribute locations of the first program
+    _instancedProgram->bindAttribLocation(_positionAttrib, "a_position");
+    _instancedProgram->bindAttribLocation(_uvAttrib, "a_uv");
+    _instancedProgram->bindAttribLocation(_boneAttrib, "a_bone");
+    _instancedProgram->link();
+
+    _instancedMatrixUniform = _instancedProgram->getUniformLocation("u_matrix");
+    _instancedTextureUniform = _instancedProgram->getUniformLocation("u_tex0");
+    _paletteUniform = _instancedProgram->getUniformLocation("u_palette");
+    _paletteBaseUniform = _instancedProgram->getUniformLocation("u_paletteBase");
+    _paletteStrideUniform = _instancedProgram->getUniformLocation("u_paletteStride");
+
+    glGenBuffers(1, &_paletteBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, _paletteBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::vec4) * 3 * MaxBones, 0, GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    glGenTextures(1, &_paletteTexture);
+    glBindTexture(GL_TEXTURE_BUFFER, _paletteTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, _paletteBuffer);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
 }
 
-void RenderApi::SetupBones(const float m[128][4][4], int count)
+void RenderApi::SetupBones(const float m[MaxBones][4][4], int count)
 {
-    for (int i = 0; i < count && i < 32; i++)
+    if (count > MaxBones)
+    {
+        count = MaxBones;
+    }
+
+    // The studio bone transforms are row major 3x4 matrices, glm is column major
+    for (int i = 0; i < count; i++)
     {
-        copy_to_mat4(mats[i], m[i]);
+        for (int c = 0; c < 4; c++)
+        {
+            _bones[i][c] = glm::vec4(m[i][0][c], m[i][1][c], m[i][2][c], c == 3 ? 1.0f : 0.0f);
+        }
     }
+
     glBindBuffer(GL_UNIFORM_BUFFER, _bonesBuffer);
-    glBufferSubData(GL_UNIFORM_BUFFER, 0, count * sizeof(glm::mat4), glm::value_ptr(mats[0]));
-    glBindBufferRange(GL_UNIFORM_BUFFER, 0, _bonesBuffer, 0, count * sizeof(glm::mat4));
+    // Orphan the previous bones, the draws of the previous entity may still be reading them
+    glBufferData(GL_UNIFORM_BUFFER, MaxBones * sizeof(glm::mat4), 0, GL_STREAM_DRAW);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, count * sizeof(glm::mat4), glm::value_ptr(_bones[0]));
+    glBindBufferBase(GL_UNIFORM_BUFFER, 0, _bonesBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 void RenderApi::Render(const glm::mat4 &m)
 {
-    if (_vertices.empty())
+    if (_vertices.empty() || _indices.empty())
     {
+        Clear();
+
         return;
     }
 
+    auto firstVertex = _vertexStream.append(_vertices.data(), GLsizei(_vertices.size()));
+
+    if (firstVertex < 0)
+    {
+        std::cerr << "too many vertices to stream (" << _vertices.size() << ")" << std::endl;
+
+        Clear();
+
+        return;
+    }
+
+    BuildBatches();
+
     _program->use();
 
-    glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+    _vertexStream.bind();
 
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _indexBuffer);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        GLsizeiptr(_batchedIndices.size() * sizeof(unsigned int)),
+        _batchedIndices.data(),
+        GL_STREAM_DRAW);
+
+    SetupAttributes();
+
+    glUniformMatrix4fv(_matrixUniform, 1, false, glm::value_ptr(m));
+
+    glActiveTexture(GL_TEXTURE0);
+    for (auto &batch : _batches)
+    {
+        glBindTexture(GL_TEXTURE_2D, batch.textureIndex);
+
+        glDrawElementsBaseVertex(
+            GL_TRIANGLES,
+            GLsizei(batch.indexCount),
+            GL_UNSIGNED_INT,
+            reinterpret_cast<const GLvoid *>(batch.firstIndex * sizeof(unsigned int)),
+            firstVertex);
+    }
+
+    _vertexStream.fence();
+    _vertexStream.release();
+    _vertexStream.unbind();
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    Clear();
+}
+
+int RenderApi::Upload()
+{
+    BuildBatches();
+
+    Model model;
+    model.batches = _batches;
+
+    glGenVertexArrays(1, &model.vertexArray);
+    glGenBuffers(1, &model.vertexBuffer);
+    glGenBuffers(1, &model.indexBuffer);
+
+    glBindVertexArray(model.vertexArray);
+
+    glBindBuffer(GL_ARRAY_BUFFER, model.vertexBuffer);
     glBufferData(
         GL_ARRAY_BUFFER,
         GLsizeiptr(_vertices.size() * VertexSize()),
-        0,
+        _vertices.data(),
         GL_STATIC_DRAW);
 
-    glBufferSubData(
-        GL_ARRAY_BUFFER,
-        0,
-        GLsizeiptr(_vertices.size() * VertexSize()),
-        reinterpret_cast<const GLvoid *>(&_vertices[0]));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model.indexBuffer);
+    glBufferData(
+        GL_ELEMENT_ARRAY_BUFFER,
+        GLsizeiptr(_batchedIndices.size() * sizeof(unsigned int)),
+        _batchedIndices.data(),
+        GL_STATIC_DRAW);
 
-    glVertexAttribPointer(_positionAttrib, 3, GL_FLOAT, GL_FALSE, VertexSize(), (void *)0);
-    glEnableVertexAttribArray(_positionAttrib);
+    SetupAttributes();
 
-    glVertexAttribPointer(_uvAttrib, 2, GL_FLOAT, GL_FALSE, VertexSize(), (void *)(sizeof(glm::vec3)));
-    glEnableVertexAttribArray(_uvAttrib);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-    glVertexAttribPointer(_boneAttrib, 1, GL_INT, GL_FALSE, VertexSize(), (void *)(sizeof(glm::vec3) + sizeof(glm::vec2)));
-    glEnableVertexAttribArray(_boneAttrib);
+    Clear();
+
+    _models.push_back(std::move(model));
+
+    return int(_models.size() - 1);
+}
+
+void RenderApi::ClearModels()
+{
+    for (auto &model : _models)
+    {
+        glDeleteVertexArrays(1, &model.vertexArray);
+        glDeleteBuffers(1, &model.vertexBuffer);
+        glDeleteBuffers(1, &model.indexBuffer);
+    }
+
+    _models.clear();
+}
+
+void RenderApi::Render(int model, const glm::mat4 &m)
+{
+    if (model < 0 || size_t(model) >= _models.size())
+    {
+        return;
+    }
+
+    auto &uploaded = _models[model];
+
+    _program->use();
+
+    glBindVertexArray(uploaded.vertexArray);
 
     glUniformMatrix4fv(_matrixUniform, 1, false, glm::value_ptr(m));
 
+    glActiveTexture(GL_TEXTURE0);
+    for (auto &batch : uploaded.batches)
+    {
+        glBindTexture(GL_TEXTURE_2D, batch.textureIndex);
+
+        glDrawElements(
+            GL_TRIANGLES,
+            GLsizei(batch.indexCount),
+            GL_UNSIGNED_INT,
+            reinterpret_cast<const GLvoid *>(batch.firstIndex * sizeof(unsigned int)));
+    }
+
+    glBindVertexArray(0);
+}
+
+void RenderApi::QueueInstance(int model, const float bones[][4][4], int count, const glm::mat4 &transform)
+{
+    if (model < 0 || size_t(model) >= _models.size() || count <= 0)
+    {
+        return;
+    }
+
+    if (count > MaxBones)
+    {
+        count = MaxBones;
+    }
+
+    Instance instance;
+    instance.model = model;
+    instance.firstBone = _bonePalette.size() / 3;
+    instance.boneCount = count;
+
+    // Bake the instance transform into the bones, the studio bones are row major 3x4 matrices
+    for (int i = 0; i < count; i++)
+    {
+        glm::mat4 bone(1.0f);
+
+        for (int c = 0; c < 4; c++)
+        {
+            bone[c] = glm::vec4(bones[i][0][c], bones[i][1][c], bones[i][2][c], c == 3 ? 1.0f : 0.0f);
+        }
+
+        auto world = transform * bone;
+
+        for (int r = 0; r < 3; r++)
+        {
+            _bonePalette.push_back(glm::vec4(world[0][r], world[1][r], world[2][r], world[3][r]));
+        }
+    }
+
+    _instances.push_back(instance);
+}
+
+int RenderApi::RenderInstances(const glm::mat4 &m)
+{
+    PROFILE_ZONE("RenderApi::RenderInstances");
+    ALLOCATION_SCOPE("studio.instances");
+
+    if (_instances.empty())
+    {
+        return 0;
+    }
+
+    // Instances of the same model have to be next to each other in the palette, so the
+    // shader can find the bones of an instance from gl_InstanceID
+    std::stable_sort(_instances.begin(), _instances.end(), [](const Instance &a, const Instance &b) {
+        return a.model < b.model;
+    });
+
+    _instanceRuns.clear();
+    _packedPalette.clear();
+    for (size_t i = 0; i < _instances.size();)
+    {
+        InstanceRun run = {_instances[i].model, _packedPalette.size(), 0, 0};
+
+        size_t end = i;
+        while (end < _instances.size() && _instances[end].model == run.model)
+        {
+            run.stride = std::max(run.stride, _instances[end].boneCount * 3);
+            end++;
+        }
+
+        for (; i < end; i++)
+        {
+            auto &instance = _instances[i];
+            auto first = _bonePalette.begin() + instance.firstBone * 3;
+
+            _packedPalette.insert(_packedPalette.end(), first, first + instance.boneCount * 3);
+            _packedPalette.resize(run.firstRow + (run.count + 1) * run.stride);
+            run.count++;
+        }
+
+        _instanceRuns.push_back(run);
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, _paletteBuffer);
+    // Orphan the previous palette, the draws of the previous frame may still be reading it
+    glBufferData(
+        GL_TEXTURE_BUFFER,
+        GLsizeiptr(_packedPalette.size() * sizeof(glm::vec4)),
+        _packedPalette.data(),
+        GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    _instancedProgram->use();
+
+    glUniformMatrix4fv(_instancedMatrixUniform, 1, false, glm::value_ptr(m));
+    glUniform1i(_instancedTextureUniform, 0);
+    glUniform1i(_paletteUniform, 1);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, _paletteTexture);
+
+    int drawCalls = 0;
+
+    glActiveTexture(GL_TEXTURE0);
+    for (auto &run : _instanceRuns)
+    {
+        auto &uploaded = _models[run.model];
+
+        glUniform1i(_paletteBaseUniform, GLint(run.firstRow));
+        glUniform1i(_paletteStrideUniform, run.stride);
+
+        glBindVertexArray(uploaded.vertexArray);
+
+        for (auto &batch : uploaded.batches)
+        {
+            glBindTexture(GL_TEXTURE_2D, batch.textureIndex);
+
+            glDrawElementsInstanced(
+                GL_TRIANGLES,
+                GLsizei(batch.indexCount),
+                GL_UNSIGNED_INT,
+                reinterpret_cast<const GLvoid *>(batch.firstIndex * sizeof(unsigned int)),
+                GLsizei(run.count));
+
+            drawCalls++;
+        }
+    }
+
+    glBindVertexArray(0);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0);
+
+    _instances.clear();
+    _bonePalette.clear();
+
+    return drawCalls;
+}
+
+void RenderApi::BuildBatches()
+{
+    // Merge all meshes sharing a texture into one range, so there is one draw per texture
+    std::stable_sort(_meshes.begin(), _meshes.end(), [](const Mesh &a, const Mesh &b) {
+        return a.textureIndex < b.textureIndex;
+    });
+
+    _batches.clear();
+    _batchedIndices.clear();
     for (auto &mesh : _meshes)
     {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, mesh->textureIndex);
+        if (mesh.indexCount == 0)
+        {
+            continue;
+        }
 
-        for (auto &face : _faces)
+        if (_batches.empty() || _batches.back().textureIndex != mesh.textureIndex)
         {
-            if (face->fan)
-            {
-                glDrawArrays(GL_TRIANGLE_FAN, face->firstVertex, face->vertexCount);
-            }
-            else
-            {
-                glDrawArrays(GL_TRIANGLE_STRIP, face->firstVertex, face->vertexCount);
-            }
+            _batches.push_back({mesh.textureIndex, _batchedIndices.size(), 0});
         }
+
+        _batchedIndices.insert(
+            _batchedIndices.end(),
+            _indices.begin() + mesh.firstIndex,
+            _indices.begin() + mesh.firstIndex + mesh.indexCount);
+
+        _batches.back().indexCount += mesh.indexCount;
     }
+}
+
+void RenderApi::SetupAttributes()
+{
+    glVertexAttribPointer(_positionAttrib, 3, GL_FLOAT, GL_FALSE, VertexSize(), (void *)0);
+    glEnableVertexAttribArray(_positionAttrib);
+
+    glVertexAttribPointer(_uvAttrib, 2, GL_FLOAT, GL_FALSE, VertexSize(), (void *)(sizeof(glm::vec3)));
+    glEnableVertexAttribArray(_uvAttrib);
+
+    glVertexAttribIPointer(_boneAttrib, 1, GL_INT, VertexSize(), (void *)(sizeof(glm::vec3) + sizeof(glm::vec2)));
+    glEnableVertexAttribArray(_boneAttrib);
+}
 
+void RenderApi::Clear()
+{
     _vertices.clear();
+    _indices.clear();
     _meshes.clear();
-    _faces.clear();
+    _inMesh = false;
+    _inFace = false;
 }
 
 void RenderApi::Texture(unsigned int index)
 {
-    if (_currentMesh == nullptr)
+    if (!_inMesh)
     {
         return;
     }
 
-    _currentMesh->textureIndex = index;
+    _meshes.back().textureIndex = index;
 }
 
 void RenderApi::BeginMesh()
 {
-    if (_currentMesh != nullptr)
+    if (_inMesh)
     {
         return;
     }
 
-    _currentMesh = std::unique_ptr<Mesh>(new Mesh());
+    Mesh mesh;
+    mesh.firstIndex = _indices.size();
+
+    _meshes.push_back(mesh);
+    _inMesh = true;
 }
 
 void RenderApi::EndMesh()
 {
-    if (_currentMesh == nullptr)
+    if (!_inMesh)
     {
         return;
     }
 
-    _currentMesh->faceCount = _faces.size() - _currentMesh->firstFace;
-
-    _meshes.push_back(std::move(_currentMesh));
-    _currentMesh = nullptr;
+    _meshes.back().indexCount = _indices.size() - _meshes.back().firstIndex;
+    _inMesh = false;
 }
 
 void RenderApi::BeginFace(bool fan)
 {
-    if (_currentFace != nullptr)
+    if (_inFace)
     {
         return;
     }
 
-    _currentFace = std::unique_ptr<Face>(new Face());
-    _currentFace->firstVertex = _vertices.size();
-    _currentFace->fan = fan;
+    _faceFirstVertex = _vertices.size();
+    _faceIsFan = fan;
+    _inFace = true;
 }
 
 void RenderApi::EndFace()
 {
-    if (_currentFace == nullptr)
+    if (!_inFace)
     {
         return;
     }
 
-    _currentFace->vertexCount = _vertices.size() - _currentFace->firstVertex;
+    _inFace = false;
+
+    auto first = static_cast<unsigned int>(_faceFirstVertex);
+    auto count = static_cast<unsigned int>(_vertices.size() - _faceFirstVertex);
 
-    _faces.push_back(std::move(_currentFace));
-    _currentFace = nullptr;
+    // Convert the fan or strip to a triangle list, keeping the winding of the original primitive
+    for (unsigned int i = 2; i < count; i++)
+    {
+        if (_faceIsFan)
+        {
+            _indices.push_back(first);
+            _indices.push_back(first + i - 1);
+            _indices.push_back(first + i);
+        }
+        else if ((i & 1) == 0)
+        {
+            _indices.push_back(first + i - 2);
+            _indices.push_back(first + i - 1);
+            _indices.push_back(first + i);
+        }
+        else
+        {
+            _indices.push_back(first + i - 1);
+            _indices.push_back(first + i - 2);
+            _indices.push_back(first + i);
+        }
+    }
 }
 
 void RenderApi::Position(const glm::vec3 &pos)
@@ -3,6 +3,7 @@
 
 #include <glad/glad.h>
 
+#include <glbuffer.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <memory>
@@ -36,6 +37,8 @@ public:
 
     void attach(GLuint index);
 
+    void bindAttribLocation(GLuint index, const char *name);
+
     void link();
 
     GLint getAttribLocation(const char *name) const;
@@ -63,27 +66,68 @@ class RenderApi
         int bone = 0;
     };
 
-    struct Face
+    // A range of triangle indices that are all drawn with the same texture
+    struct Mesh
     {
-        size_t firstVertex;
-        size_t vertexCount;
-        bool fan = true;
+        unsigned int textureIndex = 0;
+        size_t firstIndex = 0;
+        size_t indexCount = 0;
     };
 
-    struct Mesh
+    // Geometry that was uploaded once and is drawn many times
+    struct Model
+    {
+        unsigned int vertexArray = 0;
+        unsigned int vertexBuffer = 0;
+        unsigned int indexBuffer = 0;
+        std::vector<Mesh> batches;
+    };
+
+    // An uploaded model queued for RenderInstances, its bones are already in world space
+    struct Instance
+    {
+        int model = 0;
+        size_t firstBone = 0;
+        int boneCount = 0;
+    };
+
+    // The instances of one model in the packed palette, each stride rows apart
+    struct InstanceRun
     {
-        unsigned int textureIndex;
-        size_t firstFace;
-        size_t faceCount;
+        int model = 0;
+        size_t firstRow = 0;
+        int stride = 0;
+        size_t count = 0;
     };
 
 public:
+    static const int MaxBones = 128;
+
+    ~RenderApi();
+
     void Setup();
 
-    void SetupBones(const float m[128][4][4], int count);
+    void SetupBones(const float m[MaxBones][4][4], int count);
 
+    // Draws everything recorded since the last Render or Upload, the vertices are streamed
     void Render(const glm::mat4 &m);
 
+    // Moves everything recorded since the last Render or Upload into static buffers, the
+    // returned handle can be drawn every frame with only the bones changing
+    int Upload();
+
+    void Render(int model, const glm::mat4 &m);
+
+    // Deletes the buffers of all uploaded models, their handles are invalid afterwards
+    void ClearModels();
+
+    // Queues an uploaded model with its own bones and transform, all queued instances of a
+    // model are drawn together by RenderInstances with one instanced draw per texture
+    void QueueInstance(int model, const float bones[][4][4], int count, const glm::mat4 &transform);
+
+    // Returns the number of draw calls
+    int RenderInstances(const glm::mat4 &m);
+
     void Texture(unsigned int index);
 
     void BeginMesh();
@@ -101,7 +145,7 @@ public:
     void Bone(int bone);
 
 private:
-    unsigned int _vbo;
+    StreamBufferType _vertexStream;
     std::unique_ptr<GlProgram> _program;
     int _positionAttrib;
     int _colorAttrib;
@@ -111,17 +155,48 @@ private:
     int _textureUniform;
     int _bonesBlockUniform;
     unsigned int _bonesBuffer;
+    glm::mat4 _bones[MaxBones];
 
     unsigned int VertexSize() const { return sizeof(Vertex); }
 
     glm::vec2 _nextUv;
     int _nextBone;
-    std::unique_ptr<Face> _currentFace = nullptr;
-    std::unique_ptr<Mesh> _currentMesh = nullptr;
+    bool _inMesh = false;
+    bool _inFace = false;
+    bool _faceIsFan = true;
+    size_t _faceFirstVertex = 0;
 
     std::vector<Vertex> _vertices;
-    std::vector<std::unique_ptr<Face>> _faces;
-    std::vector<std::unique_ptr<Mesh>> _meshes;
+    std::vector<unsigned int> _indices;
+    std::vector<Mesh> _meshes;
+
+    // Scratch for Render, kept around so the per frame batching does not allocate
+    std::vector<unsigned int> _batchedIndices;
+    std::vector<Mesh> _batches;
+    unsigned int _indexBuffer = 0;
+
+    std::vector<Model> _models;
+
+    // The bones of all queued instances as three rows of a 3x4 matrix each, read by the
+    // instanced program from a buffer texture
+    std::unique_ptr<GlProgram> _instancedProgram;
+    int _instancedMatrixUniform;
+    int _instancedTextureUniform;
+    int _paletteUniform;
+    int _paletteBaseUniform;
+    int _paletteStrideUniform;
+    unsigned int _paletteBuffer = 0;
+    unsigned int _paletteTexture = 0;
+    std::vector<glm::vec4> _bonePalette;
+    std::vector<glm::vec4> _packedPalette;
+    std::vector<Instance> _instances;
+    std::vector<InstanceRun> _instanceRuns;
+
+    void BuildBatches();
+
+    void SetupAttributes();
+
+    void Clear();
 };
 
 #endif // RENDERAPI_H
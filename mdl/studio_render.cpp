@@ -17,6 +17,10 @@
 
 ////////////////////////////////////////////////////////////////////////
 
+#include "../allocationtracker.h"
+#include "../profiler.h"
+#include "../workerpool.h"
+#include "bonekernels.hpp"
 #include "common/mathlib.h"
 #include "engine/studio.h"
 #include "public/steam/steamtypes.h" // defines int32, required by studio.h
@@ -29,26 +33,16 @@ float g_lambert = 1.5;
 
 ////////////////////////////////////////////////////////////////////////
 
-vec3_t g_xformverts[MAXSTUDIOVERTS];  // transformed vertices
-vec3_t g_lightvalues[MAXSTUDIOVERTS]; // light surface normals
-vec3_t *g_pxformverts;
-vec3_t *g_pvlightvalues;
-
-vec3_t g_lightvec;                  // light vector in model reference frame
-vec3_t g_blightvec[MAXSTUDIOBONES]; // light vectors in bone reference frames
-int g_ambientlight;                 // ambient world light
-float g_shadelight;                 // direct world light
-vec3_t g_lightcolor;
-vec4_t g_adj; // non persistant, make static
-
-int g_smodels_total; // cookie
-
-float g_bonetransform[MAXSTUDIOBONES][4][4]; // bone transformation matrix
+// bone positions and rotations of every blend while SetUpBones runs, one per thread so
+// entities can be set up in parallel
+struct StudioBoneScratch
+{
+    vec3_t pos[4][MAXSTUDIOBONES];
+    vec4_t q[4][MAXSTUDIOBONES];
+    float local[MAXSTUDIOBONES][3][4];
+};
 
-int g_chrome[MAXSTUDIOVERTS][2];      // texture coords for surface normals
-int g_chromeage[MAXSTUDIOBONES];      // last time chrome vectors were updated
-vec3_t g_chromeup[MAXSTUDIOBONES];    // chrome vector "up" in bone reference frames
-vec3_t g_chromeright[MAXSTUDIOBONES]; // chrome vector "right" in bone reference frames
+static thread_local StudioBoneScratch g_bonescratch;
 
 ////////////////////////////////////////////////////////////////////////
 
@@ -306,12 +300,12 @@ void StudioEntity::CalcBoneAdj()
             case STUDIO_XR:
             case STUDIO_YR:
             case STUDIO_ZR:
-                g_adj[j] = value * (Q_PI / 180.0);
+                m_adj[j] = value * (Q_PI / 180.0);
                 break;
             case STUDIO_X:
             case STUDIO_Y:
             case STUDIO_Z:
-                g_adj[j] = value;
+                m_adj[j] = value;
                 break;
         }
     }
@@ -374,8 +368,8 @@ void StudioEntity::CalcBoneQuaternion(int frame, float s, mstudiobone_t *pbone,
 
         if (pbone->bonecontroller[j + 3] != -1)
         {
-            angle1[j] += g_adj[pbone->bonecontroller[j + 3]];
-            angle2[j] += g_adj[pbone->bonecontroller[j + 3]];
+            angle1[j] += m_adj[pbone->bonecontroller[j + 3]];
+            angle2[j] += m_adj[pbone->bonecontroller[j + 3]];
         }
     }
 
@@ -438,7 +432,7 @@ void StudioEntity::CalcBonePosition(int frame, float s, mstudiobone_t *pbone, ms
         }
         if (pbone->bonecontroller[j] != -1)
         {
-            pos[j] += g_adj[pbone->bonecontroller[j]];
+            pos[j] += m_adj[pbone->bonecontroller[j]];
         }
     }
 }
@@ -471,7 +465,69 @@ void StudioEntity::CalcRotations(vec3_t *pos, vec4_t *q, mstudioseqdesc_t *pseqd
         pos[pseqdesc->motionbone][2] = 0.0;
 }
 
-mstudioanim_t *StudioEntity::GetAnim(mstudioseqdesc_t *pseqdesc)
+void StudioEntity::CalcRotations(vec3_t *pos, vec4_t *q, mstudioseqdesc_t *pseqdesc, const StudioModel::DecodedAnimation &anim, int blend, float f)
+{
+    int i, j;
+    int frame;
+    float s;
+    vec4_t q1, q2;
+    vec3_t angle1, angle2;
+
+    frame = (int)f;
+    s = (f - frame);
+
+    if (frame >= anim.numframes)
+        frame = anim.numframes - 1;
+
+    // add in programatic controllers
+    CalcBoneAdj();
+
+    auto pbone = _model->get<mstudiobone_t>(_model->m_pstudiohdr->boneindex);
+
+    auto value1 = anim.Frame(blend, frame);
+    auto value2 = anim.Frame(blend, frame + 1 < anim.numframes ? frame + 1 : frame);
+
+    for (i = 0; i < _model->m_pstudiohdr->numbones; i++, pbone++, value1 += 6, value2 += 6)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            angle1[j] = value1[j + 3];
+            angle2[j] = value2[j + 3];
+            pos[i][j] = value1[j] * (1.0 - s) + s * value2[j];
+
+            if (pbone->bonecontroller[j + 3] != -1)
+            {
+                angle1[j] += m_adj[pbone->bonecontroller[j + 3]];
+                angle2[j] += m_adj[pbone->bonecontroller[j + 3]];
+            }
+
+            if (pbone->bonecontroller[j] != -1)
+            {
+                pos[i][j] += m_adj[pbone->bonecontroller[j]];
+            }
+        }
+
+        if (!VectorCompare(angle1, angle2))
+        {
+            AngleQuaternion(angle1, q1);
+            AngleQuaternion(angle2, q2);
+            QuaternionSlerp(q1, q2, s, q[i]);
+        }
+        else
+        {
+            AngleQuaternion(angle1, q[i]);
+        }
+    }
+
+    if (pseqdesc->motiontype & STUDIO_X)
+        pos[pseqdesc->motionbone][0] = 0.0;
+    if (pseqdesc->motiontype & STUDIO_Y)
+        pos[pseqdesc->motionbone][1] = 0.0;
+    if (pseqdesc->motiontype & STUDIO_Z)
+        pos[pseqdesc->motionbone][2] = 0.0;
+}
+
+mstudioanim_t *StudioEntity::GetAnim(mstudioseqdesc_t *pseqdesc, valve::FileView &pin)
 {
     auto pseqgroup = _model->get<mstudioseqgroup_t>(_model->m_pstudiohdr->seqgroupindex) + pseqdesc->seqgroup;
 
@@ -480,33 +536,22 @@ mstudioanim_t *StudioEntity::GetAnim(mstudioseqdesc_t *pseqdesc)
         return _model->get<mstudioanim_t>(pseqgroup->unused2 /* was pseqgroup->data, will be almost always be 0 */ + pseqdesc->animindex);
     }
 
-    return (mstudioanim_t *)((byte *)_model->m_panimhdr[pseqdesc->seqgroup] + pseqdesc->animindex);
+    if (!_model->RequestSequenceGroup(pseqdesc->seqgroup, pin))
+    {
+        return nullptr;
+    }
+
+    return (mstudioanim_t *)(pin.Data() + pseqdesc->animindex);
 }
 
 void StudioEntity::SlerpBones(vec4_t q1[], vec3_t pos1[], vec4_t q2[], vec3_t pos2[], float s)
 {
-    int i;
-    vec4_t q3;
-    float s1;
-
     if (s < 0)
         s = 0;
     else if (s > 1.0)
         s = 1.0;
 
-    s1 = 1.0 - s;
-
-    for (i = 0; i < _model->m_pstudiohdr->numbones; i++)
-    {
-        QuaternionSlerp(q1[i], q2[i], s, q3);
-        q1[i][0] = q3[0];
-        q1[i][1] = q3[1];
-        q1[i][2] = q3[2];
-        q1[i][3] = q3[3];
-        pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s;
-        pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s;
-        pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s;
-    }
+    SlerpBoneArrays(q1, pos1, q2, pos2, s, _model->m_pstudiohdr->numbones);
 }
 
 void StudioEntity::AdvanceFrame(float dt)
@@ -530,45 +575,77 @@ void StudioEntity::AdvanceFrame(float dt)
 
 void StudioEntity::SetUpBones(void)
 {
-    static vec3_t pos[MAXSTUDIOBONES];
-    float bonematrix[4][4];
-    static vec4_t q[MAXSTUDIOBONES];
+    auto &pos = g_bonescratch.pos[0];
+    auto &q = g_bonescratch.q[0];
 
     if (m_sequence >= _model->m_pstudiohdr->numseq)
     {
         m_sequence = 0;
     }
 
-    auto pseqdesc = _model->get<mstudioseqdesc_t>(_model->m_pstudiohdr->seqindex) + m_sequence;
+    auto sequence = m_sequence;
+    auto frame = m_frame;
+    auto pseqdesc = _model->get<mstudioseqdesc_t>(_model->m_pstudiohdr->seqindex) + sequence;
+
+    // keeps the sequence group mapped while it is sampled
+    valve::FileView pin;
+
+    auto panim = GetAnim(pseqdesc, pin);
+
+    if (panim == nullptr)
+    {
+        // the sequence group is still loading, hold the previous pose. Until there is one
+        // show the first frame of the first sequence.
+        if (m_hasbones || sequence == 0)
+        {
+            return;
+        }
+
+        sequence = 0;
+        frame = 0;
+        pseqdesc = _model->get<mstudioseqdesc_t>(_model->m_pstudiohdr->seqindex);
+        panim = GetAnim(pseqdesc, pin);
+
+        if (panim == nullptr)
+        {
+            return;
+        }
+    }
 
-    auto panim = GetAnim(pseqdesc);
-    CalcRotations(pos, q, pseqdesc, panim, m_frame);
+    // sample the decoded tracks when the sequence fits in the cache, walking the compressed
+    // values costs time linear in the frame number
+    auto decoded = _model->GetDecodedAnimation(sequence, panim);
+
+    auto calcRotations = [&](vec3_t *pos, vec4_t *q, int blend) {
+        if (decoded != nullptr)
+            CalcRotations(pos, q, pseqdesc, *decoded, blend, frame);
+        else
+            CalcRotations(pos, q, pseqdesc, panim + blend * _model->m_pstudiohdr->numbones, frame);
+    };
+
+    calcRotations(pos, q, 0);
 
     if (pseqdesc->numblends > 1)
     {
-        static vec3_t pos2[MAXSTUDIOBONES];
-        static vec4_t q2[MAXSTUDIOBONES];
+        auto &pos2 = g_bonescratch.pos[1];
+        auto &q2 = g_bonescratch.q[1];
 
         float s;
 
-        panim += _model->m_pstudiohdr->numbones;
-        CalcRotations(pos2, q2, pseqdesc, panim, m_frame);
+        calcRotations(pos2, q2, 1);
         s = m_blending[0] / 255.0;
 
         SlerpBones(q, pos, q2, pos2, s);
 
         if (pseqdesc->numblends == 4)
         {
-            static vec3_t pos3[MAXSTUDIOBONES];
-            static vec4_t q3[MAXSTUDIOBONES];
-            static vec3_t pos4[MAXSTUDIOBONES];
-            static vec4_t q4[MAXSTUDIOBONES];
+            auto &pos3 = g_bonescratch.pos[2];
+            auto &q3 = g_bonescratch.q[2];
+            auto &pos4 = g_bonescratch.pos[3];
+            auto &q4 = g_bonescratch.q[3];
 
-            panim += _model->m_pstudiohdr->numbones;
-            CalcRotations(pos3, q3, pseqdesc, panim, m_frame);
-
-            panim += _model->m_pstudiohdr->numbones;
-            CalcRotations(pos4, q4, pseqdesc, panim, m_frame);
+            calcRotations(pos3, q3, 2);
+            calcRotations(pos4, q4, 3);
 
             s = m_blending[0] / 255.0;
             SlerpBones(q3, pos3, q4, pos4, s);
@@ -580,24 +657,22 @@ void StudioEntity::SetUpBones(void)
 
     auto pbones = _model->get<mstudiobone_t>(_model->m_pstudiohdr->boneindex);
 
-    for (int i = 0; i < _model->m_pstudiohdr->numbones; i++)
-    {
-        QuaternionMatrix(q[i], bonematrix);
+    BoneMatrixArrays(q, pos, _model->m_pstudiohdr->numbones, g_bonescratch.local);
+    ConcatBoneArrays(pbones, g_bonescratch.local, _model->m_pstudiohdr->numbones, m_bonetransform);
 
-        bonematrix[0][3] = pos[i][0];
-        bonematrix[1][3] = pos[i][1];
-        bonematrix[2][3] = pos[i][2];
-        bonematrix[3][3] = 0.0f;
+    m_hasbones = true;
+}
 
-        if (pbones[i].parent == -1)
-        {
-            memcpy(g_bonetransform[i], bonematrix, sizeof(float) * 16);
-        }
-        else
-        {
-            R_ConcatTransforms(g_bonetransform[pbones[i].parent], bonematrix, g_bonetransform[i]);
-        }
-    }
+void StudioEntity::SetUpBones(std::vector<StudioEntity *> &entities, WorkerPool &workers)
+{
+    PROFILE_ZONE("StudioEntity::SetUpBones");
+    ALLOCATION_SCOPE("studio.bones");
+
+    workers.ParallelFor(entities.size(), [&entities](size_t i) {
+        ALLOCATION_SCOPE("studio.bones");
+
+        entities[i]->SetUpBones();
+    });
 }
 
 void StudioEntity::Lighting(float *lv, int bone, int flags, vec3_t normal)
@@ -605,23 +680,23 @@ void StudioEntity::Lighting(float *lv, int bone, int flags, vec3_t normal)
     float illum;
     float lightcos;
 
-    illum = g_ambientlight;
+    illum = m_ambientlight;
 
     if (flags & STUDIO_NF_FLATSHADE)
     {
-        illum += g_shadelight * 0.8;
+        illum += m_shadelight * 0.8;
     }
     else
     {
         float r;
-        lightcos = DotProduct(normal, g_blightvec[bone]); // -1 colinear, 1 opposite
+        lightcos = DotProduct(normal, m_blightvec[bone]); // -1 colinear, 1 opposite
 
         if (lightcos > 1.0)
         {
             lightcos = 1;
         }
 
-        illum += g_shadelight;
+        illum += m_shadelight;
 
         r = g_lambert;
         if (r <= 1.0) r = 1.0;
@@ -629,7 +704,7 @@ void StudioEntity::Lighting(float *lv, int bone, int flags, vec3_t normal)
         lightcos = (lightcos + (r - 1.0)) / r; // do modified hemispherical lighting
         if (lightcos > 0.0)
         {
-            illum -= g_shadelight * lightcos;
+            illum -= m_shadelight * lightcos;
         }
         if (illum <= 0)
         {
@@ -649,7 +724,7 @@ void StudioEntity::Chrome(int *pchrome, int bone, vec3_t normal)
 {
     float n;
 
-    if (g_chromeage[bone] != g_smodels_total)
+    if (m_chromeage[bone] != m_smodels_total)
     {
         // calculate vectors from the viewer to the bone. This roughly adjusts for position
         vec3_t chromeupvec;    // g_chrome t vector in world reference frame
@@ -657,27 +732,27 @@ void StudioEntity::Chrome(int *pchrome, int bone, vec3_t normal)
         vec3_t tmp;            // vector pointing at bone in world reference frame
         vec3_t origin;
         VectorScale(origin, -1, tmp);
-        tmp[0] += g_bonetransform[bone][0][3];
-        tmp[1] += g_bonetransform[bone][1][3];
-        tmp[2] += g_bonetransform[bone][2][3];
+        tmp[0] += m_bonetransform[bone][0][3];
+        tmp[1] += m_bonetransform[bone][1][3];
+        tmp[2] += m_bonetransform[bone][2][3];
         VectorNormalize(tmp);
         CrossProduct(tmp, g_vright, chromeupvec);
         VectorNormalize(chromeupvec);
         CrossProduct(tmp, chromeupvec, chromerightvec);
         VectorNormalize(chromerightvec);
 
-        VectorIRotate(chromeupvec, g_bonetransform[bone], g_chromeup[bone]);
-        VectorIRotate(chromerightvec, g_bonetransform[bone], g_chromeright[bone]);
+        VectorIRotate(chromeupvec, m_bonetransform[bone], m_chromeup[bone]);
+        VectorIRotate(chromerightvec, m_bonetransform[bone], m_chromeright[bone]);
 
-        g_chromeage[bone] = g_smodels_total;
+        m_chromeage[bone] = m_smodels_total;
     }
 
     // calc s coord
-    n = DotProduct(normal, g_chromeright[bone]);
+    n = DotProduct(normal, m_chromeright[bone]);
     pchrome[0] = (n + 1.0) * 32; // FIX: make this a float
 
     // calc t coord
-    n = DotProduct(normal, g_chromeup[bone]);
+    n = DotProduct(normal, m_chromeup[bone]);
     pchrome[1] = (n + 1.0) * 32; // FIX: make this a float
 }
 
@@ -687,28 +762,28 @@ StudioEntity::SetupLighting
 	set some global variables based on entity position
 inputs:
 outputs:
-	g_ambientlight
-	g_shadelight
+	m_ambientlight
+	m_shadelight
 ================
 */
 void StudioEntity::SetupLighting()
 {
     int i;
-    g_ambientlight = 32;
-    g_shadelight = 192;
+    m_ambientlight = 32;
+    m_shadelight = 192;
 
-    g_lightvec[0] = 0;
-    g_lightvec[1] = 0;
-    g_lightvec[2] = -1.0;
+    m_lightvec[0] = 0;
+    m_lightvec[1] = 0;
+    m_lightvec[2] = -1.0;
 
-    g_lightcolor[0] = 1.0;
-    g_lightcolor[1] = 1.0;
-    g_lightcolor[2] = 1.0;
+    m_lightcolor[0] = 1.0;
+    m_lightcolor[1] = 1.0;
+    m_lightcolor[2] = 1.0;
 
     // TODO: only do it for bones that actually have textures
     for (i = 0; i < _model->m_pstudiohdr->numbones; i++)
     {
-        VectorIRotate(g_lightvec, g_bonetransform[i], g_blightvec[i]);
+        VectorIRotate(m_lightvec, m_bonetransform[i], m_blightvec[i]);
     }
 }
 
@@ -738,7 +813,7 @@ void StudioEntity::SetupModel(int bodypart)
     index = m_bodynum / pbodypart->base;
     index = index % pbodypart->nummodels;
 
-    _model->m_pmodel = _model->get<mstudiomodel_t>(pbodypart->modelindex) + index;
+    m_pmodel = _model->get<mstudiomodel_t>(pbodypart->modelindex) + index;
 }
 
 /*
@@ -749,14 +824,11 @@ inputs:
 	r_entorigin
 ================
 */
-void StudioEntity::DrawModel(RenderApi &renderer)
+void StudioEntity::DrawModel(RenderApi &renderer, const glm::mat4 &matrix)
 {
     int i;
 
-    g_smodels_total++; // render data cache cookie
-
-    g_pxformverts = &g_xformverts[0];
-    g_pvlightvalues = &g_lightvalues[0];
+    m_smodels_total++; // render data cache cookie
 
     if (_model->m_pstudiohdr->numbodyparts == 0)
         return;
@@ -766,125 +838,119 @@ void StudioEntity::DrawModel(RenderApi &renderer)
     for (i = 0; i < _model->m_pstudiohdr->numbodyparts; i++)
     {
         SetupModel(i);
-        DrawPoints(renderer);
+        DrawPoints(renderer, matrix);
     }
 }
 
-//#define LEGACY_CODE 1
 /*
 ================
+StudioEntity::QueueModel
+	queues every bodypart for RenderApi::RenderInstances, the bones have to be set up
+	already
+================
+*/
+void StudioEntity::QueueModel(RenderApi &renderer, const glm::mat4 &transform)
+{
+    if (_model->m_pstudiohdr->numbodyparts == 0 || !m_hasbones)
+        return;
+
+    for (int i = 0; i < _model->m_pstudiohdr->numbodyparts; i++)
+    {
+        SetupModel(i);
+        renderer.QueueInstance(GetUploadedModel(renderer), m_bonetransform, _model->m_pstudiohdr->numbones, transform);
+    }
+}
 
+/*
+================
+StudioEntity::DrawPoints
+	the bind pose of a submodel is recorded and uploaded the first time it is drawn with a
+	skin, after that only the bones are uploaded and the vertices are skinned on the GPU
 ================
 */
-void StudioEntity::DrawPoints(RenderApi &renderer)
+void StudioEntity::DrawPoints(RenderApi &renderer, const glm::mat4 &matrix)
 {
-    int i;
+    renderer.SetupBones(m_bonetransform, _model->m_pstudiohdr->numbones);
 
-    auto pvertbone = _model->get<byte>(_model->m_pmodel->vertinfoindex);
-    auto ptexture = _model->get_texture<mstudiotexture_t>(_model->m_ptexturehdr->textureindex);
+    auto model = GetUploadedModel(renderer);
 
-    auto pstudioverts = _model->get<vec3_t>(_model->m_pmodel->vertindex);
+    glCullFace(GL_FRONT);
 
-    auto pskinref = _model->get<short>(_model->m_ptexturehdr->skinindex);
+    renderer.Render(model, matrix);
+}
+
+int StudioEntity::GetUploadedModel(RenderApi &renderer)
+{
+    int skinnum = 0;
     if (m_skinnum != 0 && m_skinnum < _model->m_ptexturehdr->numskinfamilies)
-        pskinref += (m_skinnum * _model->m_ptexturehdr->numskinref);
+        skinnum = m_skinnum;
 
-    renderer.SetupBones(g_bonetransform, _model->m_pstudiohdr->numbones);
+    auto key = std::make_pair(m_pmodel, skinnum);
+    auto uploaded = _model->m_uploadedmodels.find(key);
 
-    for (i = 0; i < _model->m_pmodel->numverts; i++)
+    if (uploaded == _model->m_uploadedmodels.end())
     {
-        /*
-        VectorTransform(pstudioverts[i], g_bonetransform[pvertbone[i]], g_pxformverts[i]);
-        /*/
-        for (int w = 0; w < 3; w++)
-            g_pxformverts[i][w] = pstudioverts[i][w];
-//*/
+        uploaded = _model->m_uploadedmodels.insert(std::make_pair(key, UploadPoints(renderer, skinnum))).first;
     }
 
-    glCullFace(GL_FRONT);
+    return uploaded->second;
+}
+
+int StudioEntity::UploadPoints(RenderApi &renderer, int skinnum)
+{
+    int i;
+
+    auto pvertbone = _model->get<byte>(m_pmodel->vertinfoindex);
+    auto ptexture = _model->get_texture<mstudiotexture_t>(_model->m_ptexturehdr->textureindex);
+
+    auto pstudioverts = _model->get<vec3_t>(m_pmodel->vertindex);
 
-    for (int j = 0; j < _model->m_pmodel->nummesh; j++)
+    auto pskinref = _model->get<short>(_model->m_ptexturehdr->skinindex);
+    pskinref += (skinnum * _model->m_ptexturehdr->numskinref);
+
+    for (int j = 0; j < m_pmodel->nummesh; j++)
     {
         float s, t;
         short *ptricmds;
 
-        auto pmesh = _model->get<mstudiomesh_t>(_model->m_pmodel->meshindex) + j;
+        auto pmesh = _model->get<mstudiomesh_t>(m_pmodel->meshindex) + j;
         ptricmds = _model->get<short>(pmesh->triindex);
 
         s = 1.0 / (float)ptexture[pskinref[pmesh->skinref]].width;
         t = 1.0 / (float)ptexture[pskinref[pmesh->skinref]].height;
 
-#ifdef LEGACY_CODE
-        glBindTexture(GL_TEXTURE_2D, ptexture[pskinref[pmesh->skinref]].index);
-#else
         renderer.BeginMesh();
         renderer.Texture(ptexture[pskinref[pmesh->skinref]].index);
-#endif // LEGACY_CODE
-
-        bool useChrome = ptexture[pskinref[pmesh->skinref]].flags & STUDIO_NF_CHROME;
 
         while (i = *(ptricmds++))
         {
             if (i < 0)
             {
-#ifdef LEGACY_CODE
-                glBegin(GL_TRIANGLE_FAN);
-#else
                 renderer.BeginFace(true);
-#endif // LEGACY_CODE
                 i = -i;
             }
             else
             {
-#ifdef LEGACY_CODE
-                glBegin(GL_TRIANGLE_STRIP);
-#else
                 renderer.BeginFace(false);
-#endif // LEGACY_CODE
             }
 
             for (; i > 0; i--, ptricmds += 4)
             {
-                renderer.Bone(pvertbone[ptricmds[1]]);
-                if (useChrome)
-                {
-                    // FIX: put these in as integer coords, not floats
-#ifdef LEGACY_CODE
-                    glTexCoord2f(g_chrome[ptricmds[1]][0] * s, g_chrome[ptricmds[1]][1] * t);
-#else
-                    renderer.Uv(glm::vec2(g_chrome[ptricmds[1]][0] * s, g_chrome[ptricmds[1]][1] * t));
-#endif // LEGACY_CODE
-                }
-                else
-                {
-                    // FIX: put these in as integer coords, not floats
-#ifdef LEGACY_CODE
-                    glTexCoord2f(ptricmds[2] * s, ptricmds[3] * t);
-#else
-                    renderer.Uv(glm::vec2(ptricmds[2] * s, ptricmds[3] * t));
-#endif // LEGACY_CODE
-                }
+                // the vertices stay in the space of their bone, the vertex shader transforms them
+                renderer.Bone(pvertbone[ptricmds[0]]);
 
-#ifdef LEGACY_CODE
-                glColor4f(1.0, 1.0, 1.0, 1.0);
-#else
-#endif // LEGACY_CODE
+                // FIX: put these in as integer coords, not floats
+                renderer.Uv(glm::vec2(ptricmds[2] * s, ptricmds[3] * t));
 
-                auto av = g_pxformverts[ptricmds[0]];
-#ifdef LEGACY_CODE
-                glVertex3f(av[0], av[1], av[2]);
-#else
+                auto av = pstudioverts[ptricmds[0]];
                 renderer.Position(glm::vec3(av[0], av[1], av[2]));
-#endif // LEGACY_CODE
             }
-#ifdef LEGACY_CODE
-            glEnd();
-#else
+
             renderer.EndFace();
-#endif // LEGACY_CODE
         }
-#ifndef LEGACY_CODE
+
         renderer.EndMesh();
-#endif // LEGACY_CODE
     }
+
+    return renderer.Upload();
 }
@@ -15,178 +15,577 @@
 
 #include <glad/glad.h>
 
+#include "../allocationtracker.h"
+#include "../profiler.h"
+#include "../workerpool.h"
 #include "common/mathlib.h"
 #include "engine/studio.h"
 #include "public/steam/steamtypes.h" // defines int32, required by studio.h
 #include "studiomodel.h"
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <spdlog/spdlog.h>
 #include <stdio.h>
+#include <thread>
 
 #pragma warning(disable : 4244) // double to float
 
 ////////////////////////////////////////////////////////////////////////
 
-void StudioModel::UploadTexture(mstudiotexture_t *ptexture, byte *data, byte *pal)
+StudioTextureSet::StudioTextureSet(WorkerPool *workers)
+    : _workers(workers)
+{}
+
+unsigned int StudioTextureSet::Find(uint64_t hash) const
+{
+    auto found = _textures.find(hash);
+
+    return found != _textures.end() ? found->second : 0;
+}
+
+void StudioTextureSet::Add(uint64_t hash, unsigned int texture)
+{
+    _textures[hash] = texture;
+}
+
+void StudioTextureSet::Clear()
+{
+    for (auto &texture : _textures)
+    {
+        glDeleteTextures(1, &texture.second);
+    }
+
+    _textures.clear();
+}
+
+WorkerPool *StudioTextureSet::Workers() const
 {
-    // unsigned *in, int inwidth, int inheight, unsigned *out,  int outwidth, int outheight;
-    int outwidth, outheight;
-    int i, j;
-    int row1[256], row2[256], col1[256], col2[256];
-    byte *pix1, *pix2, *pix3, *pix4;
-    byte *tex, *out;
+    return _workers;
+}
 
-    // convert texture to power of 2
-    for (outwidth = 1; outwidth < ptexture->width; outwidth <<= 1)
-        ;
+static uint64_t HashTexture(const mstudiotexture_t *ptexture, const byte *data, const byte *pal)
+{
+    // FNV-1a over the size, the flags, the indices and the palette
+    uint64_t hash = 14695981039346656037ULL;
 
-    if (outwidth > 256)
-        outwidth = 256;
+    auto add = [&hash](const byte *bytes, size_t count) {
+        for (size_t i = 0; i < count; i++)
+        {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
 
-    for (outheight = 1; outheight < ptexture->height; outheight <<= 1)
-        ;
+    add((const byte *)&ptexture->width, sizeof(ptexture->width));
+    add((const byte *)&ptexture->height, sizeof(ptexture->height));
+    add((const byte *)&ptexture->flags, sizeof(ptexture->flags));
+    add(data, size_t(ptexture->width) * size_t(ptexture->height));
+    add(pal, 256 * 3);
 
-    if (outheight > 256)
-        outheight = 256;
+    return hash;
+}
 
-    tex = out = (byte *)malloc(outwidth * outheight * 4);
+unsigned int StudioModel::UploadTexture(const std::vector<valve::MipLevel> &levels)
+{
+    unsigned int texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
 
-    for (i = 0; i < outwidth; i++)
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (size_t level = 0; level < levels.size(); level++)
     {
-        col1[i] = (i + 0.25) * (ptexture->width / (float)outwidth);
-        col2[i] = (i + 0.75) * (ptexture->width / (float)outwidth);
+        glTexImage2D(GL_TEXTURE_2D, GLint(level), GL_RGBA8, levels[level].width, levels[level].height, 0, GL_RGBA, GL_UNSIGNED_BYTE, levels[level].data.data());
     }
 
-    for (i = 0; i < outheight; i++)
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(levels.size()) - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return texture;
+}
+
+void StudioModel::UploadTextures(byte *pin, mstudiotexture_t *ptexture, int count)
+{
+    PROFILE_ZONE("StudioModel::UploadTextures");
+    ALLOCATION_SCOPE("studio.textures");
+
+    std::vector<uint64_t> hashes(count);
+    std::vector<int> conversions;
+    std::map<uint64_t, int> converting;
+
+    for (int i = 0; i < count; i++)
     {
-        row1[i] = (int)((i + 0.25) * (ptexture->height / (float)outheight)) * ptexture->width;
-        row2[i] = (int)((i + 0.75) * (ptexture->height / (float)outheight)) * ptexture->width;
+        auto data = pin + ptexture[i].index;
+        auto pal = data + ptexture[i].width * ptexture[i].height;
+
+        hashes[i] = HashTexture(&ptexture[i], data, pal);
+
+        if (m_textures->Find(hashes[i]) != 0 || converting.count(hashes[i]) != 0)
+        {
+            continue;
+        }
+
+        converting.insert(std::make_pair(hashes[i], i));
+        conversions.push_back(i);
     }
 
-    // scale down and convert to 32bit RGB
-    for (i = 0; i < outheight; i++)
+    // expand the palettes and build the mip chains of the new textures on the workers
+    std::vector<std::vector<valve::MipLevel>> levels(conversions.size());
+
+    auto convert = [&](size_t c) {
+        ALLOCATION_SCOPE("studio.textures");
+
+        auto &texture = ptexture[conversions[c]];
+        auto data = pin + texture.index;
+        auto pal = data + texture.width * texture.height;
+
+        // masked textures are transparent where they use the last palette entry
+        auto alpha = (texture.flags & STUDIO_NF_MASKED) ? valve::PaletteAlpha::LastIsTransparent : valve::PaletteAlpha::Opaque;
+
+        std::vector<byte> rgba(size_t(texture.width) * size_t(texture.height) * 4);
+        valve::ExpandPalette(data, texture.width * texture.height, pal, alpha, rgba.data());
+
+        valve::BuildMipChain(rgba.data(), texture.width, texture.height, levels[c]);
+    };
+
+    if (m_textures->Workers() != nullptr)
+    {
+        m_textures->Workers()->ParallelFor(conversions.size(), convert);
+    }
+    else
     {
-        for (j = 0; j < outwidth; j++, out += 4)
+        for (size_t c = 0; c < conversions.size(); c++)
         {
-            pix1 = &pal[data[row1[i] + col1[j]] * 3];
-            pix2 = &pal[data[row1[i] + col2[j]] * 3];
-            pix3 = &pal[data[row2[i] + col1[j]] * 3];
-            pix4 = &pal[data[row2[i] + col2[j]] * 3];
-
-            out[0] = (pix1[0] + pix2[0] + pix3[0] + pix4[0]) >> 2;
-            out[1] = (pix1[1] + pix2[1] + pix3[1] + pix4[1]) >> 2;
-            out[2] = (pix1[2] + pix2[2] + pix3[2] + pix4[2]) >> 2;
-            out[3] = 0xFF;
+            convert(c);
         }
     }
 
-    unsigned int texture = 0;
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, 3 /*??*/, outwidth, outheight, 0, GL_RGBA, GL_UNSIGNED_BYTE, tex);
-    //glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-    // ptexture->width = outwidth;
-    // ptexture->height = outheight;
-    ptexture->index = texture;
+    // GL calls have to stay on this thread
+    for (size_t c = 0; c < conversions.size(); c++)
+    {
+        m_textures->Add(hashes[conversions[c]], UploadTexture(levels[c]));
+    }
 
-    free(tex);
+    for (int i = 0; i < count; i++)
+    {
+        ptexture[i].index = m_textures->Find(hashes[i]);
+    }
 }
 
-studiohdr_t *StudioModel::LoadModel(const char *modelname)
+// Runs the sequence group loads one after the other on a single background thread, started on
+// first use
+class StudioLoaderThread
 {
-    FILE *fp = nullptr;
-    long size;
-    void *buffer;
-
-    // load the model
-    if (fopen_s(&fp, modelname, "rb") != 0)
+public:
+    ~StudioLoaderThread()
     {
-        printf("unable to open %s\n", modelname);
-        exit(1);
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _stop = true;
+        }
+
+        _wake.notify_one();
+
+        if (_thread.joinable())
+        {
+            _thread.join();
+        }
     }
 
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    buffer = malloc(size);
-    fread(buffer, size, 1, fp);
+    void Post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_lock);
 
-    byte *pin;
-    studiohdr_t *phdr;
-    mstudiotexture_t *ptexture;
+            if (!_thread.joinable())
+            {
+                _thread = std::thread(&StudioLoaderThread::Run, this);
+            }
 
-    pin = (byte *)buffer;
-    phdr = (studiohdr_t *)pin;
+            _jobs.push_back(std::move(job));
+        }
+
+        _wake.notify_one();
+    }
 
-    ptexture = (mstudiotexture_t *)(pin + phdr->textureindex);
-    if (phdr->textureindex != 0)
+private:
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::deque<std::function<void()>> _jobs;
+    std::thread _thread;
+    bool _stop = false;
+
+    void Run()
     {
-        for (int i = 0; i < phdr->numtextures; i++)
+        PROFILE_THREAD("studio loader");
+
+        while (true)
         {
-            UploadTexture(&ptexture[i], pin + ptexture[i].index, pin + ptexture[i].width * ptexture[i].height + ptexture[i].index);
+            std::function<void()> job;
+
+            {
+                std::unique_lock<std::mutex> lock(_lock);
+
+                _wake.wait(lock, [this]() { return _stop || !_jobs.empty(); });
+
+                if (_stop && _jobs.empty())
+                {
+                    return;
+                }
+
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+            }
+
+            job();
         }
     }
+};
+
+static StudioLoaderThread g_loaderthread;
+
+StudioModel::~StudioModel()
+{
+    // queued loads still point at this model
+    WaitForSequenceGroups();
+}
+
+void StudioModel::WaitForSequenceGroups()
+{
+    std::unique_lock<std::mutex> lock(m_seqgrouplock);
+
+    m_seqgroupsdone.wait(lock, [this]() { return m_seqgroupsloading == 0; });
+}
+
+bool StudioModel::MapModelFile(valve::IFileSystem *fs, const std::string &filename, valve::FileView &view)
+{
+    auto location = fs->LocateFile(filename);
+
+    if (location.empty())
+    {
+        spdlog::error("Unable to find {}", filename);
+
+        return false;
+    }
 
-    // UNDONE: free texture memory
+    auto fullpath = std::filesystem::path(location) / filename;
 
-    fclose(fp);
+    if (!fs->MapFile(fullpath.string(), view))
+    {
+        return false;
+    }
 
-    return (studiohdr_t *)buffer;
+    // the sequence group header is the smaller one, every studio file starts with it
+    if (view.Size() < sizeof(studioseqhdr_t) || ((studioseqhdr_t *)view.Data())->length > int(view.Size()))
+    {
+        spdlog::error("{} is not a valid studio model", filename);
+
+        view = valve::FileView();
+
+        return false;
+    }
+
+    return true;
 }
 
-studioseqhdr_t *StudioModel::LoadDemandSequences(const char *modelname)
+studiohdr_t *StudioModel::LoadModel(valve::IFileSystem *fs, const std::string &filename)
 {
-    FILE *fp = nullptr;
-    long size;
-    void *buffer;
+    valve::FileView view;
 
-    // load the model
-    if (fopen_s(&fp, modelname, "rb") != 0)
+    if (!MapModelFile(fs, filename, view) || view.Size() < sizeof(studiohdr_t))
     {
-        printf("unable to open %s\n", modelname);
-        exit(1);
+        return nullptr;
     }
 
-    fseek(fp, 0, SEEK_END);
-    size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    buffer = malloc(size);
-    fread(buffer, size, 1, fp);
+    m_files.push_back(view);
+
+    auto pin = view.Data();
+    auto phdr = (studiohdr_t *)pin;
 
-    fclose(fp);
+    if (m_textures != nullptr && phdr->textureindex != 0)
+    {
+        UploadTextures(pin, (mstudiotexture_t *)(pin + phdr->textureindex), phdr->numtextures);
+    }
 
-    return (studioseqhdr_t *)buffer;
+    return phdr;
 }
 
-void StudioModel::Init(const char *modelname)
+bool StudioModel::Init(valve::IFileSystem *fs, const std::string &modelname, StudioTextureSet *textures)
 {
-    m_ptexturehdr = m_pstudiohdr = LoadModel(modelname);
+    m_textures = textures;
+    m_ptexturehdr = m_pstudiohdr = LoadModel(fs, modelname);
+
+    if (m_pstudiohdr == nullptr)
+    {
+        return false;
+    }
+
+    m_fs = fs;
+    m_basename = modelname.substr(0, modelname.size() - 4);
 
     // preload textures
     if (m_pstudiohdr->numtextures == 0)
     {
-        char texturename[256];
+        m_ptexturehdr = LoadModel(fs, m_basename + "T.mdl");
+
+        if (m_ptexturehdr == nullptr)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void StudioModel::SetSequenceGroupBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_seqgrouplock);
+
+    m_seqgroupbudget = bytes;
+
+    EvictSequenceGroups(-1);
+}
+
+bool StudioModel::RequestSequenceGroup(int group, valve::FileView &view)
+{
+    if (group <= 0 || group >= m_pstudiohdr->numseqgroups || group >= 32)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_seqgrouplock);
+
+    auto &seqgroup = m_seqgroups[group];
+
+    seqgroup.lastused = ++m_seqgroupclock;
+
+    if (!seqgroup.view.Empty())
+    {
+        view = seqgroup.view;
+
+        return true;
+    }
+
+    if (!seqgroup.loading && !seqgroup.failed && m_fs != nullptr)
+    {
+        seqgroup.loading = true;
+        m_seqgroupsloading++;
+
+        g_loaderthread.Post([this, group]() { LoadSequenceGroup(group); });
+    }
+
+    return false;
+}
+
+void StudioModel::LoadSequenceGroup(int group)
+{
+    PROFILE_ZONE("StudioModel::LoadSequenceGroup");
+    ALLOCATION_SCOPE("studio.sequences");
+
+    char seqgroupname[8];
+
+    snprintf(seqgroupname, sizeof(seqgroupname), "%02d.mdl", group);
+
+    valve::FileView view;
+
+    auto loaded = MapModelFile(m_fs, m_basename + seqgroupname, view);
+
+    {
+        std::lock_guard<std::mutex> lock(m_seqgrouplock);
+
+        auto &seqgroup = m_seqgroups[group];
+
+        seqgroup.loading = false;
+        seqgroup.failed = !loaded;
+
+        if (loaded)
+        {
+            seqgroup.view = view;
+            m_seqgroupsize += view.Size();
+
+            EvictSequenceGroups(group);
+        }
+
+        m_seqgroupsloading--;
+    }
+
+    m_seqgroupsdone.notify_all();
+}
+
+void StudioModel::EvictSequenceGroups(int keep)
+{
+    while (m_seqgroupsize > m_seqgroupbudget)
+    {
+        SequenceGroup *oldest = nullptr;
+
+        for (int i = 1; i < 32; i++)
+        {
+            auto &seqgroup = m_seqgroups[i];
+
+            if (i == keep || seqgroup.view.Empty())
+            {
+                continue;
+            }
+
+            if (oldest == nullptr || seqgroup.lastused < oldest->lastused)
+            {
+                oldest = &seqgroup;
+            }
+        }
+
+        if (oldest == nullptr)
+        {
+            break;
+        }
+
+        // entities that are sampling it still hold their own view, the mapping goes away
+        // when they are done
+        m_seqgroupsize -= oldest->view.Size();
+        oldest->view = valve::FileView();
+    }
+}
+
+StudioModelCache::StudioModelCache(valve::IFileSystem *fs, WorkerPool *workers)
+    : _fs(fs), _textures(workers)
+{}
+
+StudioModel *StudioModelCache::Get(const std::string &filename)
+{
+    auto key = std::filesystem::path(filename).lexically_normal().generic_string();
+
+    auto found = _models.find(key);
+
+    if (found != _models.end())
+    {
+        return found->second.get();
+    }
+
+    auto model = std::make_unique<StudioModel>();
+
+    if (!model->Init(_fs, key, &_textures))
+    {
+        // remember the failure so every entity using this model does not retry it
+        model = nullptr;
+    }
+
+    return (_models[key] = std::move(model)).get();
+}
+
+void StudioModelCache::Clear()
+{
+    _models.clear();
+    _textures.Clear();
+}
+
+void StudioModel::SetAnimationCacheBudget(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_animcachelock);
+
+    m_animcachebudget = bytes;
 
-        strcpy_s(texturename, 256, modelname);
-        texturename[strlen(texturename) - 4] = '\0';
-        strcat_s(texturename, 256, "T.mdl");
+    EvictDecodedAnimations(0);
+}
+
+void StudioModel::EvictDecodedAnimations(size_t needed)
+{
+    while (!m_decodedanims.empty() && m_animcachesize + needed > m_animcachebudget)
+    {
+        auto oldest = m_decodedanims.begin();
+        for (auto itr = m_decodedanims.begin(); itr != m_decodedanims.end(); ++itr)
+        {
+            if (itr->second->lastused < oldest->second->lastused)
+                oldest = itr;
+        }
 
-        m_ptexturehdr = LoadModel(texturename);
+        m_animcachesize -= oldest->second->Size();
+        m_decodedanims.erase(oldest);
     }
+}
+
+// walks the run length encoded values of one channel once, writing every frame
+static void DecodeAnimValues(mstudioanimvalue_t *panimvalue, int numframes, float value, float scale, float *out, size_t stride)
+{
+    int frame = 0;
+    float last = value;
 
-    // preload animations
-    if (m_pstudiohdr->numseqgroups > 1)
+    while (frame < numframes && panimvalue->num.total > 0)
     {
-        for (int i = 1; i < m_pstudiohdr->numseqgroups; i++)
+        int valid = panimvalue->num.valid;
+        int total = panimvalue->num.total;
+
+        for (int k = 0; k < total && frame < numframes; k++, frame++)
         {
-            char seqgroupname[256];
+            // past the valid values the last one repeats
+            last = value + panimvalue[(k < valid ? k : valid - 1) + 1].value * scale;
+            out[frame * stride] = last;
+        }
+
+        panimvalue += valid + 1;
+    }
+
+    for (; frame < numframes; frame++)
+    {
+        out[frame * stride] = last;
+    }
+}
+
+std::shared_ptr<const StudioModel::DecodedAnimation> StudioModel::GetDecodedAnimation(int sequence, mstudioanim_t *panim)
+{
+    std::lock_guard<std::mutex> lock(m_animcachelock);
 
-            strcpy_s(seqgroupname, 256, modelname);
-            seqgroupname[strlen(seqgroupname) - 4] = '\0';
-            sprintf_s(seqgroupname, 256, "%s%02d.mdl", seqgroupname, i);
+    auto found = m_decodedanims.find(sequence);
+    if (found != m_decodedanims.end())
+    {
+        found->second->lastused = ++m_animcacheclock;
+
+        return found->second;
+    }
+
+    auto pseqdesc = get<mstudioseqdesc_t>(m_pstudiohdr->seqindex) + sequence;
+    auto pbone = get<mstudiobone_t>(m_pstudiohdr->boneindex);
+    int numbones = m_pstudiohdr->numbones;
+    int numframes = pseqdesc->numframes > 0 ? pseqdesc->numframes : 1;
+    size_t size = size_t(pseqdesc->numblends) * numframes * numbones * 6 * sizeof(float);
+
+    if (size > m_animcachebudget)
+    {
+        return nullptr;
+    }
 
-            m_panimhdr[i] = LoadDemandSequences(seqgroupname);
+    EvictDecodedAnimations(size);
+
+    auto anim = std::make_shared<DecodedAnimation>();
+    anim->numframes = numframes;
+    anim->numbones = numbones;
+    anim->values.resize(size / sizeof(float));
+
+    size_t stride = size_t(numbones) * 6;
+    for (int blend = 0; blend < pseqdesc->numblends; blend++)
+    {
+        for (int i = 0; i < numbones; i++, panim++)
+        {
+            float *out = anim->values.data() + (size_t(blend) * numframes * numbones + i) * 6;
+
+            for (int j = 0; j < 6; j++)
+            {
+                if (panim->offset[j] == 0)
+                {
+                    for (int frame = 0; frame < numframes; frame++)
+                        out[frame * stride + j] = pbone[i].value[j];
+                }
+                else
+                {
+                    auto panimvalue = (mstudioanimvalue_t *)((byte *)panim + panim->offset[j]);
+                    DecodeAnimValues(panimvalue, numframes, pbone[i].value[j], pbone[i].scale[j], out + j, stride);
+                }
+            }
         }
     }
+
+    anim->lastused = ++m_animcacheclock;
+    m_animcachesize += anim->Size();
+    m_decodedanims[sequence] = anim;
+
+    return anim;
 }
@@ -11,30 +11,144 @@
 #ifndef STUDIOMODEL_H
 #define STUDIOMODEL_H
 
+#include "../hltexture.h"
+#include "../hltypes.h"
 #include "engine/studio.h"
 #include "renderapi.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <glm/glm.hpp>
 
+class WorkerPool;
+
+// GL names of the uploaded studio textures by content hash, so identical skins of different
+// models share one texture. Clear deletes them, it needs the context they were uploaded in.
+class StudioTextureSet
+{
+public:
+    // The palettes of new textures are expanded on the workers, without them on this thread
+    explicit StudioTextureSet(WorkerPool *workers = nullptr);
+
+    // 0 when no texture with the hash is uploaded
+    unsigned int Find(uint64_t hash) const;
+
+    void Add(uint64_t hash, unsigned int texture);
+
+    void Clear();
+
+    WorkerPool *Workers() const;
+
+private:
+    WorkerPool *_workers;
+    std::map<uint64_t, unsigned int> _textures;
+};
+
 class StudioModel
 {
 public:
-    void Init(const char *modelname);
+    // Decompressed animation values of one sequence, stored per blend and frame as
+    // [bone][X, Y, Z, XR, YR, ZR] with the bone defaults and scales already applied
+    struct DecodedAnimation
+    {
+        int numframes = 0;
+        int numbones = 0;
+        std::vector<float> values;
+        size_t lastused = 0;
+
+        const float *Frame(int blend, int frame) const
+        {
+            return values.data() + (size_t(blend) * numframes + frame) * numbones * 6;
+        }
+
+        size_t Size() const
+        {
+            return values.size() * sizeof(float);
+        }
+    };
+
+    ~StudioModel();
+
+    // Maps the model and its T.mdl textures through the file system, modelname is relative to
+    // the mod directory. The NN.mdl sequence groups are loaded when a sequence first needs them.
+    // The textures are uploaded to the set, without one no GL calls are made, for animating the
+    // model without a context.
+    bool Init(valve::IFileSystem *fs, const std::string &modelname, StudioTextureSet *textures);
+
+    // Loaded sequence groups are evicted, least recently used first, when they exceed the budget
+    void SetSequenceGroupBudget(size_t bytes);
+
+    // Returns true with a view of the sequence group when it is loaded. Otherwise it queues the
+    // group on the loader thread and returns false, the caller should try again later.
+    bool RequestSequenceGroup(int group, valve::FileView &view);
+
+    // Blocks until the sequence groups queued on the loader thread are loaded or have failed
+    void WaitForSequenceGroups();
+
+    // Decoded sequences are kept until they would exceed the budget, the least recently used
+    // are evicted first. A budget of 0 disables decoding.
+    void SetAnimationCacheBudget(size_t bytes);
+
+    std::shared_ptr<const DecodedAnimation> GetDecodedAnimation(int sequence, mstudioanim_t *panim);
 
 private:
     // internal data
-    studiohdr_t *m_pstudiohdr;
-    mstudiomodel_t *m_pmodel;
+    studiohdr_t *m_pstudiohdr = nullptr;
 
-    studiohdr_t *m_ptexturehdr;
-    studioseqhdr_t *m_panimhdr[32];
+    studiohdr_t *m_ptexturehdr = nullptr;
 
-    studiohdr_t *LoadModel(const char *modelname);
-    studioseqhdr_t *LoadDemandSequences(const char *modelname);
+    // mapped views the headers above point into
+    std::vector<valve::FileView> m_files;
+    StudioTextureSet *m_textures = nullptr;
 
-    void UploadTexture(mstudiotexture_t *ptexture, byte *data, byte *pal);
+    struct SequenceGroup
+    {
+        valve::FileView view;
+        bool loading = false;
+        bool failed = false;
+        size_t lastused = 0;
+    };
+
+    // sequence groups are requested from the threads that set up bones and filled in by the
+    // loader thread
+    valve::IFileSystem *m_fs = nullptr;
+    std::string m_basename;
+    std::mutex m_seqgrouplock;
+    std::condition_variable m_seqgroupsdone;
+    SequenceGroup m_seqgroups[32];
+    int m_seqgroupsloading = 0;
+    size_t m_seqgroupbudget = 16 * 1024 * 1024;
+    size_t m_seqgroupsize = 0;
+    size_t m_seqgroupclock = 0;
+
+    void LoadSequenceGroup(int group);
+    void EvictSequenceGroups(int keep);
+
+    // RenderApi handles of the submodels that were uploaded, per skin family
+    std::map<std::pair<mstudiomodel_t *, int>, int> m_uploadedmodels;
+
+    // entities sample the decoded animations from the threads that set up their bones
+    std::mutex m_animcachelock;
+    std::map<int, std::shared_ptr<DecodedAnimation>> m_decodedanims;
+    size_t m_animcachebudget = 32 * 1024 * 1024;
+    size_t m_animcachesize = 0;
+    size_t m_animcacheclock = 0;
+
+    void EvictDecodedAnimations(size_t needed);
+
+    bool MapModelFile(valve::IFileSystem *fs, const std::string &filename, valve::FileView &view);
+    studiohdr_t *LoadModel(valve::IFileSystem *fs, const std::string &filename);
+
+    // Uploads the textures of a model or T.mdl file at their own resolution with a full mip
+    // chain, and replaces their data offset with the GL name
+    void UploadTextures(byte *pin, mstudiotexture_t *ptexture, int count);
+    static unsigned int UploadTexture(const std::vector<valve::MipLevel> &levels);
 
     template <typename T>
     T *get(int index)
@@ -56,12 +170,34 @@ private:
     friend class StudioEntity;
 };
 
+// One StudioModel per file, shared by every entity that uses it
+class StudioModelCache
+{
+public:
+    StudioModelCache(valve::IFileSystem *fs, WorkerPool *workers = nullptr);
+
+    // Loads the model on first use, returns nullptr when it failed to load
+    StudioModel *Get(const std::string &filename);
+
+    // Unloads the models and deletes their textures
+    void Clear();
+
+private:
+    valve::IFileSystem *_fs;
+    std::map<std::string, std::unique_ptr<StudioModel>> _models;
+    StudioTextureSet _textures;
+};
+
 class StudioEntity
 {
 public:
     StudioEntity(StudioModel *model);
 
-    void DrawModel(RenderApi &renderer);
+    void DrawModel(RenderApi &renderer, const glm::mat4 &matrix);
+
+    // Queues the bodyparts as instances with the bones of the last SetUpBones, so all entities
+    // sharing a model are drawn together
+    void QueueModel(RenderApi &renderer, const glm::mat4 &transform);
     void AdvanceFrame(float dt);
 
     void ExtractBbox(float *mins, float *maxs);
@@ -76,6 +212,12 @@ public:
     int SetBodygroup(int iGroup, int iValue);
     int SetSkin(int iValue);
 
+    // Evaluates the bone transforms of the current frame, only touches the state of this entity
+    void SetUpBones(void);
+
+    // Sets up the bones of all entities on the threads of the pool
+    static void SetUpBones(std::vector<StudioEntity *> &entities, WorkerPool &workers);
+
 private:
     int m_sequence = 0;                  // sequence index
     float m_frame = 0;                   // frame
@@ -84,18 +226,36 @@ private:
     byte m_controller[4] = {0, 0, 0, 0}; // bone controllers
     byte m_blending[2] = {0, 0};         // animation blending
     byte m_mouth = 0;                    // mouth position
+    bool m_hasbones = false;             // m_bonetransform holds a pose
 
     StudioModel *_model = nullptr;
+    mstudiomodel_t *m_pmodel = nullptr; // submodel of the bodypart being drawn
+
+    float m_bonetransform[MAXSTUDIOBONES][4][4]; // bone transformation matrix
+    vec4_t m_adj;                                // bone controller adjustments
+
+    vec3_t m_lightvec;                  // light vector in model reference frame
+    vec3_t m_blightvec[MAXSTUDIOBONES]; // light vectors in bone reference frames
+    int m_ambientlight;                 // ambient world light
+    float m_shadelight;                 // direct world light
+    vec3_t m_lightcolor;
+
+    int m_smodels_total = 0;               // cookie
+    int m_chromeage[MAXSTUDIOBONES] = {0}; // last time chrome vectors were updated
+    vec3_t m_chromeup[MAXSTUDIOBONES];     // chrome vector "up" in bone reference frames
+    vec3_t m_chromeright[MAXSTUDIOBONES];  // chrome vector "right" in bone reference frames
 
     void CalcBoneAdj(void);
     void CalcBoneQuaternion(int frame, float s, mstudiobone_t *pbone, mstudioanim_t *panim, float *q);
     void CalcBonePosition(int frame, float s, mstudiobone_t *pbone, mstudioanim_t *panim, float *pos);
     void CalcRotations(vec3_t *pos, vec4_t *q, mstudioseqdesc_t *pseqdesc, mstudioanim_t *panim, float f);
-    mstudioanim_t *GetAnim(mstudioseqdesc_t *pseqdesc);
+    void CalcRotations(vec3_t *pos, vec4_t *q, mstudioseqdesc_t *pseqdesc, const StudioModel::DecodedAnimation &anim, int blend, float f);
+    mstudioanim_t *GetAnim(mstudioseqdesc_t *pseqdesc, valve::FileView &pin);
     void SlerpBones(vec4_t q1[], vec3_t pos1[], vec4_t q2[], vec3_t pos2[], float s);
-    void SetUpBones(void);
 
-    void DrawPoints(RenderApi &renderer);
+    void DrawPoints(RenderApi &renderer, const glm::mat4 &matrix);
+    int GetUploadedModel(RenderApi &renderer);
+    int UploadPoints(RenderApi &renderer, int skinnum);
 
     void Lighting(float *lv, int bone, int flags, vec3_t normal);
     void Chrome(int *chrome, int bone, vec3_t normal);
@@ -0,0 +1,325 @@
+#ifdef GENMAP_PROFILER
+
+#include "profiler.h"
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <spdlog/spdlog.h>
+#include <vector>
+
+namespace
+{
+    class Event
+    {
+    public:
+        const char *name;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // Only its own thread writes to a ring, count is published after the event so the trace can
+    // be written while other threads are still recording
+    class ThreadRing
+    {
+    public:
+        uint32_t id = 0;
+        std::string name;
+        bool inUse = false;
+        std::vector<Event> events;
+        std::atomic<size_t> count{0};
+
+        void Push(
+            const char *name,
+            uint64_t start,
+            uint64_t end)
+        {
+            auto index = count.load(std::memory_order_relaxed);
+
+            events[index % Profiler::RingSize] = Event{name, start, end};
+
+            count.store(index + 1, std::memory_order_release);
+        }
+    };
+
+    class GpuZone
+    {
+    public:
+        const char *name;
+        GLuint begin;
+        GLuint end;
+    };
+
+    class ProfilerState
+    {
+    public:
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+        // Rings are never freed, the ring of a thread that exits is reused by the next thread so
+        // the short lived worker threads don't add a ring every frame
+        std::mutex ringsLock;
+        std::vector<std::unique_ptr<ThreadRing>> rings;
+
+        // Only touched on the GL thread
+        ThreadRing gpuRing;
+        std::vector<GLuint> freeQueries;
+        std::deque<GpuZone> pendingZones;
+    };
+
+    // Intentionally leaked, threads that exit during static destruction still release their ring
+    ProfilerState &State()
+    {
+        static ProfilerState *state = new ProfilerState();
+
+        return *state;
+    }
+
+    ThreadRing *AcquireRing()
+    {
+        auto &state = State();
+
+        std::lock_guard<std::mutex> lock(state.ringsLock);
+
+        for (auto &ring : state.rings)
+        {
+            if (!ring->inUse)
+            {
+                ring->inUse = true;
+
+                return ring.get();
+            }
+        }
+
+        auto ring = std::make_unique<ThreadRing>();
+        ring->id = uint32_t(state.rings.size() + 1);
+        ring->name = "thread " + std::to_string(ring->id);
+        ring->inUse = true;
+        ring->events.resize(Profiler::RingSize);
+
+        state.rings.push_back(std::move(ring));
+
+        return state.rings.back().get();
+    }
+
+    class ThreadRingHandle
+    {
+    public:
+        ThreadRing *ring = AcquireRing();
+
+        ~ThreadRingHandle()
+        {
+            auto &state = State();
+
+            std::lock_guard<std::mutex> lock(state.ringsLock);
+
+            ring->inUse = false;
+        }
+    };
+
+    thread_local ThreadRingHandle threadRing;
+
+    GLuint AcquireQuery()
+    {
+        auto &state = State();
+
+        if (state.freeQueries.empty())
+        {
+            GLuint queries[64];
+            glGenQueries(64, queries);
+
+            state.freeQueries.assign(queries, queries + 64);
+        }
+
+        auto query = state.freeQueries.back();
+        state.freeQueries.pop_back();
+
+        return query;
+    }
+
+    void WriteJsonString(
+        std::ostream &out,
+        const std::string &value)
+    {
+        out << '"';
+        for (auto c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out << '\\';
+            }
+            out << ((unsigned char)c < 0x20 ? ' ' : c);
+        }
+        out << '"';
+    }
+
+    void WriteRing(
+        std::ostream &out,
+        const ThreadRing &ring,
+        bool &first)
+    {
+        auto count = ring.count.load(std::memory_order_acquire);
+        if (count == 0)
+        {
+            return;
+        }
+
+        out << (first ? "\n" : ",\n");
+        first = false;
+
+        out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring.id << ",\"args\":{\"name\":";
+        WriteJsonString(out, ring.name);
+        out << "}}";
+
+        auto oldest = count > Profiler::RingSize ? count - Profiler::RingSize : 0;
+        for (auto i = oldest; i < count; i++)
+        {
+            auto &event = ring.events[i % Profiler::RingSize];
+
+            out << ",\n{\"name\":";
+            WriteJsonString(out, event.name);
+            out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring.id
+                << ",\"ts\":" << double(event.start) / 1000.0
+                << ",\"dur\":" << double(event.end - event.start) / 1000.0 << "}";
+        }
+    }
+} // namespace
+
+uint64_t Profiler::Now()
+{
+    auto elapsed = std::chrono::steady_clock::now() - State().epoch;
+
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+void Profiler::Record(
+    const char *name,
+    uint64_t start,
+    uint64_t end)
+{
+    threadRing.ring->Push(name, start, end);
+}
+
+void Profiler::SetThreadName(
+    const char *name)
+{
+    // the first use of threadRing acquires the ring, which takes the lock itself
+    auto ring = threadRing.ring;
+    auto &state = State();
+
+    std::lock_guard<std::mutex> lock(state.ringsLock);
+
+    ring->name = name;
+}
+
+void Profiler::CollectGpuZones()
+{
+    auto &state = State();
+
+    if (state.pendingZones.empty())
+    {
+        return;
+    }
+
+    // The GL clock is only related to ours through the current time of both
+    GLint64 gpuNow = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    auto offset = int64_t(Now()) - int64_t(gpuNow);
+
+    while (!state.pendingZones.empty())
+    {
+        auto &zone = state.pendingZones.front();
+
+        GLint available = 0;
+        glGetQueryObjectiv(zone.end, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available == 0)
+        {
+            break;
+        }
+
+        GLuint64 begin = 0, end = 0;
+        glGetQueryObjectui64v(zone.begin, GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(zone.end, GL_QUERY_RESULT, &end);
+
+        state.gpuRing.Push(zone.name, uint64_t(int64_t(begin) + offset), uint64_t(int64_t(end) + offset));
+
+        state.freeQueries.push_back(zone.begin);
+        state.freeQueries.push_back(zone.end);
+        state.pendingZones.pop_front();
+    }
+}
+
+bool Profiler::WriteChromeTrace(
+    const std::string &filename)
+{
+    std::ofstream out(filename);
+
+    if (!out)
+    {
+        spdlog::error("unable to write trace to {}", filename);
+
+        return false;
+    }
+
+    auto &state = State();
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    bool first = true;
+    {
+        std::lock_guard<std::mutex> lock(state.ringsLock);
+
+        for (auto &ring : state.rings)
+        {
+            WriteRing(out, *ring, first);
+        }
+    }
+
+    WriteRing(out, state.gpuRing, first);
+
+    out << "\n]}\n";
+
+    spdlog::info("trace written to {}", filename);
+
+    return true;
+}
+
+GpuProfileZone::GpuProfileZone(
+    const char *name)
+    : _name(name)
+{
+    // timer queries need GL 3.3 or ARB_timer_query
+    if (glad_glQueryCounter == nullptr)
+    {
+        return;
+    }
+
+    auto &state = State();
+    if (state.gpuRing.events.empty())
+    {
+        state.gpuRing.name = "GPU";
+        state.gpuRing.events.resize(Profiler::RingSize);
+    }
+
+    _begin = AcquireQuery();
+    glQueryCounter(_begin, GL_TIMESTAMP);
+}
+
+GpuProfileZone::~GpuProfileZone()
+{
+    if (_begin == 0)
+    {
+        return;
+    }
+
+    auto end = AcquireQuery();
+    glQueryCounter(end, GL_TIMESTAMP);
+
+    State().pendingZones.push_back(GpuZone{_name, _begin, end});
+}
+
+#endif // GENMAP_PROFILER
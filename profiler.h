@@ -0,0 +1,96 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Scoped CPU and GPU zones that are written to a Chrome trace_event file, which can be opened in
+// chrome://tracing or Perfetto. Zones are only recorded when GENMAP_PROFILER is defined, the
+// macros compile to nothing otherwise.
+//
+//     PROFILE_ZONE("BspAsset::Load");   times the rest of the scope on this thread
+//     PROFILE_GPU_ZONE("RenderBsp");    also times the GL commands of the scope with timer queries
+//     PROFILE_THREAD("loader");         names the track of this thread in the trace
+//     PROFILE_FRAME();                  collects the finished GPU zones, once per frame
+//     PROFILE_WRITE_TRACE("genmap.trace.json");
+
+#ifdef GENMAP_PROFILER
+
+#include <cstdint>
+#include <string>
+
+class Profiler
+{
+public:
+    // Zones per thread, the oldest are overwritten when a thread records more
+    static const size_t RingSize = 1 << 15;
+
+    // Nanoseconds since the profiler started
+    static uint64_t Now();
+
+    // name must outlive the profiler, zones only keep the pointer
+    static void Record(
+        const char *name,
+        uint64_t start,
+        uint64_t end);
+
+    static void SetThreadName(
+        const char *name);
+
+    // Moves the GPU zones whose queries are finished to the trace, without waiting for the rest
+    static void CollectGpuZones();
+
+    static bool WriteChromeTrace(
+        const std::string &filename);
+};
+
+class ProfileZone
+{
+public:
+    explicit ProfileZone(
+        const char *name)
+        : _name(name), _start(Profiler::Now())
+    {}
+
+    ~ProfileZone()
+    {
+        Profiler::Record(_name, _start, Profiler::Now());
+    }
+
+private:
+    const char *_name;
+    uint64_t _start;
+};
+
+// Must only be used on the thread that owns the GL context
+class GpuProfileZone
+{
+public:
+    explicit GpuProfileZone(
+        const char *name);
+
+    ~GpuProfileZone();
+
+private:
+    const char *_name;
+    unsigned int _begin = 0;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(_profileZone, __LINE__)(name)
+#define PROFILE_GPU_ZONE(name)                                   \
+    ProfileZone PROFILE_CONCAT(_profileZone, __LINE__)(name);    \
+    GpuProfileZone PROFILE_CONCAT(_gpuProfileZone, __LINE__)(name)
+#define PROFILE_THREAD(name) Profiler::SetThreadName(name)
+#define PROFILE_FRAME() Profiler::CollectGpuZones()
+#define PROFILE_WRITE_TRACE(filename) Profiler::WriteChromeTrace(filename)
+
+#else
+
+#define PROFILE_ZONE(name)
+#define PROFILE_GPU_ZONE(name)
+#define PROFILE_THREAD(name)
+#define PROFILE_FRAME()
+#define PROFILE_WRITE_TRACE(filename)
+
+#endif // GENMAP_PROFILER
+
+#endif // PROFILER_H
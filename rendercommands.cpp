@@ -0,0 +1,180 @@
+#include "rendercommands.h"
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <spdlog/spdlog.h>
+
+void RenderCommandList::Clear()
+{
+    _packets.clear();
+}
+
+void RenderCommandList::Draw(
+    uint8_t pass,
+    uint8_t pipeline,
+    uint32_t texture,
+    uint32_t lightmap,
+    uint32_t transform,
+    uint32_t first,
+    uint32_t count)
+{
+    DrawPacket packet;
+
+    packet.pass = pass;
+    packet.pipeline = pipeline;
+    packet.texture = texture;
+    packet.lightmap = lightmap;
+    packet.transform = transform;
+    packet.first = first;
+    packet.count = count;
+
+    _packets.push_back(packet);
+}
+
+const std::vector<DrawPacket> &RenderCommandList::Packets() const
+{
+    return _packets;
+}
+
+void RenderCommandQueue::Reset(
+    unsigned int listCount)
+{
+    if (_lists.size() < listCount)
+    {
+        _lists.resize(listCount);
+    }
+
+    for (auto &list : _lists)
+    {
+        list.Clear();
+    }
+
+    _packets.clear();
+    _transforms.clear();
+}
+
+uint32_t RenderCommandQueue::AddTransform(
+    const glm::mat4 &matrix,
+    const glm::vec4 &color)
+{
+    _transforms.push_back(DrawTransform{matrix, color});
+
+    return uint32_t(_transforms.size() - 1);
+}
+
+RenderCommandList &RenderCommandQueue::List(
+    unsigned int index)
+{
+    return _lists[index];
+}
+
+unsigned int RenderCommandQueue::ListCount() const
+{
+    return (unsigned int)_lists.size();
+}
+
+uint64_t RenderCommandQueue::Key(
+    const DrawPacket &packet)
+{
+    const uint64_t textureMask = (uint64_t(1) << TextureBits) - 1;
+    const uint64_t lightmapMask = (uint64_t(1) << LightmapBits) - 1;
+    const uint64_t transformMask = (uint64_t(1) << TransformBits) - 1;
+
+    auto key = uint64_t(packet.pass & 0xf) << 60;
+    key |= uint64_t(packet.pipeline & 0xf) << 56;
+    key |= (uint64_t(packet.texture) & textureMask) << (LightmapBits + TransformBits);
+    key |= (uint64_t(packet.lightmap) & lightmapMask) << TransformBits;
+    key |= uint64_t(packet.transform) & transformMask;
+
+    return key;
+}
+
+void RenderCommandQueue::Sort()
+{
+    PROFILE_ZONE("RenderCommandQueue::Sort");
+
+    size_t count = 0;
+    for (auto &list : _lists)
+    {
+        count += list.Packets().size();
+    }
+
+    _packets.clear();
+    _packets.reserve(count);
+
+    for (auto &list : _lists)
+    {
+        for (auto &packet : list.Packets())
+        {
+            _packets.push_back(packet);
+            _packets.back().key = Key(packet);
+        }
+    }
+
+    std::sort(_packets.begin(), _packets.end(), [](const DrawPacket &a, const DrawPacket &b) {
+        if (a.key != b.key)
+        {
+            return a.key < b.key;
+        }
+
+        return a.first < b.first;
+    });
+}
+
+const std::vector<DrawPacket> &RenderCommandQueue::Packets() const
+{
+    return _packets;
+}
+
+const std::vector<DrawTransform> &RenderCommandQueue::Transforms() const
+{
+    return _transforms;
+}
+
+ReplayStats RenderCommandQueue::Replay(
+    RenderCommandBackend &backend) const
+{
+    PROFILE_ZONE("RenderCommandQueue::Replay");
+
+    ReplayStats stats;
+
+    const DrawPacket *previous = nullptr;
+
+    for (auto &packet : _packets)
+    {
+        if (packet.transform >= _transforms.size())
+        {
+            spdlog::warn("draw packet with unknown transform {} skipped", packet.transform);
+
+            continue;
+        }
+
+        bool pipelineChanged = previous == nullptr || packet.pass != previous->pass || packet.pipeline != previous->pipeline;
+
+        if (pipelineChanged)
+        {
+            backend.SetPipeline(packet.pipeline);
+            stats.pipelineChanges++;
+        }
+
+        if (pipelineChanged || packet.transform != previous->transform)
+        {
+            backend.SetTransform(_transforms[packet.transform]);
+            stats.transformChanges++;
+        }
+
+        if (pipelineChanged || packet.texture != previous->texture || packet.lightmap != previous->lightmap)
+        {
+            backend.SetTextures(packet.texture, packet.lightmap);
+            stats.textureChanges++;
+        }
+
+        backend.Draw(packet.first, packet.count);
+        stats.draws++;
+
+        previous = &packet;
+    }
+
+    return stats;
+}
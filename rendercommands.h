@@ -0,0 +1,128 @@
+#ifndef RENDERCOMMANDS_H
+#define RENDERCOMMANDS_H
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+// The draws of a frame, recorded without touching the graphics API. Transforms are added on
+// one thread before recording, then every worker records into its own RenderCommandList
+// without locking. Sort merges the lists into one stream ordered by state and Replay hands it
+// to a RenderCommandBackend, which is only told about the state that changed between draws.
+//
+// Sorting is by pass, pipeline, texture, lightmap and transform, in that order. Passes are
+// replayed in the order of their numbers, so blended passes get a higher number than the
+// opaque ones.
+
+class DrawPacket
+{
+public:
+    uint64_t key = 0; // set by Sort
+    uint8_t pass = 0;
+    uint8_t pipeline = 0; // shader and fixed function state, up to the backend
+    uint32_t texture = 0;
+    uint32_t lightmap = 0;
+    uint32_t transform = 0; // index returned by RenderCommandQueue::AddTransform
+    uint32_t first = 0;     // vertex or index range, up to the backend
+    uint32_t count = 0;
+};
+
+class DrawTransform
+{
+public:
+    glm::mat4 matrix;
+    glm::vec4 color;
+};
+
+class RenderCommandList
+{
+public:
+    void Clear();
+
+    void Draw(
+        uint8_t pass,
+        uint8_t pipeline,
+        uint32_t texture,
+        uint32_t lightmap,
+        uint32_t transform,
+        uint32_t first,
+        uint32_t count);
+
+    const std::vector<DrawPacket> &Packets() const;
+
+private:
+    std::vector<DrawPacket> _packets;
+};
+
+class RenderCommandBackend
+{
+public:
+    virtual ~RenderCommandBackend() = default;
+
+    // The transform and textures are set again after every pipeline change
+    virtual void SetPipeline(
+        uint8_t pipeline) = 0;
+
+    virtual void SetTransform(
+        const DrawTransform &transform) = 0;
+
+    virtual void SetTextures(
+        uint32_t texture,
+        uint32_t lightmap) = 0;
+
+    virtual void Draw(
+        uint32_t first,
+        uint32_t count) = 0;
+};
+
+class ReplayStats
+{
+public:
+    int draws = 0;
+    int pipelineChanges = 0;
+    int transformChanges = 0;
+    int textureChanges = 0;
+};
+
+class RenderCommandQueue
+{
+public:
+    static const int TextureBits = 18;
+    static const int LightmapBits = 18;
+    static const int TransformBits = 20;
+
+    // Clears the transforms and all packets and makes sure there are listCount lists. The lists
+    // keep their memory between frames.
+    void Reset(
+        unsigned int listCount);
+
+    uint32_t AddTransform(
+        const glm::mat4 &matrix,
+        const glm::vec4 &color);
+
+    RenderCommandList &List(
+        unsigned int index);
+
+    unsigned int ListCount() const;
+
+    // Merges the lists and sorts the packets by key. Draws with the same state keep the order of
+    // their vertex ranges, so the result does not depend on which worker recorded what.
+    void Sort();
+
+    const std::vector<DrawPacket> &Packets() const;
+
+    const std::vector<DrawTransform> &Transforms() const;
+
+    ReplayStats Replay(
+        RenderCommandBackend &backend) const;
+
+    static uint64_t Key(
+        const DrawPacket &packet);
+
+private:
+    std::vector<RenderCommandList> _lists;
+    std::vector<DrawPacket> _packets;
+    std::vector<DrawTransform> _transforms;
+};
+
+#endif // RENDERCOMMANDS_H
@@ -0,0 +1,477 @@
+#include "softwarerenderer.h"
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <spdlog/spdlog.h>
+#include <thread>
+
+static glm::vec4 SampleTexture(
+    valve::Texture *texture,
+    const glm::vec2 &uv)
+{
+    if (texture == nullptr || texture->Data() == nullptr || texture->Width() <= 0 || texture->Height() <= 0)
+    {
+        return glm::vec4(1.0f);
+    }
+
+    auto width = texture->Width();
+    auto height = texture->Height();
+    auto bpp = texture->Bpp();
+    auto data = texture->Data();
+
+    // bilinear like GL_LINEAR, texel centers are at half pixels
+    auto x = uv.x * width - 0.5f;
+    auto y = uv.y * height - 0.5f;
+    auto fx = std::floor(x);
+    auto fy = std::floor(y);
+    auto tx = x - fx;
+    auto ty = y - fy;
+
+    auto address = [&](int i, int size) {
+        if (texture->Repeat())
+        {
+            i %= size;
+            return i < 0 ? i + size : i;
+        }
+
+        return std::clamp(i, 0, size - 1);
+    };
+
+    auto x0 = address(int(fx), width);
+    auto x1 = address(int(fx) + 1, width);
+    auto y0 = address(int(fy), height);
+    auto y1 = address(int(fy) + 1, height);
+
+    auto texel = [&](int tx, int ty) {
+        auto p = data + (size_t(ty) * width + tx) * bpp;
+
+        return glm::vec4(p[0], p[1], p[2], bpp == 4 ? p[3] : 255) * (1.0f / 255.0f);
+    };
+
+    auto top = glm::mix(texel(x0, y0), texel(x1, y0), tx);
+    auto bottom = glm::mix(texel(x0, y1), texel(x1, y1), tx);
+
+    return glm::mix(top, bottom, ty);
+}
+
+static uint32_t Crc32(
+    const unsigned char *data,
+    size_t size,
+    uint32_t crc = 0)
+{
+    static uint32_t table[256] = {0};
+
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+static void WriteChunk(
+    std::vector<unsigned char> &png,
+    const char *type,
+    const std::vector<unsigned char> &data)
+{
+    auto put32 = [&png](uint32_t value) {
+        png.push_back((value >> 24) & 0xFF);
+        png.push_back((value >> 16) & 0xFF);
+        png.push_back((value >> 8) & 0xFF);
+        png.push_back(value & 0xFF);
+    };
+
+    put32(uint32_t(data.size()));
+
+    auto start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data.begin(), data.end());
+
+    put32(Crc32(png.data() + start, png.size() - start));
+}
+
+bool SoftwareRenderer::Setup(
+    int width,
+    int height,
+    unsigned int threadCount)
+{
+    if (width <= 0 || height <= 0)
+    {
+        return false;
+    }
+
+    _width = width;
+    _height = height;
+    _tilesX = (width + TileSize - 1) / TileSize;
+    _tilesY = (height + TileSize - 1) / TileSize;
+    _threadCount = std::max(1u, threadCount);
+
+    _colorBuffer.resize(size_t(width) * size_t(height));
+    _depthBuffer.resize(size_t(width) * size_t(height));
+    _bins.resize(size_t(_tilesX) * size_t(_tilesY));
+    _triangles.clear();
+
+    return true;
+}
+
+void SoftwareRenderer::SetMatrix(
+    const glm::mat4 &matrix)
+{
+    _matrix = matrix;
+}
+
+void SoftwareRenderer::Clear(
+    const glm::vec4 &color)
+{
+    std::fill(_colorBuffer.begin(), _colorBuffer.end(), color);
+    std::fill(_depthBuffer.begin(), _depthBuffer.end(), 1.0f);
+}
+
+void SoftwareRenderer::DrawFan(
+    const VertexType *vertices,
+    int count,
+    valve::Texture *texture,
+    valve::Texture *lightmap,
+    const glm::vec4 &color,
+    BlendModes mode)
+{
+    if (count < 3)
+    {
+        return;
+    }
+
+    _clipPositions.clear();
+    _clipUvs.clear();
+    for (int i = 0; i < count; i++)
+    {
+        _clipPositions.push_back(_matrix * glm::vec4(vertices[i].pos, 1.0f));
+        _clipUvs.push_back(vertices[i].uvs);
+    }
+
+    // only the near plane is clipped against, the other planes are handled by the bins
+    _clippedPositions.clear();
+    _clippedUvs.clear();
+    for (int i = 0; i < count; i++)
+    {
+        auto j = (i + 1) % count;
+        auto &a = _clipPositions[i];
+        auto &b = _clipPositions[j];
+        auto da = a.z + a.w;
+        auto db = b.z + b.w;
+
+        if (da >= 0.0f)
+        {
+            _clippedPositions.push_back(a);
+            _clippedUvs.push_back(_clipUvs[i]);
+        }
+
+        if ((da >= 0.0f) != (db >= 0.0f))
+        {
+            auto t = da / (da - db);
+            _clippedPositions.push_back(glm::mix(a, b, t));
+            _clippedUvs.push_back(glm::mix(_clipUvs[i], _clipUvs[j], t));
+        }
+    }
+
+    if (_clippedPositions.size() < 3)
+    {
+        return;
+    }
+
+    auto toScreen = [this](const glm::vec4 &clip, const glm::vec4 &uvs) {
+        ScreenVertex v;
+        v.invW = 1.0f / std::max(clip.w, 1e-6f);
+        v.pos = glm::vec3(
+            (clip.x * v.invW * 0.5f + 0.5f) * _width,
+            (0.5f - clip.y * v.invW * 0.5f) * _height,
+            clip.z * v.invW * 0.5f + 0.5f);
+        v.uvs = uvs * v.invW;
+
+        return v;
+    };
+
+    auto first = toScreen(_clippedPositions[0], _clippedUvs[0]);
+    auto previous = toScreen(_clippedPositions[1], _clippedUvs[1]);
+
+    for (size_t i = 2; i < _clippedPositions.size(); i++)
+    {
+        auto current = toScreen(_clippedPositions[i], _clippedUvs[i]);
+
+        AddTriangle(first, previous, current, texture, lightmap, color, mode);
+
+        previous = current;
+    }
+}
+
+void SoftwareRenderer::AddTriangle(
+    const ScreenVertex &a,
+    const ScreenVertex &b,
+    const ScreenVertex &c,
+    valve::Texture *texture,
+    valve::Texture *lightmap,
+    const glm::vec4 &color,
+    BlendModes mode)
+{
+    Triangle triangle = {{a, b, c}, 0.0f, texture, lightmap, color, mode};
+
+    triangle.area = (b.pos.x - a.pos.x) * (c.pos.y - a.pos.y) - (b.pos.y - a.pos.y) * (c.pos.x - a.pos.x);
+
+    if (std::abs(triangle.area) < 1e-8f)
+    {
+        return;
+    }
+
+    auto minX = std::min({a.pos.x, b.pos.x, c.pos.x});
+    auto maxX = std::max({a.pos.x, b.pos.x, c.pos.x});
+    auto minY = std::min({a.pos.y, b.pos.y, c.pos.y});
+    auto maxY = std::max({a.pos.y, b.pos.y, c.pos.y});
+
+    if (maxX < 0.0f || maxY < 0.0f || minX >= float(_width) || minY >= float(_height))
+    {
+        return;
+    }
+
+    auto tileX0 = std::max(0, int(minX) / TileSize);
+    auto tileY0 = std::max(0, int(minY) / TileSize);
+    auto tileX1 = std::min(_tilesX - 1, int(maxX) / TileSize);
+    auto tileY1 = std::min(_tilesY - 1, int(maxY) / TileSize);
+
+    auto index = uint32_t(_triangles.size());
+    _triangles.push_back(triangle);
+
+    for (int y = tileY0; y <= tileY1; y++)
+    {
+        for (int x = tileX0; x <= tileX1; x++)
+        {
+            _bins[size_t(y) * _tilesX + x].push_back(index);
+        }
+    }
+}
+
+void SoftwareRenderer::Flush()
+{
+    PROFILE_ZONE("SoftwareRenderer::Flush");
+
+    std::atomic<int> nextTile(0);
+    auto tileCount = _tilesX * _tilesY;
+
+    auto worker = [this, &nextTile, tileCount]() {
+        for (int tile = nextTile++; tile < tileCount; tile = nextTile++)
+        {
+            RasterizeTile(tile);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < _threadCount; i++)
+    {
+        threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto &bin : _bins)
+    {
+        bin.clear();
+    }
+
+    _triangles.clear();
+}
+
+void SoftwareRenderer::RasterizeTile(
+    int tile)
+{
+    auto x0 = (tile % _tilesX) * TileSize;
+    auto y0 = (tile / _tilesX) * TileSize;
+    auto x1 = std::min(x0 + TileSize, _width);
+    auto y1 = std::min(y0 + TileSize, _height);
+
+    for (auto index : _bins[tile])
+    {
+        auto &triangle = _triangles[index];
+        auto &a = triangle.v[0].pos;
+        auto &b = triangle.v[1].pos;
+        auto &c = triangle.v[2].pos;
+
+        auto minX = std::max(x0, int(std::floor(std::min({a.x, b.x, c.x}))));
+        auto maxX = std::min(x1 - 1, int(std::ceil(std::max({a.x, b.x, c.x}))));
+        auto minY = std::max(y0, int(std::floor(std::min({a.y, b.y, c.y}))));
+        auto maxY = std::min(y1 - 1, int(std::ceil(std::max({a.y, b.y, c.y}))));
+
+        auto invArea = 1.0f / triangle.area;
+
+        for (int y = minY; y <= maxY; y++)
+        {
+            for (int x = minX; x <= maxX; x++)
+            {
+                auto px = x + 0.5f;
+                auto py = y + 0.5f;
+
+                auto w0 = ((c.x - b.x) * (py - b.y) - (c.y - b.y) * (px - b.x)) * invArea;
+                auto w1 = ((a.x - c.x) * (py - c.y) - (a.y - c.y) * (px - c.x)) * invArea;
+                auto w2 = 1.0f - w0 - w1;
+
+                if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f)
+                {
+                    continue;
+                }
+
+                auto pixel = size_t(y) * _width + x;
+                auto depth = w0 * a.z + w1 * b.z + w2 * c.z;
+
+                if (depth >= _depthBuffer[pixel] || depth < 0.0f)
+                {
+                    continue;
+                }
+
+                auto invW = w0 * triangle.v[0].invW + w1 * triangle.v[1].invW + w2 * triangle.v[2].invW;
+                auto uvs = (w0 * triangle.v[0].uvs + w1 * triangle.v[1].uvs + w2 * triangle.v[2].uvs) / invW;
+
+                auto texel0 = SampleTexture(triangle.texture, glm::vec2(uvs.z, uvs.w));
+                auto texel1 = SampleTexture(triangle.lightmap, glm::vec2(uvs.x, uvs.y));
+
+                switch (triangle.mode)
+                {
+                    case BlendModes::Opaque:
+                    {
+                        _colorBuffer[pixel] = texel0 * texel1 * triangle.color;
+                        break;
+                    }
+                    case BlendModes::AlphaTest:
+                    {
+                        if (texel0.a < 0.2f)
+                        {
+                            continue;
+                        }
+
+                        _colorBuffer[pixel] = glm::vec4(glm::vec3(texel0) * glm::vec3(texel1), 1.0f);
+                        break;
+                    }
+                    case BlendModes::Additive:
+                    {
+                        auto source = texel0 * texel1 * triangle.color;
+                        _colorBuffer[pixel] = glm::min(source + _colorBuffer[pixel] * _colorBuffer[pixel].a, glm::vec4(1.0f));
+                        break;
+                    }
+                }
+
+                _depthBuffer[pixel] = depth;
+            }
+        }
+    }
+}
+
+bool SoftwareRenderer::SavePng(
+    const std::string &filename) const
+{
+    // 8 bit RGB rows, each with filter type 0
+    std::vector<unsigned char> raw;
+    raw.reserve(size_t(_height) * (size_t(_width) * 3 + 1));
+    for (int y = 0; y < _height; y++)
+    {
+        raw.push_back(0);
+        for (int x = 0; x < _width; x++)
+        {
+            auto &color = _colorBuffer[size_t(y) * _width + x];
+            for (int c = 0; c < 3; c++)
+            {
+                raw.push_back((unsigned char)(std::clamp(color[c], 0.0f, 1.0f) * 255.0f + 0.5f));
+            }
+        }
+    }
+
+    // zlib stream of stored deflate blocks, screenshots are written for comparing not for size
+    std::vector<unsigned char> idat = {0x78, 0x01};
+    for (size_t offset = 0; offset < raw.size() || offset == 0; offset += 65535)
+    {
+        auto size = std::min(raw.size() - offset, size_t(65535));
+        auto last = offset + size >= raw.size();
+
+        idat.push_back(last ? 1 : 0);
+        idat.push_back(size & 0xFF);
+        idat.push_back((size >> 8) & 0xFF);
+        idat.push_back(~size & 0xFF);
+        idat.push_back((~size >> 8) & 0xFF);
+        idat.insert(idat.end(), raw.begin() + offset, raw.begin() + offset + size);
+
+        if (last)
+        {
+            break;
+        }
+    }
+
+    uint32_t s1 = 1, s2 = 0;
+    for (auto byte : raw)
+    {
+        s1 = (s1 + byte) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    auto adler = (s2 << 16) | s1;
+    idat.push_back((adler >> 24) & 0xFF);
+    idat.push_back((adler >> 16) & 0xFF);
+    idat.push_back((adler >> 8) & 0xFF);
+    idat.push_back(adler & 0xFF);
+
+    std::vector<unsigned char> ihdr = {
+        (unsigned char)(_width >> 24), (unsigned char)(_width >> 16), (unsigned char)(_width >> 8), (unsigned char)_width,
+        (unsigned char)(_height >> 24), (unsigned char)(_height >> 16), (unsigned char)(_height >> 8), (unsigned char)_height,
+        8, 2, 0, 0, 0};
+
+    std::vector<unsigned char> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    WriteChunk(png, "IHDR", ihdr);
+    WriteChunk(png, "IDAT", idat);
+    WriteChunk(png, "IEND", {});
+
+    std::ofstream file(filename, std::ios::out | std::ios::binary);
+
+    if (!file.is_open())
+    {
+        spdlog::error("failed to write {}", filename);
+
+        return false;
+    }
+
+    file.write((const char *)png.data(), std::streamsize(png.size()));
+
+    return true;
+}
+
+glm::vec4 SoftwareRenderer::Pixel(
+    int x,
+    int y) const
+{
+    return _colorBuffer[size_t(y) * _width + x];
+}
+
+int SoftwareRenderer::Width() const
+{
+    return _width;
+}
+
+int SoftwareRenderer::Height() const
+{
+    return _height;
+}
@@ -0,0 +1,113 @@
+#ifndef SOFTWARERENDERER_H
+#define SOFTWARERENDERER_H
+
+#include "hltexture.h"
+#include "include/glbuffer.h"
+
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+// Rasterizes the world faces on the CPU, for rendering without a GL context. Faces are
+// clipped and transformed when they are drawn, and binned into tiles of TileSize pixels. Flush
+// rasterizes the tiles on threadCount threads, every tile draws its triangles in the order
+// they were drawn so blending matches the GL path.
+class SoftwareRenderer
+{
+public:
+    static const int TileSize = 64;
+
+    enum class BlendModes
+    {
+        Opaque,    // texture * lightmap * color
+        AlphaTest, // like solidBlendingFragmentShader, texels with alpha below 0.2 are discarded
+        Additive,  // glBlendFunc(GL_ONE, GL_DST_ALPHA) on a framebuffer cleared with alpha 1
+    };
+
+    bool Setup(
+        int width,
+        int height,
+        unsigned int threadCount);
+
+    void SetMatrix(
+        const glm::mat4 &matrix);
+
+    void Clear(
+        const glm::vec4 &color);
+
+    // Draws a convex polygon as a triangle fan, the uvs of the vertices are the lightmap
+    // coordinates in xy and the texture coordinates in zw like in the GL vertex buffer
+    void DrawFan(
+        const VertexType *vertices,
+        int count,
+        valve::Texture *texture,
+        valve::Texture *lightmap,
+        const glm::vec4 &color,
+        BlendModes mode);
+
+    void Flush();
+
+    bool SavePng(
+        const std::string &filename) const;
+
+    // The color of a pixel, as written by the last Flush
+    glm::vec4 Pixel(
+        int x,
+        int y) const;
+
+    int Width() const;
+
+    int Height() const;
+
+private:
+    class ScreenVertex
+    {
+    public:
+        glm::vec3 pos; // pixels and depth
+        float invW;
+        glm::vec4 uvs; // divided by w for perspective correct interpolation
+    };
+
+    class Triangle
+    {
+    public:
+        ScreenVertex v[3];
+        float area;
+        valve::Texture *texture;
+        valve::Texture *lightmap;
+        glm::vec4 color;
+        BlendModes mode;
+    };
+
+    int _width = 0;
+    int _height = 0;
+    int _tilesX = 0;
+    int _tilesY = 0;
+    unsigned int _threadCount = 1;
+    glm::mat4 _matrix = glm::mat4(1.0f);
+    std::vector<glm::vec4> _colorBuffer;
+    std::vector<float> _depthBuffer;
+    std::vector<Triangle> _triangles;
+    std::vector<std::vector<uint32_t>> _bins;
+
+    // scratch for clipping a fan against the near plane
+    std::vector<glm::vec4> _clipPositions;
+    std::vector<glm::vec4> _clipUvs;
+    std::vector<glm::vec4> _clippedPositions;
+    std::vector<glm::vec4> _clippedUvs;
+
+    void AddTriangle(
+        const ScreenVertex &a,
+        const ScreenVertex &b,
+        const ScreenVertex &c,
+        valve::Texture *texture,
+        valve::Texture *lightmap,
+        const glm::vec4 &color,
+        BlendModes mode);
+
+    void RasterizeTile(
+        int tile);
+};
+
+#endif // SOFTWARERENDERER_H
@@ -0,0 +1,128 @@
+#include "texturearrays.h"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+int TextureArrayLayout::SizeClass(
+    int size)
+{
+    int sizeClass = 1;
+
+    while (sizeClass < size)
+    {
+        sizeClass *= 2;
+    }
+
+    return sizeClass;
+}
+
+void TextureArrayLayout::Build(
+    const std::vector<valve::Texture *> &textures)
+{
+    _slots.assign(textures.size(), TextureArraySlot());
+    _arrays.clear();
+
+    // The array that is being filled for every size class, arrays of a class are split at
+    // MaxLayers
+    std::map<std::pair<int, int>, int> openArrays;
+
+    for (size_t t = 0; t < textures.size(); t++)
+    {
+        auto width = std::max(1, textures[t]->Width());
+        auto height = std::max(1, textures[t]->Height());
+        auto sizeClass = std::make_pair(SizeClass(width), SizeClass(height));
+
+        auto open = openArrays.find(sizeClass);
+        if (open == openArrays.end() || _arrays[open->second].textures.size() >= size_t(MaxLayers))
+        {
+            TextureArray array;
+            array.width = sizeClass.first;
+            array.height = sizeClass.second;
+
+            _arrays.push_back(array);
+            openArrays[sizeClass] = int(_arrays.size() - 1);
+        }
+
+        auto index = openArrays[sizeClass];
+        auto &array = _arrays[index];
+
+        auto &slot = _slots[t];
+        slot.array = index;
+        slot.layer = int(array.textures.size());
+        slot.scale = glm::vec2(float(width) / float(array.width), float(height) / float(array.height));
+
+        array.textures.push_back(int(t));
+        array.scales.push_back(slot.scale);
+    }
+}
+
+const std::vector<TextureArraySlot> &TextureArrayLayout::Slots() const
+{
+    return _slots;
+}
+
+const std::vector<TextureArray> &TextureArrayLayout::Arrays() const
+{
+    return _arrays;
+}
+
+// The texel of the source at x in a layer of sizeClass. The padding after the texture repeats
+// its first texels, so filtering at its right edge sees them, and ends with its last texels,
+// because the layer wraps from its last texel to the texture's first one. When only one texel
+// is padded it goes to the wrap.
+static int PaddedTexel(
+    int x,
+    int size,
+    int sizeClass)
+{
+    if (x < size)
+    {
+        return x;
+    }
+
+    if (x - size < sizeClass - x - 1)
+    {
+        return (x - size) % size;
+    }
+
+    return (size - (sizeClass - x) % size) % size;
+}
+
+void TextureArrayLayout::PadToSizeClass(
+    const valve::Texture &texture,
+    int width,
+    int height,
+    std::vector<unsigned char> &rgba)
+{
+    rgba.resize(size_t(width) * size_t(height) * 4);
+
+    auto textureWidth = texture.Width();
+    auto textureHeight = texture.Height();
+    auto bpp = texture.Bpp();
+    auto data = texture.Data();
+
+    if (textureWidth < 1 || textureHeight < 1 || data == nullptr)
+    {
+        std::fill(rgba.begin(), rgba.end(), (unsigned char)255);
+
+        return;
+    }
+
+    for (int y = 0; y < height; y++)
+    {
+        auto sourceRow = data + size_t(PaddedTexel(y, textureHeight, height)) * size_t(textureWidth) * size_t(bpp);
+        auto destination = rgba.data() + size_t(y) * size_t(width) * 4;
+
+        for (int x = 0; x < width; x++)
+        {
+            auto source = sourceRow + size_t(PaddedTexel(x, textureWidth, width)) * size_t(bpp);
+
+            destination[0] = source[0];
+            destination[1] = bpp > 1 ? source[1] : source[0];
+            destination[2] = bpp > 2 ? source[2] : source[0];
+            destination[3] = bpp > 3 ? source[3] : 255;
+            destination += 4;
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef TEXTUREARRAYS_H
+#define TEXTUREARRAYS_H
+
+#include "hltexture.h"
+
+#include <glm/glm.hpp>
+#include <vector>
+
+// Groups the world textures into texture arrays by size class, so faces with different
+// textures can be drawn together. The size class of a texture is its size rounded up to powers
+// of two. A texture is padded to its class with the texels around its edges, and the shader
+// wraps the texture coordinates itself with the scale of the layer, so repeating textures keep
+// repeating.
+//
+// This only decides the layout and fills the layers, creating the GL textures is up to the
+// caller.
+
+class TextureArraySlot
+{
+public:
+    int array = 0;
+    int layer = 0;
+    glm::vec2 scale = glm::vec2(1.0f); // texture size / size class
+};
+
+class TextureArray
+{
+public:
+    int width = 0;
+    int height = 0;
+    std::vector<int> textures; // texture of every layer
+    std::vector<glm::vec2> scales;
+};
+
+class TextureArrayLayout
+{
+public:
+    // Also the length of the scale array in the shader
+    static const int MaxLayers = 64;
+
+    // The smallest power of two of at least size
+    static int SizeClass(
+        int size);
+
+    // Textures without data get a 1x1 slot
+    void Build(
+        const std::vector<valve::Texture *> &textures);
+
+    const std::vector<TextureArraySlot> &Slots() const;
+
+    const std::vector<TextureArray> &Arrays() const;
+
+    // Copies the texture to the top left of an RGBA layer of width x height. The padding after
+    // it starts with its first columns and rows and ends with its last ones, so the last column
+    // and row of the layer, which filtering at its left and top edges reads through the wrap of
+    // the layer, are its last column and row. A texture without data is white.
+    static void PadToSizeClass(
+        const valve::Texture &texture,
+        int width,
+        int height,
+        std::vector<unsigned char> &rgba);
+
+private:
+    std::vector<TextureArraySlot> _slots;
+    std::vector<TextureArray> _arrays;
+};
+
+#endif // TEXTUREARRAYS_H
@@ -0,0 +1,617 @@
+#include "texturecompression.h"
+
+#include "allocationtracker.h"
+#include "profiler.h"
+#include "workerpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <spdlog/spdlog.h>
+#include <thread>
+
+namespace
+{
+    // Bump when the output of the mips or the encoders changes, old cache entries are then
+    // ignored
+    const uint32_t CacheVersion = 1;
+    const uint32_t CacheMagic = 0x4354474d; // "MGTC"
+
+    uint64_t Fnv1a(
+        const void *data,
+        size_t size,
+        uint64_t hash = 0xcbf29ce484222325ull)
+    {
+        auto bytes = reinterpret_cast<const unsigned char *>(data);
+
+        for (size_t i = 0; i < size; i++)
+        {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        }
+
+        return hash;
+    }
+
+    uint16_t To565(
+        const float color[3])
+    {
+        auto r = int(std::min(std::max(color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+        auto g = int(std::min(std::max(color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+        auto b = int(std::min(std::max(color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+
+        return uint16_t((r << 11) | (g << 5) | b);
+    }
+
+    void From565(
+        uint16_t color,
+        int out[3])
+    {
+        auto r = (color >> 11) & 31;
+        auto g = (color >> 5) & 63;
+        auto b = color & 31;
+
+        out[0] = (r << 3) | (r >> 2);
+        out[1] = (g << 2) | (g >> 4);
+        out[2] = (b << 3) | (b >> 2);
+    }
+
+    // The endpoints are the extremes of the pixels along their principal axis, inset a little
+    // so the rounding to 565 doesn't push them outside
+    void EncodeColorBlock(
+        const unsigned char pixels[64],
+        unsigned char out[8])
+    {
+        float mean[3] = {0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                mean[c] += pixels[i * 4 + c] / 16.0f;
+            }
+        }
+
+        float covariance[6] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        for (int i = 0; i < 16; i++)
+        {
+            auto r = pixels[i * 4] - mean[0];
+            auto g = pixels[i * 4 + 1] - mean[1];
+            auto b = pixels[i * 4 + 2] - mean[2];
+
+            covariance[0] += r * r;
+            covariance[1] += r * g;
+            covariance[2] += r * b;
+            covariance[3] += g * g;
+            covariance[4] += g * b;
+            covariance[5] += b * b;
+        }
+
+        float axis[3] = {1.0f, 1.0f, 1.0f};
+        for (int i = 0; i < 8; i++)
+        {
+            float next[3] = {
+                axis[0] * covariance[0] + axis[1] * covariance[1] + axis[2] * covariance[2],
+                axis[0] * covariance[1] + axis[1] * covariance[3] + axis[2] * covariance[4],
+                axis[0] * covariance[2] + axis[1] * covariance[4] + axis[2] * covariance[5],
+            };
+
+            auto length = std::max(std::max(std::abs(next[0]), std::abs(next[1])), std::abs(next[2]));
+            if (length <= 0.0f)
+            {
+                break;
+            }
+
+            for (int c = 0; c < 3; c++)
+            {
+                axis[c] = next[c] / length;
+            }
+        }
+
+        auto axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+        float low = 0.0f, high = 0.0f;
+        for (int i = 0; i < 16; i++)
+        {
+            auto t = ((pixels[i * 4] - mean[0]) * axis[0] + (pixels[i * 4 + 1] - mean[1]) * axis[1] + (pixels[i * 4 + 2] - mean[2]) * axis[2]) / axisLength;
+
+            low = std::min(low, t);
+            high = std::max(high, t);
+        }
+
+        auto inset = (high - low) / 16.0f;
+        low += inset;
+        high -= inset;
+
+        float endpoint0[3], endpoint1[3];
+        for (int c = 0; c < 3; c++)
+        {
+            endpoint0[c] = mean[c] + axis[c] * high;
+            endpoint1[c] = mean[c] + axis[c] * low;
+        }
+
+        auto color0 = To565(endpoint0);
+        auto color1 = To565(endpoint1);
+
+        // color0 > color1 selects the four color mode, which BC3 always uses
+        if (color0 < color1)
+        {
+            std::swap(color0, color1);
+        }
+
+        uint32_t indices = 0;
+        if (color0 != color1)
+        {
+            int palette[4][3];
+            From565(color0, palette[0]);
+            From565(color1, palette[1]);
+            for (int c = 0; c < 3; c++)
+            {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+
+            for (int i = 0; i < 16; i++)
+            {
+                int best = 0, bestDistance = INT32_MAX;
+
+                for (int p = 0; p < 4; p++)
+                {
+                    auto r = pixels[i * 4] - palette[p][0];
+                    auto g = pixels[i * 4 + 1] - palette[p][1];
+                    auto b = pixels[i * 4 + 2] - palette[p][2];
+                    auto distance = r * r + g * g + b * b;
+
+                    if (distance < bestDistance)
+                    {
+                        best = p;
+                        bestDistance = distance;
+                    }
+                }
+
+                indices |= uint32_t(best) << (i * 2);
+            }
+        }
+
+        out[0] = uint8_t(color0 & 0xff);
+        out[1] = uint8_t(color0 >> 8);
+        out[2] = uint8_t(color1 & 0xff);
+        out[3] = uint8_t(color1 >> 8);
+        for (int i = 0; i < 4; i++)
+        {
+            out[4 + i] = uint8_t(indices >> (i * 8));
+        }
+    }
+
+    // The eight alpha mode between the lowest and highest alpha, so 0 and 255 are exact
+    void EncodeAlphaBlock(
+        const unsigned char pixels[64],
+        unsigned char out[8])
+    {
+        int alpha0 = 0, alpha1 = 255;
+        for (int i = 0; i < 16; i++)
+        {
+            alpha0 = std::max(alpha0, int(pixels[i * 4 + 3]));
+            alpha1 = std::min(alpha1, int(pixels[i * 4 + 3]));
+        }
+
+        uint64_t indices = 0;
+        if (alpha0 != alpha1)
+        {
+            int palette[8] = {alpha0, alpha1};
+            for (int p = 2; p < 8; p++)
+            {
+                palette[p] = ((8 - p) * alpha0 + (p - 1) * alpha1) / 7;
+            }
+
+            for (int i = 0; i < 16; i++)
+            {
+                int best = 0, bestDistance = INT32_MAX;
+
+                for (int p = 0; p < 8; p++)
+                {
+                    auto distance = std::abs(pixels[i * 4 + 3] - palette[p]);
+
+                    if (distance < bestDistance)
+                    {
+                        best = p;
+                        bestDistance = distance;
+                    }
+                }
+
+                indices |= uint64_t(best) << (i * 3);
+            }
+        }
+
+        out[0] = uint8_t(alpha0);
+        out[1] = uint8_t(alpha1);
+        for (int i = 0; i < 6; i++)
+        {
+            out[2 + i] = uint8_t(indices >> (i * 8));
+        }
+    }
+
+    template <class EncodeBlock>
+    void EncodeBlocks(
+        const unsigned char *rgba,
+        int width,
+        int height,
+        size_t blockSize,
+        std::vector<unsigned char> &blocks,
+        EncodeBlock encodeBlock)
+    {
+        auto blocksWide = (width + 3) / 4;
+        auto blocksHigh = (height + 3) / 4;
+
+        blocks.resize(size_t(blocksWide) * size_t(blocksHigh) * blockSize);
+
+        unsigned char pixels[64];
+        for (int by = 0; by < blocksHigh; by++)
+        {
+            for (int bx = 0; bx < blocksWide; bx++)
+            {
+                for (int y = 0; y < 4; y++)
+                {
+                    auto row = rgba + size_t(std::min(by * 4 + y, height - 1)) * size_t(width) * 4;
+
+                    for (int x = 0; x < 4; x++)
+                    {
+                        memcpy(pixels + (y * 4 + x) * 4, row + std::min(bx * 4 + x, width - 1) * 4, 4);
+                    }
+                }
+
+                encodeBlock(pixels, blocks.data() + (size_t(by) * blocksWide + bx) * blockSize);
+            }
+        }
+    }
+} // namespace
+
+TextureCache::TextureCache(
+    const std::filesystem::path &directory)
+    : _directory(directory)
+{}
+
+bool TextureCache::Load(
+    uint64_t key,
+    TextureFormat format,
+    std::vector<valve::MipLevel> &levels) const
+{
+    std::ifstream file(_directory / fmt::format("{:016x}.tex", key), std::ios::binary);
+
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    uint32_t header[4] = {0, 0, 0, 0};
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+
+    if (!file || header[0] != CacheMagic || header[1] != CacheVersion || header[2] != uint32_t(format) || header[3] > 32)
+    {
+        return false;
+    }
+
+    levels.resize(header[3]);
+    for (auto &level : levels)
+    {
+        int32_t size[2] = {0, 0};
+        file.read(reinterpret_cast<char *>(size), sizeof(size));
+
+        if (!file || size[0] <= 0 || size[1] <= 0 || size[0] > 65536 || size[1] > 65536)
+        {
+            return false;
+        }
+
+        level.width = size[0];
+        level.height = size[1];
+        level.data.resize(TextureCompression::LevelSize(format, level.width, level.height));
+        file.read(reinterpret_cast<char *>(level.data.data()), std::streamsize(level.data.size()));
+
+        if (!file)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool TextureCache::Store(
+    uint64_t key,
+    TextureFormat format,
+    const std::vector<valve::MipLevel> &levels) const
+{
+    std::error_code error;
+    std::filesystem::create_directories(_directory, error);
+
+    if (error)
+    {
+        spdlog::warn("failed to create texture cache {}: {}", _directory.string(), error.message());
+
+        return false;
+    }
+
+    // Written under a temporary name, so another process never reads half a file
+    auto path = _directory / fmt::format("{:016x}.tex", key);
+    auto temporary = path;
+    temporary += fmt::format(".{}", std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    {
+        std::ofstream file(temporary, std::ios::binary);
+
+        uint32_t header[4] = {CacheMagic, CacheVersion, uint32_t(format), uint32_t(levels.size())};
+        file.write(reinterpret_cast<const char *>(header), sizeof(header));
+
+        for (auto &level : levels)
+        {
+            int32_t size[2] = {level.width, level.height};
+            file.write(reinterpret_cast<const char *>(size), sizeof(size));
+            file.write(reinterpret_cast<const char *>(level.data.data()), std::streamsize(level.data.size()));
+        }
+
+        if (!file)
+        {
+            spdlog::warn("failed to write texture cache entry {}", temporary.string());
+            file.close();
+            std::filesystem::remove(temporary, error);
+
+            return false;
+        }
+    }
+
+    std::filesystem::rename(temporary, path, error);
+
+    return !error;
+}
+
+size_t TextureCompression::LevelSize(
+    TextureFormat format,
+    int width,
+    int height)
+{
+    auto blocks = size_t((width + 3) / 4) * size_t((height + 3) / 4);
+
+    switch (format)
+    {
+        case TextureFormat::BC1:
+            return blocks * 8;
+        case TextureFormat::BC3:
+            return blocks * 16;
+        default:
+            return size_t(width) * size_t(height) * 4;
+    }
+}
+
+void TextureCompression::EncodeBC1(
+    const unsigned char *rgba,
+    int width,
+    int height,
+    std::vector<unsigned char> &blocks)
+{
+    EncodeBlocks(rgba, width, height, 8, blocks, [](const unsigned char *pixels, unsigned char *out) {
+        EncodeColorBlock(pixels, out);
+    });
+}
+
+void TextureCompression::EncodeBC3(
+    const unsigned char *rgba,
+    int width,
+    int height,
+    std::vector<unsigned char> &blocks)
+{
+    EncodeBlocks(rgba, width, height, 16, blocks, [](const unsigned char *pixels, unsigned char *out) {
+        EncodeAlphaBlock(pixels, out);
+        EncodeColorBlock(pixels, out + 8);
+    });
+}
+
+void TextureCompression::CompressLayer(
+    const valve::Texture &texture,
+    int width,
+    int height,
+    TextureFormat format,
+    std::vector<valve::MipLevel> &levels,
+    const TextureCache *cache,
+    bool *cached,
+    uint64_t *key)
+{
+    if (cached != nullptr)
+    {
+        *cached = false;
+    }
+
+    if (key != nullptr)
+    {
+        *key = 0;
+    }
+
+    auto alphaTestReference = !texture.Name().empty() && texture.Name()[0] == '{' ? AlphaTestReference : 0.0f;
+
+    std::vector<unsigned char> rgba;
+    TextureArrayLayout::PadToSizeClass(texture, width, height, rgba);
+
+    uint64_t layerKey = 0;
+    if (cache != nullptr)
+    {
+        uint32_t parameters[4] = {uint32_t(format), uint32_t(width), uint32_t(height), alphaTestReference > 0.0f ? 1u : 0u};
+
+        layerKey = Fnv1a(parameters, sizeof(parameters));
+        layerKey = Fnv1a(rgba.data(), rgba.size(), layerKey);
+
+        if (key != nullptr)
+        {
+            *key = layerKey;
+        }
+
+        if (cache->Load(layerKey, format, levels))
+        {
+            if (cached != nullptr)
+            {
+                *cached = true;
+            }
+
+            return;
+        }
+    }
+
+    valve::BuildGammaCorrectMipChain(rgba.data(), width, height, alphaTestReference, levels);
+
+    if (format != TextureFormat::RGBA8)
+    {
+        std::vector<unsigned char> blocks;
+
+        for (auto &level : levels)
+        {
+            if (format == TextureFormat::BC1)
+            {
+                EncodeBC1(level.data.data(), level.width, level.height, blocks);
+            }
+            else
+            {
+                EncodeBC3(level.data.data(), level.width, level.height, blocks);
+            }
+
+            level.data.swap(blocks);
+        }
+    }
+
+    if (cache != nullptr)
+    {
+        cache->Store(layerKey, format, levels);
+    }
+}
+
+TextureFormat TextureCompression::ArrayFormat(
+    const std::vector<valve::Texture *> &textures,
+    const TextureArray &array,
+    bool compress)
+{
+    if (!compress)
+    {
+        return TextureFormat::RGBA8;
+    }
+
+    for (auto t : array.textures)
+    {
+        auto &name = textures[t]->Name();
+        if (!name.empty() && name[0] == '{')
+        {
+            return TextureFormat::BC3;
+        }
+    }
+
+    return TextureFormat::BC1;
+}
+
+void TextureCompression::AppendLayer(
+    CompressedTextureArray &array,
+    const std::vector<valve::MipLevel> &levels)
+{
+    if (array.levels.empty())
+    {
+        array.levels.resize(levels.size());
+        for (size_t l = 0; l < levels.size(); l++)
+        {
+            array.levels[l].width = levels[l].width;
+            array.levels[l].height = levels[l].height;
+            array.levels[l].data.reserve(levels[l].data.size() * size_t(array.layers));
+        }
+    }
+
+    for (size_t l = 0; l < levels.size() && l < array.levels.size(); l++)
+    {
+        auto &data = array.levels[l].data;
+        data.insert(data.end(), levels[l].data.begin(), levels[l].data.end());
+    }
+}
+
+size_t TextureCompression::ArraySize(
+    const CompressedTextureArray &array)
+{
+    size_t size = 0;
+
+    for (auto &level : array.levels)
+    {
+        size += level.data.size();
+    }
+
+    return size;
+}
+
+void TextureCompression::CompressArrays(
+    const std::vector<valve::Texture *> &textures,
+    const TextureArrayLayout &layout,
+    bool compress,
+    const TextureCache *cache,
+    WorkerPool &workers,
+    std::vector<CompressedTextureArray> &arrays,
+    TextureCompressionStats &stats)
+{
+    PROFILE_ZONE("TextureCompression::CompressArrays");
+    ALLOCATION_SCOPE("render.textures");
+
+    class Job
+    {
+    public:
+        size_t array;
+        size_t layer;
+        std::vector<valve::MipLevel> levels;
+        bool cached = false;
+        uint64_t key = 0;
+    };
+
+    auto &layoutArrays = layout.Arrays();
+
+    arrays.assign(layoutArrays.size(), CompressedTextureArray());
+    stats = TextureCompressionStats();
+
+    std::vector<Job> jobs;
+    for (size_t a = 0; a < layoutArrays.size(); a++)
+    {
+        auto &array = arrays[a];
+        array.width = layoutArrays[a].width;
+        array.height = layoutArrays[a].height;
+        array.layers = int(layoutArrays[a].textures.size());
+        array.format = ArrayFormat(textures, layoutArrays[a], compress);
+
+        for (size_t l = 0; l < layoutArrays[a].textures.size(); l++)
+        {
+            jobs.push_back(Job{a, l, {}, false, 0});
+        }
+    }
+
+    workers.ParallelFor(jobs.size(), [&](size_t j) {
+        ALLOCATION_SCOPE("render.textures");
+
+        auto &job = jobs[j];
+        auto &array = arrays[job.array];
+        auto &texture = *textures[layoutArrays[job.array].textures[job.layer]];
+
+        CompressLayer(texture, array.width, array.height, array.format, job.levels, cache, &job.cached, &job.key);
+    });
+
+    // The jobs are in array and layer order, so the layers of a level are appended in order
+    for (auto &job : jobs)
+    {
+        auto &array = arrays[job.array];
+
+        AppendLayer(array, job.levels);
+        array.keys.push_back(job.key);
+
+        for (size_t l = 0; l < job.levels.size(); l++)
+        {
+            stats.rgbaBytes += LevelSize(TextureFormat::RGBA8, job.levels[l].width, job.levels[l].height);
+            stats.bytes += job.levels[l].data.size();
+        }
+
+        stats.layers++;
+        stats.cachedLayers += job.cached ? 1 : 0;
+    }
+
+    spdlog::info(
+        "built {} texture layers ({} from the cache), {} KiB instead of {} KiB as RGBA8",
+        stats.layers,
+        stats.cachedLayers,
+        stats.bytes / 1024,
+        stats.rgbaBytes / 1024);
+}
@@ -0,0 +1,132 @@
+#ifndef TEXTURECOMPRESSION_H
+#define TEXTURECOMPRESSION_H
+
+#include "hltexture.h"
+#include "texturearrays.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+class WorkerPool;
+
+// Builds the mip chains of the world texture arrays and encodes them to BC1 or BC3 on worker
+// threads, without touching GL, so the upload only has to hand the finished levels over. Arrays
+// without alpha tested textures are BC1, the others BC3. The levels are gamma correct and the
+// alpha of '{' textures keeps its coverage at the alpha test reference of the shaders.
+//
+// The encoded layers are kept in a TextureCache, keyed by a hash of their contents, so a texture
+// is only encoded once for every map that uses it.
+
+enum class TextureFormat
+{
+    RGBA8,
+    BC1,
+    BC3,
+};
+
+class CompressedTextureArray
+{
+public:
+    TextureFormat format = TextureFormat::RGBA8;
+    int width = 0;
+    int height = 0;
+    int layers = 0;
+    std::vector<valve::MipLevel> levels; // the layers of a level one after the other
+    std::vector<uint64_t> keys;          // cache key of every layer, 0 without a cache
+};
+
+class TextureCompressionStats
+{
+public:
+    size_t layers = 0;
+    size_t cachedLayers = 0;
+    size_t rgbaBytes = 0; // of all levels as RGBA8
+    size_t bytes = 0;
+};
+
+class TextureCache
+{
+public:
+    explicit TextureCache(
+        const std::filesystem::path &directory);
+
+    bool Load(
+        uint64_t key,
+        TextureFormat format,
+        std::vector<valve::MipLevel> &levels) const;
+
+    bool Store(
+        uint64_t key,
+        TextureFormat format,
+        const std::vector<valve::MipLevel> &levels) const;
+
+private:
+    std::filesystem::path _directory;
+};
+
+class TextureCompression
+{
+public:
+    // The alpha test reference of the solid blending shader
+    static constexpr float AlphaTestReference = 0.2f;
+
+    // Bytes of a level, BC levels are rounded up to whole 4x4 blocks
+    static size_t LevelSize(
+        TextureFormat format,
+        int width,
+        int height);
+
+    // Encodes an RGBA image, blocks over the edge repeat the last row and column
+    static void EncodeBC1(
+        const unsigned char *rgba,
+        int width,
+        int height,
+        std::vector<unsigned char> &blocks);
+
+    static void EncodeBC3(
+        const unsigned char *rgba,
+        int width,
+        int height,
+        std::vector<unsigned char> &blocks);
+
+    // Pads the texture to width x height and builds its levels in the format. The key is the
+    // one of the layer in the cache, so it can be loaded without the texture later.
+    static void CompressLayer(
+        const valve::Texture &texture,
+        int width,
+        int height,
+        TextureFormat format,
+        std::vector<valve::MipLevel> &levels,
+        const TextureCache *cache = nullptr,
+        bool *cached = nullptr,
+        uint64_t *key = nullptr);
+
+    // BC3 when one of the textures of the array is alpha tested
+    static TextureFormat ArrayFormat(
+        const std::vector<valve::Texture *> &textures,
+        const TextureArray &array,
+        bool compress);
+
+    // Appends the levels of the next layer, the array has its size and layer count set
+    static void AppendLayer(
+        CompressedTextureArray &array,
+        const std::vector<valve::MipLevel> &levels);
+
+    // Bytes of all levels
+    static size_t ArraySize(
+        const CompressedTextureArray &array);
+
+    // Processes the layers of all arrays on the worker pool. Without compression the arrays are
+    // RGBA8 with the same mip chains.
+    static void CompressArrays(
+        const std::vector<valve::Texture *> &textures,
+        const TextureArrayLayout &layout,
+        bool compress,
+        const TextureCache *cache,
+        WorkerPool &workers,
+        std::vector<CompressedTextureArray> &arrays,
+        TextureCompressionStats &stats);
+};
+
+#endif // TEXTURECOMPRESSION_H
@@ -0,0 +1,179 @@
+#include "textureresidency.h"
+
+#include "profiler.h"
+
+#include <algorithm>
+
+void TextureResidency::Setup(
+    const TextureArrayLayout &layout,
+    const std::vector<size_t> &arrayBytes,
+    const std::vector<size_t> &textureBytes,
+    size_t gpuBudget,
+    size_t cpuBudget)
+{
+    _gpuBudget = gpuBudget;
+    _cpuBudget = cpuBudget;
+    _gpuBytes = 0;
+    _cpuBytes = 0;
+    _frame = 0;
+
+    _arrays.assign(layout.Arrays().size(), Array());
+    for (size_t a = 0; a < _arrays.size() && a < arrayBytes.size(); a++)
+    {
+        _arrays[a].bytes = arrayBytes[a];
+    }
+
+    _textures.assign(layout.Slots().size(), Texture());
+    for (size_t t = 0; t < _textures.size(); t++)
+    {
+        _textures[t].array = layout.Slots()[t].array;
+        _textures[t].bytes = t < textureBytes.size() ? textureBytes[t] : 0;
+
+        _cpuBytes += _textures[t].bytes;
+    }
+
+    _arraysToLoad.clear();
+    _arraysToEvict.clear();
+    _texturesToRelease.clear();
+}
+
+void TextureResidency::Update(
+    const std::vector<bool> &referenced)
+{
+    PROFILE_ZONE("TextureResidency::Update");
+
+    _frame++;
+
+    _arraysToLoad.clear();
+    _arraysToEvict.clear();
+    _texturesToRelease.clear();
+
+    for (size_t t = 0; t < _textures.size() && t < referenced.size(); t++)
+    {
+        if (referenced[t])
+        {
+            _textures[t].lastUsed = _frame;
+            _arrays[_textures[t].array].lastUsed = _frame;
+        }
+    }
+
+    for (size_t a = 0; a < _arrays.size(); a++)
+    {
+        if (_arrays[a].lastUsed == _frame && _arrays[a].state == ArrayState::Evicted)
+        {
+            _arrays[a].state = ArrayState::Loading;
+            _gpuBytes += _arrays[a].bytes;
+            _arraysToLoad.push_back(int(a));
+        }
+    }
+
+    // Only resident arrays are evicted, a loading array has an upload that still writes to it
+    if (_gpuBytes > _gpuBudget)
+    {
+        _candidates.clear();
+        for (size_t a = 0; a < _arrays.size(); a++)
+        {
+            if (_arrays[a].state == ArrayState::Resident && _arrays[a].lastUsed < _frame)
+            {
+                _candidates.push_back(int(a));
+            }
+        }
+
+        std::sort(_candidates.begin(), _candidates.end(), [this](int a, int b) {
+            return _arrays[a].lastUsed < _arrays[b].lastUsed;
+        });
+
+        for (size_t c = 0; c < _candidates.size() && _gpuBytes > _gpuBudget; c++)
+        {
+            auto &array = _arrays[_candidates[c]];
+
+            array.state = ArrayState::Evicted;
+            _gpuBytes -= array.bytes;
+            _arraysToEvict.push_back(_candidates[c]);
+        }
+    }
+
+    // The textures of loading arrays are still needed to build their layers
+    if (_cpuBytes > _cpuBudget)
+    {
+        _candidates.clear();
+        for (size_t t = 0; t < _textures.size(); t++)
+        {
+            auto &texture = _textures[t];
+
+            if (texture.decoded && texture.lastUsed < _frame && _arrays[texture.array].state != ArrayState::Loading)
+            {
+                _candidates.push_back(int(t));
+            }
+        }
+
+        std::sort(_candidates.begin(), _candidates.end(), [this](int a, int b) {
+            return _textures[a].lastUsed < _textures[b].lastUsed;
+        });
+
+        for (size_t c = 0; c < _candidates.size() && _cpuBytes > _cpuBudget; c++)
+        {
+            auto &texture = _textures[_candidates[c]];
+
+            texture.decoded = false;
+            _cpuBytes -= texture.bytes;
+            _texturesToRelease.push_back(_candidates[c]);
+        }
+    }
+}
+
+const std::vector<int> &TextureResidency::ArraysToLoad() const
+{
+    return _arraysToLoad;
+}
+
+const std::vector<int> &TextureResidency::ArraysToEvict() const
+{
+    return _arraysToEvict;
+}
+
+const std::vector<int> &TextureResidency::TexturesToRelease() const
+{
+    return _texturesToRelease;
+}
+
+void TextureResidency::ArrayLoaded(
+    int array)
+{
+    if (_arrays[array].state == ArrayState::Loading)
+    {
+        _arrays[array].state = ArrayState::Resident;
+    }
+}
+
+void TextureResidency::TextureDecoded(
+    int texture)
+{
+    if (!_textures[texture].decoded)
+    {
+        _textures[texture].decoded = true;
+        _cpuBytes += _textures[texture].bytes;
+    }
+}
+
+TextureResidency::ArrayState TextureResidency::State(
+    int array) const
+{
+    return _arrays[array].state;
+}
+
+bool TextureResidency::IsDecoded(
+    int texture) const
+{
+    return _textures[texture].decoded;
+}
+
+size_t TextureResidency::GpuBytes() const
+{
+    return _gpuBytes;
+}
+
+size_t TextureResidency::CpuBytes() const
+{
+    return _cpuBytes;
+}
@@ -0,0 +1,101 @@
+#ifndef TEXTURERESIDENCY_H
+#define TEXTURERESIDENCY_H
+
+#include "texturearrays.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Decides which world textures are kept in memory, so a big map doesn't keep every texture on
+// the GPU and every decoded texture on the CPU for as long as it is loaded. The caller tells it
+// every frame which textures the faces around the camera use, it answers with the texture
+// arrays to load and to evict and the decoded textures to release.
+//
+// GPU copies are whole texture arrays, an array is loaded when one of its textures is used and
+// evicted least recently used first once the arrays are over the GPU budget. CPU copies are the
+// decoded textures, only needed to build the layers again when they are not in the cache. They
+// are released least recently used first once they are over the CPU budget. Arrays and textures
+// that are used in the frame are never evicted, so the budgets can be exceeded by what is around
+// the camera.
+//
+// This is only the bookkeeping, creating and deleting the textures is up to the caller.
+
+class TextureResidency
+{
+public:
+    enum class ArrayState
+    {
+        Evicted,
+        Loading,
+        Resident,
+    };
+
+    // All arrays start evicted and all textures decoded, the budgets are in bytes
+    void Setup(
+        const TextureArrayLayout &layout,
+        const std::vector<size_t> &arrayBytes,
+        const std::vector<size_t> &textureBytes,
+        size_t gpuBudget,
+        size_t cpuBudget);
+
+    // referenced has a flag for every texture, the decisions are valid until the next update
+    void Update(
+        const std::vector<bool> &referenced);
+
+    const std::vector<int> &ArraysToLoad() const;
+
+    const std::vector<int> &ArraysToEvict() const;
+
+    const std::vector<int> &TexturesToRelease() const;
+
+    // A loading array whose upload is done
+    void ArrayLoaded(
+        int array);
+
+    // A released texture that was decoded again to load its array
+    void TextureDecoded(
+        int texture);
+
+    ArrayState State(
+        int array) const;
+
+    bool IsDecoded(
+        int texture) const;
+
+    size_t GpuBytes() const;
+
+    size_t CpuBytes() const;
+
+private:
+    class Array
+    {
+    public:
+        ArrayState state = ArrayState::Evicted;
+        size_t bytes = 0;
+        uint64_t lastUsed = 0;
+    };
+
+    class Texture
+    {
+    public:
+        int array = 0;
+        bool decoded = true;
+        size_t bytes = 0;
+        uint64_t lastUsed = 0;
+    };
+
+    std::vector<Array> _arrays;
+    std::vector<Texture> _textures;
+    size_t _gpuBudget = 0;
+    size_t _cpuBudget = 0;
+    size_t _gpuBytes = 0; // of the loading and resident arrays
+    size_t _cpuBytes = 0;
+    uint64_t _frame = 0;
+    std::vector<int> _arraysToLoad;
+    std::vector<int> _arraysToEvict;
+    std::vector<int> _texturesToRelease;
+    std::vector<int> _candidates;
+};
+
+#endif // TEXTURERESIDENCY_H
@@ -0,0 +1,304 @@
+#include "textureuploads.h"
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <spdlog/spdlog.h>
+
+void TextureUploadScheduler::Setup(
+    size_t frameBudget)
+{
+    _frameBudget = frameBudget;
+
+    glGenBuffers(RingSize, _buffers);
+    for (auto buffer : _buffers)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(_frameBudget), nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void TextureUploadScheduler::Cleanup()
+{
+    for (auto &fence : _fences)
+    {
+        if (fence != nullptr)
+        {
+            glDeleteSync(fence);
+            fence = nullptr;
+        }
+    }
+
+    if (_buffers[0] != 0)
+    {
+        glDeleteBuffers(RingSize, _buffers);
+        std::fill(std::begin(_buffers), std::end(_buffers), 0);
+    }
+
+    _uploads.clear();
+    _pending.clear();
+}
+
+int TextureUploadScheduler::Enqueue(
+    GLenum target,
+    GLuint texture,
+    const TextureUploadFormat &format,
+    int layers,
+    std::vector<valve::MipLevel> &&levels)
+{
+    Upload upload;
+    upload.target = target;
+    upload.texture = texture;
+    upload.format = format;
+    upload.layers = std::max(1, layers);
+    upload.levels = std::move(levels);
+
+    auto compressed = format.format == 0;
+
+    // The storage is allocated without data, which would be read from a bound unpack buffer
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glBindTexture(target, texture);
+    glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, std::max(0, int(upload.levels.size()) - 1));
+
+    size_t largestRow = 0;
+    for (size_t l = 0; l < upload.levels.size(); l++)
+    {
+        auto &level = upload.levels[l];
+
+        if (target == GL_TEXTURE_2D_ARRAY && compressed)
+        {
+            glCompressedTexImage3D(target, GLint(l), format.internalFormat, level.width, level.height, upload.layers, 0, GLsizei(level.data.size()), nullptr);
+        }
+        else if (target == GL_TEXTURE_2D_ARRAY)
+        {
+            glTexImage3D(target, GLint(l), GLint(format.internalFormat), level.width, level.height, upload.layers, 0, format.format, GL_UNSIGNED_BYTE, nullptr);
+        }
+        else if (compressed)
+        {
+            glCompressedTexImage2D(target, GLint(l), format.internalFormat, level.width, level.height, 0, GLsizei(level.data.size()), nullptr);
+        }
+        else
+        {
+            glTexImage2D(target, GLint(l), GLint(format.internalFormat), level.width, level.height, 0, format.format, GL_UNSIGNED_BYTE, nullptr);
+        }
+
+        largestRow = std::max(largestRow, RowSize(upload, level));
+    }
+
+    // A row is never split, so the ring grows when one doesn't fit. Respecifying the buffers
+    // leaves the uploads still reading the old storage alone.
+    if (largestRow > _frameBudget && _buffers[0] != 0)
+    {
+        spdlog::warn("texture rows of {} bytes do not fit the upload budget of {} bytes", largestRow, _frameBudget);
+
+        _frameBudget = largestRow;
+        for (auto buffer : _buffers)
+        {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, GLsizeiptr(_frameBudget), nullptr, GL_STREAM_DRAW);
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    _uploads.push_back(std::move(upload));
+    _pending.push_back(int(_uploads.size() - 1));
+
+    return int(_uploads.size() - 1);
+}
+
+void TextureUploadScheduler::SetPriority(
+    int upload,
+    float priority)
+{
+    _uploads[upload].priority = priority;
+}
+
+bool TextureUploadScheduler::IsResident(
+    int upload) const
+{
+    return upload >= 0 && size_t(upload) < _uploads.size() && _uploads[upload].resident;
+}
+
+size_t TextureUploadScheduler::PendingCount() const
+{
+    return _pending.size();
+}
+
+size_t TextureUploadScheduler::Update(
+    bool wait)
+{
+    PROFILE_ZONE("TextureUploadScheduler::Update");
+
+    if (_pending.empty() || _buffers[0] == 0)
+    {
+        return 0;
+    }
+
+    auto &fence = _fences[_next];
+    if (fence != nullptr)
+    {
+        auto result = glClientWaitSync(fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? GLuint64(1000000000) : 0);
+        while (wait && result == GL_TIMEOUT_EXPIRED)
+        {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000));
+        }
+
+        // The GPU still reads from this buffer, try again next frame
+        if (result == GL_TIMEOUT_EXPIRED)
+        {
+            return 0;
+        }
+
+        glDeleteSync(fence);
+        fence = nullptr;
+    }
+
+    std::stable_sort(_pending.begin(), _pending.end(), [this](int a, int b) {
+        return _uploads[a].priority < _uploads[b].priority;
+    });
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _buffers[_next]);
+
+    auto mapped = static_cast<unsigned char *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, GLsizeiptr(_frameBudget), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+
+    if (mapped == nullptr)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        return 0;
+    }
+
+    _copies.clear();
+
+    size_t offset = 0;
+    for (auto id : _pending)
+    {
+        auto &upload = _uploads[id];
+
+        while (upload.level < upload.levels.size())
+        {
+            auto &level = upload.levels[upload.level];
+            auto rowSize = RowSize(upload, level);
+            auto rowCount = RowCount(upload, level);
+            auto rows = std::min(rowCount - upload.row, int((_frameBudget - offset) / rowSize));
+
+            if (rows <= 0)
+            {
+                break;
+            }
+
+            auto source = level.data.data() + (size_t(upload.layer) * size_t(rowCount) + size_t(upload.row)) * rowSize;
+            memcpy(mapped + offset, source, size_t(rows) * rowSize);
+
+            _copies.push_back(Copy{id, upload.level, upload.layer, upload.row, rows, offset, size_t(rows) * rowSize});
+            offset += size_t(rows) * rowSize;
+
+            upload.row += rows;
+            if (upload.row == rowCount)
+            {
+                upload.row = 0;
+                if (++upload.layer == upload.layers)
+                {
+                    upload.layer = 0;
+                    upload.level++;
+                }
+            }
+        }
+
+        if (upload.level < upload.levels.size())
+        {
+            break;
+        }
+    }
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for (auto &copy : _copies)
+    {
+        IssueCopy(_uploads[copy.upload], copy);
+    }
+
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    _next = (_next + 1) % RingSize;
+
+    _pending.erase(
+        std::remove_if(_pending.begin(), _pending.end(), [this](int id) {
+            auto &upload = _uploads[id];
+
+            if (upload.level < upload.levels.size())
+            {
+                return false;
+            }
+
+            upload.resident = true;
+            std::vector<valve::MipLevel>().swap(upload.levels);
+
+            return true;
+        }),
+        _pending.end());
+
+    return offset;
+}
+
+void TextureUploadScheduler::Finish()
+{
+    PROFILE_ZONE("TextureUploadScheduler::Finish");
+
+    while (!_pending.empty())
+    {
+        Update(true);
+    }
+}
+
+int TextureUploadScheduler::RowCount(
+    const Upload &upload,
+    const valve::MipLevel &level)
+{
+    return upload.format.format == 0 ? (level.height + 3) / 4 : level.height;
+}
+
+size_t TextureUploadScheduler::RowSize(
+    const Upload &upload,
+    const valve::MipLevel &level)
+{
+    auto width = upload.format.format == 0 ? (level.width + 3) / 4 : level.width;
+
+    return size_t(width) * size_t(upload.format.bytesPerPixel);
+}
+
+void TextureUploadScheduler::IssueCopy(
+    const Upload &upload,
+    const Copy &copy) const
+{
+    auto &level = upload.levels[copy.level];
+    auto compressed = upload.format.format == 0;
+    auto data = reinterpret_cast<const void *>(copy.offset);
+
+    // Compressed rows are 4 pixels high, the last one can be cut off by the level
+    auto y = compressed ? copy.row * 4 : copy.row;
+    auto height = compressed ? std::min(copy.rows * 4, level.height - y) : copy.rows;
+
+    glBindTexture(upload.target, upload.texture);
+
+    if (upload.target == GL_TEXTURE_2D_ARRAY && compressed)
+    {
+        glCompressedTexSubImage3D(upload.target, GLint(copy.level), 0, y, copy.layer, level.width, height, 1, upload.format.internalFormat, GLsizei(copy.size), data);
+    }
+    else if (upload.target == GL_TEXTURE_2D_ARRAY)
+    {
+        glTexSubImage3D(upload.target, GLint(copy.level), 0, y, copy.layer, level.width, height, 1, upload.format.format, GL_UNSIGNED_BYTE, data);
+    }
+    else if (compressed)
+    {
+        glCompressedTexSubImage2D(upload.target, GLint(copy.level), 0, y, level.width, height, upload.format.internalFormat, GLsizei(copy.size), data);
+    }
+    else
+    {
+        glTexSubImage2D(upload.target, GLint(copy.level), 0, y, level.width, height, upload.format.format, GL_UNSIGNED_BYTE, data);
+    }
+}
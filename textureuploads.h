@@ -0,0 +1,117 @@
+#ifndef TEXTUREUPLOADS_H
+#define TEXTUREUPLOADS_H
+
+#include "hltexture.h"
+
+#include <cstddef>
+#include <glad/glad.h>
+#include <vector>
+
+// Streams texture data to GL through a ring of pixel unpack buffers, so loading a map doesn't
+// stall on uploading everything before the first frame. Update copies up to the frame budget
+// into the next buffer of the ring and issues the sub image uploads from it. A buffer is only
+// written again once the fence of its last uploads has passed, if the GPU is behind the frame
+// uploads nothing.
+//
+// Uploads are picked by priority, lower first, and split into rows, or rows of 4x4 blocks for
+// compressed formats, so a big level can take several frames. An upload is resident once all
+// of its data is handed to GL, draws after that see the texture.
+
+class TextureUploadFormat
+{
+public:
+    GLenum internalFormat = GL_RGBA8;
+    GLenum format = GL_RGBA; // 0 for compressed formats
+    int bytesPerPixel = 4;   // or bytes per 4x4 block for compressed formats
+};
+
+class TextureUploadScheduler
+{
+public:
+    static const int RingSize = 3;
+
+    // Every buffer of the ring holds frameBudget bytes, a row of any upload has to fit
+    void Setup(
+        size_t frameBudget);
+
+    void Cleanup();
+
+    // Allocates all levels of the texture, target is GL_TEXTURE_2D or GL_TEXTURE_2D_ARRAY. The
+    // levels hold the layers one after the other. Returns the id of the upload.
+    int Enqueue(
+        GLenum target,
+        GLuint texture,
+        const TextureUploadFormat &format,
+        int layers,
+        std::vector<valve::MipLevel> &&levels);
+
+    void SetPriority(
+        int upload,
+        float priority);
+
+    bool IsResident(
+        int upload) const;
+
+    size_t PendingCount() const;
+
+    // Returns the number of bytes handed to GL. With wait set it blocks on the ring instead of
+    // skipping the frame.
+    size_t Update(
+        bool wait = false);
+
+    // Uploads everything that is left
+    void Finish();
+
+private:
+    class Upload
+    {
+    public:
+        GLenum target = GL_TEXTURE_2D;
+        GLuint texture = 0;
+        TextureUploadFormat format;
+        int layers = 1;
+        std::vector<valve::MipLevel> levels;
+        float priority = 0.0f;
+        bool resident = false;
+
+        // where the next row starts
+        size_t level = 0;
+        int layer = 0;
+        int row = 0;
+    };
+
+    class Copy
+    {
+    public:
+        int upload;
+        size_t level;
+        int layer;
+        int row;
+        int rows;
+        size_t offset; // in the buffer
+        size_t size;
+    };
+
+    // Rows are pixel rows, or rows of blocks for compressed formats
+    static int RowCount(
+        const Upload &upload,
+        const valve::MipLevel &level);
+
+    static size_t RowSize(
+        const Upload &upload,
+        const valve::MipLevel &level);
+
+    void IssueCopy(
+        const Upload &upload,
+        const Copy &copy) const;
+
+    size_t _frameBudget = 0;
+    GLuint _buffers[RingSize] = {0, 0, 0};
+    GLsync _fences[RingSize] = {nullptr, nullptr, nullptr};
+    int _next = 0;
+    std::vector<Upload> _uploads;
+    std::vector<int> _pending;
+    std::vector<Copy> _copies;
+};
+
+#endif // TEXTUREUPLOADS_H
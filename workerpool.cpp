@@ -0,0 +1,140 @@
+#include "workerpool.h"
+
+#include "profiler.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(
+    unsigned int threadCount)
+{
+    if (threadCount == 0)
+    {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned int i = 1; i < threadCount; i++)
+    {
+        _threads.emplace_back(&WorkerPool::Run, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        _stopping = true;
+    }
+
+    _wake.notify_all();
+
+    for (auto &thread : _threads)
+    {
+        thread.join();
+    }
+}
+
+unsigned int WorkerPool::ThreadCount() const
+{
+    return (unsigned int)(_threads.size() + 1);
+}
+
+void WorkerPool::ParallelFor(
+    size_t count,
+    const std::function<void(size_t index)> &func,
+    unsigned int maxThreads)
+{
+    PROFILE_ZONE("WorkerPool::ParallelFor");
+
+    auto threadCount = size_t(maxThreads == 0 ? ThreadCount() : std::min(maxThreads, ThreadCount()));
+    threadCount = std::min(threadCount, count);
+
+    if (threadCount <= 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            func(i);
+        }
+
+        return;
+    }
+
+    // Shared with the helpers, a helper that only starts after the last item is taken returns
+    // without touching func, which is gone by then
+    class State
+    {
+    public:
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        size_t count = 0;
+        const std::function<void(size_t)> *func = nullptr;
+        std::mutex lock;
+        std::condition_variable finished;
+    };
+
+    auto state = std::make_shared<State>();
+    state->count = count;
+    state->func = &func;
+
+    auto work = [state]() {
+        for (auto i = state->next++; i < state->count; i = state->next++)
+        {
+            (*state->func)(i);
+
+            if (++state->done == state->count)
+            {
+                std::lock_guard<std::mutex> lock(state->lock);
+
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    for (size_t t = 1; t < threadCount; t++)
+    {
+        Push(work);
+    }
+
+    work();
+
+    std::unique_lock<std::mutex> lock(state->lock);
+    state->finished.wait(lock, [&state]() { return state->done == state->count; });
+}
+
+void WorkerPool::Push(
+    std::function<void()> &&job)
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+
+        _jobs.push_back(std::move(job));
+    }
+
+    _wake.notify_one();
+}
+
+void WorkerPool::Run()
+{
+    PROFILE_THREAD("worker");
+
+    while (true)
+    {
+        std::function<void()> job;
+
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+
+            _wake.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+
+            if (_stopping && _jobs.empty())
+            {
+                return;
+            }
+
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+
+        job();
+    }
+}
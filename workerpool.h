@@ -0,0 +1,82 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Threads that are started once and reused, so work that is spread over cores every frame
+// doesn't pay for creating threads every frame.
+//
+// ParallelFor runs the items on the calling thread as well. Workers that are free help with it,
+// so it finishes on the calling thread alone when all workers are busy with long jobs from Submit.
+//
+//     WorkerPool workers;
+//     workers.ParallelFor(entities.size(), [&](size_t i) { entities[i]->SetUpBones(); });
+//     auto result = workers.Submit([]() { return LoadSomething(); });
+
+class WorkerPool
+{
+public:
+    // threadCount counts the calling thread, 0 uses a thread per core
+    explicit WorkerPool(
+        unsigned int threadCount = 0);
+
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // The workers and the calling thread
+    unsigned int ThreadCount() const;
+
+    // Calls func(i) for every i in [0, count) on up to maxThreads threads, the calling thread
+    // included, and returns when all calls are done. 0 uses all threads.
+    void ParallelFor(
+        size_t count,
+        const std::function<void(size_t index)> &func,
+        unsigned int maxThreads = 0);
+
+    // Runs func on a worker, jobs start in the order they are submitted
+    template <class Func>
+    std::future<typename std::result_of<Func()>::type> Submit(
+        Func func)
+    {
+        using Result = typename std::result_of<Func()>::type;
+
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::move(func));
+        auto result = task->get_future();
+
+        if (_threads.empty())
+        {
+            (*task)();
+        }
+        else
+        {
+            Push([task]() { (*task)(); });
+        }
+
+        return result;
+    }
+
+private:
+    void Push(
+        std::function<void()> &&job);
+
+    void Run();
+
+    std::vector<std::thread> _threads;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::deque<std::function<void()>> _jobs;
+    bool _stopping = false;
+};
+
+#endif // WORKERPOOL_H
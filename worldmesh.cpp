@@ -0,0 +1,433 @@
+#include "worldmesh.h"
+
+#include "allocationtracker.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <spdlog/spdlog.h>
+#include <unordered_map>
+
+namespace
+{
+    // The constants of Tom Forsyth's "Linear-Speed Vertex Cache Optimisation"
+    const float CacheDecayPower = 1.5f;
+    const float LastTriangleScore = 0.75f;
+    const float ValenceBoostScale = 2.0f;
+    const float ValenceBoostPower = 0.5f;
+
+    float VertexScore(
+        int cachePosition,
+        int remainingTriangles)
+    {
+        if (remainingTriangles == 0)
+        {
+            return -1.0f;
+        }
+
+        float score = 0.0f;
+
+        if (cachePosition >= 0)
+        {
+            // The vertices of the last triangle get a fixed score, so the next triangle doesn't
+            // just share an edge with it and make a strip
+            if (cachePosition < 3)
+            {
+                score = LastTriangleScore;
+            }
+            else
+            {
+                const float scaler = 1.0f / float(WorldMesh::OptimizedCacheSize - 3);
+
+                score = std::pow(1.0f - float(cachePosition - 3) * scaler, CacheDecayPower);
+            }
+        }
+
+        // Vertices with few triangles left are worth finishing, so they don't stay behind
+        score += ValenceBoostScale * std::pow(float(remainingTriangles), -ValenceBoostPower);
+
+        return score;
+    }
+
+    // The vertex is compared bit for bit, it is already quantized
+    class VertexKey
+    {
+    public:
+        uint64_t bits[2];
+
+        bool operator==(
+            const VertexKey &other) const
+        {
+            return bits[0] == other.bits[0] && bits[1] == other.bits[1];
+        }
+    };
+
+    class VertexKeyHash
+    {
+    public:
+        size_t operator()(
+            const VertexKey &key) const
+        {
+            return std::hash<uint64_t>()(key.bits[0] ^ (key.bits[1] * 0x9e3779b97f4a7c15ull));
+        }
+    };
+
+    static_assert(sizeof(VertexKey) == sizeof(valve::tVertex), "a vertex key is the whole vertex");
+} // namespace
+
+void WorldMesh::Build(
+    const valve::hl1::BspAsset &bspAsset,
+    const TextureArrayLayout *textureArrays)
+{
+    PROFILE_ZONE("WorldMesh::Build");
+    ALLOCATION_SCOPE("bsp.mesh");
+
+    _vertices.clear();
+    _indices.clear();
+    _batches.clear();
+    _modelBatches.assign(bspAsset._models.size(), std::make_pair(size_t(0), size_t(0)));
+    _stats = WorldMeshStats();
+
+    size_t indexedMisses = 0, optimizedMisses = 0;
+
+    std::vector<int> faces;
+    std::vector<uint32_t> fan;
+    std::unordered_map<VertexKey, uint32_t, VertexKeyHash> welded;
+
+    auto batchTexture = [&bspAsset, textureArrays](int face) {
+        auto texture = bspAsset._faces[face].texture;
+
+        if (textureArrays != nullptr && texture < textureArrays->Slots().size())
+        {
+            return (unsigned int)textureArrays->Slots()[texture].array;
+        }
+
+        return texture;
+    };
+
+    for (size_t m = 0; m < bspAsset._models.size(); m++)
+    {
+        auto &model = bspAsset._models[m];
+
+        faces.clear();
+        for (int f = model.firstFace; f < model.firstFace + model.faceCount; f++)
+        {
+            if (bspAsset._faces[f].flags == 0 && bspAsset._faces[f].vertexCount >= 3)
+            {
+                faces.push_back(f);
+            }
+        }
+
+        std::stable_sort(faces.begin(), faces.end(), [&bspAsset, &batchTexture](int a, int b) {
+            auto textureA = batchTexture(a);
+            auto textureB = batchTexture(b);
+
+            if (textureA != textureB)
+            {
+                return textureA < textureB;
+            }
+
+            return bspAsset._faces[a].lightmap < bspAsset._faces[b].lightmap;
+        });
+
+        _modelBatches[m].first = _batches.size();
+
+        for (size_t i = 0; i < faces.size();)
+        {
+            WorldMeshBatch batch;
+            batch.model = int(m);
+            batch.texture = batchTexture(faces[i]);
+            batch.lightmap = bspAsset._faces[faces[i]].lightmap;
+            batch.firstIndex = uint32_t(_indices.size());
+
+            auto baseVertex = uint32_t(_vertices.size());
+            welded.clear();
+
+            for (; i < faces.size(); i++)
+            {
+                auto &face = bspAsset._faces[faces[i]];
+
+                if (batchTexture(faces[i]) != batch.texture || face.lightmap != batch.lightmap)
+                {
+                    break;
+                }
+
+                int16_t layer = 0;
+                if (textureArrays != nullptr && face.texture < textureArrays->Slots().size())
+                {
+                    layer = int16_t(textureArrays->Slots()[face.texture].layer);
+                }
+
+                fan.clear();
+                for (int v = face.firstVertex; v < face.firstVertex + face.vertexCount; v++)
+                {
+                    auto vertex = bspAsset._vertices[v];
+                    vertex.layer = layer;
+
+                    VertexKey key;
+                    memcpy(key.bits, &vertex, sizeof(key.bits));
+
+                    auto found = welded.find(key);
+                    if (found == welded.end())
+                    {
+                        found = welded.emplace(key, uint32_t(_vertices.size()) - baseVertex).first;
+                        _vertices.push_back(vertex);
+                    }
+
+                    fan.push_back(found->second);
+                }
+
+                for (size_t k = 1; k + 1 < fan.size(); k++)
+                {
+                    _indices.push_back(fan[0]);
+                    _indices.push_back(fan[k]);
+                    _indices.push_back(fan[k + 1]);
+                }
+
+                _stats.faceVertices += fan.size();
+                batch.faceCount++;
+            }
+
+            batch.indexCount = uint32_t(_indices.size()) - batch.firstIndex;
+
+            auto batchIndices = _indices.data() + batch.firstIndex;
+
+            indexedMisses += CacheMisses(batchIndices, batch.indexCount, MeasuredCacheSize);
+            OptimizeVertexCache(batchIndices, batch.indexCount, uint32_t(_vertices.size()) - baseVertex);
+            optimizedMisses += CacheMisses(batchIndices, batch.indexCount, MeasuredCacheSize);
+
+            for (uint32_t k = 0; k < batch.indexCount; k++)
+            {
+                batchIndices[k] += baseVertex;
+            }
+
+            _batches.push_back(batch);
+        }
+
+        _modelBatches[m].second = _batches.size();
+    }
+
+    _stats.vertices = _vertices.size();
+    _stats.triangles = _indices.size() / 3;
+    _stats.batches = _batches.size();
+
+    if (_stats.triangles > 0)
+    {
+        auto triangles = double(_stats.triangles);
+
+        _stats.acmrFans = double(_stats.faceVertices) / triangles;
+        _stats.acmrIndexed = double(indexedMisses) / triangles;
+        _stats.acmrOptimized = double(optimizedMisses) / triangles;
+    }
+
+    spdlog::info(
+        "world mesh: {} batches, {} triangles, {} of {} vertices after welding, ACMR {:.3f} fans, {:.3f} indexed, {:.3f} optimized",
+        _stats.batches,
+        _stats.triangles,
+        _stats.vertices,
+        _stats.faceVertices,
+        _stats.acmrFans,
+        _stats.acmrIndexed,
+        _stats.acmrOptimized);
+}
+
+void WorldMesh::ReleaseGeometry()
+{
+    std::vector<valve::tVertex>().swap(_vertices);
+    std::vector<uint32_t>().swap(_indices);
+}
+
+std::pair<size_t, size_t> WorldMesh::ModelBatches(
+    int model) const
+{
+    if (model < 0 || size_t(model) >= _modelBatches.size())
+    {
+        return std::make_pair(size_t(0), size_t(0));
+    }
+
+    return _modelBatches[model];
+}
+
+const std::vector<valve::tVertex> &WorldMesh::Vertices() const
+{
+    return _vertices;
+}
+
+const std::vector<uint32_t> &WorldMesh::Indices() const
+{
+    return _indices;
+}
+
+const std::vector<WorldMeshBatch> &WorldMesh::Batches() const
+{
+    return _batches;
+}
+
+const WorldMeshStats &WorldMesh::Stats() const
+{
+    return _stats;
+}
+
+size_t WorldMesh::CacheMisses(
+    const uint32_t *indices,
+    size_t indexCount,
+    int cacheSize)
+{
+    std::vector<uint32_t> cache(size_t(cacheSize), UINT32_MAX);
+    size_t next = 0, misses = 0;
+
+    for (size_t i = 0; i < indexCount; i++)
+    {
+        if (std::find(cache.begin(), cache.end(), indices[i]) != cache.end())
+        {
+            continue;
+        }
+
+        cache[next] = indices[i];
+        next = (next + 1) % cache.size();
+        misses++;
+    }
+
+    return misses;
+}
+
+void WorldMesh::OptimizeVertexCache(
+    uint32_t *indices,
+    size_t indexCount,
+    uint32_t vertexCount)
+{
+    auto triangleCount = indexCount / 3;
+
+    if (triangleCount < 2)
+    {
+        return;
+    }
+
+    // The triangles of every vertex, the triangles that are not added yet are kept at the front
+    // of the range of the vertex
+    std::vector<uint32_t> triangleOffsets(vertexCount + 1, 0);
+    std::vector<int> remaining(vertexCount, 0);
+    for (size_t i = 0; i < triangleCount * 3; i++)
+    {
+        remaining[indices[i]]++;
+    }
+
+    for (uint32_t v = 0; v < vertexCount; v++)
+    {
+        triangleOffsets[v + 1] = triangleOffsets[v] + uint32_t(remaining[v]);
+    }
+
+    std::vector<uint32_t> vertexTriangles(triangleCount * 3);
+    {
+        std::vector<uint32_t> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                vertexTriangles[fill[indices[t * 3 + k]]++] = uint32_t(t);
+            }
+        }
+    }
+
+    std::vector<int> cachePositions(vertexCount, -1);
+    std::vector<float> vertexScores(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; v++)
+    {
+        vertexScores[v] = VertexScore(-1, remaining[v]);
+    }
+
+    std::vector<float> triangleScores(triangleCount);
+    std::vector<bool> added(triangleCount, false);
+    for (size_t t = 0; t < triangleCount; t++)
+    {
+        triangleScores[t] = vertexScores[indices[t * 3]] + vertexScores[indices[t * 3 + 1]] + vertexScores[indices[t * 3 + 2]];
+    }
+
+    std::vector<uint32_t> output;
+    output.reserve(triangleCount * 3);
+
+    std::vector<uint32_t> cache, nextCache;
+    cache.reserve(OptimizedCacheSize + 3);
+    nextCache.reserve(OptimizedCacheSize + 3);
+
+    auto best = std::max_element(triangleScores.begin(), triangleScores.end()) - triangleScores.begin();
+    size_t nextUnadded = 0;
+
+    for (size_t n = 0; n < triangleCount; n++)
+    {
+        // Nothing in the cache has a triangle left, continue with the first one that is left
+        if (best < 0)
+        {
+            while (added[nextUnadded])
+            {
+                nextUnadded++;
+            }
+
+            best = ptrdiff_t(nextUnadded);
+        }
+
+        auto triangle = indices + best * 3;
+
+        added[best] = true;
+        output.insert(output.end(), triangle, triangle + 3);
+
+        nextCache.clear();
+        for (int k = 0; k < 3; k++)
+        {
+            auto v = triangle[k];
+
+            auto first = vertexTriangles.begin() + triangleOffsets[v];
+            auto last = first + remaining[v];
+            std::iter_swap(std::find(first, last, uint32_t(best)), last - 1);
+            remaining[v]--;
+
+            nextCache.push_back(v);
+        }
+
+        for (auto v : cache)
+        {
+            if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+            {
+                nextCache.push_back(v);
+            }
+        }
+
+        // Score the vertices in and just out of the cache and the triangles they still have
+        for (size_t c = 0; c < nextCache.size(); c++)
+        {
+            auto v = nextCache[c];
+
+            cachePositions[v] = c < size_t(OptimizedCacheSize) ? int(c) : -1;
+            vertexScores[v] = VertexScore(cachePositions[v], remaining[v]);
+        }
+
+        best = -1;
+        float bestScore = -1.0f;
+        for (auto v : nextCache)
+        {
+            for (int i = 0; i < remaining[v]; i++)
+            {
+                auto t = vertexTriangles[triangleOffsets[v] + i];
+                auto other = indices + t * 3;
+
+                triangleScores[t] = vertexScores[other[0]] + vertexScores[other[1]] + vertexScores[other[2]];
+
+                if (triangleScores[t] > bestScore)
+                {
+                    bestScore = triangleScores[t];
+                    best = ptrdiff_t(t);
+                }
+            }
+        }
+
+        if (nextCache.size() > size_t(OptimizedCacheSize))
+        {
+            nextCache.resize(OptimizedCacheSize);
+        }
+
+        cache.swap(nextCache);
+    }
+
+    std::copy(output.begin(), output.end(), indices);
+}
@@ -0,0 +1,94 @@
+#ifndef WORLDMESH_H
+#define WORLDMESH_H
+
+#include "hl1bspasset.h"
+#include "texturearrays.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Indexed triangle lists of the world faces. Faces are batched per model, texture and lightmap
+// page, so a batch is one draw. The triangle fans of a batch are split into triangles, the
+// vertices that are identical within the batch are welded and the triangles are reordered for
+// the post transform vertex cache with Tom Forsyth's linear speed algorithm.
+//
+// The lightmap coordinates point into the face's own part of the page and the texture
+// coordinates start at the repeat the face starts in, so vertices of lit faces are practically
+// never identical across faces. Welding only saves vertices of faces without a lightmap, the
+// gain of the indexing is the cache order.
+//
+// With a texture array layout the faces are batched per texture array instead of per texture,
+// the texture of a batch is then the array and every vertex carries the layer of its texture.
+
+class WorldMeshBatch
+{
+public:
+    int model = 0;
+    unsigned int texture = 0; // or texture array
+    unsigned int lightmap = 0;
+    uint32_t firstIndex = 0;
+    uint32_t indexCount = 0;
+    uint32_t faceCount = 0;
+};
+
+// The average cache miss ratio (ACMR) is the number of vertices transformed per triangle,
+// measured with a FIFO cache of WorldMesh::MeasuredCacheSize entries
+class WorldMeshStats
+{
+public:
+    size_t faceVertices = 0; // vertices of the fans
+    size_t vertices = 0;     // after welding
+    size_t triangles = 0;
+    size_t batches = 0;
+    double acmrFans = 0.0;      // drawing every fan unindexed
+    double acmrIndexed = 0.0;   // welded, triangles in fan order
+    double acmrOptimized = 0.0; // welded and reordered
+};
+
+class WorldMesh
+{
+public:
+    static const int OptimizedCacheSize = 32; // LRU cache the reordering scores against
+    static const int MeasuredCacheSize = 16;
+
+    void Build(
+        const valve::hl1::BspAsset &bspAsset,
+        const TextureArrayLayout *textureArrays = nullptr);
+
+    // Releases the vertices and indices once they are uploaded, the batches are kept
+    void ReleaseGeometry();
+
+    // First and last + 1 batch of the model
+    std::pair<size_t, size_t> ModelBatches(
+        int model) const;
+
+    const std::vector<valve::tVertex> &Vertices() const;
+
+    const std::vector<uint32_t> &Indices() const;
+
+    const std::vector<WorldMeshBatch> &Batches() const;
+
+    const WorldMeshStats &Stats() const;
+
+    // Vertices transformed when drawing the triangles with a FIFO cache of cacheSize entries
+    static size_t CacheMisses(
+        const uint32_t *indices,
+        size_t indexCount,
+        int cacheSize);
+
+    // Reorders the triangles in place, the indices have to be below vertexCount
+    static void OptimizeVertexCache(
+        uint32_t *indices,
+        size_t indexCount,
+        uint32_t vertexCount);
+
+private:
+    std::vector<valve::tVertex> _vertices;
+    std::vector<uint32_t> _indices;
+    std::vector<WorldMeshBatch> _batches;
+    std::vector<std::pair<size_t, size_t>> _modelBatches;
+    WorldMeshStats _stats;
+};
+
+#endif // WORLDMESH_H